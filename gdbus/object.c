@@ -55,7 +55,7 @@ struct generic_data {
 	GSList *objects;
 	GSList *added;
 	GSList *removed;
-	guint process_id;
+	unsigned int pending_seq;
 	gboolean pending_prop;
 	char *introspect;
 	struct generic_data *parent;
@@ -84,11 +84,20 @@ struct property_data {
 	DBusMessage *message;
 };
 
+/* Objects with changes to be signalled on one connection */
+struct connection_changes {
+	DBusConnection *conn;
+	GHashTable *objects;
+	unsigned int next_seq;
+	guint process_id;
+};
+
 static int global_flags = 0;
 static struct generic_data *root;
-static GSList *pending = NULL;
+static GHashTable *pending = NULL;
 
 static gboolean process_changes(gpointer user_data);
+static gboolean process_pending(gpointer user_data);
 static void process_properties_from_interface(struct generic_data *data,
 						struct interface_data *iface);
 static void process_property_changes(struct generic_data *data);
@@ -633,14 +642,41 @@ static gboolean g_dbus_args_have_signature(const GDBusArgInfo *args,
 	return TRUE;
 }
 
+static struct connection_changes *find_pending(DBusConnection *conn)
+{
+	if (pending == NULL)
+		return NULL;
+
+	return g_hash_table_lookup(pending, conn);
+}
+
+/*
+ * The changes of all objects of a connection are signalled from one
+ * idle callback, in the order the objects got their first change.
+ */
 static void add_pending(struct generic_data *data)
 {
-	if (data->process_id > 0)
+	struct connection_changes *changes;
+
+	if (data->pending_seq > 0)
 		return;
 
-	data->process_id = g_idle_add(process_changes, data);
+	if (pending == NULL)
+		pending = g_hash_table_new(NULL, NULL);
+
+	changes = g_hash_table_lookup(pending, data->conn);
+	if (changes == NULL) {
+		changes = g_new0(struct connection_changes, 1);
+		changes->conn = data->conn;
+		changes->objects = g_hash_table_new(NULL, NULL);
+		g_hash_table_insert(pending, data->conn, changes);
+	}
+
+	if (changes->process_id == 0)
+		changes->process_id = g_idle_add(process_pending, changes);
 
-	pending = g_slist_append(pending, data);
+	data->pending_seq = ++changes->next_seq;
+	g_hash_table_add(changes->objects, data);
 }
 
 static gboolean remove_interface(struct generic_data *data, const char *name)
@@ -983,12 +1019,32 @@ static void emit_interfaces_removed(struct generic_data *data)
 
 static void remove_pending(struct generic_data *data)
 {
-	if (data->process_id > 0) {
-		g_source_remove(data->process_id);
-		data->process_id = 0;
-	}
+	struct connection_changes *changes;
+
+	if (data->pending_seq == 0)
+		return;
+
+	data->pending_seq = 0;
+
+	changes = find_pending(data->conn);
+	if (changes == NULL)
+		return;
+
+	g_hash_table_remove(changes->objects, data);
+	if (g_hash_table_size(changes->objects) > 0)
+		return;
 
-	pending = g_slist_remove(pending, data);
+	if (changes->process_id > 0)
+		g_source_remove(changes->process_id);
+
+	g_hash_table_remove(pending, changes->conn);
+	g_hash_table_destroy(changes->objects);
+	g_free(changes);
+
+	if (g_hash_table_size(pending) == 0) {
+		g_hash_table_destroy(pending);
+		pending = NULL;
+	}
 }
 
 static gboolean process_changes(gpointer user_data)
@@ -1007,7 +1063,52 @@ static gboolean process_changes(gpointer user_data)
 	if (data->removed != NULL)
 		emit_interfaces_removed(data);
 
-	data->process_id = 0;
+	return FALSE;
+}
+
+static gint pending_seq_cmp(gconstpointer a, gconstpointer b)
+{
+	const struct generic_data *data_a = a;
+	const struct generic_data *data_b = b;
+
+	return data_a->pending_seq < data_b->pending_seq ? -1 : 1;
+}
+
+static void flush_pending(DBusConnection *connection)
+{
+	struct connection_changes *changes;
+	GList *objects, *l;
+
+	changes = find_pending(connection);
+	if (changes == NULL)
+		return;
+
+	objects = g_hash_table_get_keys(changes->objects);
+	objects = g_list_sort(objects, pending_seq_cmp);
+
+	/*
+	 * Property getters may unregister objects, so only the ones which
+	 * are still pending are processed.
+	 */
+	for (l = objects; l; l = l->next) {
+		changes = find_pending(connection);
+		if (changes == NULL)
+			break;
+
+		if (g_hash_table_contains(changes->objects, l->data))
+			process_changes(l->data);
+	}
+
+	g_list_free(objects);
+}
+
+static gboolean process_pending(gpointer user_data)
+{
+	struct connection_changes *changes = user_data;
+
+	changes->process_id = 0;
+
+	flush_pending(changes->conn);
 
 	return FALSE;
 }
@@ -1020,11 +1121,8 @@ static void generic_unregister(DBusConnection *connection, void *user_data)
 	if (parent != NULL)
 		parent->objects = g_slist_remove(parent->objects, data);
 
-	if (data->process_id > 0) {
-		g_source_remove(data->process_id);
-		data->process_id = 0;
+	if (data->pending_seq > 0)
 		process_changes(data);
-	}
 
 	g_slist_foreach(data->objects, reset_parent, data->parent);
 	g_slist_free(data->objects);
@@ -1467,19 +1565,32 @@ DBusMessage *g_dbus_create_reply(DBusMessage *message, int type, ...)
 	return reply;
 }
 
-static void g_dbus_flush(DBusConnection *connection)
+/*
+ * Signal the pending changes of the object the message is about before
+ * the message itself. Replies and errors carry no path, so everything
+ * is flushed for them, as well as for the object manager which sends
+ * the signals about its children.
+ */
+static void g_dbus_flush(DBusConnection *connection, DBusMessage *message)
 {
-	GSList *l;
+	struct generic_data *data;
+	const char *path;
+
+	if (find_pending(connection) == NULL)
+		return;
 
-	for (l = pending; l;) {
-		struct generic_data *data = l->data;
+	path = dbus_message_get_path(message);
+	if (path == NULL || (root && g_str_equal(path, root->path))) {
+		flush_pending(connection);
+		return;
+	}
 
-		l = l->next;
-		if (data->conn != connection)
-			continue;
+	if (!dbus_connection_get_object_path_data(connection, path,
+					(void **) &data) || data == NULL)
+		return;
 
+	if (data->pending_seq > 0)
 		process_changes(data);
-	}
 }
 
 gboolean g_dbus_send_message(DBusConnection *connection, DBusMessage *message)
@@ -1499,7 +1610,7 @@ gboolean g_dbus_send_message(DBusConnection *connection, DBusMessage *message)
 	}
 
 	/* Flush pending signal to guarantee message order */
-	g_dbus_flush(connection);
+	g_dbus_flush(connection, message);
 
 	result = dbus_connection_send(connection, message, NULL);
 
@@ -1516,7 +1627,7 @@ gboolean g_dbus_send_message_with_reply(DBusConnection *connection,
 	dbus_bool_t ret;
 
 	/* Flush pending signal to guarantee message order */
-	g_dbus_flush(connection);
+	g_dbus_flush(connection, message);
 
 	ret = dbus_connection_send_with_reply(connection, message, call,
 								timeout);
@@ -43,6 +43,35 @@ static DBusHandlerResult message_filter(DBusConnection *connection,
 static guint listener_id = 0;
 static GSList *listeners = NULL;
 
+/*
+ * The listeners are also indexed by the fields a signal has to match
+ * exactly: interface and member, which are interned and compared by
+ * pointer, path and arg0. A field which is not set matches anything, so
+ * a signal is looked up once for every combination of set fields which
+ * is in use, instead of being compared against every listener.
+ */
+#define KEY_INTERFACE	(1 << 0)
+#define KEY_MEMBER	(1 << 1)
+#define KEY_PATH	(1 << 2)
+#define KEY_ARGUMENT	(1 << 3)
+#define KEY_PATTERNS	(1 << 4)
+
+struct filter_key {
+	const char *interface;
+	const char *member;
+	const char *path;
+	const char *argument;
+};
+
+struct filter_bucket {
+	struct filter_key key;
+	GSList *listeners;
+};
+
+static GHashTable *listener_index = NULL;
+static guint key_patterns[KEY_PATTERNS];
+static guint listener_seq = 0;
+
 struct service_data {
 	DBusConnection *conn;
 	DBusPendingCall *call;
@@ -76,8 +105,184 @@ struct filter_data {
 	guint name_watch;
 	gboolean lock;
 	gboolean registered;
+	struct filter_bucket *bucket;
+	guint seq;
 };
 
+/* Returns the interned copy of str without interning it */
+static const char *lookup_interned(const char *str)
+{
+	if (str == NULL)
+		return NULL;
+
+	return g_quark_to_string(g_quark_try_string(str));
+}
+
+static guint filter_key_pattern(const struct filter_key *key)
+{
+	guint pattern = 0;
+
+	if (key->interface)
+		pattern |= KEY_INTERFACE;
+	if (key->member)
+		pattern |= KEY_MEMBER;
+	if (key->path)
+		pattern |= KEY_PATH;
+	if (key->argument)
+		pattern |= KEY_ARGUMENT;
+
+	return pattern;
+}
+
+static guint filter_key_hash(gconstpointer data)
+{
+	const struct filter_key *key = data;
+	guint hash;
+
+	hash = g_direct_hash(key->interface);
+	hash = hash * 31 + g_direct_hash(key->member);
+
+	if (key->path)
+		hash = hash * 31 + g_str_hash(key->path);
+	if (key->argument)
+		hash = hash * 31 + g_str_hash(key->argument);
+
+	return hash;
+}
+
+static gboolean filter_key_equal(gconstpointer a, gconstpointer b)
+{
+	const struct filter_key *key_a = a, *key_b = b;
+
+	return key_a->interface == key_b->interface &&
+			key_a->member == key_b->member &&
+			g_strcmp0(key_a->path, key_b->path) == 0 &&
+			g_strcmp0(key_a->argument, key_b->argument) == 0;
+}
+
+static void filter_bucket_free(gpointer data)
+{
+	struct filter_bucket *bucket = data;
+
+	g_free((char *) bucket->key.path);
+	g_free((char *) bucket->key.argument);
+	g_slist_free(bucket->listeners);
+	g_free(bucket);
+}
+
+static void filter_data_index(struct filter_data *data)
+{
+	struct filter_bucket *bucket;
+	struct filter_key key;
+
+	if (listener_index == NULL)
+		listener_index = g_hash_table_new_full(filter_key_hash,
+						filter_key_equal, NULL,
+						filter_bucket_free);
+
+	key.interface = g_intern_string(data->interface);
+	key.member = g_intern_string(data->member);
+	key.path = data->path;
+	key.argument = data->argument;
+
+	bucket = g_hash_table_lookup(listener_index, &key);
+	if (bucket == NULL) {
+		bucket = g_new0(struct filter_bucket, 1);
+		bucket->key.interface = key.interface;
+		bucket->key.member = key.member;
+		bucket->key.path = g_strdup(key.path);
+		bucket->key.argument = g_strdup(key.argument);
+
+		g_hash_table_insert(listener_index, &bucket->key, bucket);
+		key_patterns[filter_key_pattern(&key)]++;
+	}
+
+	bucket->listeners = g_slist_prepend(bucket->listeners, data);
+	data->bucket = bucket;
+	data->seq = ++listener_seq;
+}
+
+static void filter_data_unindex(struct filter_data *data)
+{
+	struct filter_bucket *bucket = data->bucket;
+
+	if (bucket == NULL)
+		return;
+
+	data->bucket = NULL;
+
+	bucket->listeners = g_slist_remove(bucket->listeners, data);
+	if (bucket->listeners != NULL)
+		return;
+
+	key_patterns[filter_key_pattern(&bucket->key)]--;
+	g_hash_table_remove(listener_index, &bucket->key);
+
+	if (g_hash_table_size(listener_index) == 0) {
+		g_hash_table_destroy(listener_index);
+		listener_index = NULL;
+	}
+}
+
+static gint filter_data_compare_seq(gconstpointer a, gconstpointer b)
+{
+	const struct filter_data *data_a = *(struct filter_data **) a;
+	const struct filter_data *data_b = *(struct filter_data **) b;
+
+	if (data_a->seq < data_b->seq)
+		return -1;
+
+	return data_a->seq > data_b->seq;
+}
+
+/*
+ * Collect the listeners whose interface, member, path and argument match
+ * the signal, in the order they were added. The caller still has to check
+ * the connection and the sender.
+ */
+static GPtrArray *filter_data_lookup(const struct filter_key *signal)
+{
+	GPtrArray *matches = NULL;
+	guint pattern;
+
+	if (listener_index == NULL)
+		return NULL;
+
+	for (pattern = 0; pattern < KEY_PATTERNS; pattern++) {
+		struct filter_bucket *bucket;
+		struct filter_key key;
+		GSList *l;
+
+		if (key_patterns[pattern] == 0)
+			continue;
+
+		key.interface = pattern & KEY_INTERFACE ?
+						signal->interface : NULL;
+		key.member = pattern & KEY_MEMBER ? signal->member : NULL;
+		key.path = pattern & KEY_PATH ? signal->path : NULL;
+		key.argument = pattern & KEY_ARGUMENT ? signal->argument : NULL;
+
+		/* The signal lacks a field this pattern requires */
+		if (filter_key_pattern(&key) != pattern)
+			continue;
+
+		bucket = g_hash_table_lookup(listener_index, &key);
+		if (bucket == NULL)
+			continue;
+
+		if (matches == NULL)
+			matches = g_ptr_array_new();
+
+		for (l = bucket->listeners; l != NULL; l = l->next)
+			g_ptr_array_add(matches, l->data);
+	}
+
+	if (matches != NULL && matches->len > 1)
+		g_ptr_array_sort(matches, filter_data_compare_seq);
+
+	return matches;
+}
+
 static struct filter_data *filter_data_find_match(DBusConnection *connection,
 							const char *name,
 							const char *owner,
@@ -86,9 +291,28 @@ static struct filter_data *filter_data_find_match(DBusConnection *connection,
 							const char *member,
 							const char *argument)
 {
+	struct filter_bucket *bucket;
+	struct filter_key key;
 	GSList *current;
 
-	for (current = listeners;
+	if (listener_index == NULL)
+		return NULL;
+
+	key.interface = lookup_interned(interface);
+	key.member = lookup_interned(member);
+	key.path = path;
+	key.argument = argument;
+
+	/* Not interned means no listener uses it */
+	if ((interface != NULL && key.interface == NULL) ||
+			(member != NULL && key.member == NULL))
+		return NULL;
+
+	bucket = g_hash_table_lookup(listener_index, &key);
+	if (bucket == NULL)
+		return NULL;
+
+	for (current = bucket->listeners;
 			current != NULL; current = current->next) {
 		struct filter_data *data = current->data;
 
@@ -101,18 +325,6 @@ static struct filter_data *filter_data_find_match(DBusConnection *connection,
 		if (g_strcmp0(owner, data->owner) != 0)
 			continue;
 
-		if (g_strcmp0(path, data->path) != 0)
-			continue;
-
-		if (g_strcmp0(interface, data->interface) != 0)
-			continue;
-
-		if (g_strcmp0(member, data->member) != 0)
-			continue;
-
-		if (g_strcmp0(argument, data->argument) != 0)
-			continue;
-
 		return data;
 	}
 
@@ -208,6 +420,8 @@ static void filter_data_free(struct filter_data *data)
 {
 	GSList *l;
 
+	filter_data_unindex(data);
+
 	/* Remove filter if there are no listeners left for the connection */
 	if (filter_data_find(data->connection) == NULL)
 		dbus_connection_remove_filter(data->connection, message_filter,
@@ -277,6 +491,7 @@ proceed:
 	}
 
 	listeners = g_slist_append(listeners, data);
+	filter_data_index(data);
 
 	return data;
 }
@@ -510,23 +725,40 @@ static DBusHandlerResult message_filter(DBusConnection *connection,
 					DBusMessage *message, void *user_data)
 {
 	struct filter_data *data;
-	const char *sender, *path, *iface, *member, *arg = NULL;
-	GSList *current, *delete_listener = NULL;
+	struct filter_key signal;
+	const char *sender, *arg = NULL;
+	GPtrArray *matches;
+	guint i;
 
 	/* Only filter signals */
 	if (dbus_message_get_type(message) != DBUS_MESSAGE_TYPE_SIGNAL)
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 
 	sender = dbus_message_get_sender(message);
-	path = dbus_message_get_path(message);
-	iface = dbus_message_get_interface(message);
-	member = dbus_message_get_member(message);
 	dbus_message_get_args(message, NULL, DBUS_TYPE_STRING, &arg, DBUS_TYPE_INVALID);
 
+	signal.path = dbus_message_get_path(message);
+	signal.interface = lookup_interned(dbus_message_get_interface(message));
+	signal.member = lookup_interned(dbus_message_get_member(message));
+	signal.argument = arg;
+
+	matches = filter_data_lookup(&signal);
+	if (matches == NULL)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
+
+	/*
+	 * Lock all matches up front, a callback removing the watches of
+	 * another match must not free it before it has been looked at.
+	 */
+	for (i = 0; i < matches->len; i++) {
+		data = g_ptr_array_index(matches, i);
+		data->lock = TRUE;
+	}
+
 	/* If sender != NULL it is always the owner */
 
-	for (current = listeners; current != NULL; current = current->next) {
-		data = current->data;
+	for (i = 0; i < matches->len; i++) {
+		data = g_ptr_array_index(matches, i);
 
 		if (connection != data->connection)
 			continue;
@@ -537,55 +769,28 @@ static DBusHandlerResult message_filter(DBusConnection *connection,
 		if (data->owner && g_str_equal(sender, data->owner) == FALSE)
 			continue;
 
-		if (data->path && g_str_equal(path, data->path) == FALSE)
-			continue;
-
-		if (data->interface && g_str_equal(iface,
-						data->interface) == FALSE)
-			continue;
-
-		if (data->member && g_str_equal(member, data->member) == FALSE)
-			continue;
-
-		if (data->argument && g_str_equal(arg,
-						data->argument) == FALSE)
-			continue;
-
-		if (data->handle_func) {
-			data->lock = TRUE;
-
+		if (data->handle_func)
 			data->handle_func(connection, message, data);
-
-			data->callbacks = data->processed;
-			data->processed = NULL;
-			data->lock = FALSE;
-		}
-
-		if (!data->callbacks)
-			delete_listener = g_slist_prepend(delete_listener,
-								current);
 	}
 
-	if (delete_listener == NULL)
-		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
-
-	for (current = delete_listener; current != NULL;
-					current = delete_listener->next) {
-		GSList *l = current->data;
+	for (i = 0; i < matches->len; i++) {
+		data = g_ptr_array_index(matches, i);
 
-		data = l->data;
+		data->callbacks = g_slist_concat(data->callbacks,
+							data->processed);
+		data->processed = NULL;
+		data->lock = FALSE;
 
-		/* Has any other callback added callbacks back to this data? */
 		if (data->callbacks != NULL)
 			continue;
 
 		remove_match(data);
-		listeners = g_slist_delete_link(listeners, l);
+		listeners = g_slist_remove(listeners, data);
 
 		filter_data_free(data);
 	}
 
-	g_slist_free(delete_listener);
+	g_ptr_array_free(matches, TRUE);
 
 	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 }
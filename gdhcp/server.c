@@ -61,8 +61,11 @@ struct _GDHCPServer {
 	int listener_sockfd;
 	guint listener_watch;
 	GIOChannel *listener_channel;
-	GList *lease_list;
+	GPtrArray *lease_heap;	/* min-heap on the expire time */
 	GHashTable *nip_lease_hash;
+	GHashTable *mac_lease_hash;
+	uint64_t *pool_bitmap;	/* addresses in use, bit 0 is start_ip */
+	uint32_t pool_cursor;	/* the search for a free address starts here */
 	GHashTable *option_hash; /* Options send to client */
 	GDHCPSaveLeaseFunc save_lease_func;
 	GDHCPLeaseAddedCb lease_added_cb;
@@ -74,6 +77,7 @@ struct dhcp_lease {
 	time_t expire;
 	uint32_t lease_nip;
 	uint8_t lease_mac[ETH_ALEN];
+	unsigned int heap_index;
 };
 
 static inline void debug(GDHCPServer *server, const char *format, ...)
@@ -92,28 +96,234 @@ static inline void debug(GDHCPServer *server, const char *format, ...)
 	va_end(ap);
 }
 
-static struct dhcp_lease *find_lease_by_mac(GDHCPServer *dhcp_server,
-						const uint8_t *mac)
+static guint mac_hash(gconstpointer key)
+{
+	const uint8_t *mac = key;
+	guint hash = 0;
+	int i;
+
+	for (i = 0; i < ETH_ALEN; i++)
+		hash = hash * 31 + mac[i];
+
+	return hash;
+}
+
+static gboolean mac_equal(gconstpointer a, gconstpointer b)
+{
+	return memcmp(a, b, ETH_ALEN) == 0;
+}
+
+/*
+ * The leases are kept in a binary min-heap ordered by the expire time,
+ * so the oldest lease is always the first one. Each lease knows its
+ * position, which allows removing or updating it in O(log n).
+ */
+static void lease_heap_swap(GPtrArray *heap, unsigned int i, unsigned int j)
 {
-	GList *list;
+	struct dhcp_lease *lease_i = heap->pdata[i];
+	struct dhcp_lease *lease_j = heap->pdata[j];
 
-	for (list = dhcp_server->lease_list; list; list = list->next) {
-		struct dhcp_lease *lease = list->data;
+	heap->pdata[i] = lease_j;
+	lease_j->heap_index = i;
+
+	heap->pdata[j] = lease_i;
+	lease_i->heap_index = j;
+}
+
+static bool lease_expires_before(GPtrArray *heap, unsigned int i,
+							unsigned int j)
+{
+	const struct dhcp_lease *lease_i = heap->pdata[i];
+	const struct dhcp_lease *lease_j = heap->pdata[j];
 
-		if (memcmp(lease->lease_mac, mac, ETH_ALEN) == 0)
-			return lease;
+	return lease_i->expire < lease_j->expire;
+}
+
+static void lease_heap_update(GPtrArray *heap, struct dhcp_lease *lease)
+{
+	unsigned int i = lease->heap_index;
+
+	while (i > 0 && lease_expires_before(heap, i, (i - 1) / 2)) {
+		lease_heap_swap(heap, i, (i - 1) / 2);
+		i = (i - 1) / 2;
 	}
 
-	return NULL;
+	while (1) {
+		unsigned int left = 2 * i + 1, right = left + 1, min = i;
+
+		if (left < heap->len && lease_expires_before(heap, left, min))
+			min = left;
+
+		if (right < heap->len && lease_expires_before(heap, right, min))
+			min = right;
+
+		if (min == i)
+			break;
+
+		lease_heap_swap(heap, i, min);
+		i = min;
+	}
 }
 
-static void remove_lease(GDHCPServer *dhcp_server, struct dhcp_lease *lease)
+static void lease_heap_add(GPtrArray *heap, struct dhcp_lease *lease)
+{
+	lease->heap_index = heap->len;
+	g_ptr_array_add(heap, lease);
+
+	lease_heap_update(heap, lease);
+}
+
+static void lease_heap_remove(GPtrArray *heap, struct dhcp_lease *lease)
+{
+	unsigned int i = lease->heap_index;
+
+	/* the last lease takes its place */
+	g_ptr_array_remove_index_fast(heap, i);
+
+	if (i < heap->len) {
+		struct dhcp_lease *moved = heap->pdata[i];
+
+		moved->heap_index = i;
+		lease_heap_update(heap, moved);
+	}
+}
+
+/* e.g. 192.168.55.0 and 192.168.55.255 are never handed out */
+static bool is_reserved_nip(uint32_t nip)
+{
+	return (nip & 0xff) == 0 || (nip & 0xff) == 0xff;
+}
+
+static void pool_mark(GDHCPServer *dhcp_server, uint32_t nip, bool used)
+{
+	uint32_t bit;
+
+	if (!dhcp_server->pool_bitmap)
+		return;
+
+	if (nip < dhcp_server->start_ip || nip > dhcp_server->end_ip)
+		return;
+
+	if (!used && is_reserved_nip(nip))
+		return;
+
+	bit = nip - dhcp_server->start_ip;
+
+	if (used)
+		dhcp_server->pool_bitmap[bit / 64] |= 1ULL << (bit % 64);
+	else
+		dhcp_server->pool_bitmap[bit / 64] &= ~(1ULL << (bit % 64));
+}
+
+/*
+ * One bit per address of the pool, reserved addresses and the bits
+ * behind the end of the pool are always marked as used.
+ */
+static void pool_rebuild(GDHCPServer *dhcp_server)
+{
+	GHashTableIter iter;
+	gpointer key;
+	uint32_t size, words, nip;
+
+	g_free(dhcp_server->pool_bitmap);
+	dhcp_server->pool_bitmap = NULL;
+	dhcp_server->pool_cursor = 0;
+
+	if (dhcp_server->end_ip < dhcp_server->start_ip)
+		return;
+
+	size = dhcp_server->end_ip - dhcp_server->start_ip + 1;
+	words = size / 64 + 1;
+
+	dhcp_server->pool_bitmap = g_try_new0(uint64_t, words);
+	if (!dhcp_server->pool_bitmap)
+		return;
+
+	dhcp_server->pool_bitmap[words - 1] = ~0ULL << (size % 64);
+
+	for (nip = dhcp_server->start_ip; nip <= dhcp_server->end_ip; nip++) {
+		if (is_reserved_nip(nip))
+			pool_mark(dhcp_server, nip, true);
+
+		if (nip == dhcp_server->end_ip)
+			break;
+	}
+
+	g_hash_table_iter_init(&iter, dhcp_server->nip_lease_hash);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+		pool_mark(dhcp_server, GPOINTER_TO_INT(key), true);
+}
+
+/*
+ * Find a free address, starting where the last search stopped so that
+ * the addresses handed out before are skipped in one go.
+ */
+static uint32_t pool_find_free(GDHCPServer *dhcp_server)
+{
+	uint64_t *bitmap = dhcp_server->pool_bitmap;
+	uint32_t words, word, i, bit, size;
+
+	if (!bitmap)
+		return 0;
+
+	size = dhcp_server->end_ip - dhcp_server->start_ip + 1;
+	words = size / 64 + 1;
+	word = dhcp_server->pool_cursor / 64;
+
+	/* the first word is looked at again at the end */
+	for (i = 0; i <= words; i++) {
+		uint64_t used = bitmap[word];
+
+		if (i == 0)
+			used |= (1ULL << (dhcp_server->pool_cursor % 64)) - 1;
+
+		if (~used) {
+			bit = word * 64 + __builtin_ctzll(~used);
+
+			dhcp_server->pool_cursor = bit + 1 < size ? bit + 1 : 0;
+
+			return dhcp_server->start_ip + bit;
+		}
+
+		word = (word + 1) % words;
+	}
+
+	return 0;
+}
+
+static void lease_link(GDHCPServer *dhcp_server, struct dhcp_lease *lease)
+{
+	lease_heap_add(dhcp_server->lease_heap, lease);
+
+	g_hash_table_insert(dhcp_server->nip_lease_hash,
+				GINT_TO_POINTER((int) lease->lease_nip), lease);
+	g_hash_table_insert(dhcp_server->mac_lease_hash,
+				lease->lease_mac, lease);
+
+	pool_mark(dhcp_server, lease->lease_nip, true);
+}
+
+static void lease_unlink(GDHCPServer *dhcp_server, struct dhcp_lease *lease)
 {
-	dhcp_server->lease_list =
-			g_list_remove(dhcp_server->lease_list, lease);
+	lease_heap_remove(dhcp_server->lease_heap, lease);
 
 	g_hash_table_remove(dhcp_server->nip_lease_hash,
 				GINT_TO_POINTER((int) lease->lease_nip));
+	g_hash_table_remove(dhcp_server->mac_lease_hash, lease->lease_mac);
+
+	pool_mark(dhcp_server, lease->lease_nip, false);
+}
+
+static struct dhcp_lease *find_lease_by_mac(GDHCPServer *dhcp_server,
+						const uint8_t *mac)
+{
+	return g_hash_table_lookup(dhcp_server->mac_lease_hash, mac);
+}
+
+static void remove_lease(GDHCPServer *dhcp_server, struct dhcp_lease *lease)
+{
+	lease_unlink(dhcp_server, lease);
+
 	g_free(lease);
 }
 
@@ -145,11 +355,7 @@ static int get_lease(GDHCPServer *dhcp_server, uint32_t yiaddr,
 	debug(dhcp_server, "lease_mac %p lease_nip %p", lease_mac, lease_nip);
 
 	if (lease_nip) {
-		dhcp_server->lease_list =
-				g_list_remove(dhcp_server->lease_list,
-								lease_nip);
-		g_hash_table_remove(dhcp_server->nip_lease_hash,
-				GINT_TO_POINTER((int) ntohl(yiaddr)));
+		lease_unlink(dhcp_server, lease_nip);
 
 		if (!lease_mac)
 			*lease = lease_nip;
@@ -163,11 +369,7 @@ static int get_lease(GDHCPServer *dhcp_server, uint32_t yiaddr,
 	}
 
 	if (lease_mac) {
-		dhcp_server->lease_list =
-				g_list_remove(dhcp_server->lease_list,
-								lease_mac);
-		g_hash_table_remove(dhcp_server->nip_lease_hash,
-				GINT_TO_POINTER((int) lease_mac->lease_nip));
+		lease_unlink(dhcp_server, lease_mac);
 		*lease = lease_mac;
 
 		return 0;
@@ -180,14 +382,6 @@ static int get_lease(GDHCPServer *dhcp_server, uint32_t yiaddr,
 	return 0;
 }
 
-static gint compare_expire(gconstpointer a, gconstpointer b)
-{
-	const struct dhcp_lease *lease1 = a;
-	const struct dhcp_lease *lease2 = b;
-
-	return lease2->expire - lease1->expire;
-}
-
 static struct dhcp_lease *add_lease(GDHCPServer *dhcp_server, uint32_t expire,
 					const uint8_t *chaddr, uint32_t yiaddr)
 {
@@ -208,11 +402,7 @@ static struct dhcp_lease *add_lease(GDHCPServer *dhcp_server, uint32_t expire,
 	else
 		lease->expire = expire;
 
-	dhcp_server->lease_list = g_list_insert_sorted(dhcp_server->lease_list,
-							lease, compare_expire);
-
-	g_hash_table_insert(dhcp_server->nip_lease_hash,
-				GINT_TO_POINTER((int) lease->lease_nip), lease);
+	lease_link(dhcp_server, lease);
 
 	return lease;
 }
@@ -242,35 +432,27 @@ static bool is_expired_lease(struct dhcp_lease *lease)
 static uint32_t find_free_or_expired_nip(GDHCPServer *dhcp_server,
 					const uint8_t *safe_mac)
 {
-	uint32_t ip_addr;
+	uint32_t ip_addr, first = 0;
 	struct dhcp_lease *lease;
-	GList *list;
-	ip_addr = dhcp_server->start_ip;
-	for (; ip_addr <= dhcp_server->end_ip; ip_addr++) {
-		/* e.g. 192.168.55.0 */
-		if ((ip_addr & 0xff) == 0)
-			continue;
-
-		/* e.g. 192.168.55.255 */
-		if ((ip_addr & 0xff) == 0xff)
-			continue;
-
-		lease = find_lease_by_nip(dhcp_server, ip_addr);
-		if (lease)
-			continue;
 
+	/*
+	 * Each search moves the cursor past the address it returns, so
+	 * an address in use by someone else is skipped, and getting the
+	 * first one again means every free address has been tried.
+	 */
+	while ((ip_addr = pool_find_free(dhcp_server)) != first) {
 		if (arp_check(htonl(ip_addr), safe_mac))
 			return ip_addr;
+
+		if (!first)
+			first = ip_addr;
 	}
 
-	/* The last lease is the oldest one */
-	list = g_list_last(dhcp_server->lease_list);
-	if (!list)
+	/* The first lease is the oldest one */
+	if (dhcp_server->lease_heap->len == 0)
 		return 0;
 
-	lease = list->data;
-	if (!lease)
-		return 0;
+	lease = g_ptr_array_index(dhcp_server->lease_heap, 0);
 
 	 if (!is_expired_lease(lease))
 		return 0;
@@ -284,31 +466,31 @@ static uint32_t find_free_or_expired_nip(GDHCPServer *dhcp_server,
 static void lease_set_expire(GDHCPServer *dhcp_server,
 			struct dhcp_lease *lease, uint32_t expire)
 {
-	dhcp_server->lease_list = g_list_remove(dhcp_server->lease_list, lease);
-
 	lease->expire = expire;
 
-	dhcp_server->lease_list = g_list_insert_sorted(dhcp_server->lease_list,
-							lease, compare_expire);
+	lease_heap_update(dhcp_server->lease_heap, lease);
 }
 
 static void destroy_lease_table(GDHCPServer *dhcp_server)
 {
-	GList *list;
+	unsigned int i;
 
 	g_hash_table_destroy(dhcp_server->nip_lease_hash);
+	g_hash_table_destroy(dhcp_server->mac_lease_hash);
 
 	dhcp_server->nip_lease_hash = NULL;
+	dhcp_server->mac_lease_hash = NULL;
 
-	for (list = dhcp_server->lease_list; list; list = list->next) {
-		struct dhcp_lease *lease = list->data;
+	for (i = 0; i < dhcp_server->lease_heap->len; i++)
+		g_free(dhcp_server->lease_heap->pdata[i]);
 
-		g_free(lease);
-	}
+	g_ptr_array_free(dhcp_server->lease_heap, TRUE);
+
+	dhcp_server->lease_heap = NULL;
 
-	g_list_free(dhcp_server->lease_list);
+	g_free(dhcp_server->pool_bitmap);
 
-	dhcp_server->lease_list = NULL;
+	dhcp_server->pool_bitmap = NULL;
 }
 static uint32_t get_interface_address(int index)
 {
@@ -382,6 +564,9 @@ GDHCPServer *g_dhcp_server_new(GDHCPType type,
 
 	dhcp_server->nip_lease_hash = g_hash_table_new_full(g_direct_hash,
 						g_direct_equal, NULL, NULL);
+	dhcp_server->mac_lease_hash = g_hash_table_new_full(mac_hash,
+						mac_equal, NULL, NULL);
+	dhcp_server->lease_heap = g_ptr_array_new();
 	dhcp_server->option_hash = g_hash_table_new_full(g_direct_hash,
 						g_direct_equal, NULL, NULL);
 
@@ -578,13 +763,13 @@ static void send_offer(GDHCPServer *dhcp_server,
 
 static void save_lease(GDHCPServer *dhcp_server)
 {
-	GList *list;
+	unsigned int i;
 
 	if (!dhcp_server->save_lease_func)
 		return;
 
-	for (list = dhcp_server->lease_list; list; list = list->next) {
-		struct dhcp_lease *lease = list->data;
+	for (i = 0; i < dhcp_server->lease_heap->len; i++) {
+		struct dhcp_lease *lease = dhcp_server->lease_heap->pdata[i];
 		dhcp_server->save_lease_func(lease->lease_mac,
 					lease->lease_nip, lease->expire);
 	}
@@ -887,6 +1072,8 @@ int g_dhcp_server_set_ip_range(GDHCPServer *dhcp_server,
 
 	dhcp_server->end_ip = ntohl(_host_addr.s_addr);
 
+	pool_rebuild(dhcp_server);
+
 	return 0;
 }
 
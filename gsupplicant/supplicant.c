@@ -186,7 +186,6 @@ struct _GSupplicantInterface {
 	GHashTable *network_table;
 	GHashTable *peer_table;
 	GHashTable *group_table;
-	GHashTable *bss_mapping;
 	void *data;
 	const char *pending_peer_path;
 	GSupplicantNetwork *current_network;
@@ -195,6 +194,7 @@ struct _GSupplicantInterface {
 
 struct g_supplicant_bss {
 	GSupplicantInterface *interface;
+	GSupplicantNetwork *network;
 	char *path;
 	unsigned char bssid[6];
 	unsigned char ssid[32];
@@ -727,7 +727,6 @@ static void remove_interface(gpointer data)
 {
 	GSupplicantInterface *interface = data;
 
-	g_hash_table_destroy(interface->bss_mapping);
 	g_hash_table_destroy(interface->network_table);
 	g_hash_table_destroy(interface->peer_table);
 	g_hash_table_destroy(interface->group_table);
@@ -781,10 +780,29 @@ static void remove_bss(gpointer data)
 
 	supplicant_dbus_property_call_cancel_all(bss);
 
+	if (bss_mapping && g_hash_table_lookup(bss_mapping, bss->path) == bss)
+		g_hash_table_remove(bss_mapping, bss->path);
+
 	g_free(bss->path);
 	g_free(bss);
 }
 
+/* Look up a BSS by path, restricted to interface unless that is NULL */
+static struct g_supplicant_bss *lookup_bss(GSupplicantInterface *interface,
+							const char *path)
+{
+	struct g_supplicant_bss *bss;
+
+	bss = g_hash_table_lookup(bss_mapping, path);
+	if (!bss)
+		return NULL;
+
+	if (interface && bss->interface != interface)
+		return NULL;
+
+	return bss;
+}
+
 static void remove_peer(gpointer data)
 {
 	GSupplicantPeer *peer = data;
@@ -1238,6 +1256,56 @@ dbus_uint16_t g_supplicant_network_get_frequency(GSupplicantNetwork *network)
 	return network->frequency;
 }
 
+static bool has_frequency(const dbus_uint16_t *freqs, unsigned int num,
+						dbus_uint16_t freq)
+{
+	unsigned int i;
+
+	for (i = 0; i < num; i++) {
+		if (freqs[i] == freq)
+			return true;
+	}
+
+	return false;
+}
+
+/*
+ * Store the distinct frequencies of the BSSs of the network into freqs,
+ * the one of the best BSS first. Returns the number of frequencies.
+ */
+unsigned int g_supplicant_network_get_frequencies(GSupplicantNetwork *network,
+					dbus_uint16_t *freqs, unsigned int max)
+{
+	GHashTableIter iter;
+	gpointer value;
+	unsigned int num = 0;
+
+	if (!network || max == 0)
+		return 0;
+
+	if (network->best_bss && network->best_bss->frequency)
+		freqs[num++] = network->best_bss->frequency;
+
+	g_hash_table_iter_init(&iter, network->bss_table);
+	while (num < max && g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct g_supplicant_bss *bss = value;
+
+		if (bss->frequency && !has_frequency(freqs, num,
+							bss->frequency))
+			freqs[num++] = bss->frequency;
+	}
+
+	return num;
+}
+
+static gboolean match_frequency(gpointer key, gpointer value,
+							gpointer user_data)
+{
+	struct g_supplicant_bss *bss = value;
+
+	return bss->frequency == GPOINTER_TO_UINT(user_data);
+}
+
 dbus_bool_t g_supplicant_network_get_wps(GSupplicantNetwork *network)
 {
 	if (!network)
@@ -1600,7 +1668,7 @@ static int add_or_replace_bss_to_network(struct g_supplicant_bss *bss)
 	GSupplicantInterface *interface = bss->interface;
 	GSupplicantNetwork *network;
 	char *group;
-	bool is_new_network;
+	bool is_new_network, new_frequency;
 
 	group = create_group(bss);
 	SUPPLICANT_DBG("New group created: %s", group);
@@ -1677,10 +1745,18 @@ done:
 		callback_network_changed(network, "Signal");
 	}
 
-	g_hash_table_replace(interface->bss_mapping, bss->path, network);
+	bss->network = network;
+
+	/* Let the scan planning know about channels it has not seen yet */
+	new_frequency = !is_new_network && bss->frequency &&
+		!g_hash_table_find(network->bss_table, match_frequency,
+					GUINT_TO_POINTER(bss->frequency));
+
 	g_hash_table_replace(network->bss_table, bss->path, bss);
+	g_hash_table_replace(bss_mapping, bss->path, bss);
 
-	g_hash_table_replace(bss_mapping, bss->path, interface);
+	if (new_frequency)
+		callback_network_changed(network, "Frequency");
 
 	return 0;
 }
@@ -2032,7 +2108,6 @@ static struct g_supplicant_bss *interface_bss_added(DBusMessageIter *iter,
 							void *user_data)
 {
 	GSupplicantInterface *interface = user_data;
-	GSupplicantNetwork *network;
 	struct g_supplicant_bss *bss;
 	const char *path = NULL;
 
@@ -2047,12 +2122,8 @@ static struct g_supplicant_bss *interface_bss_added(DBusMessageIter *iter,
 
 	SUPPLICANT_DBG("%s", path);
 
-	network = g_hash_table_lookup(interface->bss_mapping, path);
-	if (network) {
-		bss = g_hash_table_lookup(network->bss_table, path);
-		if (bss)
-			return NULL;
-	}
+	if (lookup_bss(interface, path))
+		return NULL;
 
 	bss = g_try_new0(struct g_supplicant_bss, 1);
 	if (!bss)
@@ -2146,14 +2217,12 @@ static void interface_current_bss(GSupplicantInterface *interface,
 
 	interface_bss_added_without_keys(iter, interface);
 
-	network = g_hash_table_lookup(interface->bss_mapping, path);
-	if (!network)
-		return;
-
-	bss = g_hash_table_lookup(network->bss_table, path);
+	bss = lookup_bss(interface, path);
 	if (!bss)
 		return;
 
+	network = bss->network;
+
 	interface->current_network = network;
 
 	if (bss != network->best_bss) {
@@ -2212,20 +2281,17 @@ static void interface_bss_removed(DBusMessageIter *iter, void *user_data)
 	if (!path)
 		return;
 
-	network = g_hash_table_lookup(interface->bss_mapping, path);
-	if (!network)
+	bss = lookup_bss(interface, path);
+	if (!bss)
 		return;
 
-	bss = g_hash_table_lookup(network->bss_table, path);
+	network = bss->network;
 	if (network->best_bss == bss) {
 		network->best_bss = NULL;
 		network->signal = BSS_UNKNOWN_STRENGTH;
 		is_current_network_bss = true;
 	}
 
-	g_hash_table_remove(bss_mapping, path);
-
-	g_hash_table_remove(interface->bss_mapping, path);
 	g_hash_table_remove(network->bss_table, path);
 
 	update_network_signal(network);
@@ -2421,7 +2487,7 @@ static void interface_property(const char *key, DBusMessageIter *iter,
 static void scan_network_update(DBusMessageIter *iter, void *user_data)
 {
 	GSupplicantInterface *interface = user_data;
-	GSupplicantNetwork *network;
+	struct g_supplicant_bss *bss;
 	char *path;
 
 	if (!iter)
@@ -2436,9 +2502,9 @@ static void scan_network_update(DBusMessageIter *iter, void *user_data)
 		return;
 
 	/* Update the network details based on scan BSS data */
-	network = g_hash_table_lookup(interface->bss_mapping, path);
-	if (network)
-		callback_network_added(network);
+	bss = lookup_bss(interface, path);
+	if (bss)
+		callback_network_added(bss->network);
 }
 
 static void scan_bss_data(const char *key, DBusMessageIter *iter,
@@ -2473,8 +2539,6 @@ static GSupplicantInterface *interface_alloc(const char *path)
 					g_str_equal, NULL, remove_peer);
 	interface->group_table = g_hash_table_new_full(g_str_hash,
 					g_str_equal, NULL, remove_group);
-	interface->bss_mapping = g_hash_table_new_full(g_str_hash, g_str_equal,
-								NULL, NULL);
 
 	g_hash_table_replace(interface_table, interface->path, interface);
 
@@ -2807,18 +2871,13 @@ static void signal_bss_changed(const char *path, DBusMessageIter *iter)
 
 	SUPPLICANT_DBG("");
 
-	interface = g_hash_table_lookup(bss_mapping, path);
-	if (!interface)
-		return;
-
-	network = g_hash_table_lookup(interface->bss_mapping, path);
-	if (!network)
-		return;
-
-	bss = g_hash_table_lookup(network->bss_table, path);
+	bss = lookup_bss(NULL, path);
 	if (!bss)
 		return;
 
+	interface = bss->interface;
+	network = bss->network;
+
 	supplicant_dbus_property_foreach(iter, bss_property, bss);
 
 	old_security = network->security;
@@ -2852,9 +2911,6 @@ static void signal_bss_changed(const char *path, DBusMessageIter *iter)
 			network->signal = BSS_UNKNOWN_STRENGTH;
 		}
 
-		g_hash_table_remove(bss_mapping, path);
-
-		g_hash_table_remove(interface->bss_mapping, path);
 		g_hash_table_remove(network->bss_table, path);
 
 		update_network_signal(network);
@@ -3553,7 +3609,7 @@ static void signal_group_peer_disconnected(const char *path, DBusMessageIter *it
 	peer->connection_requested = false;
 }
 
-static struct {
+static struct supplicant_signal {
 	const char *interface;
 	const char *member;
 	void (*function) (const char *path, DBusMessageIter *iter);
@@ -3596,30 +3652,79 @@ static struct {
 	{ }
 };
 
+/*
+ * The interface and member names of signal_map are interned, so the
+ * table can hash and compare them by pointer. Names of a message which
+ * are not interned cannot be in the table.
+ */
+static GHashTable *signal_table;
+
+static guint signal_hash(gconstpointer key)
+{
+	const struct supplicant_signal *signal = key;
+
+	return g_direct_hash(signal->interface) * 31 +
+					g_direct_hash(signal->member);
+}
+
+static gboolean signal_equal(gconstpointer a, gconstpointer b)
+{
+	const struct supplicant_signal *signal_a = a, *signal_b = b;
+
+	return signal_a->interface == signal_b->interface &&
+				signal_a->member == signal_b->member;
+}
+
+static void signal_table_create(void)
+{
+	int i;
+
+	signal_table = g_hash_table_new(signal_hash, signal_equal);
+
+	for (i = 0; signal_map[i].interface; i++) {
+		signal_map[i].interface =
+			g_intern_static_string(signal_map[i].interface);
+		signal_map[i].member =
+			g_intern_static_string(signal_map[i].member);
+
+		/* The first entry wins, as it did with the linear search */
+		if (!g_hash_table_contains(signal_table, &signal_map[i]))
+			g_hash_table_add(signal_table, &signal_map[i]);
+	}
+}
+
+static const char *lookup_interned(const char *str)
+{
+	if (!str)
+		return NULL;
+
+	return g_quark_to_string(g_quark_try_string(str));
+}
+
 static DBusHandlerResult g_supplicant_filter(DBusConnection *conn,
 					DBusMessage *message, void *data)
 {
+	struct supplicant_signal key, *signal;
 	DBusMessageIter iter;
 	const char *path;
-	int i;
 
 	path = dbus_message_get_path(message);
 	if (!path)
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 
-	if (!dbus_message_iter_init(message, &iter))
+	key.interface = lookup_interned(dbus_message_get_interface(message));
+	key.member = lookup_interned(dbus_message_get_member(message));
+	if (!key.interface || !key.member)
 		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 
-	for (i = 0; signal_map[i].interface; i++) {
-		if (!dbus_message_has_interface(message, signal_map[i].interface))
-			continue;
+	signal = g_hash_table_lookup(signal_table, &key);
+	if (!signal)
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 
-		if (!dbus_message_has_member(message, signal_map[i].member))
-			continue;
+	if (!dbus_message_iter_init(message, &iter))
+		return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 
-		signal_map[i].function(path, &iter);
-		break;
-	}
+	signal->function(path, &iter);
 
 	return DBUS_HANDLER_RESULT_NOT_YET_HANDLED;
 }
@@ -5789,8 +5894,12 @@ int g_supplicant_register(const GSupplicantCallbacks *callbacks)
 	if (!connection)
 		return -EIO;
 
+	signal_table_create();
+
 	if (!dbus_connection_add_filter(connection, g_supplicant_filter,
 						NULL, NULL)) {
+		g_hash_table_destroy(signal_table);
+		signal_table = NULL;
 		dbus_connection_unref(connection);
 		connection = NULL;
 		return -EIO;
@@ -5880,6 +5989,11 @@ void g_supplicant_unregister(const GSupplicantCallbacks *callbacks)
 						g_supplicant_filter, NULL);
 	}
 
+	if (signal_table) {
+		g_hash_table_destroy(signal_table);
+		signal_table = NULL;
+	}
+
 	if (config_file_table) {
 		g_hash_table_destroy(config_file_table);
 		config_file_table = NULL;
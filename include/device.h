@@ -96,6 +96,8 @@ int connman_device_set_scanning(struct connman_device *device,
 bool connman_device_get_scanning(struct connman_device *device,
 				enum connman_service_type type);
 void connman_device_reset_scanning(struct connman_device *device);
+void connman_device_add_scan_statistics(struct connman_device *device,
+				unsigned int channels, unsigned int duration);
 
 int connman_device_set_string(struct connman_device *device,
 					const char *key, const char *value);
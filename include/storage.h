@@ -22,6 +22,7 @@
 #ifndef __CONNMAN_STORAGE_H
 #define __CONNMAN_STORAGE_H
 
+#include <stdbool.h>
 #include <glib.h>
 
 #ifdef __cplusplus
@@ -31,6 +32,27 @@ extern "C" {
 gchar **connman_storage_get_services();
 GKeyFile *connman_storage_load_service(const char *service_id);
 
+/* The stored settings of a remembered WiFi network */
+struct connman_storage_network {
+	const char *ident;
+	const char *name;
+	const char *ssid;	/* in hex, as stored */
+	bool hidden;
+	bool favorite;
+	bool autoconnect;
+	glong modified;		/* seconds, 0 if not known */
+	int frequency;
+};
+
+typedef void (* connman_storage_network_cb_t) (
+			const struct connman_storage_network *network,
+			void *user_data);
+
+void connman_storage_foreach_hidden_network(connman_storage_network_cb_t func,
+						void *user_data);
+void connman_storage_foreach_autoconnect_network(
+			connman_storage_network_cb_t func, void *user_data);
+
 #ifdef __cplusplus
 }
 #endif
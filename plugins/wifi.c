@@ -67,6 +67,13 @@
 #define AUTOSCAN_EXPONENTIAL "exponential:3:300"
 #define AUTOSCAN_SINGLE "single:3"
 
+/* Every that many autoscans all channels are scanned, else the known ones */
+#define AUTOSCAN_FULL_SCAN_RATIO 4
+#define PARTIAL_SCAN_MAX_FREQS 16
+
+#define CHANNEL_HISTORY_MAX_NETWORKS 32
+#define CHANNEL_HISTORY_MAX_FREQS 8
+
 #define P2P_FIND_TIMEOUT 30
 #define P2P_CONNECTION_TIMEOUT 100
 #define P2P_LISTEN_PERIOD 500
@@ -114,6 +121,17 @@ struct autoscan_params {
 	int limit;
 	int interval;
 	unsigned int timeout;
+	unsigned int scans;
+};
+
+/*
+ * Channels a network was associated on or seen on since then, the most
+ * recent first. Autoscan probes these instead of all channels.
+ */
+struct channel_history {
+	uint16_t freqs[CHANNEL_HISTORY_MAX_FREQS];
+	unsigned int num_freqs;
+	gint64 last_used;
 };
 
 struct wifi_tethering_info {
@@ -152,6 +170,8 @@ struct wifi_data {
 	struct autoscan_params *autoscan;
 	enum wifi_scanning_type scanning_type;
 	GSupplicantScanParams *scan_params;
+	gint64 scan_started;
+	unsigned int scan_channels;
 	unsigned int p2p_find_timeout;
 	unsigned int p2p_connection_timeout;
 	struct connman_peer *pending_peer;
@@ -169,6 +189,9 @@ static GList *pending_wifi_device = NULL;
 static GList *p2p_iface_list = NULL;
 static bool wfd_service_registered = false;
 
+/* Network identifier to struct channel_history */
+static GHashTable *channel_histories = NULL;
+
 static void start_autoscan(struct connman_device *device);
 static int tech_set_tethering(struct connman_technology *technology,
 				const char *identifier, const char *passphrase,
@@ -835,6 +858,7 @@ static void reset_autoscan(struct connman_device *device)
 	autoscan = wifi->autoscan;
 
 	autoscan->interval = 0;
+	autoscan->scans = 0;
 
 	if (autoscan->timeout == 0)
 		return;
@@ -939,6 +963,29 @@ static bool is_duplicate(GSList *list, gchar *ssid, int ssid_len)
 	return false;
 }
 
+/* Returns 1 if the frequency was added and 0 if it was already there */
+static int add_scan_freq(GSupplicantScanParams *scan_data, uint16_t freq)
+{
+	uint16_t *freqs;
+	unsigned int i;
+
+	/* Don't add duplicate entries */
+	for (i = 0; i < scan_data->num_freqs; i++) {
+		if (scan_data->freqs[i] == freq)
+			return 0;
+	}
+
+	freqs = g_try_realloc(scan_data->freqs,
+			sizeof(uint16_t) * (scan_data->num_freqs + 1));
+	if (!freqs)
+		return -ENOMEM;
+
+	scan_data->freqs = freqs;
+	scan_data->freqs[scan_data->num_freqs++] = freq;
+
+	return 1;
+}
+
 static int add_scan_param(gchar *hex_ssid, char *raw_ssid, int ssid_len,
 			int freq, GSupplicantScanParams *scan_data,
 			int driver_max_scan_ssids, char *ssid_name)
@@ -1004,90 +1051,42 @@ static int add_scan_param(gchar *hex_ssid, char *raw_ssid, int ssid_len,
 
 	scan_data->ssids = g_slist_reverse(scan_data->ssids);
 
-	if (!scan_data->freqs) {
-		scan_data->freqs = g_try_malloc0(sizeof(uint16_t));
-		if (!scan_data->freqs) {
-			g_slist_free_full(scan_data->ssids, g_free);
-			return -ENOMEM;
-		}
+	if (add_scan_freq(scan_data, freq) < 0) {
+		g_slist_free_full(scan_data->ssids, g_free);
+		return -ENOMEM;
+	}
 
-		scan_data->num_freqs = 1;
-		scan_data->freqs[0] = freq;
-	} else {
-		bool duplicate = false;
+	return 1;
+}
 
-		/* Don't add duplicate entries */
-		for (i = 0; i < scan_data->num_freqs; i++) {
-			if (scan_data->freqs[i] == freq) {
-				duplicate = true;
-				break;
-			}
-		}
+struct hidden_scan_data {
+	GSupplicantScanParams *scan_data;
+	int num_ssids;
+	int add_param_failed;
+};
 
-		if (!duplicate) {
-			scan_data->num_freqs++;
-			scan_data->freqs = g_try_realloc(scan_data->freqs,
-				sizeof(uint16_t) * scan_data->num_freqs);
-			if (!scan_data->freqs) {
-				g_slist_free_full(scan_data->ssids, g_free);
-				return -ENOMEM;
-			}
-			scan_data->freqs[scan_data->num_freqs - 1] = freq;
-		}
-	}
+static void add_hidden_network(const struct connman_storage_network *network,
+							void *user_data)
+{
+	struct hidden_scan_data *params = user_data;
+	int ret;
 
-	return 1;
+	ret = add_scan_param((char *) network->ssid, NULL, 0, 0,
+				params->scan_data, 0, (char *) network->name);
+	if (ret < 0)
+		params->add_param_failed++;
+	else if (ret > 0)
+		params->num_ssids++;
 }
 
 static int get_hidden_connections(GSupplicantScanParams *scan_data)
 {
 	struct connman_config_entry **entries;
-	GKeyFile *keyfile;
-	gchar **services;
-	char *ssid, *name;
+	struct hidden_scan_data params = { scan_data, 0, 0 };
+	char *ssid;
 	int i, ret;
-	bool value;
-	int num_ssids = 0, add_param_failed = 0;
-
-	services = connman_storage_get_services();
-	for (i = 0; services && services[i]; i++) {
-		if (strncmp(services[i], "wifi_", 5) != 0)
-			continue;
 
-		keyfile = connman_storage_load_service(services[i]);
-		if (!keyfile)
-			continue;
-
-		value = g_key_file_get_boolean(keyfile,
-					services[i], "Hidden", NULL);
-		if (!value) {
-			g_key_file_free(keyfile);
-			continue;
-		}
-
-		value = g_key_file_get_boolean(keyfile,
-					services[i], "Favorite", NULL);
-		if (!value) {
-			g_key_file_free(keyfile);
-			continue;
-		}
-
-		ssid = g_key_file_get_string(keyfile,
-					services[i], "SSID", NULL);
-
-		name = g_key_file_get_string(keyfile, services[i], "Name",
-								NULL);
-
-		ret = add_scan_param(ssid, NULL, 0, 0, scan_data, 0, name);
-		if (ret < 0)
-			add_param_failed++;
-		else if (ret > 0)
-			num_ssids++;
-
-		g_free(ssid);
-		g_free(name);
-		g_key_file_free(keyfile);
-	}
+	connman_storage_foreach_hidden_network(add_hidden_network, &params);
 
 	/*
 	 * Check if there are any hidden AP that needs to be provisioned.
@@ -1112,20 +1111,18 @@ static int get_hidden_connections(GSupplicantScanParams *scan_data)
 
 		ret = add_scan_param(NULL, ssid, len, 0, scan_data, 0, ssid);
 		if (ret < 0)
-			add_param_failed++;
+			params.add_param_failed++;
 		else if (ret > 0)
-			num_ssids++;
+			params.num_ssids++;
 	}
 
 	connman_config_free_entries(entries);
 
-	if (add_param_failed > 0)
+	if (params.add_param_failed > 0)
 		DBG("Unable to scan %d out of %d SSIDs",
-					add_param_failed, num_ssids);
-
-	g_strfreev(services);
+				params.add_param_failed, params.num_ssids);
 
-	return num_ssids;
+	return params.num_ssids;
 }
 
 static int get_hidden_connections_params(struct wifi_data *wifi,
@@ -1198,32 +1195,218 @@ err:
 	return 0;
 }
 
+static void channel_history_add(struct channel_history *history,
+						uint16_t freq, bool recent)
+{
+	unsigned int i;
+
+	for (i = 0; i < history->num_freqs; i++) {
+		if (history->freqs[i] == freq)
+			break;
+	}
+
+	if (i < history->num_freqs && !recent)
+		return;
+
+	/* A new channel takes a free slot or the one of the oldest */
+	if (i == history->num_freqs) {
+		if (history->num_freqs < CHANNEL_HISTORY_MAX_FREQS)
+			history->num_freqs++;
+		else
+			i--;
+	}
+
+	if (!recent) {
+		history->freqs[i] = freq;
+		return;
+	}
+
+	memmove(history->freqs + 1, history->freqs, i * sizeof(uint16_t));
+	history->freqs[0] = freq;
+}
+
+static void remove_oldest_channel_history(void)
+{
+	GHashTableIter iter;
+	gpointer key, value;
+	const char *oldest = NULL;
+	gint64 last_used = G_MAXINT64;
+
+	g_hash_table_iter_init(&iter, channel_histories);
+	while (g_hash_table_iter_next(&iter, &key, &value)) {
+		struct channel_history *history = value;
+
+		if (history->last_used < last_used) {
+			last_used = history->last_used;
+			oldest = key;
+		}
+	}
+
+	if (oldest)
+		g_hash_table_remove(channel_histories, oldest);
+}
+
+/*
+ * A history is started when a network gets associated, the channels of
+ * further BSSs of the network are only learned for networks with one.
+ */
+static void update_channel_history(GSupplicantNetwork *network,
+							bool associated)
+{
+	struct channel_history *history;
+	dbus_uint16_t freqs[CHANNEL_HISTORY_MAX_FREQS];
+	const char *identifier;
+	unsigned int num;
+
+	identifier = g_supplicant_network_get_identifier(network);
+	if (!identifier)
+		return;
+
+	history = g_hash_table_lookup(channel_histories, identifier);
+	if (!history) {
+		if (!associated)
+			return;
+
+		if (g_hash_table_size(channel_histories) >=
+						CHANNEL_HISTORY_MAX_NETWORKS)
+			remove_oldest_channel_history();
+
+		history = g_new0(struct channel_history, 1);
+		g_hash_table_replace(channel_histories, g_strdup(identifier),
+								history);
+	}
+
+	if (associated)
+		history->last_used = g_get_monotonic_time();
+
+	num = g_supplicant_network_get_frequencies(network, freqs,
+						CHANNEL_HISTORY_MAX_FREQS);
+
+	/* The first one is of the best BSS, add it last as most recent */
+	while (num > 0)
+		channel_history_add(history, freqs[--num], associated);
+
+	DBG("%s on %u channels", identifier, history->num_freqs);
+}
+
+struct partial_scan_data {
+	GSupplicantScanParams *scan_params;
+	bool full;
+};
+
+static void add_partial_scan_freq(struct partial_scan_data *data,
+							uint16_t freq)
+{
+	if (data->full || freq == 0)
+		return;
+
+	if (add_scan_freq(data->scan_params, freq) < 0 ||
+			data->scan_params->num_freqs > PARTIAL_SCAN_MAX_FREQS)
+		data->full = true;
+}
+
+static void add_autoconnect_freq(const struct connman_storage_network *network,
+							void *user_data)
+{
+	add_partial_scan_freq(user_data, network->frequency);
+}
+
+/*
+ * Scan parameters for the channels of the known networks, or NULL if
+ * there are none or too many of them for a partial scan to pay off.
+ */
+static GSupplicantScanParams *get_partial_scan_params(void)
+{
+	struct partial_scan_data data = { NULL, false };
+	GHashTableIter iter;
+	gpointer value;
+	unsigned int i;
+
+	data.scan_params = g_try_malloc0(sizeof(GSupplicantScanParams));
+	if (!data.scan_params)
+		return NULL;
+
+	g_hash_table_iter_init(&iter, channel_histories);
+	while (g_hash_table_iter_next(&iter, NULL, &value)) {
+		struct channel_history *history = value;
+
+		for (i = 0; i < history->num_freqs; i++)
+			add_partial_scan_freq(&data, history->freqs[i]);
+	}
+
+	/* Favorites not associated with since startup */
+	connman_storage_foreach_autoconnect_network(add_autoconnect_freq,
+									&data);
+
+	if (data.full || data.scan_params->num_freqs == 0) {
+		g_supplicant_free_scan_params(data.scan_params);
+		return NULL;
+	}
+
+	return data.scan_params;
+}
+
+static void add_scan_statistics(struct wifi_data *wifi)
+{
+	gint64 duration;
+
+	if (!wifi->scan_started)
+		return;
+
+	duration = g_get_monotonic_time() - wifi->scan_started;
+	wifi->scan_started = 0;
+
+	connman_device_add_scan_statistics(wifi->device, wifi->scan_channels,
+							duration / 1000);
+}
+
+/* scan_params, which may be NULL for a full scan, are always consumed */
 static int throw_wifi_scan(struct connman_device *device,
+			GSupplicantScanParams *scan_params,
 			GSupplicantInterfaceCallback callback)
 {
 	struct wifi_data *wifi = connman_device_get_data(device);
+	unsigned int channels;
 	int ret;
 
-	if (!wifi)
-		return -ENODEV;
+	if (!wifi) {
+		ret = -ENODEV;
+		goto free;
+	}
 
 	DBG("device %p %p", device, wifi->interface);
 
-	if (wifi->tethering)
-		return -EBUSY;
+	if (wifi->tethering) {
+		ret = -EBUSY;
+		goto free;
+	}
 
-	if (connman_device_get_scanning(device, CONNMAN_SERVICE_TYPE_WIFI))
-		return -EALREADY;
+	if (connman_device_get_scanning(device, CONNMAN_SERVICE_TYPE_WIFI)) {
+		ret = -EALREADY;
+		goto free;
+	}
+
+	channels = scan_params ? scan_params->num_freqs : 0;
 
 	connman_device_ref(device);
 
-	ret = g_supplicant_interface_scan(wifi->interface, NULL,
+	ret = g_supplicant_interface_scan(wifi->interface, scan_params,
 						callback, device);
 	if (ret == 0) {
+		wifi->scan_started = g_get_monotonic_time();
+		wifi->scan_channels = channels;
+
 		connman_device_set_scanning(device,
 				CONNMAN_SERVICE_TYPE_WIFI, true);
-	} else
-		connman_device_unref(device);
+
+		return 0;
+	}
+
+	connman_device_unref(device);
+
+free:
+	if (scan_params)
+		g_supplicant_free_scan_params(scan_params);
 
 	return ret;
 }
@@ -1251,6 +1434,8 @@ static void scan_callback(int result, GSupplicantInterface *interface,
 	DBG("result %d wifi %p", result, wifi);
 
 	if (wifi) {
+		add_scan_statistics(wifi);
+
 		if (wifi->hidden && !wifi->postpone_hidden) {
 			connman_network_clear_hidden(wifi->hidden->user_data);
 			hidden_free(wifi->hidden);
@@ -1320,6 +1505,8 @@ static void scan_callback_hidden(int result,
 	if (!wifi)
 		goto out;
 
+	add_scan_statistics(wifi);
+
 	/* User is trying to connect to a hidden AP */
 	if (wifi->hidden && wifi->postpone_hidden)
 		goto out;
@@ -1348,6 +1535,7 @@ static gboolean autoscan_timeout(gpointer data)
 	struct connman_device *device = data;
 	struct wifi_data *wifi = connman_device_get_data(device);
 	struct autoscan_params *autoscan;
+	GSupplicantScanParams *scan_params = NULL;
 	int interval;
 
 	if (!wifi)
@@ -1364,7 +1552,10 @@ static gboolean autoscan_timeout(gpointer data)
 	if (interval > autoscan->limit)
 		interval = autoscan->limit;
 
-	throw_wifi_scan(wifi->device, scan_callback_hidden);
+	if (autoscan->scans++ % AUTOSCAN_FULL_SCAN_RATIO != 0)
+		scan_params = get_partial_scan_params();
+
+	throw_wifi_scan(wifi->device, scan_params, scan_callback_hidden);
 
 	/*
 	 * In case BackgroundScanning is disabled, interval will reach the
@@ -1610,130 +1801,59 @@ static int wifi_disable(struct connman_device *device)
 	return -EINPROGRESS;
 }
 
-struct last_connected {
-	GTimeVal modified;
-	gchar *ssid;
-	int freq;
-};
-
 static gint sort_entry(gconstpointer a, gconstpointer b, gpointer user_data)
 {
-	GTimeVal *aval = (GTimeVal *)a;
-	GTimeVal *bval = (GTimeVal *)b;
+	const struct connman_storage_network *anet = a;
+	const struct connman_storage_network *bnet = b;
 
 	/* Note that the sort order is descending */
-	if (aval->tv_sec < bval->tv_sec)
+	if (anet->modified < bnet->modified)
 		return 1;
 
-	if (aval->tv_sec > bval->tv_sec)
+	if (anet->modified > bnet->modified)
 		return -1;
 
 	return 0;
 }
 
-static void free_entry(gpointer data)
+static void add_latest_network(const struct connman_storage_network *network,
+							void *user_data)
 {
-	struct last_connected *entry = data;
+	GSequence *latest_list = user_data;
 
-	g_free(entry->ssid);
-	g_free(entry);
+	g_sequence_insert_sorted(latest_list, (gpointer) network,
+							sort_entry, NULL);
 }
 
 static int get_latest_connections(int max_ssids,
 				GSupplicantScanParams *scan_data)
 {
+	const struct connman_storage_network *network;
 	GSequenceIter *iter;
 	GSequence *latest_list;
-	struct last_connected *entry;
-	GKeyFile *keyfile;
-	GTimeVal modified;
-	gchar **services;
-	gchar *str;
-	char *ssid;
-	int i, freq;
-	int num_ssids = 0;
+	int i, num_ssids;
 
-	latest_list = g_sequence_new(free_entry);
+	latest_list = g_sequence_new(NULL);
 	if (!latest_list)
 		return -ENOMEM;
 
-	services = connman_storage_get_services();
-	for (i = 0; services && services[i]; i++) {
-		if (strncmp(services[i], "wifi_", 5) != 0)
-			continue;
-
-		keyfile = connman_storage_load_service(services[i]);
-		if (!keyfile)
-			continue;
-
-		str = g_key_file_get_string(keyfile,
-					services[i], "Favorite", NULL);
-		if (!str || g_strcmp0(str, "true")) {
-			g_free(str);
-			g_key_file_free(keyfile);
-			continue;
-		}
-		g_free(str);
-
-		str = g_key_file_get_string(keyfile,
-					services[i], "AutoConnect", NULL);
-		if (!str || g_strcmp0(str, "true")) {
-			g_free(str);
-			g_key_file_free(keyfile);
-			continue;
-		}
-		g_free(str);
-
-		str = g_key_file_get_string(keyfile,
-					services[i], "Modified", NULL);
-		if (!str) {
-			g_key_file_free(keyfile);
-			continue;
-		}
-		g_time_val_from_iso8601(str, &modified);
-		g_free(str);
-
-		ssid = g_key_file_get_string(keyfile,
-					services[i], "SSID", NULL);
-
-		freq = g_key_file_get_integer(keyfile, services[i],
-					"Frequency", NULL);
-		if (freq) {
-			entry = g_try_new(struct last_connected, 1);
-			if (!entry) {
-				g_sequence_free(latest_list);
-				g_key_file_free(keyfile);
-				g_free(ssid);
-				return -ENOMEM;
-			}
-
-			entry->ssid = ssid;
-			entry->modified = modified;
-			entry->freq = freq;
-
-			g_sequence_insert_sorted(latest_list, entry,
-						sort_entry, NULL);
-			num_ssids++;
-		} else
-			g_free(ssid);
-
-		g_key_file_free(keyfile);
-	}
-
-	g_strfreev(services);
+	connman_storage_foreach_autoconnect_network(add_latest_network,
+								latest_list);
 
+	num_ssids = g_sequence_get_length(latest_list);
 	num_ssids = num_ssids > max_ssids ? max_ssids : num_ssids;
 
 	iter = g_sequence_get_begin_iter(latest_list);
 
 	for (i = 0; i < num_ssids; i++) {
-		entry = g_sequence_get(iter);
+		network = g_sequence_get(iter);
 
-		DBG("ssid %s freq %d modified %lu", entry->ssid, entry->freq,
-						entry->modified.tv_sec);
+		DBG("ssid %s freq %d modified %lu", network->ssid,
+				network->frequency, network->modified);
 
-		add_scan_param(entry->ssid, NULL, 0, entry->freq, scan_data,
-						max_ssids, entry->ssid);
+		add_scan_param((char *) network->ssid, NULL, 0,
+				network->frequency, scan_data, max_ssids,
+				(char *) network->ssid);
 
 		iter = g_sequence_iter_next(iter);
 	}
@@ -1765,7 +1885,7 @@ static int wifi_scan_simple(struct connman_device *device)
 	if (wifi)
 		wifi_update_scanner_type(wifi, WIFI_SCANNING_PASSIVE);
 
-	return throw_wifi_scan(device, scan_callback_hidden);
+	return throw_wifi_scan(device, NULL, scan_callback_hidden);
 }
 
 static gboolean p2p_find_stop(gpointer data)
@@ -2921,7 +3041,11 @@ static void network_changed(GSupplicantNetwork *network, const char *property)
 	} else if (g_str_equal(property, "Signal")) {
 		connman_network_set_strength(connman_network,
 					calculate_strength(network));
+		update_channel_history(network, false);
 		update_needed = true;
+	} else if (g_str_equal(property, "Frequency")) {
+		update_channel_history(network, false);
+		update_needed = false;
 	} else
 		update_needed = false;
 
@@ -2956,6 +3080,8 @@ static void network_associated(GSupplicantNetwork *network)
 	if (!connman_network)
 		return;
 
+	update_channel_history(network, true);
+
 	if (wifi->network) {
 		if (wifi->network == connman_network)
 			return;
@@ -3554,20 +3680,28 @@ static int wifi_init(void)
 	if (err < 0)
 		return err;
 
+	channel_histories = g_hash_table_new_full(g_str_hash, g_str_equal,
+							g_free, g_free);
+
 	err = g_supplicant_register(&callbacks);
-	if (err < 0) {
-		connman_network_driver_unregister(&network_driver);
-		return err;
-	}
+	if (err < 0)
+		goto err;
 
 	err = connman_technology_driver_register(&tech_driver);
 	if (err < 0) {
 		g_supplicant_unregister(&callbacks);
-		connman_network_driver_unregister(&network_driver);
-		return err;
+		goto err;
 	}
 
 	return 0;
+
+err:
+	g_hash_table_destroy(channel_histories);
+	channel_histories = NULL;
+
+	connman_network_driver_unregister(&network_driver);
+
+	return err;
 }
 
 static void wifi_exit(void)
@@ -3578,6 +3712,9 @@ static void wifi_exit(void)
 
 	g_supplicant_unregister(&callbacks);
 
+	g_hash_table_destroy(channel_histories);
+	channel_histories = NULL;
+
 	connman_network_driver_unregister(&network_driver);
 }
 
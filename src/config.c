@@ -224,6 +224,9 @@ static void unregister_service(gpointer data)
 				 * address.
 				 */
 			}
+
+			/* a delayed save would write the files back */
+			__connman_service_cancel_save(service);
 		}
 
 		if (!__connman_storage_remove_service(service_id))
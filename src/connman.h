@@ -264,6 +264,9 @@ int __connman_resolvfile_remove(int index, const char *domain, const char *serve
 int __connman_resolver_redo_servers(int index);
 int __connman_resolver_set_mdns(int index, bool enabled);
 
+int __connman_storage_init(bool compact);
+void __connman_storage_cleanup(void);
+
 GKeyFile *__connman_storage_open_global(void);
 GKeyFile *__connman_storage_load_global(void);
 int __connman_storage_save_global(GKeyFile *keyfile);
@@ -345,13 +348,13 @@ void __connman_ipconfig_enable_ipv6(struct connman_ipconfig *ipconfig);
 int __connman_ipconfig_init(void);
 void __connman_ipconfig_cleanup(void);
 
-struct rtnl_link_stats;
+struct rtnl_link_stats64;
 
 void __connman_ipconfig_newlink(int index, unsigned short type,
 				unsigned int flags, const char *address,
 							unsigned short mtu,
-						struct rtnl_link_stats *stats);
-void __connman_ipconfig_dellink(int index, struct rtnl_link_stats *stats);
+						struct rtnl_link_stats64 *stats);
+void __connman_ipconfig_dellink(int index, struct rtnl_link_stats64 *stats);
 int __connman_ipconfig_newaddr(int index, int family, const char *label,
 				unsigned char prefixlen, const char *address);
 void __connman_ipconfig_deladdr(int index, int family, const char *label,
@@ -572,6 +575,7 @@ int __connman_device_request_hidden_scan(struct connman_device *device,
 				const char *identity, const char *passphrase,
 				const char *security, void *user_data);
 void __connman_device_stop_scan(enum connman_service_type type);
+void __connman_device_append_statistics(DBusMessageIter *dict);
 
 bool __connman_device_isfiltered(const char *devname);
 
@@ -815,13 +819,14 @@ int __connman_service_reset_ipconfig(struct connman_service *service,
 		enum connman_service_state *new_state);
 
 void __connman_service_notify(struct connman_service *service,
-			unsigned int rx_packets, unsigned int tx_packets,
-			unsigned int rx_bytes, unsigned int tx_bytes,
-			unsigned int rx_error, unsigned int tx_error,
-			unsigned int rx_dropped, unsigned int tx_dropped);
+			uint64_t rx_packets, uint64_t tx_packets,
+			uint64_t rx_bytes, uint64_t tx_bytes,
+			uint64_t rx_error, uint64_t tx_error,
+			uint64_t rx_dropped, uint64_t tx_dropped);
 
 int __connman_service_counter_register(const char *counter);
 void __connman_service_counter_unregister(const char *counter);
+void __connman_service_counter_due(const char *counter);
 
 #include <connman/peer.h>
 
@@ -852,6 +857,9 @@ int __connman_peer_service_unregister(const char *owner,
 
 void __connman_service_mark_dirty();
 void __connman_service_save(struct connman_service *service);
+void __connman_service_flush_saves(void);
+void __connman_service_cancel_save(struct connman_service *service);
+void __connman_service_append_statistics(DBusMessageIter *dict);
 
 #include <connman/notifier.h>
 
@@ -886,9 +894,16 @@ void __connman_rtnl_start(void);
 void __connman_rtnl_cleanup(void);
 
 enum connman_device_type __connman_rtnl_get_device_type(int index);
-unsigned int __connman_rtnl_update_interval_add(unsigned int interval);
-unsigned int __connman_rtnl_update_interval_remove(unsigned int interval);
+typedef void (* connman_rtnl_update_cb_t) (void *user_data);
+
+unsigned int __connman_rtnl_update_interval_add(unsigned int interval,
+					connman_rtnl_update_cb_t callback,
+					void *user_data);
+void __connman_rtnl_update_interval_remove(unsigned int id);
+void __connman_rtnl_update_index_add(int index);
+void __connman_rtnl_update_index_remove(int index);
 int __connman_rtnl_request_update(void);
+void __connman_rtnl_append_statistics(DBusMessageIter *dict);
 int __connman_rtnl_send(const void *buf, size_t len);
 
 bool __connman_session_policy_autoconnect(enum connman_service_connect_reason reason);
@@ -900,14 +915,14 @@ int __connman_session_init(void);
 void __connman_session_cleanup(void);
 
 struct connman_stats_data {
-	unsigned int rx_packets;
-	unsigned int tx_packets;
-	unsigned int rx_bytes;
-	unsigned int tx_bytes;
-	unsigned int rx_errors;
-	unsigned int tx_errors;
-	unsigned int rx_dropped;
-	unsigned int tx_dropped;
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_errors;
+	uint64_t tx_errors;
+	uint64_t rx_dropped;
+	uint64_t tx_dropped;
 	unsigned int time;
 };
 
@@ -922,6 +937,12 @@ int __connman_stats_get(struct connman_service *service,
 				bool roaming,
 				struct connman_stats_data *data);
 
+int __connman_stats_shm_init(void);
+void __connman_stats_shm_cleanup(void);
+void __connman_stats_shm_update(const char *ident, bool roaming,
+				const struct connman_stats_data *data);
+void __connman_stats_shm_remove(const char *ident);
+
 int __connman_iptables_dump(int type,
 				const char *table_name);
 int __connman_iptables_new_chain(int type,
@@ -971,6 +992,7 @@ void __connman_dnsproxy_remove_listener(int index);
 int __connman_dnsproxy_append(int index, const char *domain, const char *server);
 int __connman_dnsproxy_remove(int index, const char *domain, const char *server);
 int __connman_dnsproxy_set_mdns(int index, bool enabled);
+void __connman_dnsproxy_append_statistics(DBusMessageIter *dict);
 
 int __connman_6to4_probe(struct connman_service *service);
 void __connman_6to4_remove(struct connman_ipconfig *ipconfig);
@@ -986,7 +1008,11 @@ void __connman_ippool_cleanup(void);
 
 void __connman_ippool_free(struct connman_ippool *pool);
 
+#define IPPOOL_MIN_PREFIXLEN 20
+#define IPPOOL_MAX_PREFIXLEN 30
+
 struct connman_ippool *__connman_ippool_create(int index,
+					unsigned char prefixlen,
 					unsigned int start,
 					unsigned int range,
 					ippool_collision_cb_t collision_cb,
@@ -1033,6 +1059,8 @@ int __connman_firewall_enable_marking(struct firewall_context *ctx,
 					char *id, const char *src_ip,
 					uint32_t mark);
 int __connman_firewall_disable_marking(struct firewall_context *ctx);
+void __connman_firewall_begin(void);
+int __connman_firewall_commit(void);
 
 int __connman_firewall_init(void);
 void __connman_firewall_cleanup(void);
@@ -38,6 +38,7 @@ struct connman_counter {
 	char *owner;
 	char *path;
 	unsigned int interval;
+	unsigned int update_id;
 	guint watch;
 };
 
@@ -47,7 +48,7 @@ static void remove_counter(gpointer user_data)
 
 	DBG("owner %s path %s", counter->owner, counter->path);
 
-	__connman_rtnl_update_interval_remove(counter->interval);
+	__connman_rtnl_update_interval_remove(counter->update_id);
 
 	__connman_service_counter_unregister(counter->path);
 
@@ -56,6 +57,17 @@ static void remove_counter(gpointer user_data)
 	g_free(counter);
 }
 
+/*
+ * Usage is only sent for the statistics requested when the interval of
+ * the counter expired, not for the ones requested for other counters.
+ */
+static void interval_expired(void *user_data)
+{
+	struct connman_counter *counter = user_data;
+
+	__connman_service_counter_due(counter->path);
+}
+
 static void owner_disconnect(DBusConnection *conn, void *user_data)
 {
 	struct connman_counter *counter = user_data;
@@ -97,7 +109,8 @@ int __connman_counter_register(const char *owner, const char *path,
 	g_hash_table_replace(owner_mapping, counter->owner, counter);
 
 	counter->interval = interval;
-	__connman_rtnl_update_interval_add(counter->interval);
+	counter->update_id = __connman_rtnl_update_interval_add(
+				counter->interval, interval_expired, counter);
 
 	counter->watch = g_dbus_add_disconnect_watch(connection, owner,
 					owner_disconnect, counter, NULL);
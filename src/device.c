@@ -38,6 +38,14 @@ static GSList *device_list = NULL;
 static gchar **device_filter = NULL;
 static gchar **nodevice_filter = NULL;
 
+static struct {
+	uint64_t full_scans;
+	uint64_t partial_scans;
+	uint64_t partial_scan_channels;
+	uint64_t full_scan_time;
+	uint64_t partial_scan_time;
+} scan_stats;
+
 enum connman_pending_type {
 	PENDING_NONE	= 0,
 	PENDING_ENABLE	= 1,
@@ -794,6 +802,51 @@ int connman_device_set_scanning(struct connman_device *device,
 	return 0;
 }
 
+/**
+ * connman_device_add_scan_statistics:
+ * @device: device structure
+ * @channels: number of scanned channels, 0 for all of them
+ * @duration: time the scan took in milliseconds
+ *
+ * Account a finished scan of the device
+ */
+void connman_device_add_scan_statistics(struct connman_device *device,
+				unsigned int channels, unsigned int duration)
+{
+	DBG("device %p channels %u duration %u ms", device, channels,
+								duration);
+
+	if (channels == 0) {
+		scan_stats.full_scans++;
+		scan_stats.full_scan_time += duration;
+		return;
+	}
+
+	scan_stats.partial_scans++;
+	scan_stats.partial_scan_channels += channels;
+	scan_stats.partial_scan_time += duration;
+}
+
+void __connman_device_append_statistics(DBusMessageIter *dict)
+{
+	dbus_uint64_t full_scans = scan_stats.full_scans;
+	dbus_uint64_t partial_scans = scan_stats.partial_scans;
+	dbus_uint64_t channels = scan_stats.partial_scan_channels;
+	dbus_uint64_t full_time = scan_stats.full_scan_time;
+	dbus_uint64_t partial_time = scan_stats.partial_scan_time;
+
+	connman_dbus_dict_append_basic(dict, "FullScans",
+					DBUS_TYPE_UINT64, &full_scans);
+	connman_dbus_dict_append_basic(dict, "PartialScans",
+					DBUS_TYPE_UINT64, &partial_scans);
+	connman_dbus_dict_append_basic(dict, "PartialScanChannels",
+					DBUS_TYPE_UINT64, &channels);
+	connman_dbus_dict_append_basic(dict, "FullScanTime",
+					DBUS_TYPE_UINT64, &full_time);
+	connman_dbus_dict_append_basic(dict, "PartialScanTime",
+					DBUS_TYPE_UINT64, &partial_time);
+}
+
 /**
  * connman_device_set_string:
  * @device: device structure
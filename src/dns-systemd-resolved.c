@@ -434,6 +434,10 @@ int __connman_dnsproxy_set_mdns(int index, bool enabled)
 	return 0;
 }
 
+void __connman_dnsproxy_append_statistics(DBusMessageIter *dict)
+{
+}
+
 int __connman_dnsproxy_init(void)
 {
 	int ret;
@@ -32,6 +32,8 @@
 #include <netinet/in.h>
 #include <sys/types.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include <fcntl.h>
 #include <netdb.h>
 #include <resolv.h>
@@ -40,6 +42,7 @@
 #include <glib.h>
 
 #include "connman.h"
+#include "src/shared/dnswire.h"
 
 #define debug(fmt...) do { } while (0)
 
@@ -103,6 +106,14 @@ struct server_data {
 	bool enabled;
 	bool connected;
 	struct partial_reply *incoming_reply;
+	/* smoothed latency (ms) and loss (per mille) of the server */
+	unsigned int srtt;
+	unsigned int rttvar;
+	unsigned int loss;
+	time_t last_sample;
+	uint64_t queries;
+	uint64_t replies;
+	uint64_t lost;
 };
 
 struct request_data {
@@ -128,6 +139,15 @@ struct request_data {
 	gsize resplen;
 	struct listener_data *ifdata;
 	bool append_domain;
+	bool prefetch; /* refreshes the cache, there is no client */
+	/* the best server and the one the hedged query went to */
+	struct server_data *server;
+	struct server_data *hedge_server;
+	gint64 sent;
+	gint64 hedge_sent;
+	bool server_replied;
+	bool hedge_replied;
+	guint hedge;
 };
 
 struct listener_data {
@@ -163,18 +183,25 @@ struct cache_data {
 	time_t valid_until;
 	time_t cache_until;
 	int timeout;
-	uint16_t type;
 	uint16_t answers;
 	unsigned int data_len;
-	unsigned char *data; /* contains DNS header + body */
+	unsigned char data[]; /* contains DNS header + body */
 };
 
+/*
+ * The cache is keyed by the question, i.e. the name (in wire format),
+ * type and class. A response without answers (NXDOMAIN or NODATA) is
+ * cached too, see RFC 2308.
+ */
 struct cache_entry {
 	char *key;
+	uint16_t type;
+	uint16_t class;
 	bool want_refresh;
 	int hits;
-	struct cache_data *ipv4;
-	struct cache_data *ipv6;
+	time_t prefetch_until; /* a refresh query is in flight */
+	struct cache_data *data;
+	GList lru; /* link in cache_lru, data points back to the entry */
 };
 
 struct domain_question {
@@ -210,11 +237,98 @@ struct domain_rr {
  * not occupy too much memory. Each cached entry occupies on average
  * about 100 bytes memory (depending on DNS name length).
  * Example: caching www.connman.net uses 97 bytes memory.
- * The value is the max amount of cached DNS responses (count).
+ * The default is the max amount of cached DNS responses (count), it
+ * can be changed with DNSCacheSize and the memory used can be further
+ * bounded with DNSCacheMemoryLimit in main.conf.
+ */
+#define DEFAULT_CACHE_SIZE 256
+
+/*
+ * The periodic refresh only looks at this many of the most recently
+ * used entries, so its cost does not depend on the cache size.
+ */
+#define CACHE_REFRESH_BATCH 32
+
+/*
+ * Expired entries can still be served for a while (RFC 8767), popular
+ * entries are refreshed before they expire. Both are configured with
+ * DNSCacheServeStale and DNSCachePrefetchThreshold in main.conf.
+ */
+#define DEFAULT_CACHE_SERVE_STALE (24 * 60 * 60)
+#define DEFAULT_CACHE_PREFETCH 10
+#define STALE_ANSWER_TTL 30
+#define PREFETCH_TIMEOUT 5
+
+/*
+ * A query is first sent to the server with the best latency and loss
+ * estimate only. If it has not answered within srtt + 4 * rttvar a
+ * hedged query goes to the next best server. The delay is clamped to
+ * these values, in milliseconds. Estimates older than SERVER_STATS_AGE
+ * seconds are ignored so that every server gets probed now and then.
+ */
+#define HEDGE_MIN_DELAY 50
+#define HEDGE_MAX_DELAY 2000
+#define HEDGE_INITIAL_DELAY 500
+#define SERVER_STATS_AGE 60
+
+/*
+ * Up to this many queries are read from a UDP listener with one
+ * recvmmsg() call, and their cached answers are sent with one sendmmsg().
+ */
+#define UDP_BATCH_SIZE 16
+#define UDP_BATCH_BUF_LEN 4096
+
+/*
+ * With DNSCachePersistent the cache is kept on disk for each network
+ * in STORAGEDIR/<service>/dns-cache. The file is a header followed by
+ * the entries, each one directly followed by its key and data. All
+ * fields are in host byte order, the file is not meant to be portable.
  */
-#define MAX_CACHE_SIZE 256
+#define CACHE_SNAPSHOT_MAGIC 0x43444e53 /* "CDNS" */
+#define CACHE_SNAPSHOT_VERSION 1
+#define CACHE_SNAPSHOT_INTERVAL (10 * 60)
+
+struct cache_snapshot_header {
+	uint32_t magic;
+	uint32_t version;
+	int64_t saved;
+	uint32_t count;
+} __attribute__ ((packed));
+
+struct cache_snapshot_entry {
+	uint16_t type;
+	uint16_t class;
+	uint16_t key_len;
+	uint16_t answers;
+	int32_t hits;
+	int32_t timeout;
+	int64_t inserted;
+	int64_t valid_until;
+	int64_t cache_until;
+	uint32_t data_len;
+} __attribute__ ((packed));
 
 static int cache_size;
+static size_t cache_bytes;
+static unsigned int cache_max_size = DEFAULT_CACHE_SIZE;
+static size_t cache_max_bytes;
+static unsigned int cache_serve_stale = DEFAULT_CACHE_SERVE_STALE;
+static unsigned int cache_prefetch_percent = DEFAULT_CACHE_PREFETCH;
+/* cache entries, most recently used first */
+static GQueue cache_lru = G_QUEUE_INIT;
+static struct {
+	uint64_t hits;
+	uint64_t misses;
+	uint64_t evictions;
+	uint64_t stale_hits;
+	uint64_t prefetches;
+	uint64_t hedged;
+} cache_stats;
+static struct {
+	uint64_t queries;
+	uint64_t recv_calls;
+	uint64_t send_calls;
+} udp_stats;
 static GHashTable *cache;
 static int cache_refcount;
 static GSList *server_list = NULL;
@@ -222,7 +336,16 @@ static GSList *request_list = NULL;
 static GHashTable *listener_table = NULL;
 static time_t next_refresh;
 static GHashTable *partial_tcp_req_table;
+/* replies are rewritten here, see strip_domains() */
+static unsigned char reply_buf[2 + 65535];
 static guint cache_timer = 0;
+static bool cache_persistent;
+/* identifier of the default service, names the cache snapshot */
+static char *cache_ident;
+static guint cache_snapshot_timer;
+
+static void cache_snapshot_load(void);
+static void cache_snapshot_save(void);
 
 static guint16 get_id(void)
 {
@@ -283,6 +406,92 @@ static struct request_data *find_request(guint16 id)
 	return NULL;
 }
 
+static void server_update_loss(struct server_data *server, bool lost)
+{
+	server->loss = (7 * server->loss + (lost ? 1000 : 0)) / 8;
+	server->last_sample = time(NULL);
+
+	if (lost)
+		server->lost++;
+}
+
+/* RFC 6298 style estimate, the values are in milliseconds */
+static void server_update_rtt(struct server_data *server, unsigned int rtt)
+{
+	unsigned int delta;
+
+	if (rtt == 0)
+		rtt = 1;
+
+	if (server->srtt == 0) {
+		server->srtt = rtt;
+		server->rttvar = rtt / 2;
+	} else {
+		delta = server->srtt > rtt ? server->srtt - rtt :
+						rtt - server->srtt;
+		server->rttvar = (3 * server->rttvar + delta) / 4;
+		server->srtt = (7 * server->srtt + rtt) / 8;
+	}
+
+	server_update_loss(server, false);
+}
+
+static void server_reply_received(struct server_data *server,
+					struct request_data *req)
+{
+	gint64 sent;
+
+	if (server == req->server && !req->server_replied) {
+		req->server_replied = true;
+		sent = req->sent;
+	} else if (server == req->hedge_server && !req->hedge_replied) {
+		req->hedge_replied = true;
+		sent = req->hedge_sent;
+
+		/* the best server missed its deadline */
+		if (req->server && !req->server_replied)
+			server_update_loss(req->server, true);
+	} else
+		return;
+
+	server->replies++;
+	server_update_rtt(server, (g_get_monotonic_time() - sent) / 1000);
+}
+
+static void server_request_lost(struct request_data *req)
+{
+	if (req->server && !req->server_replied)
+		server_update_loss(req->server, true);
+
+	if (req->hedge_server && !req->hedge_replied)
+		server_update_loss(req->hedge_server, true);
+}
+
+/*
+ * Lower is better, a lost query costs about as much as the longest
+ * hedge delay. Servers without recent samples are tried first.
+ */
+static unsigned int server_score(struct server_data *server)
+{
+	if (server->srtt == 0 ||
+			server->last_sample + SERVER_STATS_AGE < time(NULL))
+		return 0;
+
+	return server->srtt + server->loss * HEDGE_MAX_DELAY / 1000;
+}
+
+static unsigned int server_hedge_delay(struct server_data *server)
+{
+	unsigned int delay;
+
+	if (server->srtt == 0)
+		return HEDGE_INITIAL_DELAY;
+
+	delay = server->srtt + 4 * server->rttvar;
+
+	return CLAMP(delay, HEDGE_MIN_DELAY, HEDGE_MAX_DELAY);
+}
+
 static struct server_data *find_server(int index,
 					const char *server,
 						int protocol)
@@ -339,14 +548,18 @@ static void refresh_dns_entry(struct cache_entry *entry, char *name)
 		g_resolv_add_nameserver(ipv6_resolve, "::1", 53, 0);
 	}
 
-	if (!entry->ipv4) {
+	/*
+	 * The resolver only knows how to look up addresses, other
+	 * record types are fetched again when they are next asked for.
+	 */
+	if (!entry->data && entry->type == ns_t_a) {
 		debug("Refreshing A record for %s", name);
 		g_resolv_lookup_hostname(ipv4_resolve, name,
 					dummy_resolve_func, NULL);
 		age = 4;
 	}
 
-	if (!entry->ipv6) {
+	if (!entry->data && entry->type == ns_t_aaaa) {
 		debug("Refreshing AAAA record for %s", name);
 		g_resolv_lookup_hostname(ipv6_resolve, name,
 					dummy_resolve_func, NULL);
@@ -358,65 +571,114 @@ static void refresh_dns_entry(struct cache_entry *entry, char *name)
 		entry->hits = 0;
 }
 
-static int dns_name_length(unsigned char *buf)
+static void update_cached_ttl(unsigned char *msg, int len, int new_ttl)
 {
-	if ((buf[0] & NS_CMPRSFLGS) == NS_CMPRSFLGS) /* compressed name */
-		return 2;
-	return strlen((char *)buf) + 1;
-}
+	struct domain_hdr *hdr = (void *) msg;
+	struct dns_reader reader;
+	uint16_t type, class;
+	int count;
 
-static void update_cached_ttl(unsigned char *buf, int len, int new_ttl)
-{
-	unsigned char *c;
-	uint16_t w;
-	int l;
+	if (len < (int) sizeof(*hdr))
+		return;
+
+	count = ntohs(hdr->ancount) + ntohs(hdr->nscount);
 
-	/* skip the header */
-	c = buf + 12;
-	len -= 12;
+	dns_reader_init(&reader, msg, len);
+	reader.pos = sizeof(*hdr);
 
 	/* skip the query, which is a name and 2 16 bit words */
-	l = dns_name_length(c);
-	c += l;
-	len -= l;
-	c += 4;
-	len -= 4;
-
-	/* now we get the answer records */
-
-	while (len > 0) {
-		/* first a name */
-		l = dns_name_length(c);
-		c += l;
-		len -= l;
-		if (len < 0)
-			break;
-		/* then type + class, 2 bytes each */
-		c += 4;
-		len -= 4;
-		if (len < 0)
-			break;
+	if (dns_read_question(&reader, NULL, 0, &type, &class) < 0)
+		return;
+
+	/* now we get the answer and authority records */
+	while (count-- > 0) {
+		struct dns_rr rr;
 
-		/* now the 4 byte TTL field */
-		c[0] = new_ttl >> 24 & 0xff;
-		c[1] = new_ttl >> 16 & 0xff;
-		c[2] = new_ttl >> 8 & 0xff;
-		c[3] = new_ttl & 0xff;
-		c += 4;
-		len -= 4;
-		if (len < 0)
+		if (dns_read_rr(&reader, NULL, 0, &rr) < 0)
 			break;
 
-		/* now the 2 byte rdlen field */
-		w = c[0] << 8 | c[1];
-		c += w + 2;
-		len -= w + 2;
+		/* the 4 byte TTL field follows type and class */
+		dns_put_u32(msg + rr.offset + 4, new_ttl);
+	}
+}
+
+/*
+ * While the queries received in one listener wakeup are handled, the
+ * UDP answers for them are queued here and sent with one sendmmsg().
+ */
+static struct {
+	int sk;
+	unsigned int count;
+	struct mmsghdr msgs[UDP_BATCH_SIZE];
+	struct iovec iov[UDP_BATCH_SIZE];
+	struct sockaddr_in6 addr[UDP_BATCH_SIZE];
+	unsigned char buf[UDP_BATCH_SIZE][UDP_BATCH_BUF_LEN];
+} udp_tx = { .sk = -1 };
+
+static void udp_flush(void)
+{
+	unsigned int sent = 0;
+	int err;
+
+	while (sent < udp_tx.count) {
+		err = sendmmsg(udp_tx.sk, udp_tx.msgs + sent,
+				udp_tx.count - sent, MSG_NOSIGNAL);
+		udp_stats.send_calls++;
+
+		if (err < 0) {
+			if (errno == EINTR)
+				continue;
+
+			/*
+			 * The error is for the first message not sent, drop
+			 * only that one and go on with the rest.
+			 */
+			connman_error("Failed to send DNS response: %s",
+							strerror(errno));
+			sent++;
+			continue;
+		}
+
+		sent += err;
+	}
+
+	udp_tx.count = 0;
+}
+
+static int udp_sendto(int sk, const unsigned char *buf, size_t len,
+			const struct sockaddr *to, socklen_t tolen)
+{
+	unsigned int i;
+
+	if (sk != udp_tx.sk || len > UDP_BATCH_BUF_LEN ||
+					tolen > sizeof(udp_tx.addr[0])) {
+		udp_stats.send_calls++;
+		return sendto(sk, buf, len, MSG_NOSIGNAL, to, tolen);
 	}
+
+	if (udp_tx.count == UDP_BATCH_SIZE)
+		udp_flush();
+
+	i = udp_tx.count++;
+
+	memcpy(udp_tx.buf[i], buf, len);
+	memcpy(&udp_tx.addr[i], to, tolen);
+
+	udp_tx.iov[i].iov_base = udp_tx.buf[i];
+	udp_tx.iov[i].iov_len = len;
+
+	memset(&udp_tx.msgs[i], 0, sizeof(udp_tx.msgs[i]));
+	udp_tx.msgs[i].msg_hdr.msg_name = &udp_tx.addr[i];
+	udp_tx.msgs[i].msg_hdr.msg_namelen = tolen;
+	udp_tx.msgs[i].msg_hdr.msg_iov = &udp_tx.iov[i];
+	udp_tx.msgs[i].msg_hdr.msg_iovlen = 1;
+
+	return len;
 }
 
 static void send_cached_response(int sk, unsigned char *buf, int len,
 				const struct sockaddr *to, socklen_t tolen,
-				int protocol, int id, uint16_t answers, int ttl)
+				int protocol, int id, int ttl)
 {
 	struct domain_hdr *hdr;
 	unsigned char *ptr = buf;
@@ -446,23 +708,24 @@ static void send_cached_response(int sk, unsigned char *buf, int len,
 
 	hdr = (void *) (ptr + offset);
 
+	/*
+	 * The cached packet keeps the response code and the answer and
+	 * authority sections of the original reply, only the id and
+	 * the TTLs need to be adjusted.
+	 */
 	hdr->id = id;
 	hdr->qr = 1;
-	hdr->rcode = ns_r_noerror;
-	hdr->ancount = htons(answers);
-	hdr->nscount = 0;
-	hdr->arcount = 0;
 
-	/* if this is a negative reply, we are authorative */
-	if (answers == 0)
-		hdr->aa = 1;
-	else
-		update_cached_ttl((unsigned char *)hdr, adj_len, ttl);
+	update_cached_ttl((unsigned char *)hdr, adj_len, ttl);
 
-	debug("sk %d id 0x%04x answers %d ptr %p length %d dns %d",
-		sk, hdr->id, answers, ptr, len, dns_len);
+	debug("sk %d id 0x%04x rcode %d answers %d ptr %p length %d dns %d",
+		sk, hdr->id, hdr->rcode, ntohs(hdr->ancount), ptr, len,
+		dns_len);
 
-	err = sendto(sk, ptr, len, MSG_NOSIGNAL, to, tolen);
+	if (protocol == IPPROTO_UDP)
+		err = udp_sendto(sk, ptr, len, to, tolen);
+	else
+		err = sendto(sk, ptr, len, MSG_NOSIGNAL, to, tolen);
 	if (err < 0) {
 		connman_error("Cannot send cached DNS response: %s",
 				strerror(errno));
@@ -506,7 +769,11 @@ static void send_response(int sk, unsigned char *buf, size_t len,
 	hdr->nscount = 0;
 	hdr->arcount = 0;
 
-	err = sendto(sk, buf, sizeof(*hdr) + offset, MSG_NOSIGNAL, to, tolen);
+	if (protocol == IPPROTO_UDP)
+		err = udp_sendto(sk, buf, sizeof(*hdr) + offset, to, tolen);
+	else
+		err = sendto(sk, buf, sizeof(*hdr) + offset, MSG_NOSIGNAL,
+								to, tolen);
 	if (err < 0) {
 		connman_error("Failed to send DNS response to %d: %s",
 				sk, strerror(errno));
@@ -534,6 +801,9 @@ static void destroy_request_data(struct request_data *req)
 	if (req->timeout > 0)
 		g_source_remove(req->timeout);
 
+	if (req->hedge > 0)
+		g_source_remove(req->hedge);
+
 	g_free(req->resp);
 	g_free(req->request);
 	g_free(req->name);
@@ -553,6 +823,11 @@ static gboolean request_timeout(gpointer user_data)
 
 	request_list = g_slist_remove(request_list, req);
 
+	server_request_lost(req);
+
+	if (req->prefetch)
+		goto out;
+
 	if (req->protocol == IPPROTO_UDP) {
 		sk = get_req_udp_socket(req);
 		sa = &req->sa;
@@ -658,6 +933,87 @@ static int append_query(unsigned char *buf, unsigned int size,
 	return ptr - buf;
 }
 
+static size_t cache_data_size(struct cache_data *data)
+{
+	if (!data)
+		return 0;
+
+	return sizeof(*data) + data->data_len;
+}
+
+static void cache_data_free(struct cache_data **data)
+{
+	if (!*data)
+		return;
+
+	cache_bytes -= cache_data_size(*data);
+
+	g_free(*data);
+	*data = NULL;
+}
+
+static void cache_entry_touch(struct cache_entry *entry)
+{
+	g_queue_unlink(&cache_lru, &entry->lru);
+	g_queue_push_head_link(&cache_lru, &entry->lru);
+}
+
+static guint cache_entry_hash(gconstpointer key)
+{
+	const struct cache_entry *entry = key;
+
+	return g_str_hash(entry->key) ^
+			((guint) entry->type << 16 | entry->class);
+}
+
+static gboolean cache_entry_equal(gconstpointer a, gconstpointer b)
+{
+	const struct cache_entry *entry_a = a, *entry_b = b;
+
+	return entry_a->type == entry_b->type &&
+		entry_a->class == entry_b->class &&
+		g_str_equal(entry_a->key, entry_b->key);
+}
+
+static struct cache_entry *cache_lookup(char *name, uint16_t type,
+							uint16_t class)
+{
+	struct cache_entry key = {
+		.key = name,
+		.type = type,
+		.class = class,
+	};
+
+	if (!cache)
+		return NULL;
+
+	return g_hash_table_lookup(cache, &key);
+}
+
+/*
+ * Meta queries and zone transfers are never cached, neither is
+ * anything else than the Internet class.
+ */
+static bool cache_type_is_cacheable(uint16_t type, uint16_t class)
+{
+	if (class != ns_c_in)
+		return false;
+
+	switch (type) {
+	case ns_t_opt:
+	case ns_t_tkey:
+	case ns_t_tsig:
+	case ns_t_ixfr:
+	case ns_t_axfr:
+	case ns_t_mailb:
+	case ns_t_maila:
+	case ns_t_any:
+		return false;
+	}
+
+	return true;
+}
+
 static bool cache_check_is_valid(struct cache_data *data,
 				time_t current_time)
 {
@@ -670,6 +1026,22 @@ static bool cache_check_is_valid(struct cache_data *data,
 	return true;
 }
 
+/*
+ * Expired data can still be used to answer while the entry is being
+ * refreshed, see RFC 8767.
+ */
+static bool cache_check_is_usable(struct cache_data *data,
+				time_t current_time)
+{
+	if (!data)
+		return false;
+
+	if (data->cache_until + (time_t) cache_serve_stale < current_time)
+		return false;
+
+	return true;
+}
+
 /*
  * remove stale cached entries so that they can be refreshed
  */
@@ -677,28 +1049,16 @@ static void cache_enforce_validity(struct cache_entry *entry)
 {
 	time_t current_time = time(NULL);
 
-	if (!cache_check_is_valid(entry->ipv4, current_time)
-							&& entry->ipv4) {
-		debug("cache timeout \"%s\" type A", entry->key);
-		g_free(entry->ipv4->data);
-		g_free(entry->ipv4);
-		entry->ipv4 = NULL;
-
-	}
-
-	if (!cache_check_is_valid(entry->ipv6, current_time)
-							&& entry->ipv6) {
-		debug("cache timeout \"%s\" type AAAA", entry->key);
-		g_free(entry->ipv6->data);
-		g_free(entry->ipv6);
-		entry->ipv6 = NULL;
+	if (!cache_check_is_usable(entry->data, current_time)
+							&& entry->data) {
+		debug("cache timeout \"%s\" type %d", entry->key,
+							entry->type);
+		cache_data_free(&entry->data);
 	}
 }
 
-static uint16_t cache_check_validity(char *question, uint16_t type,
-				struct cache_entry *entry)
+static bool cache_check_validity(struct cache_entry *entry)
 {
-	time_t current_time = time(NULL);
 	bool want_refresh = false;
 
 	/*
@@ -710,43 +1070,17 @@ static uint16_t cache_check_validity(char *question, uint16_t type,
 
 	cache_enforce_validity(entry);
 
-	switch (type) {
-	case 1:		/* IPv4 */
-		if (!cache_check_is_valid(entry->ipv4, current_time)) {
-			debug("cache %s \"%s\" type A", entry->ipv4 ?
-					"timeout" : "entry missing", question);
-
-			if (want_refresh)
-				entry->want_refresh = true;
-
-			/*
-			 * We do not remove cache entry if there is still
-			 * valid IPv6 entry found in the cache.
-			 */
-			if (!cache_check_is_valid(entry->ipv6, current_time) && !want_refresh) {
-				g_hash_table_remove(cache, question);
-				type = 0;
-			}
-		}
-		break;
-
-	case 28:	/* IPv6 */
-		if (!cache_check_is_valid(entry->ipv6, current_time)) {
-			debug("cache %s \"%s\" type AAAA", entry->ipv6 ?
-					"timeout" : "entry missing", question);
+	if (entry->data)
+		return true;
 
-			if (want_refresh)
-				entry->want_refresh = true;
+	debug("cache entry missing \"%s\" type %d", entry->key, entry->type);
 
-			if (!cache_check_is_valid(entry->ipv4, current_time) && !want_refresh) {
-				g_hash_table_remove(cache, question);
-				type = 0;
-			}
-		}
-		break;
-	}
+	if (want_refresh)
+		entry->want_refresh = true;
+	else
+		g_hash_table_remove(cache, entry);
 
-	return type;
+	return false;
 }
 
 static void cache_element_destroy(gpointer value)
@@ -756,15 +1090,11 @@ static void cache_element_destroy(gpointer value)
 	if (!entry)
 		return;
 
-	if (entry->ipv4) {
-		g_free(entry->ipv4->data);
-		g_free(entry->ipv4);
-	}
+	g_queue_unlink(&cache_lru, &entry->lru);
 
-	if (entry->ipv6) {
-		g_free(entry->ipv6->data);
-		g_free(entry->ipv6);
-	}
+	cache_data_free(&entry->data);
+
+	cache_bytes -= sizeof(*entry) + strlen(entry->key) + 1;
 
 	g_free(entry->key);
 	g_free(entry);
@@ -773,6 +1103,50 @@ static void cache_element_destroy(gpointer value)
 		cache_size = 0;
 }
 
+static bool cache_is_full(size_t needed, bool new_entry)
+{
+	if (new_entry && (unsigned int) cache_size >= cache_max_size)
+		return true;
+
+	if (cache_max_bytes && cache_bytes + needed > cache_max_bytes)
+		return true;
+
+	return false;
+}
+
+/*
+ * Make room for a response by evicting the least recently used entries.
+ * The response is either for a new entry or for keep, which is never
+ * evicted. Returns false if the response would not fit into the cache.
+ */
+static bool cache_make_room(size_t needed, struct cache_entry *keep)
+{
+	GList *link;
+
+	if (cache_max_bytes && needed > cache_max_bytes)
+		return false;
+
+	while (cache_is_full(needed, !keep)) {
+		struct cache_entry *entry;
+
+		link = g_queue_peek_tail_link(&cache_lru);
+		if (!link)
+			break;
+
+		entry = link->data;
+		if (entry == keep)
+			return false;
+
+		debug("cache evict \"%s\" type %d hits %d", entry->key,
+					entry->type, entry->hits);
+
+		g_hash_table_remove(cache, entry);
+		cache_stats.evictions++;
+	}
+
+	return true;
+}
+
 static gboolean try_remove_cache(gpointer user_data)
 {
 	cache_timer = 0;
@@ -780,6 +1154,9 @@ static gboolean try_remove_cache(gpointer user_data)
 	if (__sync_fetch_and_sub(&cache_refcount, 1) == 1) {
 		debug("No cache users, removing it.");
 
+		/* the default service may still be the same one */
+		cache_snapshot_save();
+
 		g_hash_table_destroy(cache);
 		cache = NULL;
 	}
@@ -789,36 +1166,42 @@ static gboolean try_remove_cache(gpointer user_data)
 
 static void create_cache(void)
 {
-	if (__sync_fetch_and_add(&cache_refcount, 1) == 0)
-		cache = g_hash_table_new_full(g_str_hash,
-					g_str_equal,
+	if (__sync_fetch_and_add(&cache_refcount, 1) == 0) {
+		cache = g_hash_table_new_full(cache_entry_hash,
+					cache_entry_equal,
 					NULL,
 					cache_element_destroy);
+
+		cache_snapshot_load();
+	}
 }
 
-static struct cache_entry *cache_check(gpointer request, int *qtype, int proto)
+static struct cache_entry *cache_check(gpointer request, size_t len,
+						int *qtype, int proto)
 {
-	char *question;
+	char question[NS_MAXDNAME + 1];
 	struct cache_entry *entry;
-	struct domain_question *q;
-	uint16_t type;
-	int offset, proto_offset;
+	struct dns_reader reader;
+	uint16_t type, class;
+	int proto_offset;
 
 	if (!request)
 		return NULL;
 
 	proto_offset = protocol_offset(proto);
-	if (proto_offset < 0)
+	if (proto_offset < 0 ||
+			len < proto_offset + sizeof(struct domain_hdr))
 		return NULL;
 
-	question = request + proto_offset + 12;
+	dns_reader_init(&reader, request + proto_offset, len - proto_offset);
+	reader.pos = sizeof(struct domain_hdr);
 
-	offset = strlen(question) + 1;
-	q = (void *) (question + offset);
-	type = ntohs(q->type);
+	/* the same key as the one cache_update() builds for the reply */
+	if (dns_read_question(&reader, (uint8_t *) question,
+				sizeof(question) - 1, &type, &class) < 0)
+		return NULL;
 
-	/* We only cache either A (1) or AAAA (28) requests */
-	if (type != 1 && type != 28)
+	if (!cache_type_is_cacheable(type, class))
 		return NULL;
 
 	if (!cache) {
@@ -826,12 +1209,11 @@ static struct cache_entry *cache_check(gpointer request, int *qtype, int proto)
 		return NULL;
 	}
 
-	entry = g_hash_table_lookup(cache, question);
+	entry = cache_lookup(question, type, class);
 	if (!entry)
 		return NULL;
 
-	type = cache_check_validity(question, type, entry);
-	if (type == 0)
+	if (!cache_check_validity(entry))
 		return NULL;
 
 	*qtype = type;
@@ -839,430 +1221,222 @@ static struct cache_entry *cache_check(gpointer request, int *qtype, int proto)
 }
 
 /*
- * Get a label/name from DNS resource record. The function decompresses the
- * label if necessary. The function does not convert the name to presentation
- * form. This means that the result string will contain label lengths instead
- * of dots between labels. We intentionally do not want to convert to dotted
- * format so that we can cache the wire format string directly.
+ * Check if the response can be cached and for how long. On success the
+ * question name (in wire format), type and class are returned together
+ * with the TTL and the length of the message up to the end of the
+ * authority section. The additional section is never cached as it
+ * might contain EDNS0 data that is only meant for us.
+ *
+ * For a negative response (NXDOMAIN or NODATA) the TTL is taken from
+ * the SOA record of the authority section as described in RFC 2308.
+ * Negative responses without a SOA record are not cached.
  */
-static int get_name(int counter,
-		unsigned char *pkt, unsigned char *start, unsigned char *max,
-		unsigned char *output, int output_max, int *output_len,
-		unsigned char **end, char *name, size_t max_name, int *name_len)
+static int parse_response(unsigned char *msg, int len,
+			char *question, int qlen,
+			uint16_t *type, uint16_t *class, int *ttl,
+			uint16_t *answers, int *cache_len)
 {
-	unsigned char *p;
+	struct domain_hdr *hdr = (void *) msg;
+	struct dns_reader reader;
+	uint16_t ancount, nscount;
+	int64_t answer_ttl = -1, soa_ttl = -1;
+	int err, i;
+	bool negative;
 
-	/* Limit recursion to 10 (this means up to 10 labels in domain name) */
-	if (counter > 10)
+	if (len < (int) sizeof(*hdr))
 		return -EINVAL;
 
-	p = start;
-	while (*p) {
-		if ((*p & NS_CMPRSFLGS) == NS_CMPRSFLGS) {
-			uint16_t offset = (*p & 0x3F) * 256 + *(p + 1);
-
-			if (offset >= max - pkt)
-				return -ENOBUFS;
+	ancount = ntohs(hdr->ancount);
+	nscount = ntohs(hdr->nscount);
 
-			if (!*end)
-				*end = p + 2;
+	debug("qr %d qdcount %d", hdr->qr, ntohs(hdr->qdcount));
 
-			return get_name(counter + 1, pkt, pkt + offset, max,
-					output, output_max, output_len, end,
-					name, max_name, name_len);
-		} else {
-			unsigned label_len = *p;
+	/* We currently only cache responses where question count is 1 */
+	if (hdr->qr != 1 || ntohs(hdr->qdcount) != 1 || hdr->tc ||
+						hdr->opcode != ns_o_query)
+		return -EINVAL;
 
-			if (pkt + label_len > max)
-				return -ENOBUFS;
+	if (hdr->rcode != ns_r_noerror && hdr->rcode != ns_r_nxdomain)
+		return -ENOMSG;
 
-			if (*output_len > output_max)
-				return -ENOBUFS;
+	dns_reader_init(&reader, msg, len);
+	reader.pos = sizeof(*hdr);
 
-			if ((*name_len + 1 + label_len + 1) > max_name)
-				return -ENOBUFS;
+	/* the question name is kept with its terminating root label */
+	err = dns_read_question(&reader, (uint8_t *) question, qlen,
+							type, class);
+	if (err < 0)
+		return err;
 
-			/*
-			 * We need the original name in order to check
-			 * if this answer is the correct one.
-			 */
-			name[(*name_len)++] = label_len;
-			memcpy(name + *name_len, p + 1,	label_len + 1);
-			*name_len += label_len;
+	if (!cache_type_is_cacheable(*type, *class))
+		return -ENOMSG;
 
-			/* We compress the result */
-			output[0] = NS_CMPRSFLGS;
-			output[1] = 0x0C;
-			*output_len = 2;
+	for (i = 0; i < ancount + nscount; i++) {
+		struct dns_rr rr;
+		uint32_t minimum;
 
-			p += label_len + 1;
+		err = dns_read_rr(&reader, NULL, 0, &rr);
+		if (err < 0)
+			return err;
 
-			if (!*end)
-				*end = p;
+		/* RFC 2181, a TTL with the most significant bit set is 0 */
+		if (rr.ttl > INT32_MAX)
+			rr.ttl = 0;
 
-			if (p >= max)
-				return -ENOBUFS;
+		if (i < ancount) {
+			if (answer_ttl < 0 || rr.ttl < answer_ttl)
+				answer_ttl = rr.ttl;
+			continue;
 		}
-	}
 
-	return 0;
-}
+		if (rr.type != ns_t_soa || soa_ttl >= 0)
+			continue;
 
-static int parse_rr(unsigned char *buf, unsigned char *start,
-			unsigned char *max,
-			unsigned char *response, unsigned int *response_size,
-			uint16_t *type, uint16_t *class, int *ttl, int *rdlen,
-			unsigned char **end,
-			char *name, size_t max_name)
-{
-	struct domain_rr *rr;
-	int err, offset;
-	int name_len = 0, output_len = 0, max_rsp = *response_size;
+		/*
+		 * The MINIMUM field is the last 32 bit word of the SOA
+		 * rdata, after two names and four other 32 bit words.
+		 */
+		if (rr.rdlen < 2 + 5 * NS_INT32SZ)
+			return -EINVAL;
 
-	err = get_name(0, buf, start, max, response, max_rsp,
-			&output_len, end, name, max_name, &name_len);
-	if (err < 0)
-		return err;
+		minimum = dns_get_u32(msg + reader.pos - NS_INT32SZ);
 
-	offset = output_len;
+		soa_ttl = MIN(rr.ttl, minimum);
+	}
 
-	if ((unsigned int) offset > *response_size)
-		return -ENOBUFS;
+	negative = ancount == 0 || hdr->rcode == ns_r_nxdomain;
+	if (negative) {
+		if (soa_ttl < 0)
+			return -ENOMSG;
 
-	rr = (void *) (*end);
+		if (answer_ttl < 0 || soa_ttl < answer_ttl)
+			answer_ttl = soa_ttl;
+	}
 
-	if (!rr)
-		return -EINVAL;
+	*ttl = answer_ttl;
+	*answers = ancount;
+	*cache_len = reader.pos;
 
-	*type = ntohs(rr->type);
-	*class = ntohs(rr->class);
-	*ttl = ntohl(rr->ttl);
-	*rdlen = ntohs(rr->rdlen);
+	return 0;
+}
 
-	if (*ttl < 0)
-		return -EINVAL;
-
-	memcpy(response + offset, *end, sizeof(struct domain_rr));
-
-	offset += sizeof(struct domain_rr);
-	*end += sizeof(struct domain_rr);
-
-	if ((unsigned int) (offset + *rdlen) > *response_size)
-		return -ENOBUFS;
-
-	memcpy(response + offset, *end, *rdlen);
-
-	*end += *rdlen;
-
-	*response_size = offset + *rdlen;
-
-	return 0;
-}
+static bool resolv(struct request_data *req,
+				gpointer request, gpointer name);
 
-static bool check_alias(GSList *aliases, char *name)
+/* turn a DNS name into a hostname with dots */
+static char *cache_entry_hostname(struct cache_entry *entry, char *dns_name)
 {
-	GSList *list;
+	char *c;
 
-	if (aliases) {
-		for (list = aliases; list; list = list->next) {
-			int len = strlen((char *)list->data);
-			if (strncmp((char *)list->data, name, len) == 0)
-				return true;
-		}
+	strncpy(dns_name, entry->key, NS_MAXDNAME);
+	dns_name[NS_MAXDNAME] = '\0';
+
+	c = dns_name;
+	while (c && *c) {
+		int jump;
+		jump = *c;
+		*c = '.';
+		c += jump + 1;
 	}
 
-	return false;
+	return &dns_name[1];
 }
 
-static int parse_response(unsigned char *buf, int buflen,
-			char *question, int qlen,
-			uint16_t *type, uint16_t *class, int *ttl,
-			unsigned char *response, unsigned int *response_len,
-			uint16_t *answers)
+/*
+ * Send a query for the entry to the upstream servers without a client
+ * waiting for it. The reply replaces the cached data in cache_update().
+ */
+static void cache_prefetch(struct cache_entry *entry, time_t current_time)
 {
-	struct domain_hdr *hdr = (void *) buf;
+	struct request_data *req;
 	struct domain_question *q;
-	unsigned char *ptr;
-	uint16_t qdcount = ntohs(hdr->qdcount);
-	uint16_t ancount = ntohs(hdr->ancount);
-	int err, i;
-	uint16_t qtype, qclass;
-	unsigned char *next = NULL;
-	unsigned int maxlen = *response_len;
-	GSList *aliases = NULL, *list;
-	char name[NS_MAXDNAME + 1];
-
-	if (buflen < 12)
-		return -EINVAL;
-
-	debug("qr %d qdcount %d", hdr->qr, qdcount);
-
-	/* We currently only cache responses where question count is 1 */
-	if (hdr->qr != 1 || qdcount != 1)
-		return -EINVAL;
-
-	ptr = buf + sizeof(struct domain_hdr);
-
-	strncpy(question, (char *) ptr, qlen);
-	qlen = strlen(question);
-	ptr += qlen + 1; /* skip \0 */
-
-	q = (void *) ptr;
-	qtype = ntohs(q->type);
-
-	/* We cache only A and AAAA records */
-	if (qtype != 1 && qtype != 28)
-		return -ENOMSG;
-
-	qclass = ntohs(q->class);
-
-	ptr += 2 + 2; /* ptr points now to answers */
-
-	err = -ENOMSG;
-	*response_len = 0;
-	*answers = 0;
+	char dns_name[NS_MAXDNAME + 1];
+	unsigned char *buf;
+	size_t key_len;
 
-	memset(name, 0, sizeof(name));
+	if (entry->prefetch_until >= current_time || !server_list)
+		return;
 
-	/*
-	 * We have a bunch of answers (like A, AAAA, CNAME etc) to
-	 * A or AAAA question. We traverse the answers and parse the
-	 * resource records. Only A and AAAA records are cached, all
-	 * the other records in answers are skipped.
-	 */
-	for (i = 0; i < ancount; i++) {
-		/*
-		 * Get one address at a time to this buffer.
-		 * The max size of the answer is
-		 *   2 (pointer) + 2 (type) + 2 (class) +
-		 *   4 (ttl) + 2 (rdlen) + addr (16 or 4) = 28
-		 * for A or AAAA record.
-		 * For CNAME the size can be bigger.
-		 */
-		unsigned char rsp[NS_MAXCDNAME];
-		unsigned int rsp_len = sizeof(rsp) - 1;
-		int ret, rdlen;
-
-		memset(rsp, 0, sizeof(rsp));
-
-		ret = parse_rr(buf, ptr, buf + buflen, rsp, &rsp_len,
-			type, class, ttl, &rdlen, &next, name,
-			sizeof(name) - 1);
-		if (ret != 0) {
-			err = ret;
-			goto out;
-		}
+	req = g_try_new0(struct request_data, 1);
+	if (!req)
+		return;
 
-		/*
-		 * Now rsp contains compressed or uncompressed resource
-		 * record. Next we check if this record answers the question.
-		 * The name var contains the uncompressed label.
-		 * One tricky bit is the CNAME records as they alias
-		 * the name we might be interested in.
-		 */
+	key_len = strlen(entry->key) + 1;
 
-		/*
-		 * Go to next answer if the class is not the one we are
-		 * looking for.
-		 */
-		if (*class != qclass) {
-			ptr = next;
-			next = NULL;
-			continue;
-		}
+	req->request_len = sizeof(struct domain_hdr) + key_len + sizeof(*q);
+	req->request = buf = g_try_malloc0(req->request_len);
+	if (!buf) {
+		g_free(req);
+		return;
+	}
 
-		/*
-		 * Try to resolve aliases also, type is CNAME(5).
-		 * This is important as otherwise the aliased names would not
-		 * be cached at all as the cache would not contain the aliased
-		 * question.
-		 *
-		 * If any CNAME is found in DNS packet, then we cache the alias
-		 * IP address instead of the question (as the server
-		 * said that question has only an alias).
-		 * This means in practice that if e.g., ipv6.google.com is
-		 * queried, DNS server returns CNAME of that name which is
-		 * ipv6.l.google.com. We then cache the address of the CNAME
-		 * but return the question name to client. So the alias
-		 * status of the name is not saved in cache and thus not
-		 * returned to the client. We do not return DNS packets from
-		 * cache to client saying that ipv6.google.com is an alias to
-		 * ipv6.l.google.com but we return instead a DNS packet that
-		 * says ipv6.google.com has address xxx which is in fact the
-		 * address of ipv6.l.google.com. For caching purposes this
-		 * should not cause any issues.
-		 */
-		if (*type == 5 && strncmp(question, name, qlen) == 0) {
-			/*
-			 * So now the alias answered the question. This is
-			 * not very useful from caching point of view as
-			 * the following A or AAAA records will not match the
-			 * question. We need to find the real A/AAAA record
-			 * of the alias and cache that.
-			 */
-			unsigned char *end = NULL;
-			int name_len = 0, output_len = 0;
+	req->client_sk = -1;
+	req->protocol = IPPROTO_UDP;
+	req->family = AF_INET;
+	req->prefetch = true;
 
-			memset(rsp, 0, sizeof(rsp));
-			rsp_len = sizeof(rsp) - 1;
+	req->dstid = get_id();
+	req->srcid = req->dstid;
+	req->altid = get_id();
 
-			/*
-			 * Alias is in rdata part of the message,
-			 * and next-rdlen points to it. So we need to get
-			 * the real name of the alias.
-			 */
-			ret = get_name(0, buf, next - rdlen, buf + buflen,
-					rsp, rsp_len, &output_len, &end,
-					name, sizeof(name) - 1, &name_len);
-			if (ret != 0) {
-				/* just ignore the error at this point */
-				ptr = next;
-				next = NULL;
-				continue;
-			}
+	buf[0] = req->dstid & 0xff;
+	buf[1] = req->dstid >> 8;
+	((struct domain_hdr *) buf)->rd = 1;
+	((struct domain_hdr *) buf)->qdcount = htons(1);
 
-			/*
-			 * We should now have the alias of the entry we might
-			 * want to cache. Just remember it for a while.
-			 * We check the alias list when we have parsed the
-			 * A or AAAA record.
-			 */
-			aliases = g_slist_prepend(aliases, g_strdup(name));
+	memcpy(buf + sizeof(struct domain_hdr), entry->key, key_len);
+	q = (void *) (buf + sizeof(struct domain_hdr) + key_len);
+	q->type = htons(entry->type);
+	q->class = htons(entry->class);
 
-			ptr = next;
-			next = NULL;
-			continue;
-		}
+	req->name = g_strdup(cache_entry_hostname(entry, dns_name));
 
-		if (*type == qtype) {
-			/*
-			 * We found correct type (A or AAAA)
-			 */
-			if (check_alias(aliases, name) ||
-				(!aliases && strncmp(question, name,
-							qlen) == 0)) {
-				/*
-				 * We found an alias or the name of the rr
-				 * matches the question. If so, we append
-				 * the compressed label to the cache.
-				 * The end result is a response buffer that
-				 * will contain one or more cached and
-				 * compressed resource records.
-				 */
-				if (*response_len + rsp_len > maxlen) {
-					err = -ENOBUFS;
-					goto out;
-				}
-				memcpy(response + *response_len, rsp, rsp_len);
-				*response_len += rsp_len;
-				(*answers)++;
-				err = 0;
-			}
-		}
+	debug("prefetch %s type %d", (char *) req->name, entry->type);
 
-		ptr = next;
-		next = NULL;
+	resolv(req, req->request, req->name);
+	if (req->numserv == 0) {
+		destroy_request_data(req);
+		return;
 	}
 
-out:
-	for (list = aliases; list; list = list->next)
-		g_free(list->data);
-	g_slist_free(aliases);
+	entry->prefetch_until = current_time + PREFETCH_TIMEOUT;
+	cache_stats.prefetches++;
 
-	return err;
+	req->timeout = g_timeout_add_seconds(PREFETCH_TIMEOUT,
+						request_timeout, req);
+	request_list = g_slist_append(request_list, req);
 }
 
-struct cache_timeout {
-	time_t current_time;
-	int max_timeout;
-	int try_harder;
-};
-
-static gboolean cache_check_entry(gpointer key, gpointer value,
-					gpointer user_data)
+/*
+ * Account a hit on the entry and return the TTL to put into the cached
+ * response. Expired data is answered with a short TTL while it is
+ * refreshed, popular entries are refreshed before they expire.
+ */
+static int cache_hit(struct cache_entry *entry)
 {
-	struct cache_timeout *data = user_data;
-	struct cache_entry *entry = value;
-	int max_timeout;
-
-	/* Scale the number of hits by half as part of cache aging */
-
-	entry->hits /= 2;
-
-	/*
-	 * If either IPv4 or IPv6 cached entry has expired, we
-	 * remove both from the cache.
-	 */
-
-	if (entry->ipv4 && entry->ipv4->timeout > 0) {
-		max_timeout = entry->ipv4->cache_until;
-		if (max_timeout > data->max_timeout)
-			data->max_timeout = max_timeout;
+	struct cache_data *data = entry->data;
+	time_t current_time = time(NULL);
+	time_t lifetime, left;
 
-		if (entry->ipv4->cache_until < data->current_time)
-			return TRUE;
-	}
+	entry->hits++;
+	cache_stats.hits++;
 
-	if (entry->ipv6 && entry->ipv6->timeout > 0) {
-		max_timeout = entry->ipv6->cache_until;
-		if (max_timeout > data->max_timeout)
-			data->max_timeout = max_timeout;
+	cache_entry_touch(entry);
 
-		if (entry->ipv6->cache_until < data->current_time)
-			return TRUE;
+	if (!cache_check_is_valid(data, current_time)) {
+		cache_stats.stale_hits++;
+		cache_prefetch(entry, current_time);
+		return STALE_ANSWER_TTL;
 	}
 
-	/*
-	 * if we're asked to try harder, also remove entries that have
-	 * few hits
-	 */
-	if (data->try_harder && entry->hits < 4)
-		return TRUE;
-
-	return FALSE;
-}
-
-static void cache_cleanup(void)
-{
-	static int max_timeout;
-	struct cache_timeout data;
-	int count = 0;
-
-	data.current_time = time(NULL);
-	data.max_timeout = 0;
-	data.try_harder = 0;
-
-	/*
-	 * In the first pass, we only remove entries that have timed out.
-	 * We use a cache of the first time to expire to do this only
-	 * when it makes sense.
-	 */
-	if (max_timeout <= data.current_time) {
-		count = g_hash_table_foreach_remove(cache, cache_check_entry,
-						&data);
-	}
-	debug("removed %d in the first pass", count);
+	lifetime = data->cache_until - data->inserted;
+	left = data->cache_until - current_time;
 
-	/*
-	 * In the second pass, if the first pass turned up blank,
-	 * we also expire entries with a low hit count,
-	 * while aging the hit count at the same time.
-	 */
-	data.try_harder = 1;
-	if (count == 0)
-		count = g_hash_table_foreach_remove(cache, cache_check_entry,
-						&data);
+	if (entry->hits > 2 &&
+			left * 100 < lifetime * cache_prefetch_percent)
+		cache_prefetch(entry, current_time);
 
-	if (count == 0)
-		/*
-		 * If we could not remove anything, then remember
-		 * what is the max timeout and do nothing if we
-		 * have not yet reached it. This will prevent
-		 * constant traversal of the cache if it is full.
-		 */
-		max_timeout = data.max_timeout;
-	else
-		max_timeout = 0;
+	return data->valid_until - current_time;
 }
 
 static gboolean cache_invalidate_entry(gpointer key, gpointer value,
@@ -1274,21 +1448,11 @@ static gboolean cache_invalidate_entry(gpointer key, gpointer value,
 	cache_enforce_validity(entry);
 
 	/* if anything is not expired, mark the entry for refresh */
-	if (entry->hits > 0 && (entry->ipv4 || entry->ipv6))
+	if (entry->hits > 0 && entry->data)
 		entry->want_refresh = true;
 
 	/* delete the cached data */
-	if (entry->ipv4) {
-		g_free(entry->ipv4->data);
-		g_free(entry->ipv4);
-		entry->ipv4 = NULL;
-	}
-
-	if (entry->ipv6) {
-		g_free(entry->ipv6->data);
-		g_free(entry->ipv6);
-		entry->ipv6 = NULL;
-	}
+	cache_data_free(&entry->data);
 
 	/* keep the entry if we want it refreshed, delete it otherwise */
 	if (entry->want_refresh)
@@ -1318,28 +1482,19 @@ static void cache_refresh_entry(struct cache_entry *entry)
 
 	cache_enforce_validity(entry);
 
-	if (entry->hits > 2 && !entry->ipv4)
-		entry->want_refresh = true;
-	if (entry->hits > 2 && !entry->ipv6)
+	if (entry->hits > 2 && !entry->data)
 		entry->want_refresh = true;
 
 	if (entry->want_refresh) {
-		char *c;
 		char dns_name[NS_MAXDNAME + 1];
+		char *name;
+
 		entry->want_refresh = false;
 
-		/* turn a DNS name into a hostname with dots */
-		strncpy(dns_name, entry->key, NS_MAXDNAME);
-		c = dns_name;
-		while (c && *c) {
-			int jump;
-			jump = *c;
-			*c = '.';
-			c += jump + 1;
-		}
-		debug("Refreshing %s\n", dns_name);
+		name = cache_entry_hostname(entry, dns_name);
+		debug("Refreshing %s\n", name);
 		/* then refresh the hostname */
-		refresh_dns_entry(entry, &dns_name[1]);
+		refresh_dns_entry(entry, name);
 	}
 }
 
@@ -1359,177 +1514,115 @@ static void cache_refresh(void)
 	g_hash_table_foreach(cache, cache_refresh_iterator, NULL);
 }
 
-static int reply_query_type(unsigned char *msg, int len)
+/*
+ * Popular entries are kept at the head of the LRU list, so for the
+ * periodic refresh it is enough to look at the most recently used ones.
+ */
+static void cache_refresh_recent(void)
 {
-	unsigned char *c;
-	int l;
-	int type;
-
-	/* skip the header */
-	c = msg + sizeof(struct domain_hdr);
-	len -= sizeof(struct domain_hdr);
-
-	if (len < 0)
-		return 0;
-
-	/* now the query, which is a name and 2 16 bit words */
-	l = dns_name_length(c);
-	c += l;
-	type = c[0] << 8 | c[1];
+	GList *list;
+	int count = 0;
 
-	return type;
+	for (list = cache_lru.head; list && count < CACHE_REFRESH_BATCH;
+					list = list->next, count++)
+		cache_refresh_entry(list->data);
 }
 
 static int cache_update(struct server_data *srv, unsigned char *msg,
 			unsigned int msg_len)
 {
 	int offset = protocol_offset(srv->protocol);
-	int err, qlen, ttl = 0;
+	int err, ttl = 0, cache_len = 0;
 	uint16_t answers = 0, type = 0, class = 0;
-	struct domain_hdr *hdr = (void *)(msg + offset);
-	struct domain_question *q;
+	struct domain_hdr *hdr;
 	struct cache_entry *entry;
 	struct cache_data *data;
 	char question[NS_MAXDNAME + 1];
-	unsigned char response[NS_MAXDNAME + 1];
 	unsigned char *ptr;
-	unsigned int rsplen;
 	bool new_entry = true;
 	time_t current_time;
-
-	if (cache_size >= MAX_CACHE_SIZE) {
-		cache_cleanup();
-		if (cache_size >= MAX_CACHE_SIZE)
-			return 0;
-	}
+	size_t needed;
 
 	current_time = time(NULL);
 
 	/* don't do a cache refresh more than twice a minute */
 	if (next_refresh < current_time) {
-		cache_refresh();
+		cache_refresh_recent();
 		next_refresh = current_time + 30;
 	}
 
-	if (offset < 0)
+	if (offset < 0 || msg_len < offset + sizeof(*hdr))
 		return 0;
 
-	debug("offset %d hdr %p msg %p rcode %d", offset, hdr, msg, hdr->rcode);
+	hdr = (void *)(msg + offset);
 
-	/* Continue only if response code is 0 (=ok) */
-	if (hdr->rcode != ns_r_noerror)
-		return 0;
+	debug("offset %d hdr %p msg %p rcode %d", offset, hdr, msg, hdr->rcode);
 
 	if (!cache)
 		create_cache();
 
-	rsplen = sizeof(response) - 1;
-	question[sizeof(question) - 1] = '\0';
-
 	err = parse_response(msg + offset, msg_len - offset,
 				question, sizeof(question) - 1,
-				&type, &class, &ttl,
-				response, &rsplen, &answers);
+				&type, &class, &ttl, &answers, &cache_len);
+	if (err < 0 || ttl == 0)
+		return 0;
 
 	/*
-	 * special case: if we do a ipv6 lookup and get no result
-	 * for a record that's already in our ipv4 cache.. we want
-	 * to cache the negative response.
+	 * If the cache contains already valid data for the question,
+	 * do not add it again unless we asked for a refresh.
 	 */
-	if ((err == -ENOMSG || err == -ENOBUFS) &&
-			reply_query_type(msg + offset,
-					msg_len - offset) == 28) {
-		entry = g_hash_table_lookup(cache, question);
-		if (entry && entry->ipv4 && !entry->ipv6) {
-			int cache_offset = 0;
-
-			data = g_try_new(struct cache_data, 1);
-			if (!data)
-				return -ENOMEM;
-			data->inserted = entry->ipv4->inserted;
-			data->type = type;
-			data->answers = ntohs(hdr->ancount);
-			data->timeout = entry->ipv4->timeout;
-			if (srv->protocol == IPPROTO_UDP)
-				cache_offset = 2;
-			data->data_len = msg_len + cache_offset;
-			data->data = ptr = g_malloc(data->data_len);
-			ptr[0] = (data->data_len - 2) / 256;
-			ptr[1] = (data->data_len - 2) - ptr[0] * 256;
-			if (srv->protocol == IPPROTO_UDP)
-				ptr += 2;
-			data->valid_until = entry->ipv4->valid_until;
-			data->cache_until = entry->ipv4->cache_until;
-			memcpy(ptr, msg, msg_len);
-			entry->ipv6 = data;
-			/*
-			 * we will get a "hit" when we serve the response
-			 * out of the cache
-			 */
-			entry->hits--;
-			if (entry->hits < 0)
-				entry->hits = 0;
-			return 0;
-		}
-	}
-
-	if (err < 0 || ttl == 0)
+	entry = cache_lookup(question, type, class);
+	if (entry && entry->prefetch_until < current_time &&
+			cache_check_is_valid(entry->data, current_time))
 		return 0;
 
-	qlen = strlen(question);
-
 	/*
-	 * If the cache contains already data, check if the
-	 * type of the cached data is the same and do not add
-	 * to cache if data is already there.
-	 * This is needed so that we can cache both A and AAAA
-	 * records for the same name.
+	 * The "2" in start of the length is the TCP offset. We allocate it
+	 * here even for UDP packet because it simplifies the sending
+	 * of cached packet.
 	 */
-	entry = g_hash_table_lookup(cache, question);
-	if (!entry) {
-		entry = g_try_new(struct cache_entry, 1);
-		if (!entry)
-			return -ENOMEM;
-
-		data = g_try_new(struct cache_data, 1);
-		if (!data) {
-			g_free(entry);
-			return -ENOMEM;
-		}
-
-		entry->key = g_strdup(question);
-		entry->ipv4 = entry->ipv6 = NULL;
-		entry->want_refresh = false;
-		entry->hits = 0;
-
-		if (type == 1)
-			entry->ipv4 = data;
-		else
-			entry->ipv6 = data;
-	} else {
-		if (type == 1 && entry->ipv4)
-			return 0;
-
-		if (type == 28 && entry->ipv6)
-			return 0;
-
-		data = g_try_new(struct cache_data, 1);
-		if (!data)
-			return -ENOMEM;
-
-		if (type == 1)
-			entry->ipv4 = data;
-		else
-			entry->ipv6 = data;
+	needed = sizeof(*data) + 2 + cache_len;
 
+	if (entry) {
 		/*
 		 * compensate for the hit we'll get for serving
 		 * the response out of the cache
 		 */
-		entry->hits--;
+		if (!entry->data)
+			entry->hits--;
 		if (entry->hits < 0)
 			entry->hits = 0;
 
+		/* the old data is replaced, only the new one needs room */
+		cache_data_free(&entry->data);
+		cache_entry_touch(entry);
+	} else
+		needed += sizeof(*entry) + strlen(question) + 1;
+
+	if (!cache_make_room(needed, entry))
+		return 0;
+
+	/* the header and the packet share one allocation */
+	data = g_try_malloc(sizeof(*data) + 2 + cache_len);
+	if (!data)
+		return -ENOMEM;
+
+	data->data_len = 2 + cache_len;
+	ptr = data->data;
+
+	if (!entry) {
+		entry = g_try_new0(struct cache_entry, 1);
+		if (!entry) {
+			g_free(data);
+			return -ENOMEM;
+		}
+
+		entry->key = g_strdup(question);
+		entry->type = type;
+		entry->class = class;
+	} else {
+		entry->prefetch_until = 0;
+
 		new_entry = false;
 	}
 
@@ -1537,16 +1630,8 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 		ttl = MIN_CACHE_TTL;
 
 	data->inserted = current_time;
-	data->type = type;
 	data->answers = answers;
 	data->timeout = ttl;
-	/*
-	 * The "2" in start of the length is the TCP offset. We allocate it
-	 * here even for UDP packet because it simplifies the sending
-	 * of cached packet.
-	 */
-	data->data_len = 2 + 12 + qlen + 1 + 2 + 2 + rsplen;
-	data->data = ptr = g_malloc(data->data_len);
 	data->valid_until = current_time + ttl;
 
 	/*
@@ -1558,87 +1643,306 @@ static int cache_update(struct server_data *srv, unsigned char *msg,
 
 	data->cache_until = round_down_ttl(current_time + ttl, ttl);
 
-	if (!data->data) {
-		g_free(entry->key);
-		g_free(data);
-		g_free(entry);
-		return -ENOMEM;
-	}
-
 	/*
 	 * We cache the two extra bytes at the start of the message
 	 * in a TCP packet. When sending UDP packet, we skip the first
 	 * two bytes. This way we do not need to know the format
 	 * (UDP/TCP) of the cached message.
 	 */
-	if (srv->protocol == IPPROTO_UDP)
-		memcpy(ptr + 2, msg, offset + 12);
-	else
-		memcpy(ptr, msg, offset + 12);
-
-	ptr[0] = (data->data_len - 2) / 256;
-	ptr[1] = (data->data_len - 2) - ptr[0] * 256;
-	if (srv->protocol == IPPROTO_UDP)
-		ptr += 2;
+	ptr[0] = cache_len >> 8;
+	ptr[1] = cache_len & 0xff;
+	memcpy(ptr + 2, msg + offset, cache_len);
 
-	memcpy(ptr + offset + 12, question, qlen + 1); /* copy also the \0 */
+	hdr = (void *)(ptr + 2);
+	hdr->arcount = 0;
 
-	q = (void *) (ptr + offset + 12 + qlen + 1);
-	q->type = htons(type);
-	q->class = htons(class);
-	memcpy(ptr + offset + 12 + qlen + 1 + sizeof(struct domain_question),
-		response, rsplen);
+	entry->data = data;
+	cache_bytes += cache_data_size(data);
 
 	if (new_entry) {
-		g_hash_table_replace(cache, entry->key, entry);
+		entry->lru.data = entry;
+		g_queue_push_head_link(&cache_lru, &entry->lru);
+
+		g_hash_table_replace(cache, entry, entry);
+		cache_bytes += sizeof(*entry) + strlen(entry->key) + 1;
 		cache_size++;
-	}
+	} else
+		cache_entry_touch(entry);
 
-	debug("cache %d %squestion \"%s\" type %d ttl %d size %zd packet %u "
-								"dns len %u",
-		cache_size, new_entry ? "new " : "old ",
-		question, type, ttl,
-		sizeof(*entry) + sizeof(*data) + data->data_len + qlen,
-		data->data_len,
-		srv->protocol == IPPROTO_TCP ?
-			(unsigned int)(data->data[0] * 256 + data->data[1]) :
-			data->data_len);
+	debug("cache %d %squestion \"%s\" type %d ttl %d answers %d "
+		"size %zd packet %u", cache_size, new_entry ? "new " : "old ",
+		question, type, ttl, answers,
+		sizeof(*entry) + sizeof(*data) + data->data_len,
+		data->data_len);
 
 	return 0;
 }
 
+static char *cache_snapshot_path(const char *ident)
+{
+	return g_strdup_printf("%s/%s/dns-cache", STORAGEDIR, ident);
+}
+
+/*
+ * Write the usable entries of the cache, most recently used first, so
+ * that the popular ones are loaded first if the cache is smaller later.
+ */
+static void cache_snapshot_save(void)
+{
+	struct cache_snapshot_header header;
+	time_t current_time = time(NULL);
+	GError *error = NULL;
+	GByteArray *buf;
+	GList *list;
+	char *path;
+
+	if (!cache_persistent || !cache_ident || !cache)
+		return;
+
+	memset(&header, 0, sizeof(header));
+	header.magic = CACHE_SNAPSHOT_MAGIC;
+	header.version = CACHE_SNAPSHOT_VERSION;
+	header.saved = current_time;
+
+	buf = g_byte_array_sized_new(sizeof(header) + cache_bytes);
+	g_byte_array_append(buf, (guint8 *) &header, sizeof(header));
+
+	for (list = cache_lru.head; list; list = list->next) {
+		struct cache_entry *entry = list->data;
+		struct cache_data *data = entry->data;
+		struct cache_snapshot_entry item;
+
+		if (!cache_check_is_usable(data, current_time))
+			continue;
+
+		item.type = entry->type;
+		item.class = entry->class;
+		item.key_len = strlen(entry->key);
+		item.answers = data->answers;
+		item.hits = entry->hits;
+		item.timeout = data->timeout;
+		item.inserted = data->inserted;
+		item.valid_until = data->valid_until;
+		item.cache_until = data->cache_until;
+		item.data_len = data->data_len;
+
+		g_byte_array_append(buf, (guint8 *) &item, sizeof(item));
+		g_byte_array_append(buf, (guint8 *) entry->key, item.key_len);
+		g_byte_array_append(buf, data->data, data->data_len);
+
+		header.count++;
+	}
+
+	memcpy(buf->data, &header, sizeof(header));
+
+	path = cache_snapshot_path(cache_ident);
+
+	/* written to a temporary file first and renamed over the old one */
+	if (!g_file_set_contents(path, (gchar *) buf->data, buf->len,
+								&error)) {
+		DBG("Cannot save DNS cache %s: %s", path, error->message);
+		g_error_free(error);
+	} else
+		debug("saved %u cache entries to %s", header.count, path);
+
+	g_free(path);
+	g_byte_array_free(buf, TRUE);
+}
+
+static gboolean cache_snapshot_timeout(gpointer user_data)
+{
+	cache_snapshot_save();
+
+	return TRUE;
+}
+
+/*
+ * Fill the cache from the snapshot of the default service. Entries
+ * which are not usable anymore and questions the cache already has
+ * data for are skipped, and live entries are never evicted for the
+ * snapshot ones. The cache times are wall clock times, if the clock
+ * is now behind the time the snapshot was saved (no RTC, the time is
+ * only set later by NTP) they are moved back by the difference.
+ */
+static void cache_snapshot_load(void)
+{
+	const struct cache_snapshot_header *header;
+	time_t current_time = time(NULL), shift = 0;
+	struct stat st;
+	uint8_t *map;
+	size_t pos, size;
+	char *path;
+	uint32_t i;
+	int fd, loaded = 0;
+
+	if (!cache_persistent || !cache_ident || !cache)
+		return;
+
+	path = cache_snapshot_path(cache_ident);
+
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		g_free(path);
+		return;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size < (off_t) sizeof(*header)) {
+		close(fd);
+		g_free(path);
+		return;
+	}
+
+	size = st.st_size;
+
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	close(fd);
+	if (map == MAP_FAILED) {
+		g_free(path);
+		return;
+	}
+
+	header = (const void *) map;
+	if (header->magic != CACHE_SNAPSHOT_MAGIC ||
+			header->version != CACHE_SNAPSHOT_VERSION) {
+		DBG("Ignoring DNS cache %s", path);
+		goto out;
+	}
+
+	if (header->saved > current_time)
+		shift = current_time - header->saved;
+
+	pos = sizeof(*header);
+
+	for (i = 0; i < header->count; i++) {
+		struct cache_snapshot_entry item;
+		struct cache_entry *entry;
+		struct cache_data *data;
+		const uint8_t *ptr;
+		char *key;
+		size_t needed;
+
+		if (size - pos < sizeof(item))
+			break;
+
+		memcpy(&item, map + pos, sizeof(item));
+		pos += sizeof(item);
+
+		if (size - pos < (size_t) item.key_len + item.data_len)
+			break;
+
+		ptr = map + pos;
+		pos += item.key_len + item.data_len;
+
+		if (item.key_len == 0 || memchr(ptr, 0, item.key_len))
+			continue;
+
+		/* the TCP length in front must match the message */
+		if (item.data_len < 2 + DNS_HEADER_SIZE ||
+				dns_get_u16(ptr + item.key_len) !=
+							item.data_len - 2)
+			continue;
+
+		if (!cache_type_is_cacheable(item.type, item.class))
+			continue;
+
+		if (item.cache_until + shift + (time_t) cache_serve_stale <
+								current_time)
+			continue;
+
+		key = g_strndup((const char *) ptr, item.key_len);
+
+		entry = cache_lookup(key, item.type, item.class);
+		if (entry && entry->data) {
+			g_free(key);
+			continue;
+		}
+
+		needed = sizeof(*data) + item.data_len;
+		if (!entry)
+			needed += sizeof(*entry) + item.key_len + 1;
+
+		if (cache_is_full(needed, !entry)) {
+			g_free(key);
+			break;
+		}
+
+		data = g_try_malloc(sizeof(*data) + item.data_len);
+		if (!data) {
+			g_free(key);
+			break;
+		}
+
+		data->inserted = item.inserted + shift;
+		data->valid_until = item.valid_until + shift;
+		data->cache_until = item.cache_until + shift;
+		data->timeout = item.timeout;
+		data->answers = item.answers;
+		data->data_len = item.data_len;
+		memcpy(data->data, ptr + item.key_len, item.data_len);
+
+		if (!entry) {
+			entry = g_try_new0(struct cache_entry, 1);
+			if (!entry) {
+				g_free(data);
+				g_free(key);
+				break;
+			}
+
+			entry->key = key;
+			entry->type = item.type;
+			entry->class = item.class;
+			entry->hits = item.hits;
+
+			/* keep the order, behind the entries already cached */
+			entry->lru.data = entry;
+			g_queue_push_tail_link(&cache_lru, &entry->lru);
+
+			g_hash_table_replace(cache, entry, entry);
+			cache_bytes += sizeof(*entry) + item.key_len + 1;
+			cache_size++;
+		} else
+			g_free(key);
+
+		entry->data = data;
+		cache_bytes += cache_data_size(data);
+		loaded++;
+	}
+
+	debug("loaded %d cache entries from %s", loaded, path);
+
+out:
+	munmap(map, size);
+	g_free(path);
+}
+
 static int ns_resolv(struct server_data *server, struct request_data *req,
 				gpointer request, gpointer name)
 {
 	GList *list;
 	int sk, err, type = 0;
 	char *dot, *lookup = (char *) name;
-	struct cache_entry *entry;
+	struct cache_entry *entry = NULL;
 
-	entry = cache_check(request, &type, req->protocol);
+	/* a prefetch must reach the server even if the entry is cached */
+	if (!req->prefetch)
+		entry = cache_check(request, req->request_len, &type,
+							req->protocol);
 	if (entry) {
-		int ttl_left = 0;
-		struct cache_data *data;
+		struct cache_data *data = entry->data;
+		int ttl_left;
 
-		debug("cache hit %s type %s", lookup, type == 1 ? "A" : "AAAA");
-		if (type == 1)
-			data = entry->ipv4;
-		else
-			data = entry->ipv6;
+		debug("cache hit %s type %d", lookup, type);
 
-		if (data) {
-			ttl_left = data->valid_until - time(NULL);
-			entry->hits++;
-		}
+		ttl_left = cache_hit(entry);
 
-		if (data && req->protocol == IPPROTO_TCP) {
+		if (req->protocol == IPPROTO_TCP) {
 			send_cached_response(req->client_sk, data->data,
 					data->data_len, NULL, 0, IPPROTO_TCP,
-					req->srcid, data->answers, ttl_left);
+					req->srcid, ttl_left);
 			return 1;
 		}
 
-		if (data && req->protocol == IPPROTO_UDP) {
+		if (req->protocol == IPPROTO_UDP) {
 			int udp_sk = get_req_udp_socket(req);
 
 			if (udp_sk < 0)
@@ -1646,12 +1950,15 @@ static int ns_resolv(struct server_data *server, struct request_data *req,
 
 			send_cached_response(udp_sk, data->data,
 				data->data_len, &req->sa, req->sa_len,
-				IPPROTO_UDP, req->srcid, data->answers,
-				ttl_left);
+				IPPROTO_UDP, req->srcid, ttl_left);
 			return 1;
 		}
 	}
 
+	/* only count the first server the request is sent to */
+	if (req->numserv == 0 && !req->prefetch)
+		cache_stats.misses++;
+
 	sk = g_io_channel_unix_get_fd(server->channel);
 
 	err = sendto(sk, request, req->request_len, MSG_NOSIGNAL,
@@ -1718,218 +2025,47 @@ static int ns_resolv(struct server_data *server, struct request_data *req,
 		}
 
 		debug("req %p dstid 0x%04x altid 0x%04x", req, req->dstid,
-				req->altid);
-
-		err = send(sk, alt, req->request_len + domlen, MSG_NOSIGNAL);
-		if (err < 0)
-			return -EIO;
-
-		req->numserv++;
-	}
-
-	return 0;
-}
-
-static char *convert_label(char *start, char *end, char *ptr, char *uptr,
-			int remaining_len, int *used_comp, int *used_uncomp)
-{
-	int pos, comp_pos;
-	char name[NS_MAXLABEL];
-
-	pos = dn_expand((u_char *)start, (u_char *)end, (u_char *)ptr,
-			name, NS_MAXLABEL);
-	if (pos < 0) {
-		debug("uncompress error [%d/%s]", errno, strerror(errno));
-		goto out;
-	}
-
-	/*
-	 * We need to compress back the name so that we get back to internal
-	 * label presentation.
-	 */
-	comp_pos = dn_comp(name, (u_char *)uptr, remaining_len, NULL, NULL);
-	if (comp_pos < 0) {
-		debug("compress error [%d/%s]", errno, strerror(errno));
-		goto out;
-	}
-
-	*used_comp = pos;
-	*used_uncomp = comp_pos;
-
-	return ptr;
-
-out:
-	return NULL;
-}
-
-static char *uncompress(int16_t field_count, char *start, char *end,
-			char *ptr, char *uncompressed, int uncomp_len,
-			char **uncompressed_ptr)
-{
-	char *uptr = *uncompressed_ptr; /* position in result buffer */
-
-	debug("count %d ptr %p end %p uptr %p", field_count, ptr, end, uptr);
-
-	while (field_count-- > 0 && ptr < end) {
-		int dlen;		/* data field length */
-		int ulen;		/* uncompress length */
-		int pos;		/* position in compressed string */
-		char name[NS_MAXLABEL]; /* tmp label */
-		uint16_t dns_type, dns_class;
-		int comp_pos;
-
-		if (!convert_label(start, end, ptr, name, NS_MAXLABEL,
-					&pos, &comp_pos))
-			goto out;
-
-		/*
-		 * Copy the uncompressed resource record, type, class and \0 to
-		 * tmp buffer.
-		 */
-
-		ulen = strlen(name);
-		strncpy(uptr, name, uncomp_len - (uptr - uncompressed));
-
-		debug("pos %d ulen %d left %d name %s", pos, ulen,
-			(int)(uncomp_len - (uptr - uncompressed)), uptr);
-
-		uptr += ulen;
-		*uptr++ = '\0';
-
-		ptr += pos;
-
-		/*
-		 * We copy also the fixed portion of the result (type, class,
-		 * ttl, address length and the address)
-		 */
-		memcpy(uptr, ptr, NS_RRFIXEDSZ);
-
-		dns_type = uptr[0] << 8 | uptr[1];
-		dns_class = uptr[2] << 8 | uptr[3];
-
-		if (dns_class != ns_c_in)
-			goto out;
-
-		ptr += NS_RRFIXEDSZ;
-		uptr += NS_RRFIXEDSZ;
-
-		/*
-		 * Then the variable portion of the result (data length).
-		 * Typically this portion is also compressed
-		 * so we need to uncompress it also when necessary.
-		 */
-		if (dns_type == ns_t_cname) {
-			if (!convert_label(start, end, ptr, uptr,
-					uncomp_len - (uptr - uncompressed),
-						&pos, &comp_pos))
-				goto out;
-
-			uptr[-2] = comp_pos << 8;
-			uptr[-1] = comp_pos & 0xff;
-
-			uptr += comp_pos;
-			ptr += pos;
-
-		} else if (dns_type == ns_t_a || dns_type == ns_t_aaaa) {
-			dlen = uptr[-2] << 8 | uptr[-1];
-
-			if (ptr + dlen > end) {
-				debug("data len %d too long", dlen);
-				goto out;
-			}
-
-			memcpy(uptr, ptr, dlen);
-			uptr += dlen;
-			ptr += dlen;
-
-		} else if (dns_type == ns_t_soa) {
-			int total_len = 0;
-			char *len_ptr;
-
-			/* Primary name server expansion */
-			if (!convert_label(start, end, ptr, uptr,
-					uncomp_len - (uptr - uncompressed),
-						&pos, &comp_pos))
-				goto out;
-
-			total_len += comp_pos;
-			len_ptr = &uptr[-2];
-			ptr += pos;
-			uptr += comp_pos;
-
-			/* Responsible authority's mailbox */
-			if (!convert_label(start, end, ptr, uptr,
-					uncomp_len - (uptr - uncompressed),
-						&pos, &comp_pos))
-				goto out;
-
-			total_len += comp_pos;
-			ptr += pos;
-			uptr += comp_pos;
-
-			/*
-			 * Copy rest of the soa fields (serial number,
-			 * refresh interval, retry interval, expiration
-			 * limit and minimum ttl). They are 20 bytes long.
-			 */
-			memcpy(uptr, ptr, 20);
-			uptr += 20;
-			ptr += 20;
-			total_len += 20;
-
-			/*
-			 * Finally fix the length of the data part
-			 */
-			len_ptr[0] = total_len << 8;
-			len_ptr[1] = total_len & 0xff;
-		}
+				req->altid);
 
-		*uncompressed_ptr = uptr;
-	}
+		err = send(sk, alt, req->request_len + domlen, MSG_NOSIGNAL);
+		if (err < 0)
+			return -EIO;
 
-	return ptr;
+		req->numserv++;
+	}
 
-out:
-	return NULL;
+	return 0;
 }
 
-static int strip_domains(char *name, char *answers, int maxlen)
+/*
+ * Rewrite the reply into buf so that the question and the records for
+ * the full name carry the hostname only. All names are uncompressed on
+ * the way as the compression pointers would be off after that. Returns
+ * 0 if the query had no domain appended and nothing needs to be done.
+ */
+static int strip_domains(unsigned char *reply, int reply_len,
+				unsigned char *buf, int size)
 {
-	uint16_t data_len;
-	int name_len = strlen(name);
-	char *ptr, *start = answers, *end = answers + maxlen;
-
-	while (maxlen > 0) {
-		ptr = strstr(answers, name);
-		if (ptr) {
-			char *domain = ptr + name_len;
-
-			if (*domain) {
-				int domain_len = strlen(domain);
-
-				memmove(answers + name_len,
-					domain + domain_len,
-					end - (domain + domain_len));
-
-				end -= domain_len;
-				maxlen -= domain_len;
-			}
-		}
+	uint8_t qname[DNS_MAX_NAME], host[NS_MAXLABEL + 2];
+	struct dns_reader reader;
+	int len;
 
-		answers += strlen(answers) + 1;
-		answers += 2 + 2 + 4;  /* skip type, class and ttl fields */
+	dns_reader_init(&reader, reply, reply_len);
+	if (dns_skip(&reader, sizeof(struct domain_hdr)) < 0)
+		return -EINVAL;
 
-		data_len = answers[0] << 8 | answers[1];
-		answers += 2; /* skip the length field */
+	len = dns_read_name(&reader, qname, sizeof(qname));
+	if (len < 0)
+		return len;
 
-		if (answers + data_len > end)
-			return -EINVAL;
+	/* only the first label was asked for by the client */
+	if (qname[0] == 0 || len == qname[0] + 2)
+		return 0;
 
-		answers += data_len;
-		maxlen -= answers - ptr;
-	}
+	memcpy(host, qname, qname[0] + 1);
+	host[qname[0] + 1] = '\0';
 
-	return end - start;
+	return dns_expand_message(reply, reply_len, qname, host, buf, size);
 }
 
 static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol,
@@ -1947,11 +2083,7 @@ static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol,
 
 	debug("Received %d bytes (id 0x%04x)", reply_len, dns_id);
 
-	struct request_data _req;
-	memset(&_req, 0, sizeof(_req));
-	_req.append_domain = true;
-
-	req = &_req;
+	req = find_request(dns_id);
 	if (!req)
 		return -EINVAL;
 
@@ -1964,8 +2096,6 @@ static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol,
 	req->numresp++;
 
 	if (hdr->rcode == ns_r_noerror || !req->resp) {
-		unsigned char *new_reply = NULL;
-
 		/*
 		 * If the domain name was append
 		 * remove it before forwarding the reply.
@@ -1979,165 +2109,48 @@ static int forward_dns_reply(unsigned char *reply, int reply_len, int protocol,
 		 * a domain name part.
 		 */
 		if (req->append_domain && ntohs(hdr->qdcount) == 1) {
-			uint16_t domain_len = 0;
-			uint16_t header_len;
-			uint16_t dns_type, dns_class;
-			uint8_t host_len, dns_type_pos;
-			char uncompressed[NS_MAXDNAME], *uptr;
-			char *ptr, *eom = (char *)reply + reply_len;
-
-			/*
-			 * ptr points to the first char of the hostname.
-			 * ->hostname.domain.net
-			 */
-			header_len = offset + sizeof(struct domain_hdr);
-			ptr = (char *)reply + header_len;
-
-			host_len = *ptr;
-			if (host_len > 0)
-				domain_len = strnlen(ptr + 1 + host_len,
-						reply_len - header_len);
-
-			/*
-			 * If the query type is anything other than A or AAAA,
-			 * then bail out and pass the message as is.
-			 * We only want to deal with IPv4 or IPv6 addresses.
-			 */
-			dns_type_pos = host_len + 1 + domain_len + 1;
-
-			dns_type = ptr[dns_type_pos] << 8 |
-							ptr[dns_type_pos + 1];
-			dns_class = ptr[dns_type_pos + 2] << 8 |
-							ptr[dns_type_pos + 3];
-			if (dns_type != ns_t_a && dns_type != ns_t_aaaa &&
-					dns_class != ns_c_in) {
-				debug("Pass msg dns type %d class %d",
-					dns_type, dns_class);
-				// goto pass;
-			}
+			int new_len;
 
 			/*
-			 * Remove the domain name and replace it by the end
-			 * of reply. Check if the domain is really there
-			 * before trying to copy the data. We also need to
-			 * uncompress the answers if necessary.
 			 * The domain_len can be 0 because if the original
 			 * query did not contain a domain name, then we are
 			 * sending two packets, first without the domain name
 			 * and the second packet with domain name.
 			 * The append_domain is set to true even if we sent
 			 * the first packet without domain name. In this
-			 * case we end up in this branch.
+			 * case strip_domains() leaves the reply alone.
 			 */
-			if (domain_len > 0) {
-				int len = host_len + 1;
-				int new_len, fixed_len;
-				char *answers;
-
-				/*
-				 * First copy host (without domain name) into
-				 * tmp buffer.
-				 */
-				uptr = &uncompressed[0];
-				memcpy(uptr, ptr, len);
-
-				uptr[len] = '\0'; /* host termination */
-				uptr += len + 1;
-
-				/*
-				 * Copy type and class fields of the question.
-				 */
-				ptr += len + domain_len + 1;
-				memcpy(uptr, ptr, NS_QFIXEDSZ);
-
-				/*
-				 * ptr points to answers after this
-				 */
-				ptr += NS_QFIXEDSZ;
-				uptr += NS_QFIXEDSZ;
-				answers = uptr;
-				fixed_len = answers - uncompressed;
-
-				/*
-				 * We then uncompress the result to buffer
-				 * so that we can rip off the domain name
-				 * part from the question. First answers,
-				 * then name server (authority) information,
-				 * and finally additional record info.
-				 */
-
-				ptr = uncompress(ntohs(hdr->ancount),
-						(char *)reply + offset, eom,
-						ptr, uncompressed, NS_MAXDNAME,
-						&uptr);
-				if (!ptr)
-					goto out;
-
-				ptr = uncompress(ntohs(hdr->nscount),
-						(char *)reply + offset, eom,
-						ptr, uncompressed, NS_MAXDNAME,
-						&uptr);
-				if (!ptr)
-					goto out;
-
-				ptr = uncompress(ntohs(hdr->arcount),
-						(char *)reply + offset, eom,
-						ptr, uncompressed, NS_MAXDNAME,
-						&uptr);
-				if (!ptr)
-					goto out;
+			new_len = strip_domains(reply + offset,
+						reply_len - offset,
+						reply_buf + offset,
+						sizeof(reply_buf) - offset);
+			if (new_len < 0) {
+				debug("Corrupted packet");
+				goto out;
+			}
 
-				/*
-				 * The uncompressed buffer now contains almost
-				 * valid response. Final step is to get rid of
-				 * the domain name because at least glibc
-				 * gethostbyname() implementation does extra
-				 * checks and expects to find an answer without
-				 * domain name if we asked a query without
-				 * domain part. Note that glibc getaddrinfo()
-				 * works differently and accepts FQDN in answer
-				 */
-				new_len = strip_domains(uncompressed, answers,
-							uptr - answers);
-				if (new_len < 0) {
-					debug("Corrupted packet");
-					return -EINVAL;
+			if (new_len > 0) {
+				if (protocol == IPPROTO_TCP) {
+					reply_buf[0] = new_len >> 8;
+					reply_buf[1] = new_len & 0xff;
 				}
 
-				/*
-				 * Because we have now uncompressed the answers
-				 * we might have to create a bigger buffer to
-				 * hold all that data.
-				 */
-
-				reply_len = header_len + new_len + fixed_len;
-
-				new_reply = g_try_malloc(reply_len);
-				if (!new_reply)
-					return -ENOMEM;
-
-				memcpy(new_reply, reply, header_len);
-				memcpy(new_reply + header_len, uncompressed,
-					new_len + fixed_len);
-
-				reply = new_reply;
+				reply = reply_buf;
+				reply_len = offset + new_len;
 			}
 		}
 
-	pass:
-		// g_free(req->resp);
-		// req->resplen = 0;
+		g_free(req->resp);
+		req->resplen = 0;
 
-		// req->resp = g_try_malloc(reply_len);
-		// if (!req->resp)
-		// 	return -ENOMEM;
-
-		// memcpy(req->resp, reply, reply_len);
-		// req->resplen = reply_len;
+		req->resp = g_try_malloc(reply_len);
+		if (!req->resp)
+			return -ENOMEM;
 
-		// cache_update(data, reply, reply_len);
+		memcpy(req->resp, reply, reply_len);
+		req->resplen = reply_len;
 
-		g_free(new_reply);
+		cache_update(data, reply, reply_len);
 	}
 
 out:
@@ -2149,28 +2162,34 @@ out:
 		}
 	}
 
-	// request_list = g_slist_remove(request_list, req);
+	request_list = g_slist_remove(request_list, req);
+
+	/* the reply only refreshed the cache, nobody waits for it */
+	if (req->prefetch) {
+		destroy_request_data(req);
+		return 0;
+	}
 
-	// if (protocol == IPPROTO_UDP) {
-	// 	sk = get_req_udp_socket(req);
-	// 	if (sk < 0) {
-	// 		errno = -EIO;
-	// 		err = -EIO;
-	// 	} else
-	// 		err = sendto(sk, req->resp, req->resplen, 0,
-	// 			&req->sa, req->sa_len);
-	// } else {
-	// 	sk = req->client_sk;
-	// 	err = send(sk, req->resp, req->resplen, MSG_NOSIGNAL);
-	// }
+	if (protocol == IPPROTO_UDP) {
+		sk = get_req_udp_socket(req);
+		if (sk < 0) {
+			errno = -EIO;
+			err = -EIO;
+		} else
+			err = sendto(sk, req->resp, req->resplen, 0,
+				&req->sa, req->sa_len);
+	} else {
+		sk = req->client_sk;
+		err = send(sk, req->resp, req->resplen, MSG_NOSIGNAL);
+	}
 
-	// if (err < 0)
-	// 	debug("Cannot send msg, sk %d proto %d errno %d/%s", sk,
-	// 		protocol, errno, strerror(errno));
-	// else
-	// 	debug("proto %d sent %d bytes to %d", protocol, err, sk);
+	if (err < 0)
+		debug("Cannot send msg, sk %d proto %d errno %d/%s", sk,
+			protocol, errno, strerror(errno));
+	else
+		debug("proto %d sent %d bytes to %d", protocol, err, sk);
 
-	// destroy_request_data(req);
+	destroy_request_data(req);
 
 	return err;
 }
@@ -2202,6 +2221,8 @@ static void server_destroy_socket(struct server_data *data)
 
 static void destroy_server(struct server_data *server)
 {
+	GSList *list;
+
 	debug("index %d server %s sock %d", server->index, server->server,
 			server->channel ?
 			g_io_channel_unix_get_fd(server->channel): -1);
@@ -2209,6 +2230,15 @@ static void destroy_server(struct server_data *server)
 	server_list = g_slist_remove(server_list, server);
 	server_destroy_socket(server);
 
+	for (list = request_list; list; list = list->next) {
+		struct request_data *req = list->data;
+
+		if (req->server == server)
+			req->server = NULL;
+		if (req->hedge_server == server)
+			req->hedge_server = NULL;
+	}
+
 	if (server->protocol == IPPROTO_UDP && server->enabled)
 		debug("Removing DNS server %s", server->server);
 
@@ -2237,6 +2267,7 @@ static gboolean udp_server_event(GIOChannel *channel, GIOCondition condition,
 	unsigned char buf[4096];
 	int sk, len;
 	struct server_data *data = user_data;
+	struct request_data *req;
 
 	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
 		connman_error("Error with UDP server %s", data->server);
@@ -2248,8 +2279,13 @@ static gboolean udp_server_event(GIOChannel *channel, GIOCondition condition,
 
 	len = recv(sk, buf, sizeof(buf), 0);
 
-	if (len >= 12)
+	if (len >= 12) {
+		req = find_request(buf[0] | buf[1] << 8);
+		if (req)
+			server_reply_received(data, req);
+
 		forward_dns_reply(buf, len, IPPROTO_UDP, data);
+	}
 
 	return TRUE;
 }
@@ -2657,10 +2693,21 @@ static struct server_data *create_server(int index,
 	return data;
 }
 
-static bool resolv(struct request_data *req,
-				gpointer request, gpointer name)
+static gint server_compare(gconstpointer a, gconstpointer b)
 {
-	GSList *list;
+	unsigned int score_a = server_score((struct server_data *) a);
+	unsigned int score_b = server_score((struct server_data *) b);
+
+	if (score_a < score_b)
+		return -1;
+
+	return score_a > score_b;
+}
+
+/* The enabled UDP servers, best one first */
+static GSList *get_ranked_servers(void)
+{
+	GSList *list, *servers = NULL;
 
 	for (list = server_list; list; list = list->next) {
 		struct server_data *data = list->data;
@@ -2682,11 +2729,91 @@ static bool resolv(struct request_data *req,
 			}
 		}
 
-		if (ns_resolv(data, req, request, name) > 0)
-			return true;
+		servers = g_slist_prepend(servers, data);
 	}
 
-	return false;
+	return g_slist_sort(g_slist_reverse(servers), server_compare);
+}
+
+static gboolean hedge_timeout(gpointer user_data)
+{
+	struct request_data *req = user_data;
+	GSList *list, *servers;
+
+	req->hedge = 0;
+
+	servers = get_ranked_servers();
+
+	for (list = servers; list; list = list->next) {
+		struct server_data *data = list->data;
+		int err;
+
+		if (data == req->server)
+			continue;
+
+		err = ns_resolv(data, req, req->request, req->name);
+		if (err < 0)
+			continue;
+
+		if (err > 0) {
+			/* answered from the cache in the meantime */
+			request_list = g_slist_remove(request_list, req);
+			destroy_request_data(req);
+			break;
+		}
+
+		debug("req %p hedged to %s", req, data->server);
+
+		req->hedge_server = data;
+		req->hedge_sent = g_get_monotonic_time();
+		data->queries++;
+		cache_stats.hedged++;
+		break;
+	}
+
+	g_slist_free(servers);
+
+	return FALSE;
+}
+
+/*
+ * Send the query to the best server only, the next best one gets a
+ * copy later from hedge_timeout() if there is no answer by then.
+ */
+static bool resolv(struct request_data *req,
+				gpointer request, gpointer name)
+{
+	GSList *list, *servers;
+	bool cached = false;
+
+	servers = get_ranked_servers();
+
+	for (list = servers; list; list = list->next) {
+		struct server_data *data = list->data;
+		int err;
+
+		err = ns_resolv(data, req, request, name);
+		if (err > 0) {
+			cached = true;
+			break;
+		}
+
+		if (err < 0)
+			continue;
+
+		req->server = data;
+		req->sent = g_get_monotonic_time();
+		data->queries++;
+
+		if (list->next)
+			req->hedge = g_timeout_add(server_hedge_delay(data),
+							hedge_timeout, req);
+		break;
+	}
+
+	g_slist_free(servers);
+
+	return cached;
 }
 
 static void update_domain(int index, const char *domain, bool append)
@@ -2884,9 +3011,15 @@ static void dnsproxy_default_changed(struct connman_service *service)
 
 	DBG("service %p", service);
 
+	/* keep what was learned on the previous network */
+	cache_snapshot_save();
+
 	/* DNS has changed, invalidate the cache */
 	cache_invalidate();
 
+	g_free(cache_ident);
+	cache_ident = NULL;
+
 	if (!service) {
 		/* When no services are active, then disable DNS proxying */
 		dnsproxy_offline_mode(true);
@@ -2897,6 +3030,8 @@ static void dnsproxy_default_changed(struct connman_service *service)
 	if (index < 0)
 		return;
 
+	cache_ident = g_strdup(connman_service_get_identifier(service));
+
 	for (list = server_list; list; list = list->next) {
 		struct server_data *data = list->data;
 
@@ -2913,6 +3048,7 @@ static void dnsproxy_default_changed(struct connman_service *service)
 	if (!server_enabled)
 		enable_fallback(true);
 
+	cache_snapshot_load();
 	cache_refresh();
 }
 
@@ -3125,29 +3261,22 @@ read_another:
 	 * Check if the answer is found in the cache before
 	 * creating sockets to the server.
 	 */
-	entry = cache_check(client->buf, &qtype, IPPROTO_TCP);
+	entry = cache_check(client->buf, req->request_len, &qtype,
+							IPPROTO_TCP);
 	if (entry) {
-		int ttl_left = 0;
-		struct cache_data *data;
+		struct cache_data *data = entry->data;
+		int ttl_left;
 
-		debug("cache hit %s type %s", query, qtype == 1 ? "A" : "AAAA");
-		if (qtype == 1)
-			data = entry->ipv4;
-		else
-			data = entry->ipv6;
+		debug("cache hit %s type %d", query, qtype);
 
-		if (data) {
-			ttl_left = data->valid_until - time(NULL);
-			entry->hits++;
+		ttl_left = cache_hit(entry);
 
-			send_cached_response(client_sk, data->data,
-					data->data_len, NULL, 0, IPPROTO_TCP,
-					req->srcid, data->answers, ttl_left);
+		send_cached_response(client_sk, data->data,
+				data->data_len, NULL, 0, IPPROTO_TCP,
+				req->srcid, ttl_left);
 
-			g_free(req);
-			goto out;
-		} else
-			debug("data missing, ignoring cache for this query");
+		g_free(req);
+		goto out;
 	}
 
 	for (list = server_list; list; list = list->next) {
@@ -3476,57 +3605,30 @@ static gboolean tcp6_listener_event(GIOChannel *channel, GIOCondition condition,
 				&ifdata->tcp6_listener_watch);
 }
 
-static bool udp_listener_event(GIOChannel *channel, GIOCondition condition,
-				struct listener_data *ifdata, int family,
-				guint *listener_watch)
+static void udp_listener_query(int sk, unsigned char *buf, int len,
+				struct sockaddr *client_addr,
+				socklen_t client_addr_len,
+				struct listener_data *ifdata, int family)
 {
-	unsigned char buf[768];
 	char query[512];
 	struct request_data *req;
-	struct sockaddr_in6 client_addr6;
-	socklen_t client_addr6_len = sizeof(client_addr6);
-	struct sockaddr_in client_addr4;
-	socklen_t client_addr4_len = sizeof(client_addr4);
-	void *client_addr;
-	socklen_t *client_addr_len;
-	int sk, err, len;
-
-	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
-		connman_error("Error with UDP listener channel");
-		*listener_watch = 0;
-		return false;
-	}
-
-	sk = g_io_channel_unix_get_fd(channel);
-
-	if (family == AF_INET) {
-		client_addr = &client_addr4;
-		client_addr_len = &client_addr4_len;
-	} else {
-		client_addr = &client_addr6;
-		client_addr_len = &client_addr6_len;
-	}
-
-	memset(client_addr, 0, *client_addr_len);
-	len = recvfrom(sk, buf, sizeof(buf), 0, client_addr, client_addr_len);
-	if (len < 2)
-		return true;
+	int err;
 
 	debug("Received %d bytes (id 0x%04x)", len, buf[0] | buf[1] << 8);
 
 	err = parse_request(buf, len, query, sizeof(query));
 	if (err < 0 || (g_slist_length(server_list) == 0)) {
 		send_response(sk, buf, len, client_addr,
-				*client_addr_len, IPPROTO_UDP);
-		return true;
+				client_addr_len, IPPROTO_UDP);
+		return;
 	}
 
 	req = g_try_new0(struct request_data, 1);
 	if (!req)
-		return true;
+		return;
 
-	memcpy(&req->sa, client_addr, *client_addr_len);
-	req->sa_len = *client_addr_len;
+	memcpy(&req->sa, client_addr, client_addr_len);
+	req->sa_len = client_addr_len;
 	req->client_sk = 0;
 	req->protocol = IPPROTO_UDP;
 	req->family = family;
@@ -3546,7 +3648,7 @@ static bool udp_listener_event(GIOChannel *channel, GIOCondition condition,
 	if (resolv(req, buf, query)) {
 		/* a cached result was sent, so the request can be released */
 	        g_free(req);
-		return true;
+		return;
 	}
 
 	req->name = g_strdup(query);
@@ -3554,6 +3656,60 @@ static bool udp_listener_event(GIOChannel *channel, GIOCondition condition,
 	memcpy(req->request, buf, len);
 	req->timeout = g_timeout_add_seconds(5, request_timeout, req);
 	request_list = g_slist_append(request_list, req);
+}
+
+static bool udp_listener_event(GIOChannel *channel, GIOCondition condition,
+				struct listener_data *ifdata, int family,
+				guint *listener_watch)
+{
+	static unsigned char buf[UDP_BATCH_SIZE][768];
+	static struct sockaddr_in6 client_addr[UDP_BATCH_SIZE];
+	struct mmsghdr msgs[UDP_BATCH_SIZE];
+	struct iovec iov[UDP_BATCH_SIZE];
+	int sk, i, count;
+
+	if (condition & (G_IO_NVAL | G_IO_ERR | G_IO_HUP)) {
+		connman_error("Error with UDP listener channel");
+		*listener_watch = 0;
+		return false;
+	}
+
+	sk = g_io_channel_unix_get_fd(channel);
+
+	memset(msgs, 0, sizeof(msgs));
+
+	for (i = 0; i < UDP_BATCH_SIZE; i++) {
+		iov[i].iov_base = buf[i];
+		iov[i].iov_len = sizeof(buf[i]);
+
+		msgs[i].msg_hdr.msg_name = &client_addr[i];
+		msgs[i].msg_hdr.msg_namelen = family == AF_INET ?
+					sizeof(struct sockaddr_in) :
+					sizeof(struct sockaddr_in6);
+		msgs[i].msg_hdr.msg_iov = &iov[i];
+		msgs[i].msg_hdr.msg_iovlen = 1;
+	}
+
+	count = recvmmsg(sk, msgs, UDP_BATCH_SIZE, MSG_DONTWAIT, NULL);
+	udp_stats.recv_calls++;
+	if (count <= 0)
+		return true;
+
+	udp_tx.sk = sk;
+
+	for (i = 0; i < count; i++) {
+		if (msgs[i].msg_len < 2)
+			continue;
+
+		udp_stats.queries++;
+
+		udp_listener_query(sk, buf[i], msgs[i].msg_len,
+				(struct sockaddr *) &client_addr[i],
+				msgs[i].msg_hdr.msg_namelen, ifdata, family);
+	}
+
+	udp_flush();
+	udp_tx.sk = -1;
 
 	return true;
 }
@@ -3921,6 +4077,18 @@ int __connman_dnsproxy_init(void)
 
 	DBG("");
 
+	cache_max_size = connman_setting_get_uint("DNSCacheSize");
+	if (!cache_max_size)
+		cache_max_size = DEFAULT_CACHE_SIZE;
+
+	cache_max_bytes = (size_t) connman_setting_get_uint(
+					"DNSCacheMemoryLimit") * 1024;
+
+	cache_serve_stale = connman_setting_get_uint("DNSCacheServeStale");
+	cache_prefetch_percent =
+		connman_setting_get_uint("DNSCachePrefetchThreshold");
+	cache_persistent = connman_setting_get_bool("DNSCachePersistent");
+
 	listener_table = g_hash_table_new_full(g_direct_hash, g_direct_equal,
 							NULL, g_free);
 
@@ -3938,6 +4106,11 @@ int __connman_dnsproxy_init(void)
 	if (err < 0)
 		goto destroy;
 
+	if (cache_persistent)
+		cache_snapshot_timer = g_timeout_add_seconds(
+					CACHE_SNAPSHOT_INTERVAL,
+					cache_snapshot_timeout, NULL);
+
 	return 0;
 
 destroy:
@@ -3953,6 +4126,85 @@ int __connman_dnsproxy_set_mdns(int index, bool enabled)
 	return -ENOTSUP;
 }
 
+static void append_server_statistics(DBusMessageIter *dict,
+					void *user_data)
+{
+	struct server_data *data = user_data;
+	dbus_int32_t index = data->index;
+	dbus_uint32_t srtt = data->srtt, rttvar = data->rttvar;
+	dbus_uint32_t loss = data->loss;
+
+	connman_dbus_dict_append_basic(dict, "Index",
+					DBUS_TYPE_INT32, &index);
+	connman_dbus_dict_append_basic(dict, "RoundTripTime",
+					DBUS_TYPE_UINT32, &srtt);
+	connman_dbus_dict_append_basic(dict, "RoundTripTimeVariance",
+					DBUS_TYPE_UINT32, &rttvar);
+	connman_dbus_dict_append_basic(dict, "LossRate",
+					DBUS_TYPE_UINT32, &loss);
+	connman_dbus_dict_append_basic(dict, "Queries",
+					DBUS_TYPE_UINT64, &data->queries);
+	connman_dbus_dict_append_basic(dict, "Replies",
+					DBUS_TYPE_UINT64, &data->replies);
+	connman_dbus_dict_append_basic(dict, "Lost",
+					DBUS_TYPE_UINT64, &data->lost);
+}
+
+static void append_servers(DBusMessageIter *dict, void *user_data)
+{
+	GSList *list;
+
+	for (list = server_list; list; list = list->next) {
+		struct server_data *data = list->data;
+
+		if (data->protocol != IPPROTO_UDP || !data->enabled)
+			continue;
+
+		connman_dbus_dict_append_dict(dict, data->server,
+					append_server_statistics, data);
+	}
+}
+
+void __connman_dnsproxy_append_statistics(DBusMessageIter *dict)
+{
+	dbus_uint32_t entries = cache_size, max_entries = cache_max_size;
+	dbus_uint64_t bytes = cache_bytes, max_bytes = cache_max_bytes;
+	dbus_uint64_t hits = cache_stats.hits, misses = cache_stats.misses;
+	dbus_uint64_t evictions = cache_stats.evictions;
+	dbus_uint64_t stale_hits = cache_stats.stale_hits;
+	dbus_uint64_t prefetches = cache_stats.prefetches;
+	dbus_uint64_t hedged = cache_stats.hedged;
+
+	connman_dbus_dict_append_basic(dict, "CacheEntries",
+					DBUS_TYPE_UINT32, &entries);
+	connman_dbus_dict_append_basic(dict, "CacheSize",
+					DBUS_TYPE_UINT32, &max_entries);
+	connman_dbus_dict_append_basic(dict, "CacheMemory",
+					DBUS_TYPE_UINT64, &bytes);
+	connman_dbus_dict_append_basic(dict, "CacheMemoryLimit",
+					DBUS_TYPE_UINT64, &max_bytes);
+	connman_dbus_dict_append_basic(dict, "CacheHits",
+					DBUS_TYPE_UINT64, &hits);
+	connman_dbus_dict_append_basic(dict, "CacheMisses",
+					DBUS_TYPE_UINT64, &misses);
+	connman_dbus_dict_append_basic(dict, "CacheEvictions",
+					DBUS_TYPE_UINT64, &evictions);
+	connman_dbus_dict_append_basic(dict, "CacheStaleHits",
+					DBUS_TYPE_UINT64, &stale_hits);
+	connman_dbus_dict_append_basic(dict, "CachePrefetches",
+					DBUS_TYPE_UINT64, &prefetches);
+	connman_dbus_dict_append_basic(dict, "HedgedQueries",
+					DBUS_TYPE_UINT64, &hedged);
+	connman_dbus_dict_append_basic(dict, "UDPQueries",
+					DBUS_TYPE_UINT64, &udp_stats.queries);
+	connman_dbus_dict_append_basic(dict, "UDPReceiveCalls",
+					DBUS_TYPE_UINT64, &udp_stats.recv_calls);
+	connman_dbus_dict_append_basic(dict, "UDPSendCalls",
+					DBUS_TYPE_UINT64, &udp_stats.send_calls);
+	connman_dbus_dict_append_dict(dict, "Servers",
+					append_servers, NULL);
+}
+
 void __connman_dnsproxy_cleanup(void)
 {
 	DBG("");
@@ -3962,6 +4214,16 @@ void __connman_dnsproxy_cleanup(void)
 		cache_timer = 0;
 	}
 
+	if (cache_snapshot_timer) {
+		g_source_remove(cache_snapshot_timer);
+		cache_snapshot_timer = 0;
+	}
+
+	cache_snapshot_save();
+
+	g_free(cache_ident);
+	cache_ident = NULL;
+
 	if (cache) {
 		g_hash_table_destroy(cache);
 		cache = NULL;
@@ -3986,14 +4248,35 @@ int LLVMFuzzerTestOneInput(const uint8_t* data, size_t size)
     /* I think we want to replicate what udp_server_event does here.
      * Specifically, the recv buffer size is fixed to 4096. */
 	unsigned char buf[4096];
+	struct server_data server = { .protocol = IPPROTO_UDP };
+	struct request_data *req;
 
     size_t len = size > sizeof(buf) ? sizeof(buf) : size;
 
     memcpy(buf, data, len);
 
-	if (len >= 12)
-		forward_dns_reply(buf, len, IPPROTO_UDP, data);
-    
-    return 0;
+	if (len < 12)
+		return 0;
+
+	/*
+	 * The reply is matched to a request without a client, like a
+	 * prefetch, so that it goes through the cache but is not sent.
+	 */
+	req = g_new0(struct request_data, 1);
+	req->dstid = req->altid = buf[0] | buf[1] << 8;
+	req->protocol = IPPROTO_UDP;
+	req->append_domain = true;
+	req->prefetch = true;
+	req->numserv = 1;
+	request_list = g_slist_append(request_list, req);
+
+	forward_dns_reply(buf, len, IPPROTO_UDP, &server);
+
+	if (g_slist_find(request_list, req)) {
+		request_list = g_slist_remove(request_list, req);
+		destroy_request_data(req);
+	}
+
+	return 0;
 }
 
@@ -47,6 +47,8 @@ struct connman_managed_table {
 
 struct fw_rule {
 	bool enabled;
+	bool pending;		/* changed in the open transaction */
+	bool was_enabled;	/* the state before the transaction */
 	char *table;
 	char *chain;
 	char *rule_spec;
@@ -60,6 +62,16 @@ static GSList *managed_tables;
 static struct firewall_context *connmark_ctx;
 static unsigned int connmark_ref;
 
+/*
+ * While a transaction is open the modified tables are only collected,
+ * each of them is committed once when the outermost transaction ends.
+ * The rules changed meanwhile go back to their old state if their
+ * table cannot be committed.
+ */
+static unsigned int transaction_depth;
+static GSList *transaction_tables;
+static GSList *transaction_rules;
+
 static int chain_to_index(const char *chain_name)
 {
 	if (!g_strcmp0(builtin_chains[NF_IP_PRE_ROUTING], chain_name))
@@ -251,6 +263,9 @@ static void cleanup_fw_rule(gpointer user_data)
 {
 	struct fw_rule *rule = user_data;
 
+	if (rule->pending)
+		transaction_rules = g_slist_remove(transaction_rules, rule);
+
 	g_free(rule->rule_spec);
 	g_free(rule->chain);
 	g_free(rule->table);
@@ -272,6 +287,80 @@ void __connman_firewall_destroy(struct firewall_context *ctx)
 	g_free(ctx);
 }
 
+static int commit_table(const char *table_name)
+{
+	if (transaction_depth == 0)
+		return __connman_iptables_commit(AF_INET, table_name);
+
+	if (!g_slist_find_custom(transaction_tables, table_name,
+					(GCompareFunc) g_strcmp0))
+		transaction_tables = g_slist_append(transaction_tables,
+						g_strdup(table_name));
+
+	return 0;
+}
+
+static void rule_set_enabled(struct fw_rule *rule, bool enabled)
+{
+	if (transaction_depth > 0 && !rule->pending) {
+		rule->pending = true;
+		rule->was_enabled = rule->enabled;
+		transaction_rules = g_slist_prepend(transaction_rules, rule);
+	}
+
+	rule->enabled = enabled;
+}
+
+void __connman_firewall_begin(void)
+{
+	transaction_depth++;
+}
+
+int __connman_firewall_commit(void)
+{
+	GSList *list, *failed = NULL;
+	int err = 0, e;
+
+	if (transaction_depth == 0)
+		return -EINVAL;
+
+	if (--transaction_depth > 0)
+		return 0;
+
+	for (list = transaction_tables; list; list = list->next) {
+		const char *table_name = list->data;
+
+		DBG("table %s", table_name);
+
+		e = __connman_iptables_commit(AF_INET, table_name);
+		if (e < 0) {
+			connman_error("Cannot commit iptables table %s: %s",
+						table_name, strerror(-e));
+			failed = g_slist_prepend(failed, list->data);
+			err = e;
+		}
+	}
+
+	for (list = transaction_rules; list; list = list->next) {
+		struct fw_rule *rule = list->data;
+
+		if (g_slist_find_custom(failed, rule->table,
+					(GCompareFunc) g_strcmp0))
+			rule->enabled = rule->was_enabled;
+
+		rule->pending = false;
+	}
+
+	g_slist_free(transaction_rules);
+	transaction_rules = NULL;
+
+	g_slist_free(failed);
+	g_slist_free_full(transaction_tables, g_free);
+	transaction_tables = NULL;
+
+	return err;
+}
+
 static int enable_rule(struct fw_rule *rule)
 {
 	int err;
@@ -285,11 +374,11 @@ static int enable_rule(struct fw_rule *rule)
 	if (err < 0)
 		return err;
 
-	err = __connman_iptables_commit(AF_INET, rule->table);
+	err = commit_table(rule->table);
 	if (err < 0)
 		return err;
 
-	rule->enabled = true;
+	rule_set_enabled(rule, true);
 
 	return 0;
 }
@@ -308,14 +397,14 @@ static int disable_rule(struct fw_rule *rule)
 		return err;
 	}
 
-	err = __connman_iptables_commit(AF_INET, rule->table);
+	err = commit_table(rule->table);
 	if (err < 0) {
 		connman_error("Cannot remove previously installed "
 			"iptables rules: %s", strerror(-err));
 		return err;
 	}
 
-	rule->enabled = false;
+	rule_set_enabled(rule, false);
 
 	return 0;
 }
@@ -355,7 +444,9 @@ static int firewall_enable_rules(struct firewall_context *ctx)
 {
 	struct fw_rule *rule;
 	GList *list;
-	int err = -ENOENT;
+	int err = -ENOENT, e;
+
+	__connman_firewall_begin();
 
 	for (list = g_list_first(ctx->rules); list; list = g_list_next(list)) {
 		rule = list->data;
@@ -365,6 +456,10 @@ static int firewall_enable_rules(struct firewall_context *ctx)
 			break;
 	}
 
+	e = __connman_firewall_commit();
+	if (err == 0)
+		err = e;
+
 	return err;
 }
 
@@ -375,6 +470,8 @@ static int firewall_disable_rules(struct firewall_context *ctx)
 	int e;
 	int err = -ENOENT;
 
+	__connman_firewall_begin();
+
 	for (list = g_list_last(ctx->rules); list;
 			list = g_list_previous(list)) {
 		rule = list->data;
@@ -388,6 +485,10 @@ static int firewall_disable_rules(struct firewall_context *ctx)
 			err = e;
 	}
 
+	e = __connman_firewall_commit();
+	if (e < 0)
+		err = e;
+
 	return err;
 }
 
@@ -492,11 +593,16 @@ int __connman_firewall_enable_marking(struct firewall_context *ctx,
 					char *id, const char *src_ip,
 					uint32_t mark)
 {
-	int err;
+	int err, e;
+
+	/* the connmark and the marking rules share the mangle table */
+	__connman_firewall_begin();
 
 	err = firewall_enable_connmark();
-	if (err)
+	if (err) {
+		__connman_firewall_commit();
 		return err;
+	}
 
 	switch (id_type) {
 	case CONNMAN_SESSION_ID_TYPE_UID:
@@ -513,6 +619,7 @@ int __connman_firewall_enable_marking(struct firewall_context *ctx,
 		break;
 	case CONNMAN_SESSION_ID_TYPE_LSM:
 	default:
+		__connman_firewall_commit();
 		return -EINVAL;
 	}
 
@@ -522,13 +629,29 @@ int __connman_firewall_enable_marking(struct firewall_context *ctx,
 					src_ip, mark);
 	}
 
-	return firewall_enable_rules(ctx);
+	err = firewall_enable_rules(ctx);
+
+	e = __connman_firewall_commit();
+	if (err == 0)
+		err = e;
+
+	return err;
 }
 
 int __connman_firewall_disable_marking(struct firewall_context *ctx)
 {
+	int err, e;
+
+	__connman_firewall_begin();
+
 	firewall_disable_connmark();
-	return firewall_disable_rules(ctx);
+	err = firewall_disable_rules(ctx);
+
+	e = __connman_firewall_commit();
+	if (e < 0)
+		err = e;
+
+	return err;
 }
 
 static void iterate_chains_cb(const char *chain_name, void *user_data)
@@ -46,6 +46,7 @@
 #include <sys/socket.h>
 #include <netinet/in.h>
 #include <arpa/inet.h>
+#include <poll.h>
 
 #include <linux/netfilter.h>
 #include <linux/netfilter/nfnetlink.h>
@@ -56,6 +57,7 @@
 #include <libnftnl/table.h>
 #include <libnftnl/chain.h>
 #include <libnftnl/rule.h>
+#include <libnftnl/set.h>
 #include <libnftnl/expr.h>
 
 #include <glib.h>
@@ -66,6 +68,22 @@
 #define CONNMAN_CHAIN_NAT_PRE "nat-prerouting"
 #define CONNMAN_CHAIN_NAT_POST "nat-postrouting"
 #define CONNMAN_CHAIN_ROUTE_OUTPUT "route-output"
+#define CONNMAN_MAP_UID_MARK "uid-mark"
+#define CONNMAN_MAP_SADDR_MARK "saddr-mark"
+
+/*
+ * Data types as known by nft(8), the kernel does not look at them but
+ * they make 'nft list table connman' print the maps readable.
+ */
+#define NFT_TYPE_IPADDR 7
+#define NFT_TYPE_MARK 19
+#define NFT_TYPE_UID 24
+
+/* Upper bound for one element add or delete message */
+#define ELEM_MSG_SIZE 256
+
+/* How long to wait for the answers to a batch, in milliseconds */
+#define BATCH_ACK_TIMEOUT 1000
 
 static bool debug_enabled = false;
 
@@ -76,14 +94,42 @@ struct firewall_handle {
 
 struct firewall_context {
 	struct firewall_handle rule;
+	uint32_t mark;
+	bool has_uid;
+	uint32_t uid;
+	bool has_saddr;
+	uint32_t saddr;
 };
 
+/*
+ * The marks are looked up in the maps uid-mark and saddr-mark by two
+ * fixed rules in route-output. Several sessions may share a key, the
+ * tables hold for every key the list of contexts using it, newest
+ * first. The newest one owns the map element, as its rule used to be
+ * the last one to set the mark.
+ */
 struct nftables_info {
 	struct firewall_handle ct;
+	GHashTable *uid_marks;
+	GHashTable *saddr_marks;
 };
 
 static struct nftables_info *nft_info;
 
+struct elem_op {
+	uint16_t cmd;
+	const char *map;
+	uint32_t key;
+	uint32_t mark;
+};
+
+/*
+ * Element changes are queued and sent in one batch on commit, or
+ * directly when no transaction is open.
+ */
+static int transaction_depth;
+static GSList *elem_ops;
+
 enum callback_return_type {
         CALLBACK_RETURN_NONE = 0,
         CALLBACK_RETURN_HANDLE,
@@ -495,6 +541,287 @@ static int rule_cmd(struct mnl_socket *nl, struct nftnl_rule *rule,
         return err;
 }
 
+static int set_cmd(struct mnl_socket *nl, struct nftnl_set *set,
+			uint16_t cmd, uint16_t family, uint16_t type)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct mnl_nlmsg_batch *batch;
+	struct nlmsghdr *nlh;
+	uint32_t seq = 0;
+	int err;
+
+	bzero(buf, sizeof(buf));
+
+	batch = mnl_nlmsg_batch_start(buf, sizeof(buf));
+	put_batch_headers(mnl_nlmsg_batch_current(batch),
+				NFNL_MSG_BATCH_BEGIN, seq++);
+	mnl_nlmsg_batch_next(batch);
+
+	nlh = nftnl_set_nlmsg_build_hdr(mnl_nlmsg_batch_current(batch),
+					cmd, family, type, seq++);
+	nftnl_set_nlmsg_build_payload(nlh, set);
+	nftnl_set_free(set);
+	mnl_nlmsg_batch_next(batch);
+
+	put_batch_headers(mnl_nlmsg_batch_current(batch),
+				NFNL_MSG_BATCH_END, seq++);
+	mnl_nlmsg_batch_next(batch);
+
+	err = send_and_dispatch(nl, mnl_nlmsg_batch_head(batch),
+				mnl_nlmsg_batch_size(batch), 0, NULL);
+
+	mnl_nlmsg_batch_stop(batch);
+	return err;
+}
+
+/*
+ * Send a batch whose messages all carry NLM_F_ACK, the last of them
+ * with sequence number last_seq. The kernel answers every one of them
+ * in order, also when the batch is aborted, so everything has been read
+ * with the answer for last_seq. It is there right after the send, the
+ * timeout only keeps a lost answer from stalling the main loop. Returns
+ * the first error.
+ */
+static int send_batch(struct mnl_socket *nl, const void *req,
+			size_t req_size, uint32_t last_seq)
+{
+	char buf[MNL_SOCKET_BUFFER_SIZE];
+	struct pollfd pfd;
+	struct nlmsghdr *nlh;
+	bool done = false;
+	int len, err = 0;
+
+	debug_mnl_dump_rule(req, req_size);
+
+	if (mnl_socket_sendto(nl, req, req_size) < 0)
+		return -errno;
+
+	pfd.fd = mnl_socket_get_fd(nl);
+	pfd.events = POLLIN;
+
+	while (!done) {
+		len = poll(&pfd, 1, BATCH_ACK_TIMEOUT);
+		if (len == 0) {
+			connman_warn("No netlink answer for message %u",
+								last_seq);
+			return err ? err : -ETIMEDOUT;
+		}
+
+		if (len > 0)
+			len = mnl_socket_recvfrom(nl, buf, sizeof(buf));
+
+		if (len < 0) {
+			if (errno == EINTR)
+				continue;
+
+			return -errno;
+		}
+
+		for (nlh = (struct nlmsghdr *) buf; mnl_nlmsg_ok(nlh, len);
+					nlh = mnl_nlmsg_next(nlh, &len)) {
+			struct nlmsgerr *nlerr;
+
+			/* set element events of the multicast group */
+			if (nlh->nlmsg_type != NLMSG_ERROR)
+				continue;
+
+			nlerr = mnl_nlmsg_get_payload(nlh);
+			if (nlerr->error < 0 && err == 0)
+				err = nlerr->error;
+
+			/* nothing follows when the whole batch is refused */
+			if (nlh->nlmsg_seq == last_seq ||
+					nlerr->msg.nlmsg_type ==
+						NFNL_MSG_BATCH_BEGIN)
+				done = true;
+		}
+	}
+
+	return err;
+}
+
+static void build_elem_msg(char *buf, struct elem_op *op, uint32_t seq)
+{
+	struct nftnl_set_elem *elem;
+	struct nftnl_set *set;
+	struct nlmsghdr *nlh;
+
+	set = nftnl_set_alloc();
+	elem = nftnl_set_elem_alloc();
+	if (!set || !elem)
+		goto out;
+
+	nftnl_set_set_str(set, NFTNL_SET_TABLE, CONNMAN_TABLE);
+	nftnl_set_set_str(set, NFTNL_SET_NAME, op->map);
+
+	nftnl_set_elem_set(elem, NFTNL_SET_ELEM_KEY, &op->key,
+						sizeof(op->key));
+	if (op->cmd == NFT_MSG_NEWSETELEM)
+		nftnl_set_elem_set(elem, NFTNL_SET_ELEM_DATA, &op->mark,
+						sizeof(op->mark));
+	nftnl_set_elem_add(set, elem);
+	elem = NULL;
+
+	nlh = nftnl_set_elem_nlmsg_build_hdr(buf, op->cmd, NFPROTO_IPV4,
+			op->cmd == NFT_MSG_NEWSETELEM ?
+				NLM_F_CREATE | NLM_F_ACK : NLM_F_ACK, seq);
+	nftnl_set_elems_nlmsg_build_payload(nlh, set);
+
+out:
+	if (elem)
+		nftnl_set_elem_free(elem);
+	if (set)
+		nftnl_set_free(set);
+}
+
+static int elem_ops_flush(void)
+{
+	struct mnl_nlmsg_batch *batch;
+	struct mnl_socket *nl;
+	unsigned int count;
+	uint32_t seq = 0;
+	GSList *list;
+	size_t size;
+	char *buf;
+	int err;
+
+	if (!elem_ops)
+		return 0;
+
+	elem_ops = g_slist_reverse(elem_ops);
+	count = g_slist_length(elem_ops);
+
+	DBG("%u element changes", count);
+
+	/* twice the limit, a message may be written past it */
+	size = (count + 2) * ELEM_MSG_SIZE;
+	buf = g_malloc0(size * 2);
+
+	batch = mnl_nlmsg_batch_start(buf, size);
+	put_batch_headers(mnl_nlmsg_batch_current(batch),
+				NFNL_MSG_BATCH_BEGIN, seq++);
+	mnl_nlmsg_batch_next(batch);
+
+	for (list = elem_ops; list; list = list->next) {
+		build_elem_msg(mnl_nlmsg_batch_current(batch), list->data,
+									seq++);
+		mnl_nlmsg_batch_next(batch);
+	}
+
+	put_batch_headers(mnl_nlmsg_batch_current(batch),
+				NFNL_MSG_BATCH_END, seq++);
+	mnl_nlmsg_batch_next(batch);
+
+	g_slist_free_full(elem_ops, g_free);
+	elem_ops = NULL;
+
+	err = socket_open_and_bind(&nl);
+	if (err == 0) {
+		/* the element changes are numbered 1 to count */
+		err = send_batch(nl, mnl_nlmsg_batch_head(batch),
+				mnl_nlmsg_batch_size(batch), count);
+		mnl_socket_close(nl);
+	}
+
+	mnl_nlmsg_batch_stop(batch);
+	g_free(buf);
+
+	if (err < 0)
+		connman_warn("Failed to update mark maps: %s",
+							strerror(-err));
+
+	return err;
+}
+
+static void elem_op_queue(uint16_t cmd, const char *map, uint32_t key,
+								uint32_t mark)
+{
+	struct elem_op *op;
+
+	op = g_new0(struct elem_op, 1);
+	op->cmd = cmd;
+	op->map = map;
+	op->key = key;
+	op->mark = mark;
+
+	elem_ops = g_slist_prepend(elem_ops, op);
+}
+
+static void mark_map_add(GHashTable *table, const char *map, uint32_t key,
+				struct firewall_context *ctx)
+{
+	GSList *list;
+
+	list = g_hash_table_lookup(table, GUINT_TO_POINTER(key));
+	if (list) {
+		struct firewall_context *owner = list->data;
+
+		if (owner->mark == ctx->mark)
+			goto out;
+
+		elem_op_queue(NFT_MSG_DELSETELEM, map, key, 0);
+	}
+
+	elem_op_queue(NFT_MSG_NEWSETELEM, map, key, ctx->mark);
+
+out:
+	/* the list is updated in place, keep it from being freed */
+	g_hash_table_steal(table, GUINT_TO_POINTER(key));
+
+	list = g_slist_prepend(list, ctx);
+	g_hash_table_insert(table, GUINT_TO_POINTER(key), list);
+}
+
+static void mark_map_remove(GHashTable *table, const char *map, uint32_t key,
+				struct firewall_context *ctx)
+{
+	struct firewall_context *owner;
+	GSList *list;
+
+	list = g_hash_table_lookup(table, GUINT_TO_POINTER(key));
+	if (!list)
+		return;
+
+	g_hash_table_steal(table, GUINT_TO_POINTER(key));
+
+	owner = list->data;
+	list = g_slist_remove(list, ctx);
+
+	if (!list) {
+		elem_op_queue(NFT_MSG_DELSETELEM, map, key, 0);
+		return;
+	}
+
+	g_hash_table_insert(table, GUINT_TO_POINTER(key), list);
+
+	if (owner != ctx)
+		return;
+
+	owner = list->data;
+	if (owner->mark == ctx->mark)
+		return;
+
+	elem_op_queue(NFT_MSG_DELSETELEM, map, key, 0);
+	elem_op_queue(NFT_MSG_NEWSETELEM, map, key, owner->mark);
+}
+
+static void marking_remove(struct firewall_context *ctx)
+{
+	if (!nft_info)
+		return;
+
+	if (ctx->has_uid)
+		mark_map_remove(nft_info->uid_marks, CONNMAN_MAP_UID_MARK,
+							ctx->uid, ctx);
+
+	if (ctx->has_saddr)
+		mark_map_remove(nft_info->saddr_marks, CONNMAN_MAP_SADDR_MARK,
+							ctx->saddr, ctx);
+
+	ctx->has_uid = false;
+	ctx->has_saddr = false;
+}
+
 static int rule_delete(struct firewall_handle *handle)
 {
 	struct nftnl_rule *rule;
@@ -503,6 +830,9 @@ static int rule_delete(struct firewall_handle *handle)
 
 	DBG("");
 
+	if (!handle->chain)
+		return -ENOENT;
+
 	rule = nftnl_rule_alloc();
 	if (!rule)
 		return -ENOMEM;
@@ -540,6 +870,13 @@ void __connman_firewall_destroy(struct firewall_context *ctx)
 {
 	DBG("");
 
+	if (ctx->has_uid || ctx->has_saddr) {
+		marking_remove(ctx);
+
+		if (transaction_depth == 0)
+			elem_ops_flush();
+	}
+
 	g_free(ctx);
 }
 
@@ -746,79 +1083,30 @@ int __connman_firewall_disable_snat(struct firewall_context *ctx)
 	return rule_delete(&ctx->rule);
 }
 
-static int build_rule_marking(uid_t uid, uint32_t mark, struct nftnl_rule **res)
+static int build_rule_mark_map(const char *map, bool saddr,
+				struct nftnl_rule **res)
 {
 	struct nftnl_rule *rule;
 	struct nftnl_expr *expr;
 	int err;
 
 	/*
-	 * http://wiki.nftables.org/wiki-nftables/index.php/Setting_packet_metainformation
-	 * http://wiki.nftables.org/wiki-nftables/index.php/Matching_packet_metainformation
+	 * http://wiki.nftables.org/wiki-nftables/index.php/Maps
 	 *
 	 * # nft --debug netlink add rule connman route-output	\
-	 *	meta skuid wagi mark set 1234
+	 *	meta mark set meta skuid map @uid-mark
 	 *
 	 *	ip connman route-output
 	 *	  [ meta load skuid => reg 1 ]
-	 *	  [ cmp eq reg 1 0x000003e8 ]
-	 *	  [ immediate reg 1 0x000004d2 ]
+	 *	  [ lookup reg 1 set uid-mark dreg 1 ]
 	 *	  [ meta set mark with reg 1 ]
-	 */
-
-	rule = nftnl_rule_alloc();
-	if (!rule)
-		return -ENOMEM;
-
-	nftnl_rule_set(rule, NFTNL_RULE_TABLE, CONNMAN_TABLE);
-	nftnl_rule_set(rule, NFTNL_RULE_CHAIN, CONNMAN_CHAIN_ROUTE_OUTPUT);
-
-	expr = nftnl_expr_alloc("meta");
-	if (!expr)
-		goto err;
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_META_KEY, NFT_META_SKUID);
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_META_DREG, NFT_REG_1);
-	nftnl_rule_add_expr(rule, expr);
-	err = add_cmp(rule, NFT_REG_1, NFT_CMP_EQ, &uid, sizeof(uid));
-	if (err < 0)
-		goto err;
-
-	expr = nftnl_expr_alloc("immediate");
-	if (!expr)
-		goto err;
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_IMM_DREG, NFT_REG_1);
-	nftnl_expr_set(expr, NFTNL_EXPR_IMM_DATA, &mark, sizeof(mark));
-	nftnl_rule_add_expr(rule, expr);
-
-	expr = nftnl_expr_alloc("meta");
-	if (!expr)
-		goto err;
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_META_KEY, NFT_META_MARK);
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_META_SREG, NFT_REG_1);
-	nftnl_rule_add_expr(rule, expr);
-
-	*res = rule;
-	return 0;
-
-err:
-	return -ENOMEM;
-}
-
-static int build_rule_src_ip(const char *src_ip, uint32_t mark, struct nftnl_rule **res)
-{
-	struct nftnl_rule *rule;
-	struct nftnl_expr *expr;
-	int err;
-	in_addr_t s_addr;
-
-	/*
-	 * # nft --debug netlink add rule connman route-output \
-	 *	ip saddr 192.168.10.31 mark set 1234
+	 *
+	 * # nft --debug netlink add rule connman route-output	\
+	 *	meta mark set ip saddr map @saddr-mark
 	 *
 	 *	ip connman route-output
 	 *	  [ payload load 4b @ network header + 12 => reg 1 ]
-	 *	  [ cmp eq reg 1 0x1f0aa8c0 ]
-	 *	  [ immediate reg 1 0x000004d2 ]
+	 *	  [ lookup reg 1 set saddr-mark dreg 1 ]
 	 *	  [ meta set mark with reg 1 ]
 	 */
 
@@ -832,22 +1120,28 @@ static int build_rule_src_ip(const char *src_ip, uint32_t mark, struct nftnl_rul
 	/* family ipv4 */
 	nftnl_rule_set_u32(rule, NFTNL_RULE_FAMILY, NFPROTO_IPV4);
 
-	/* source IP */
-	err = add_payload(rule, NFT_PAYLOAD_NETWORK_HEADER, NFT_REG_1,
-			offsetof(struct iphdr, saddr), sizeof(struct in_addr));
-	if (err < 0)
-		goto err;
-
-	s_addr = inet_addr(src_ip);
-	err = add_cmp(rule, NFT_REG_1, NFT_CMP_EQ, &s_addr, sizeof(s_addr));
-	if (err < 0)
-		goto err;
+	if (saddr) {
+		err = add_payload(rule, NFT_PAYLOAD_NETWORK_HEADER, NFT_REG_1,
+				offsetof(struct iphdr, saddr),
+				sizeof(struct in_addr));
+		if (err < 0)
+			goto err;
+	} else {
+		expr = nftnl_expr_alloc("meta");
+		if (!expr)
+			goto err;
+		nftnl_expr_set_u32(expr, NFTNL_EXPR_META_KEY, NFT_META_SKUID);
+		nftnl_expr_set_u32(expr, NFTNL_EXPR_META_DREG, NFT_REG_1);
+		nftnl_rule_add_expr(rule, expr);
+	}
 
-	expr = nftnl_expr_alloc("immediate");
+	/* no element, no mark */
+	expr = nftnl_expr_alloc("lookup");
 	if (!expr)
 		goto err;
-	nftnl_expr_set_u32(expr, NFTNL_EXPR_IMM_DREG, NFT_REG_1);
-	nftnl_expr_set(expr, NFTNL_EXPR_IMM_DATA, &mark, sizeof(mark));
+	nftnl_expr_set_str(expr, NFTNL_EXPR_LOOKUP_SET, map);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_LOOKUP_SREG, NFT_REG_1);
+	nftnl_expr_set_u32(expr, NFTNL_EXPR_LOOKUP_DREG, NFT_REG_1);
 	nftnl_rule_add_expr(rule, expr);
 
 	expr = nftnl_expr_alloc("meta");
@@ -861,6 +1155,7 @@ static int build_rule_src_ip(const char *src_ip, uint32_t mark, struct nftnl_rul
 	return 0;
 
 err:
+	nftnl_rule_free(rule);
 	return -ENOMEM;
 }
 
@@ -869,14 +1164,14 @@ int __connman_firewall_enable_marking(struct firewall_context *ctx,
 					char *id, const char *src_ip,
 					uint32_t mark)
 {
-	struct nftnl_rule *rule;
-	struct mnl_socket *nl;
 	struct passwd *pw;
-	uid_t uid;
-	int err;
+	uid_t uid = 0;
 
 	DBG("");
 
+	if (!nft_info)
+		return -ENOTSUP;
+
 	if (id_type == CONNMAN_SESSION_ID_TYPE_UID) {
 		pw = getpwnam(id);
 		if (!pw)
@@ -886,48 +1181,39 @@ int __connman_firewall_enable_marking(struct firewall_context *ctx,
 	else if (!src_ip)
 		return -ENOTSUP;
 
-        err = socket_open_and_bind(&nl);
-        if (err < 0)
-		return err;
+	marking_remove(ctx);
+	ctx->mark = mark;
 
 	if (id_type == CONNMAN_SESSION_ID_TYPE_UID) {
-		err = build_rule_marking(uid, mark, &rule);
-		if (err < 0)
-			goto out;
-
-		ctx->rule.chain = CONNMAN_CHAIN_ROUTE_OUTPUT;
-		err = rule_cmd(nl, rule, NFT_MSG_NEWRULE, NFPROTO_IPV4,
-				NLM_F_APPEND|NLM_F_CREATE|NLM_F_ACK,
-				CALLBACK_RETURN_HANDLE, &ctx->rule.handle);
-
-		nftnl_rule_free(rule);
+		ctx->has_uid = true;
+		ctx->uid = uid;
+		mark_map_add(nft_info->uid_marks, CONNMAN_MAP_UID_MARK,
+							ctx->uid, ctx);
 	}
 
 	if (src_ip) {
-		err = build_rule_src_ip(src_ip, mark, &rule);
-		if (err < 0)
-			goto out;
+		ctx->has_saddr = true;
+		ctx->saddr = inet_addr(src_ip);
+		mark_map_add(nft_info->saddr_marks, CONNMAN_MAP_SADDR_MARK,
+							ctx->saddr, ctx);
+	}
 
-		ctx->rule.chain = CONNMAN_CHAIN_ROUTE_OUTPUT;
-		err = rule_cmd(nl, rule, NFT_MSG_NEWRULE, NFPROTO_IPV4,
-				NLM_F_APPEND|NLM_F_CREATE|NLM_F_ACK,
-				CALLBACK_RETURN_HANDLE, &ctx->rule.handle);
+	if (transaction_depth > 0)
+		return 0;
 
-		nftnl_rule_free(rule);
-	}
-out:
-	mnl_socket_close(nl);
-	return err;
+	return elem_ops_flush();
 }
 
 int __connman_firewall_disable_marking(struct firewall_context *ctx)
 {
-	int err;
-
 	DBG("");
 
-	err = rule_delete(&ctx->rule);
-	return err;
+	marking_remove(ctx);
+
+	if (transaction_depth > 0)
+		return 0;
+
+	return elem_ops_flush();
 }
 
 static struct nftnl_table *build_table(const char *name, uint16_t family)
@@ -969,6 +1255,54 @@ static struct nftnl_chain *build_chain(const char *name, const char *table,
 	return chain;
 }
 
+static struct nftnl_set *build_mark_map(const char *name, uint32_t key_type)
+{
+	struct nftnl_set *set;
+
+	set = nftnl_set_alloc();
+	if (!set)
+		return NULL;
+
+	nftnl_set_set_str(set, NFTNL_SET_TABLE, CONNMAN_TABLE);
+	nftnl_set_set_str(set, NFTNL_SET_NAME, name);
+	nftnl_set_set_u32(set, NFTNL_SET_FAMILY, NFPROTO_IPV4);
+	nftnl_set_set_u32(set, NFTNL_SET_FLAGS, NFT_SET_MAP);
+	nftnl_set_set_u32(set, NFTNL_SET_KEY_TYPE, key_type);
+	nftnl_set_set_u32(set, NFTNL_SET_KEY_LEN, sizeof(uint32_t));
+	nftnl_set_set_u32(set, NFTNL_SET_DATA_TYPE, NFT_TYPE_MARK);
+	nftnl_set_set_u32(set, NFTNL_SET_DATA_LEN, sizeof(uint32_t));
+
+	return set;
+}
+
+static int create_mark_map(struct mnl_socket *nl, const char *name,
+				uint32_t key_type, bool saddr)
+{
+	struct nftnl_rule *rule;
+	struct nftnl_set *set;
+	int err;
+
+	set = build_mark_map(name, key_type);
+	if (!set)
+		return -ENOMEM;
+
+	err = set_cmd(nl, set, NFT_MSG_NEWSET, NFPROTO_IPV4,
+			NLM_F_CREATE | NLM_F_ACK);
+	if (err < 0)
+		return err;
+
+	err = build_rule_mark_map(name, saddr, &rule);
+	if (err < 0)
+		return err;
+
+	err = rule_cmd(nl, rule, NFT_MSG_NEWRULE, NFPROTO_IPV4,
+			NLM_F_APPEND|NLM_F_CREATE|NLM_F_ACK,
+			CALLBACK_RETURN_NONE, NULL);
+	nftnl_rule_free(rule);
+
+	return err;
+}
+
 static int create_table_and_chains(struct nftables_info *nft_info)
 {
 	struct mnl_socket *nl;
@@ -1058,6 +1392,28 @@ static int create_table_and_chains(struct nftables_info *nft_info)
 	if (err < 0)
 		goto out;
 
+	/*
+	 * The session marks, the uid rule comes first so that a source
+	 * address mark wins as before.
+	 *
+	 * # nft add map connman uid-mark { type uid : mark ; }
+	 * # nft add rule connman route-output	\
+	 *	meta mark set meta skuid map @uid-mark
+	 */
+	err = create_mark_map(nl, CONNMAN_MAP_UID_MARK, NFT_TYPE_UID, false);
+	if (err < 0)
+		goto out;
+
+	/*
+	 * # nft add map connman saddr-mark { type ipv4_addr : mark ; }
+	 * # nft add rule connman route-output	\
+	 *	meta mark set ip saddr map @saddr-mark
+	 */
+	err = create_mark_map(nl, CONNMAN_MAP_SADDR_MARK, NFT_TYPE_IPADDR,
+									true);
+	if (err < 0)
+		goto out;
+
 out:
 	if (err)
 		connman_warn("Failed to create basic chains: %s",
@@ -1093,6 +1449,27 @@ static int cleanup_table_and_chains(void)
 	return err;
 }
 
+/*
+ * Rule changes are sent as one batch each which the kernel applies
+ * atomically. The mark map updates of a transaction are collected and
+ * sent together in one batch.
+ */
+void __connman_firewall_begin(void)
+{
+	transaction_depth++;
+}
+
+int __connman_firewall_commit(void)
+{
+	if (transaction_depth == 0)
+		return -EINVAL;
+
+	if (--transaction_depth > 0)
+		return 0;
+
+	return elem_ops_flush();
+}
+
 int __connman_firewall_init(void)
 {
 	int err;
@@ -1114,8 +1491,17 @@ int __connman_firewall_init(void)
 	}
 
 	nft_info = g_new0(struct nftables_info, 1);
+	nft_info->uid_marks = g_hash_table_new_full(g_direct_hash,
+					g_direct_equal, NULL,
+					(GDestroyNotify) g_slist_free);
+	nft_info->saddr_marks = g_hash_table_new_full(g_direct_hash,
+					g_direct_equal, NULL,
+					(GDestroyNotify) g_slist_free);
+
 	err = create_table_and_chains(nft_info);
 	if (err) {
+		g_hash_table_destroy(nft_info->uid_marks);
+		g_hash_table_destroy(nft_info->saddr_marks);
 		g_free(nft_info);
 		nft_info = NULL;
 	}
@@ -1134,6 +1520,15 @@ void __connman_firewall_cleanup(void)
 		connman_warn("cleanup table and chains failed with '%s' %d\n",
 			strerror(-err), err);
 
+	/* the maps went away with the table */
+	g_slist_free_full(elem_ops, g_free);
+	elem_ops = NULL;
+
+	if (nft_info) {
+		g_hash_table_destroy(nft_info->uid_marks);
+		g_hash_table_destroy(nft_info->saddr_marks);
+	}
+
 	g_free(nft_info);
 	nft_info = NULL;
 }
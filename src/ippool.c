@@ -37,10 +37,19 @@ struct address_info {
 	uint32_t start;
 	uint32_t end;
 
+	/* highest end of this and all blocks sorted in front of it */
+	uint32_t max_end;
+
 	unsigned int use_count;
 	struct connman_ippool *pool;
 };
 
+/* A run of used addresses, made of overlapping or adjacent blocks */
+struct used_range {
+	uint32_t start;
+	uint32_t end;
+};
+
 struct connman_ippool {
 	struct address_info *info;
 
@@ -54,13 +63,220 @@ struct connman_ippool {
 	void *user_data;
 };
 
-GSList *allocated_blocks;
+/*
+ * The blocks sorted by start address. They may overlap, the addresses
+ * of the interfaces are added as they are. used_ranges is the union of
+ * them as sorted disjoint runs, so looking for a collision or for the
+ * next free block is a binary search.
+ */
+static GPtrArray *allocated_blocks;
+static GArray *used_ranges;
+
+/*
+ * The private ranges in the order they are handed out. As always, the
+ * last /24 of every /16 and 10.255.0.0/16 are never used.
+ *
+ * 16-bit block 192.168.0.0 – 192.168.255.255
+ * 20-bit block  172.16.0.0 –  172.31.255.255
+ * 24-bit block    10.0.0.0 –  10.254.255.255
+ */
+#define NUM_PRIVATE_RANGES 3
+
+static struct used_range private_ranges[NUM_PRIVATE_RANGES];
 
 static uint32_t last_block;
-static uint32_t block_16_bits;
-static uint32_t block_20_bits;
-static uint32_t block_24_bits;
-static uint32_t subnet_mask_24;
+
+/* lowest index with a start address above start */
+static guint upper_bound(uint32_t start)
+{
+	struct address_info *info;
+	guint low = 0, high = allocated_blocks->len;
+
+	while (low < high) {
+		guint mid = low + (high - low) / 2;
+
+		info = g_ptr_array_index(allocated_blocks, mid);
+		if (info->start <= start)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+/* lowest index with a start address not below start */
+static guint lower_bound(uint32_t start)
+{
+	if (start == 0)
+		return 0;
+
+	return upper_bound(start - 1);
+}
+
+/*
+ * Recompute the highest ends from the changed position on. As soon as
+ * one of them stays the same, so do all the ones behind it.
+ */
+static void update_max_end(guint from)
+{
+	struct address_info *info, *prev;
+	uint32_t max_end;
+	guint i;
+
+	for (i = from; i < allocated_blocks->len; i++) {
+		info = g_ptr_array_index(allocated_blocks, i);
+		max_end = info->end;
+
+		if (i > 0) {
+			prev = g_ptr_array_index(allocated_blocks, i - 1);
+			if (prev->max_end > max_end)
+				max_end = prev->max_end;
+		}
+
+		if (i > from && info->max_end == max_end)
+			break;
+
+		info->max_end = max_end;
+	}
+}
+
+/* index of the first run which does not end before address */
+static guint find_range(uint32_t address)
+{
+	struct used_range *range;
+	guint low = 0, high = used_ranges->len;
+
+	while (low < high) {
+		guint mid = low + (high - low) / 2;
+
+		range = &g_array_index(used_ranges, struct used_range, mid);
+		if (range->end < address)
+			low = mid + 1;
+		else
+			high = mid;
+	}
+
+	return low;
+}
+
+/* Merge start to end with all runs it overlaps or touches */
+static void add_used_range(uint32_t start, uint32_t end)
+{
+	struct used_range merged = { start, end }, *range;
+	guint first, last;
+
+	first = find_range(start > 0 ? start - 1 : 0);
+
+	for (last = first; last < used_ranges->len; last++) {
+		range = &g_array_index(used_ranges, struct used_range, last);
+
+		if (end < 0xffffffff && range->start > end + 1)
+			break;
+
+		if (range->start < merged.start)
+			merged.start = range->start;
+		if (range->end > merged.end)
+			merged.end = range->end;
+	}
+
+	if (last > first)
+		g_array_remove_range(used_ranges, first, last - first);
+
+	g_array_insert_val(used_ranges, first, merged);
+}
+
+/*
+ * Split up the run which held a removed block again. All the blocks
+ * of the run start within it, otherwise it would reach further.
+ */
+static void remove_used_range(uint32_t start)
+{
+	struct used_range range, *old;
+	struct address_info *info;
+	guint pos, end, index, first;
+
+	index = find_range(start);
+	if (index == used_ranges->len)
+		return;
+
+	old = &g_array_index(used_ranges, struct used_range, index);
+	pos = lower_bound(old->start);
+	end = upper_bound(old->end);
+
+	g_array_remove_index(used_ranges, index);
+
+	for (first = index; pos < end; pos++) {
+		info = g_ptr_array_index(allocated_blocks, pos);
+
+		if (index > first) {
+			struct used_range *last;
+
+			last = &g_array_index(used_ranges, struct used_range,
+								index - 1);
+			if (last->end == 0xffffffff ||
+					info->start <= last->end + 1) {
+				if (info->end > last->end)
+					last->end = info->end;
+				continue;
+			}
+		}
+
+		range.start = info->start;
+		range.end = info->end;
+		g_array_insert_val(used_ranges, index, range);
+		index++;
+	}
+}
+
+static void insert_block(struct address_info *info)
+{
+	guint pos;
+
+	pos = upper_bound(info->start);
+	g_ptr_array_insert(allocated_blocks, pos, info);
+
+	update_max_end(pos);
+	add_used_range(info->start, info->end);
+}
+
+static void remove_block(struct address_info *info)
+{
+	guint pos;
+
+	for (pos = lower_bound(info->start); pos < allocated_blocks->len;
+									pos++) {
+		if (g_ptr_array_index(allocated_blocks, pos) != info)
+			continue;
+
+		g_ptr_array_remove_index(allocated_blocks, pos);
+
+		update_max_end(pos);
+		remove_used_range(info->start);
+		break;
+	}
+}
+
+/*
+ * Check whether any address from start to end is in use. If so, reach
+ * is set to the end of the run of used addresses.
+ */
+static bool is_used(uint32_t start, uint32_t end, uint32_t *reach)
+{
+	struct used_range *range;
+	guint index;
+
+	index = find_range(start);
+	if (index == used_ranges->len)
+		return false;
+
+	range = &g_array_index(used_ranges, struct used_range, index);
+	if (range->start > end)
+		return false;
+
+	*reach = range->end;
+	return true;
+}
 
 void __connman_ippool_free(struct connman_ippool *pool)
 {
@@ -68,7 +284,7 @@ void __connman_ippool_free(struct connman_ippool *pool)
 		return;
 
 	if (pool->info) {
-		allocated_blocks = g_slist_remove(allocated_blocks, pool->info);
+		remove_block(pool->info);
 		g_free(pool->info);
 	}
 
@@ -90,74 +306,39 @@ static char *get_ip(uint32_t ip)
 	return g_strdup(inet_ntoa(addr));
 }
 
-static uint32_t next_block(uint32_t block)
+static bool is_reserved(uint32_t block, uint32_t size)
 {
-	uint32_t next;
-
-	/*
-	 * Return the next IP block within the private IP range
-	 *
-	 * 16-bit block 192.168.0.0 – 192.168.255.255
-	 * 20-bit block  172.16.0.0 –  172.31.255.255
-	 * 24-bit block    10.0.0.0 –  10.255.255.255
-	 */
+	/* the last /24 of a /16 */
+	return ((block + size - 1) & 0x0000ff00) == 0x0000ff00;
+}
 
-	next = (block & 0x0000ff00) >> 8;
-	next += 1;
+static uint32_t find_free_block(uint32_t from, uint32_t to, uint32_t size)
+{
+	uint32_t block = from, reach;
 
-	if (next == 255) {
-		if ((block & 0xffff0000) == block_16_bits) {
-			/*
-			 * Reached the end of the 16 bit block, switch
-			 * to the 20-bit block.
-			 */
-			return block_20_bits;
+	while (block <= to && to - block >= size - 1) {
+		if (is_reserved(block, size)) {
+			block = (block | 0x0000ffff) + 1;
+			continue;
 		}
 
-		if ((block & 0xffff0000) >= block_20_bits) {
-			next = (block & 0x00ff0000) >> 16;
-			if (next >= 16 && next < 32)
-				next += 1;
-
-			if (next == 32) {
-				/*
-				 * Reached the end of the 20 bit
-				 * block, switch to the 24-bit block.
-				 */
-				return block_24_bits;
-			}
-
-			return (block & 0xff000000) |
-				((next << 16) & 0x00ff0000);
-		}
+		if (!is_used(block, block + size - 1, &reach))
+			return block;
 
-		if ((block & 0xff000000) == block_24_bits) {
-			next = (block & 0x00ff0000) >> 16;
-			if (next < 255)
-				next += 1;
-
-			if (next == 255) {
-				/*
-				 * Reached the end of the 24 bit
-				 * block, switch to the 16-bit block.
-				 */
-				return block_16_bits;
-			}
+		if (reach >= to)
+			break;
 
-			return (block & 0xff000000) |
-				((next << 16) & 0x00ff0000);
-		}
+		/* the next aligned block behind the used ones */
+		block = (reach + size) & ~(size - 1);
 	}
 
-	return (block & 0xffff0000) | ((next << 8) & 0x0000ff00);
+	return 0;
 }
 
-static uint32_t get_free_block(unsigned int size)
+static uint32_t get_free_block(uint32_t size)
 {
-	struct address_info *info;
-	uint32_t block;
-	GSList *list;
-	bool collision;
+	uint32_t block, start;
+	int i, n, r;
 
 	/*
 	 * Instead starting always from the 16 bit block, we start
@@ -166,42 +347,49 @@ static uint32_t get_free_block(unsigned int size)
 	 * the first half of the private IP pool is in use and a new
 	 * we need to find a new block.
 	 *
-	 * To only thing we have to make sure is that we terminated if
-	 * there is no block left.
+	 * The ranges are searched from there on and then from their
+	 * beginning up to the last assigned block.
 	 */
-	if (last_block)
-		block = last_block;
-	else
-		block = block_16_bits;
+	start = last_block & ~(size - 1);
 
-	do {
-		collision = false;
-		for (list = allocated_blocks; list; list = list->next) {
-			info = list->data;
+	for (i = 0; i < NUM_PRIVATE_RANGES; i++) {
+		if (start >= private_ranges[i].start &&
+					start <= private_ranges[i].end)
+			break;
+	}
 
-			if (info->start <= block && block <= info->end) {
-				collision = true;
-				break;
-			}
-		}
+	if (i == NUM_PRIVATE_RANGES) {
+		i = 0;
+		start = private_ranges[0].start;
+	}
 
-		if (!collision)
-			return block;
+	block = find_free_block(start, private_ranges[i].end, size);
+
+	for (n = 1; !block && n < NUM_PRIVATE_RANGES; n++) {
+		r = (i + n) % NUM_PRIVATE_RANGES;
+		block = find_free_block(private_ranges[r].start,
+					private_ranges[r].end, size);
+	}
 
-		block = next_block(block);
-	} while (block != last_block);
+	if (!block && start > private_ranges[i].start)
+		block = find_free_block(private_ranges[i].start, start - 1,
+									size);
 
-	return 0;
+	return block;
 }
 
 static struct address_info *lookup_info(int index, uint32_t start)
 {
-	GSList *list;
+	struct address_info *info;
+	guint pos;
+
+	for (pos = lower_bound(start); pos < allocated_blocks->len; pos++) {
+		info = g_ptr_array_index(allocated_blocks, pos);
 
-	for (list = allocated_blocks; list; list = list->next) {
-		struct address_info *info = list->data;
+		if (info->start != start)
+			break;
 
-		if (info->index == index && info->start == start)
+		if (info->index == index)
 			return info;
 	}
 
@@ -228,7 +416,7 @@ void __connman_ippool_newaddr(int index, const char *address,
 	struct address_info *info, *it;
 	struct in_addr inp;
 	uint32_t start, end, mask;
-	GSList *list;
+	guint pos;
 
 	if (inet_aton(address, &inp) == 0)
 		return;
@@ -257,7 +445,7 @@ void __connman_ippool_newaddr(int index, const char *address,
 	info->start = start;
 	info->end = end;
 
-	allocated_blocks = g_slist_prepend(allocated_blocks, info);
+	insert_block(info);
 
 update:
 	info->use_count = info->use_count + 1;
@@ -270,16 +458,23 @@ update:
 		return;
 	}
 
-	for (list = allocated_blocks; list; list = list->next) {
-		it = list->data;
+	/*
+	 * Only blocks starting at or before it can contain the first IP,
+	 * and none of them once their highest end is below it.
+	 */
+	for (pos = upper_bound(info->start); pos > 0; pos--) {
+		it = g_ptr_array_index(allocated_blocks, pos - 1);
 
-		if (it == info)
+		if (it->max_end < info->start)
+			break;
+
+		if (it == info || it->end < info->start)
 			continue;
 
-		if (!(info->start >= it->start && info->start <= it->end))
+		if (!it->pool)
 			continue;
 
-		if (it->pool && it->pool->collision_cb)
+		if (it->pool->collision_cb)
 			it->pool->collision_cb(it->pool, it->pool->user_data);
 
 		return;
@@ -300,7 +495,11 @@ void __connman_ippool_deladdr(int index, const char *address,
 	if (!is_private_address(start))
 		return;
 
-	mask = ~(0xffffffff >> prefixlen);
+	if (prefixlen >= 32)
+		mask = 0xffffffff;
+	else
+		mask = ~(0xffffffff >> prefixlen);
+
 	start = start & mask;
 
 	info = lookup_info(index, start);
@@ -317,11 +516,12 @@ void __connman_ippool_deladdr(int index, const char *address,
 	if (info->use_count > 0)
 		return;
 
-	allocated_blocks = g_slist_remove(allocated_blocks, info);
+	remove_block(info);
 	g_free(info);
 }
 
 struct connman_ippool *__connman_ippool_create(int index,
+					unsigned char prefixlen,
 					unsigned int start,
 					unsigned int range,
 					ippool_collision_cb_t collision_cb,
@@ -329,20 +529,31 @@ struct connman_ippool *__connman_ippool_create(int index,
 {
 	struct connman_ippool *pool;
 	struct address_info *info;
-	uint32_t block;
+	uint32_t block, size, mask;
 
-	DBG("");
+	DBG("prefixlen %u", prefixlen);
+
+	if (prefixlen < IPPOOL_MIN_PREFIXLEN ||
+				prefixlen > IPPOOL_MAX_PREFIXLEN) {
+		connman_error("IP pool does not support prefix length %u",
+								prefixlen);
+		return NULL;
+	}
+
+	size = 1 << (32 - prefixlen);
+	mask = ~(size - 1);
 
 	/*
-	 * The range is at max 255 and we don't support overlapping
-	 * blocks.
+	 * The range has to leave out the network and the broadcast
+	 * address and we don't support overlapping blocks.
 	 */
-	if (start + range > 254) {
-		connman_error("IP pool does not support pool size larger than 254");
+	if (start + range > size - 2) {
+		connman_error("IP pool does not support pool size larger than %u",
+								size - 2);
 		return NULL;
 	}
 
-	block = get_free_block(start + range);
+	block = get_free_block(size);
 	if (block == 0) {
 		connman_warn("Could not find a free IP block");
 		return NULL;
@@ -362,7 +573,7 @@ struct connman_ippool *__connman_ippool_create(int index,
 
 	info->index = index;
 	info->start = block;
-	info->end = block + range;
+	info->end = block + size - 1;
 
 	pool->info = info;
 	pool->collision_cb = collision_cb;
@@ -374,12 +585,12 @@ struct connman_ippool *__connman_ippool_create(int index,
 		range = 1;
 
 	pool->gateway = get_ip(info->start + 1);
-	pool->broadcast = get_ip(info->start + 255);
-	pool->subnet_mask = get_ip(subnet_mask_24);
+	pool->broadcast = get_ip(info->end);
+	pool->subnet_mask = get_ip(mask);
 	pool->start_ip = get_ip(block + start);
 	pool->end_ip = get_ip(block + start + range);
 
-	allocated_blocks = g_slist_prepend(allocated_blocks, info);
+	insert_block(info);
 
 	return pool;
 }
@@ -413,10 +624,15 @@ int __connman_ippool_init(void)
 {
 	DBG("");
 
-	block_16_bits = ntohl(inet_addr("192.168.0.0"));
-	block_20_bits = ntohl(inet_addr("172.16.0.0"));
-	block_24_bits = ntohl(inet_addr("10.0.0.0"));
-	subnet_mask_24 = ntohl(inet_addr("255.255.255.0"));
+	private_ranges[0].start = ntohl(inet_addr("192.168.0.0"));
+	private_ranges[0].end = ntohl(inet_addr("192.168.255.255"));
+	private_ranges[1].start = ntohl(inet_addr("172.16.0.0"));
+	private_ranges[1].end = ntohl(inet_addr("172.31.255.255"));
+	private_ranges[2].start = ntohl(inet_addr("10.0.0.0"));
+	private_ranges[2].end = ntohl(inet_addr("10.254.255.255"));
+
+	allocated_blocks = g_ptr_array_new();
+	used_ranges = g_array_new(FALSE, FALSE, sizeof(struct used_range));
 
 	return 0;
 }
@@ -425,7 +641,12 @@ void __connman_ippool_cleanup(void)
 {
 	DBG("");
 
-	g_slist_free_full(allocated_blocks, g_free);
-	last_block = 0;
+	g_ptr_array_set_free_func(allocated_blocks, g_free);
+	g_ptr_array_free(allocated_blocks, TRUE);
 	allocated_blocks = NULL;
+
+	g_array_free(used_ranges, TRUE);
+	used_ranges = NULL;
+
+	last_block = 0;
 }
@@ -24,6 +24,7 @@
 #endif
 
 #include <getopt.h>
+#include <stddef.h>
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
@@ -177,6 +178,12 @@ struct connman_iptables {
 	unsigned int hook_entry[NF_INET_NUMHOOKS];
 
 	GList *entries;
+
+	/* chain name -> GList node of the chain head in entries */
+	GHashTable *chains;
+
+	/* modified since it was read from or committed to the kernel */
+	bool dirty;
 };
 
 static GHashTable *table_hash = NULL;
@@ -692,14 +699,58 @@ static bool is_chain(struct connman_iptables *table,
 	return false;
 }
 
+static const char *get_chain_name(struct connman_iptables_entry *e)
+{
+	struct xt_entry_target *target;
+
+	/* Builtin chain */
+	if (e->builtin >= 0)
+		return hooknames[e->builtin];
+
+	/* User defined chain */
+	target = iptables_entry_get_target(e);
+	if (!target)
+		return NULL;
+
+	if (!g_strcmp0(target->u.user.name, get_error_target(e->type)))
+		return (const char *)target->data;
+
+	return NULL;
+}
+
+static void chain_index_set(struct connman_iptables *table, GList *head)
+{
+	const char *name;
+
+	name = get_chain_name(head->data);
+	if (!name)
+		return;
+
+	g_hash_table_replace(table->chains, g_strdup(name), head);
+}
+
+static void chain_index_remove(struct connman_iptables *table,
+				struct connman_iptables_entry *entry)
+{
+	const char *name;
+	GList *head;
+
+	name = get_chain_name(entry);
+	if (!name)
+		return;
+
+	/*
+	 * A builtin chain keeps its name when its first rule goes away,
+	 * the index points already to the new head then.
+	 */
+	head = g_hash_table_lookup(table->chains, name);
+	if (head && head->data == entry)
+		g_hash_table_remove(table->chains, name);
+}
+
 static GList *find_chain_head(struct connman_iptables *table,
 				const char *chain_name)
 {
-	GList *list;
-	struct connman_iptables_entry *head;
-	struct xt_entry_target *target;
-	int builtin;
-	
 	switch (table->type) {
 	case AF_INET:
 	case AF_INET6:
@@ -708,28 +759,7 @@ static GList *find_chain_head(struct connman_iptables *table,
 		return NULL;
 	}
 
-	for (list = table->entries; list; list = list->next) {
-		head = list->data;
-
-		/* Buit-in chain */
-		builtin = head->builtin;
-
-		if (builtin >= 0 && !g_strcmp0(hooknames[builtin], chain_name))
-			break;
-
-		/* User defined chain */
-		target = iptables_entry_get_target(head);
-		
-		if (!target)
-			continue;
-
-		if (!g_strcmp0(target->u.user.name,
-			get_error_target(table->type)) &&
-			!g_strcmp0((char *)target->data, chain_name))
-			break;
-	}
-
-	return list;
+	return g_hash_table_lookup(table->chains, chain_name);
 }
 
 static GList *find_chain_tail(struct connman_iptables *table,
@@ -754,22 +784,28 @@ static GList *find_chain_tail(struct connman_iptables *table,
 	return g_list_last(table->entries);
 }
 
-static void update_offsets(struct connman_iptables *table)
+/*
+ * Recompute the offsets starting at the entry from, the ones in front
+ * of it are still valid. NULL recomputes all of them.
+ */
+static void update_offsets(struct connman_iptables *table, GList *from)
 {
-	GList *list, *prev;
+	GList *list;
 	struct connman_iptables_entry *entry, *prev_entry;
 
-	for (list = table->entries; list; list = list->next) {
-		entry = list->data;
+	if (!from || !from->prev) {
+		if (!table->entries)
+			return;
 
-		if (list == table->entries) {
-			entry->offset = 0;
+		entry = table->entries->data;
+		entry->offset = 0;
 
-			continue;
-		}
+		from = table->entries->next;
+	}
 
-		prev = list->prev;
-		prev_entry = prev->data;
+	for (list = from; list; list = list->next) {
+		entry = list->data;
+		prev_entry = list->prev->data;
 
 		entry->offset = prev_entry->offset +
 					iptables_entry_get_next_offset(
@@ -858,13 +894,17 @@ static int iptables_add_entry(struct connman_iptables *table,
 	table->entries = g_list_insert_before(table->entries, before, e);
 	table->num_entries++;
 	table->size += iptables_entry_get_next_offset(e);
+	table->dirty = true;
 
 	if (!before) {
 		e->offset = table->size -
 				iptables_entry_get_next_offset(e);
+		chain_index_set(table, g_list_last(table->entries));
 		return 0;
 	}
 
+	chain_index_set(table, before->prev);
+
 	entry_before = before->data;
 
 	/*
@@ -873,7 +913,7 @@ static int iptables_add_entry(struct connman_iptables *table,
 	 */
 	update_targets_reference(table, entry_before, e, false);
 
-	update_offsets(table);
+	update_offsets(table, before->prev);
 
 	return 0;
 }
@@ -889,7 +929,9 @@ static int remove_table_entry(struct connman_iptables *table,
 
 	table->size -= next_offset;
 	removed = next_offset;
+	table->dirty = true;
 
+	chain_index_remove(table, entry);
 	table->entries = g_list_remove(table->entries, entry);
 
 	iptables_entry_free(entry);
@@ -906,6 +948,7 @@ static void delete_update_hooks(struct connman_iptables *table,
 
 	e = chain_head->data;
 	e->builtin = builtin;
+	chain_index_set(table, chain_head);
 
 	table->underflow[builtin] -= removed;
 
@@ -960,7 +1003,7 @@ static int iptables_flush_chain(struct connman_iptables *table,
 	if (builtin >= 0)
 		delete_update_hooks(table, builtin, chain_tail->prev, removed);
 
-	update_offsets(table);
+	update_offsets(table, chain_tail->prev);
 
 	return 0;
 }
@@ -1125,7 +1168,7 @@ static int iptables_delete_chain(struct connman_iptables *table,
 	entry = chain_tail->prev->data;
 	remove_table_entry(table, entry);
 
-	update_offsets(table);
+	update_offsets(table, chain_tail);
 
 	return 0;
 }
@@ -1645,7 +1688,7 @@ static int iptables_delete_rule(struct connman_iptables *table,
 				struct xtables_rule_match *xt_rm)
 {
 	struct connman_iptables_entry *entry;
-	GList *chain_head, *chain_tail, *list;
+	GList *chain_head, *chain_tail, *list, *next;
 	int builtin, removed;
 
 	DBG("table %s chain %s", table->name, chain_name);
@@ -1683,6 +1726,7 @@ static int iptables_delete_rule(struct connman_iptables *table,
 
 		entry = chain_head->data;
 		entry->builtin = builtin;
+		chain_index_set(table, chain_head);
 	}
 
 	entry = list->data;
@@ -1695,12 +1739,13 @@ static int iptables_delete_rule(struct connman_iptables *table,
 		update_targets_reference(table, list->next->data,
 						list->data, true);
 
+	next = list->next;
 	removed += remove_table_entry(table, entry);
 
 	if (builtin >= 0)
 		delete_update_hooks(table, builtin, chain_head, removed);
 
-	update_offsets(table);
+	update_offsets(table, next);
 
 	return 0;
 }
@@ -1745,8 +1790,10 @@ static int iptables_change_policy(struct connman_iptables *table,
 		return -EINVAL;
 
 	t = (struct xt_standard_target *)target;
-	if (t->verdict != verdict)
+	if (t->verdict != verdict) {
 		entry->counter_idx = -1;
+		table->dirty = true;
+	}
 	t->verdict = verdict;
 
 	return 0;
@@ -2417,6 +2464,7 @@ static void table_cleanup(struct connman_iptables *table)
 	}
 
 	g_list_free(table->entries);
+	g_hash_table_destroy(table->chains);
 	g_free(table->name);
 	
 	if (table->type == AF_INET) {
@@ -2477,6 +2525,8 @@ static struct connman_iptables *iptables_init(int type, const char *table_name)
 		return NULL;
 
 	table->type = entry.type = type;
+	table->chains = g_hash_table_new_full(g_str_hash, g_str_equal,
+							g_free, NULL);
 
 	table->ipt_sock = socket(type, SOCK_RAW | SOCK_CLOEXEC, IPPROTO_RAW);
 	if (table->ipt_sock < 0)
@@ -2572,6 +2622,8 @@ static struct connman_iptables *iptables_init(int type, const char *table_name)
 			add_entry,
 			table);
 
+	table->dirty = false;
+
 	if (debug_enabled)
 		dump_table(table);
 
@@ -3012,6 +3064,145 @@ out:
 	return err;
 }
 
+/*
+ * Compare two entry blobs of the same size rule by rule. The packet
+ * and byte counters are left out, they change with the traffic.
+ */
+static bool same_rules(int type, const unsigned char *a,
+				const unsigned char *b, unsigned int size)
+{
+	size_t counters, rest;
+	unsigned int offset, next;
+
+	switch (type) {
+	case AF_INET:
+		counters = offsetof(struct ipt_entry, counters);
+		rest = offsetof(struct ipt_entry, elems);
+		break;
+	case AF_INET6:
+		counters = offsetof(struct ip6t_entry, counters);
+		rest = offsetof(struct ip6t_entry, elems);
+		break;
+	default:
+		return false;
+	}
+
+	for (offset = 0; offset < size; offset += next) {
+		if (size - offset < rest)
+			return false;
+
+		if (type == AF_INET)
+			next = ((struct ipt_entry *) (a + offset))->next_offset;
+		else
+			next = ((struct ip6t_entry *) (a + offset))->next_offset;
+
+		if (next < rest || next > size - offset)
+			return false;
+
+		/* next_offset is in the first part, so b agrees on it */
+		if (memcmp(a + offset, b + offset, counters) ||
+				memcmp(a + offset + rest, b + offset + rest,
+							next - rest))
+			return false;
+	}
+
+	return true;
+}
+
+/*
+ * A table without pending changes is what was read from or committed
+ * to the kernel. Someone else, e.g. the iptables command, might have
+ * replaced it since. There is no generation count for the legacy
+ * tables. Most changes show in the info already, the rules of the
+ * kernel are compared only when it agrees.
+ */
+static bool table_is_current(struct connman_iptables *table)
+{
+	struct ipt_getinfo info;
+	struct ip6t_getinfo info6;
+	struct ipt_get_entries *entries = NULL;
+	struct ip6t_get_entries *entries6 = NULL;
+	socklen_t s;
+	bool current = false;
+
+	switch (table->type) {
+	case AF_INET:
+		memset(&info, 0, sizeof(info));
+		s = sizeof(info);
+		g_stpcpy(info.name, table->info->name);
+
+		if (getsockopt(table->ipt_sock, IPPROTO_IP, IPT_SO_GET_INFO,
+							&info, &s) < 0)
+			return false;
+
+		if (info.num_entries != table->info->num_entries ||
+				info.size != table->info->size ||
+				memcmp(info.hook_entry, table->info->hook_entry,
+					sizeof(info.hook_entry)) ||
+				memcmp(info.underflow, table->info->underflow,
+					sizeof(info.underflow)))
+			return false;
+
+		entries = g_try_malloc0(sizeof(*entries) + info.size);
+		if (!entries)
+			return false;
+
+		g_stpcpy(entries->name, info.name);
+		entries->size = info.size;
+		s = sizeof(*entries) + info.size;
+
+		if (getsockopt(table->ipt_sock, IPPROTO_IP,
+				IPT_SO_GET_ENTRIES, entries, &s) == 0)
+			current = same_rules(AF_INET,
+					(unsigned char *) entries->entrytable,
+					(unsigned char *)
+					table->blob_entries->entrytable,
+					info.size);
+
+		g_free(entries);
+		break;
+	case AF_INET6:
+		memset(&info6, 0, sizeof(info6));
+		s = sizeof(info6);
+		g_stpcpy(info6.name, table->info6->name);
+
+		if (getsockopt(table->ipt_sock, IPPROTO_IPV6,
+					IP6T_SO_GET_INFO, &info6, &s) < 0)
+			return false;
+
+		if (info6.num_entries != table->info6->num_entries ||
+				info6.size != table->info6->size ||
+				memcmp(info6.hook_entry,
+					table->info6->hook_entry,
+					sizeof(info6.hook_entry)) ||
+				memcmp(info6.underflow,
+					table->info6->underflow,
+					sizeof(info6.underflow)))
+			return false;
+
+		entries6 = g_try_malloc0(sizeof(*entries6) + info6.size);
+		if (!entries6)
+			return false;
+
+		g_stpcpy(entries6->name, info6.name);
+		entries6->size = info6.size;
+		s = sizeof(*entries6) + info6.size;
+
+		if (getsockopt(table->ipt_sock, IPPROTO_IPV6,
+				IP6T_SO_GET_ENTRIES, entries6, &s) == 0)
+			current = same_rules(AF_INET6,
+					(unsigned char *) entries6->entrytable,
+					(unsigned char *)
+					table->blob_entries6->entrytable,
+					info6.size);
+
+		g_free(entries6);
+		break;
+	}
+
+	return current;
+}
+
 static struct connman_iptables *get_table(int type, const char *table_name)
 {
 	struct connman_iptables *table = NULL;
@@ -3021,9 +3212,14 @@ static struct connman_iptables *get_table(int type, const char *table_name)
 
 	table = hash_table_lookup(type, table_name);
 
-	if (table)
+	if (table && (table->dirty || table_is_current(table)))
 		return table;
 
+	if (table) {
+		DBG("table %s changed behind our back", table_name);
+		hash_table_remove(type, table_name);
+	}
+
 	table = iptables_init(type, table_name);
 
 	if (!table)
@@ -3904,6 +4100,76 @@ out:
 	return err;
 }
 
+/*
+ * Bring the cached table in line with the replace which has just been
+ * accepted by the kernel, instead of parsing it again. Only the blob is
+ * read back, as the kernel renders it, for table_is_current() to
+ * compare against.
+ */
+static int table_sync(struct connman_iptables *table)
+{
+	struct connman_iptables_entry *e;
+	GList *list;
+	unsigned int cnt;
+	int err;
+
+	switch (table->type) {
+	case AF_INET:
+		g_free(table->blob_entries);
+		table->blob_entries = g_try_malloc0(
+					sizeof(struct ipt_get_entries) +
+					table->size);
+		if (!table->blob_entries)
+			return -ENOMEM;
+
+		g_stpcpy(table->blob_entries->name, table->info->name);
+		table->blob_entries->size = table->size;
+
+		table->info->num_entries = table->num_entries;
+		table->info->size = table->size;
+		memcpy(table->info->hook_entry, table->hook_entry,
+					sizeof(table->info->hook_entry));
+		memcpy(table->info->underflow, table->underflow,
+					sizeof(table->info->underflow));
+		break;
+	case AF_INET6:
+		g_free(table->blob_entries6);
+		table->blob_entries6 = g_try_malloc0(
+					sizeof(struct ip6t_get_entries) +
+					table->size);
+		if (!table->blob_entries6)
+			return -ENOMEM;
+
+		g_stpcpy(table->blob_entries6->name, table->info6->name);
+		table->blob_entries6->size = table->size;
+
+		table->info6->num_entries = table->num_entries;
+		table->info6->size = table->size;
+		memcpy(table->info6->hook_entry, table->hook_entry,
+					sizeof(table->info6->hook_entry));
+		memcpy(table->info6->underflow, table->underflow,
+					sizeof(table->info6->underflow));
+		break;
+	default:
+		return -EINVAL;
+	}
+
+	err = iptables_get_entries(table);
+	if (err < 0)
+		return err;
+
+	/* The counters of the kernel are now in the order of the list */
+	for (list = table->entries, cnt = 0; list; list = list->next, cnt++) {
+		e = list->data;
+		e->counter_idx = cnt;
+	}
+
+	table->old_entries = table->num_entries;
+	table->dirty = false;
+
+	return 0;
+}
+
 int __connman_iptables_commit(int type, const char *table_name)
 {
 	struct connman_iptables *table;
@@ -3946,7 +4212,7 @@ int __connman_iptables_commit(int type, const char *table_name)
 	err = iptables_replace(table, &repl);
 
 	if (err < 0)
-		goto out_free;
+		goto out_hash_remove;
 
 	counters = g_try_malloc0(sizeof(*counters) +
 			sizeof(struct xt_counters) * table->num_entries);
@@ -3978,9 +4244,16 @@ int __connman_iptables_commit(int type, const char *table_name)
 	if (err < 0)
 		goto out_hash_remove;
 
-	err = 0;
+	/* The kernel has now what we have, keep it for the next changes */
+	if (table_sync(table) == 0)
+		goto out_free;
 
 out_hash_remove:
+	/*
+	 * The replace fails with EAGAIN when the table has been changed
+	 * in between. Read it again next time, also when it went through
+	 * but the counters or the cache could not be brought along.
+	 */
 	hash_table_remove(type, table_name);
 out_free:
 	if (type == AF_INET && repl.r)
@@ -43,6 +43,11 @@
 
 #define DEFAULT_INPUT_REQUEST_TIMEOUT (120 * 1000)
 #define DEFAULT_BROWSER_LAUNCH_TIMEOUT (300 * 1000)
+#define DEFAULT_DNS_CACHE_SIZE 256
+#define DEFAULT_DNS_CACHE_PREFETCH 10
+#define DEFAULT_DNS_CACHE_SERVE_STALE (24 * 60 * 60)
+#define DEFAULT_SERVICES_CHANGED_INTERVAL 100
+#define DEFAULT_SERVICE_SAVE_DELAY 1000
 
 #define MAINFILE "main.conf"
 #define CONFIGMAINFILE CONFIGDIR "/" MAINFILE
@@ -91,6 +96,16 @@ static struct {
 	bool auto_connect_roaming_services;
 	bool acd;
 	bool use_gateways_as_timeservers;
+	unsigned int dns_cache_size;
+	unsigned int dns_cache_memory;
+	unsigned int dns_cache_prefetch;
+	unsigned int dns_cache_serve_stale;
+	bool dns_cache_persistent;
+	unsigned int services_changed_interval;
+	unsigned int strength_hysteresis;
+	bool compact_service_storage;
+	unsigned int service_save_delay;
+	unsigned int shared_statistics_interval;
 } connman_settings  = {
 	.bg_scan = true,
 	.pref_timeservers = NULL,
@@ -113,6 +128,16 @@ static struct {
 	.auto_connect_roaming_services = false,
 	.acd = false,
 	.use_gateways_as_timeservers = false,
+	.dns_cache_size = DEFAULT_DNS_CACHE_SIZE,
+	.dns_cache_memory = 0,
+	.dns_cache_prefetch = DEFAULT_DNS_CACHE_PREFETCH,
+	.dns_cache_serve_stale = DEFAULT_DNS_CACHE_SERVE_STALE,
+	.dns_cache_persistent = false,
+	.services_changed_interval = DEFAULT_SERVICES_CHANGED_INTERVAL,
+	.strength_hysteresis = 0,
+	.compact_service_storage = false,
+	.service_save_delay = DEFAULT_SERVICE_SAVE_DELAY,
+	.shared_statistics_interval = 0,
 };
 
 #define CONF_BG_SCAN                    "BackgroundScanning"
@@ -136,6 +161,16 @@ static struct {
 #define CONF_AUTO_CONNECT_ROAMING_SERVICES "AutoConnectRoamingServices"
 #define CONF_ACD                        "AddressConflictDetection"
 #define CONF_USE_GATEWAYS_AS_TIMESERVERS "UseGatewaysAsTimeservers"
+#define CONF_DNS_CACHE_SIZE             "DNSCacheSize"
+#define CONF_DNS_CACHE_MEMORY           "DNSCacheMemoryLimit"
+#define CONF_DNS_CACHE_PREFETCH         "DNSCachePrefetchThreshold"
+#define CONF_DNS_CACHE_SERVE_STALE      "DNSCacheServeStale"
+#define CONF_DNS_CACHE_PERSISTENT       "DNSCachePersistent"
+#define CONF_SERVICES_CHANGED_INTERVAL  "ServicesChangedInterval"
+#define CONF_STRENGTH_HYSTERESIS        "ServiceStrengthHysteresis"
+#define CONF_COMPACT_SERVICE_STORAGE    "CompactServiceStorage"
+#define CONF_SERVICE_SAVE_DELAY         "ServiceSaveDelay"
+#define CONF_SHARED_STATISTICS_INTERVAL "SharedStatisticsInterval"
 
 static const char *supported_options[] = {
 	CONF_BG_SCAN,
@@ -158,6 +193,16 @@ static const char *supported_options[] = {
 	CONF_AUTO_CONNECT_ROAMING_SERVICES,
 	CONF_ACD,
 	CONF_USE_GATEWAYS_AS_TIMESERVERS,
+	CONF_DNS_CACHE_SIZE,
+	CONF_DNS_CACHE_MEMORY,
+	CONF_DNS_CACHE_PREFETCH,
+	CONF_DNS_CACHE_SERVE_STALE,
+	CONF_DNS_CACHE_PERSISTENT,
+	CONF_SERVICES_CHANGED_INTERVAL,
+	CONF_STRENGTH_HYSTERESIS,
+	CONF_COMPACT_SERVICE_STORAGE,
+	CONF_SERVICE_SAVE_DELAY,
+	CONF_SHARED_STATISTICS_INTERVAL,
 	NULL
 };
 
@@ -283,6 +328,7 @@ static void parse_config(GKeyFile *config)
         char *vendor_class_id;
 	gsize len;
 	int timeout;
+	int integer;
 
 	if (!config) {
 		connman_settings.auto_connect =
@@ -476,6 +522,76 @@ static void parse_config(GKeyFile *config)
 		connman_settings.use_gateways_as_timeservers = boolean;
 
 	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, "General",
+			CONF_DNS_CACHE_SIZE, &error);
+	if (!error && integer > 0)
+		connman_settings.dns_cache_size = integer;
+
+	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, "General",
+			CONF_DNS_CACHE_MEMORY, &error);
+	if (!error && integer >= 0)
+		connman_settings.dns_cache_memory = integer;
+
+	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, "General",
+			CONF_DNS_CACHE_PREFETCH, &error);
+	if (!error && integer >= 0 && integer < 100)
+		connman_settings.dns_cache_prefetch = integer;
+
+	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, "General",
+			CONF_DNS_CACHE_SERVE_STALE, &error);
+	if (!error && integer >= 0)
+		connman_settings.dns_cache_serve_stale = integer;
+
+	g_clear_error(&error);
+
+	boolean = __connman_config_get_bool(config, "General",
+				CONF_DNS_CACHE_PERSISTENT, &error);
+	if (!error)
+		connman_settings.dns_cache_persistent = boolean;
+
+	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, "General",
+			CONF_SERVICES_CHANGED_INTERVAL, &error);
+	if (!error && integer >= 0)
+		connman_settings.services_changed_interval = integer;
+
+	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, "General",
+			CONF_STRENGTH_HYSTERESIS, &error);
+	if (!error && integer >= 0 && integer <= 100)
+		connman_settings.strength_hysteresis = integer;
+
+	g_clear_error(&error);
+
+	boolean = __connman_config_get_bool(config, "General",
+				CONF_COMPACT_SERVICE_STORAGE, &error);
+	if (!error)
+		connman_settings.compact_service_storage = boolean;
+
+	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, "General",
+			CONF_SERVICE_SAVE_DELAY, &error);
+	if (!error && integer >= 0)
+		connman_settings.service_save_delay = integer;
+
+	g_clear_error(&error);
+
+	integer = g_key_file_get_integer(config, "General",
+			CONF_SHARED_STATISTICS_INTERVAL, &error);
+	if (!error && integer >= 0)
+		connman_settings.shared_statistics_interval = integer;
+
+	g_clear_error(&error);
 }
 
 static int config_init(const char *file)
@@ -695,6 +811,12 @@ bool connman_setting_get_bool(const char *key)
 	if (g_str_equal(key, CONF_USE_GATEWAYS_AS_TIMESERVERS))
 		return connman_settings.use_gateways_as_timeservers;
 
+	if (g_str_equal(key, CONF_DNS_CACHE_PERSISTENT))
+		return connman_settings.dns_cache_persistent;
+
+	if (g_str_equal(key, CONF_COMPACT_SERVICE_STORAGE))
+		return connman_settings.compact_service_storage;
+
 	return false;
 }
 
@@ -732,6 +854,35 @@ unsigned int *connman_setting_get_uint_list(const char *key)
 	return NULL;
 }
 
+unsigned int connman_setting_get_uint(const char *key)
+{
+	if (g_str_equal(key, CONF_DNS_CACHE_SIZE))
+		return connman_settings.dns_cache_size;
+
+	if (g_str_equal(key, CONF_DNS_CACHE_MEMORY))
+		return connman_settings.dns_cache_memory;
+
+	if (g_str_equal(key, CONF_DNS_CACHE_PREFETCH))
+		return connman_settings.dns_cache_prefetch;
+
+	if (g_str_equal(key, CONF_DNS_CACHE_SERVE_STALE))
+		return connman_settings.dns_cache_serve_stale;
+
+	if (g_str_equal(key, CONF_SERVICES_CHANGED_INTERVAL))
+		return connman_settings.services_changed_interval;
+
+	if (g_str_equal(key, CONF_STRENGTH_HYSTERESIS))
+		return connman_settings.strength_hysteresis;
+
+	if (g_str_equal(key, CONF_SERVICE_SAVE_DELAY))
+		return connman_settings.service_save_delay;
+
+	if (g_str_equal(key, CONF_SHARED_STATISTICS_INTERVAL))
+		return connman_settings.shared_statistics_interval;
+
+	return 0;
+}
+
 unsigned int connman_timeout_input_request(void)
 {
 	return connman_settings.timeout_inputreq;
@@ -815,6 +966,7 @@ int main(int argc, char *argv[])
 
 	__connman_util_init();
 	__connman_inotify_init();
+	__connman_storage_init(connman_settings.compact_service_storage);
 	__connman_technology_init();
 	__connman_notifier_init();
 	__connman_agent_init();
@@ -837,6 +989,7 @@ int main(int argc, char *argv[])
 
 	__connman_ipconfig_init();
 	__connman_rtnl_init();
+	__connman_stats_shm_init();
 	__connman_task_init();
 	__connman_proxy_init();
 	__connman_detect_init();
@@ -878,6 +1031,7 @@ int main(int argc, char *argv[])
 	__connman_detect_cleanup();
 	__connman_proxy_cleanup();
 	__connman_task_cleanup();
+	__connman_stats_shm_cleanup();
 	__connman_rtnl_cleanup();
 	__connman_resolver_cleanup();
 
@@ -900,6 +1054,7 @@ int main(int argc, char *argv[])
 	__connman_ipconfig_cleanup();
 	__connman_notifier_cleanup();
 	__connman_technology_cleanup();
+	__connman_storage_cleanup();
 	__connman_inotify_cleanup();
 
 	__connman_util_cleanup();
@@ -235,6 +235,52 @@ static DBusMessage *get_tethering_clients(DBusConnection *conn,
 	return reply;
 }
 
+/* The statistics of the subsystems are all returned as one a{sv} dict */
+static DBusMessage *get_statistics(DBusMessage *msg,
+				void (*append)(DBusMessageIter *dict))
+{
+	DBusMessage *reply;
+	DBusMessageIter array, dict;
+
+	DBG("%s", dbus_message_get_member(msg));
+
+	reply = dbus_message_new_method_return(msg);
+	if (!reply)
+		return NULL;
+
+	dbus_message_iter_init_append(reply, &array);
+
+	connman_dbus_dict_open(&array, &dict);
+	append(&dict);
+	connman_dbus_dict_close(&array, &dict);
+
+	return reply;
+}
+
+static DBusMessage *get_dnsproxy_statistics(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	return get_statistics(msg, __connman_dnsproxy_append_statistics);
+}
+
+static DBusMessage *get_netlink_statistics(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	return get_statistics(msg, __connman_rtnl_append_statistics);
+}
+
+static DBusMessage *get_service_storage_statistics(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	return get_statistics(msg, __connman_service_append_statistics);
+}
+
+static DBusMessage *get_scan_statistics(DBusConnection *conn,
+					DBusMessage *msg, void *data)
+{
+	return get_statistics(msg, __connman_device_append_statistics);
+}
+
 static DBusMessage *connect_provider(DBusConnection *conn,
 					DBusMessage *msg, void *data)
 {
@@ -543,6 +589,18 @@ static const GDBusMethodTable manager_methods[] = {
 	{ GDBUS_METHOD("GetTetheringClients",
 			NULL, GDBUS_ARGS({ "tethering_clients", "as" }),
 			get_tethering_clients) },
+	{ GDBUS_METHOD("GetDNSProxyStatistics",
+			NULL, GDBUS_ARGS({ "statistics", "a{sv}" }),
+			get_dnsproxy_statistics) },
+	{ GDBUS_METHOD("GetNetlinkStatistics",
+			NULL, GDBUS_ARGS({ "statistics", "a{sv}" }),
+			get_netlink_statistics) },
+	{ GDBUS_METHOD("GetServiceStorageStatistics",
+			NULL, GDBUS_ARGS({ "statistics", "a{sv}" }),
+			get_service_storage_statistics) },
+	{ GDBUS_METHOD("GetScanStatistics",
+			NULL, GDBUS_ARGS({ "statistics", "a{sv}" }),
+			get_scan_statistics) },
 	{ GDBUS_DEPRECATED_ASYNC_METHOD("ConnectProvider",
 			      GDBUS_ARGS({ "provider", "a{sv}" }),
 			      GDBUS_ARGS({ "path", "o" }),
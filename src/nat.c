@@ -173,6 +173,8 @@ static void update_default_interface(struct connman_service *service)
 	g_free(default_interface);
 	default_interface = interface;
 
+	__connman_firewall_begin();
+
 	g_hash_table_iter_init(&iter, nat_hash);
 
 	while (g_hash_table_iter_next(&iter, &key, &value)) {
@@ -184,6 +186,10 @@ static void update_default_interface(struct connman_service *service)
 		if (err < 0)
 			DBG("Failed to enable nat for %s", name);
 	}
+
+	err = __connman_firewall_commit();
+	if (err < 0)
+		connman_warn("Failed to update NAT rules");
 }
 
 static void shutdown_nat(gpointer key, gpointer value, gpointer user_data)
@@ -228,7 +234,10 @@ void __connman_nat_cleanup(void)
 {
 	DBG("");
 
+	__connman_firewall_begin();
 	g_hash_table_foreach(nat_hash, shutdown_nat, NULL);
+	__connman_firewall_commit();
+
 	g_hash_table_destroy(nat_hash);
 	nat_hash = NULL;
 
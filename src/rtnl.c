@@ -59,10 +59,32 @@ struct watch_data {
 static GSList *watch_list = NULL;
 static unsigned int watch_id = 0;
 
-static GSList *update_list = NULL;
-static guint update_interval = G_MAXUINT;
+/*
+ * The update intervals are kept in a timer wheel with one slot per
+ * second. Whenever at least one of them expires in a tick, the link
+ * statistics of the interfaces in update_index_table are requested,
+ * so intervals which expire together share the requests.
+ */
+#define UPDATE_WHEEL_SIZE 64
+
+struct update_data {
+	unsigned int id;
+	unsigned int interval;
+	unsigned int rounds;
+	unsigned int slot;
+	connman_rtnl_update_cb_t callback;
+	void *user_data;
+};
+
+static GSList *update_wheel[UPDATE_WHEEL_SIZE];
+static unsigned int update_slot = 0;
+static GHashTable *update_table = NULL;
+static unsigned int update_id = 0;
 static guint update_timeout = 0;
 
+/* index -> number of users which need its statistics */
+static GHashTable *update_index_table = NULL;
+
 struct interface_data {
 	int index;
 	char *ident;
@@ -363,12 +385,26 @@ static const char *operstate2str(unsigned char operstate)
 	return "";
 }
 
+static void widen_link_stats(struct rtnl_link_stats64 *stats,
+					const struct rtnl_link_stats *stats32)
+{
+	stats->rx_packets = stats32->rx_packets;
+	stats->tx_packets = stats32->tx_packets;
+	stats->rx_bytes = stats32->rx_bytes;
+	stats->tx_bytes = stats32->tx_bytes;
+	stats->rx_errors = stats32->rx_errors;
+	stats->tx_errors = stats32->tx_errors;
+	stats->rx_dropped = stats32->rx_dropped;
+	stats->tx_dropped = stats32->tx_dropped;
+}
+
 static bool extract_link(struct ifinfomsg *msg, int bytes,
 				struct ether_addr *address, const char **ifname,
 				unsigned int *mtu, unsigned char *operstate,
-				struct rtnl_link_stats *stats)
+				struct rtnl_link_stats64 *stats)
 {
 	struct rtattr *attr;
+	bool stats64 = false;
 
 	for (attr = IFLA_RTA(msg); RTA_OK(attr, bytes);
 					attr = RTA_NEXT(attr, bytes)) {
@@ -385,10 +421,18 @@ static bool extract_link(struct ifinfomsg *msg, int bytes,
 			if (mtu)
 				*mtu = *((unsigned int *) RTA_DATA(attr));
 			break;
-		case IFLA_STATS:
-			if (stats)
+		case IFLA_STATS64:
+			if (stats) {
+				memset(stats, 0, sizeof(*stats));
 				memcpy(stats, RTA_DATA(attr),
-					sizeof(struct rtnl_link_stats));
+					MIN(RTA_PAYLOAD(attr), sizeof(*stats)));
+				stats64 = true;
+			}
+			break;
+		case IFLA_STATS:
+			/* only for kernels which do not send IFLA_STATS64 */
+			if (stats && !stats64)
+				widen_link_stats(stats, RTA_DATA(attr));
 			break;
 		case IFLA_OPERSTATE:
 			if (operstate)
@@ -408,7 +452,7 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 			unsigned change, struct ifinfomsg *msg, int bytes)
 {
 	struct ether_addr address = {{ 0, 0, 0, 0, 0, 0 }};
-	struct rtnl_link_stats stats;
+	struct rtnl_link_stats64 stats;
 	unsigned char operstate = 0xff;
 	struct interface_data *interface;
 	const char *ifname = NULL;
@@ -508,7 +552,7 @@ static void process_newlink(unsigned short type, int index, unsigned flags,
 static void process_dellink(unsigned short type, int index, unsigned flags,
 			unsigned change, struct ifinfomsg *msg, int bytes)
 {
-	struct rtnl_link_stats stats;
+	struct rtnl_link_stats64 stats;
 	unsigned char operstate = 0xff;
 	const char *ifname = NULL;
 	GSList *list;
@@ -917,6 +961,9 @@ static void rtnl_link(struct nlmsghdr *hdr)
 		case IFLA_STATS:
 			print_attr(attr, "stats");
 			break;
+		case IFLA_STATS64:
+			print_attr(attr, "stats64");
+			break;
 		case IFLA_COST:
 			print_attr(attr, "cost");
 			break;
@@ -1306,13 +1353,31 @@ static guint channel_watch = 0;
 
 struct rtnl_request {
 	struct nlmsghdr hdr;
-	struct rtgenmsg msg;
+	union {
+		struct rtgenmsg msg;
+		struct ifinfomsg ifi;
+	};
 };
 #define RTNL_REQUEST_SIZE  (sizeof(struct nlmsghdr) + sizeof(struct rtgenmsg))
+#define RTNL_LINK_REQUEST_SIZE  (sizeof(struct nlmsghdr) + \
+					sizeof(struct ifinfomsg))
 
 static GSList *request_list = NULL;
 static guint32 request_seq = 0;
 
+static unsigned char *netlink_buf = NULL;
+static size_t netlink_buf_len = 0;
+
+static struct {
+	uint64_t messages;
+	uint64_t receive_calls;
+	uint64_t overruns;
+	uint64_t resyncs;
+} netlink_stats;
+
+static void rtnl_resync(void);
+static bool dump_refused(guint32 seq);
+
 static struct rtnl_request *find_request(guint32 seq)
 {
 	GSList *list;
@@ -1401,6 +1466,15 @@ static void rtnl_message(void *buf, size_t len)
 			err = NLMSG_DATA(hdr);
 			DBG("error %d (%s)", -err->error,
 						strerror(-err->error));
+			/*
+			 * A dump is refused while the one aborted by a resync
+			 * is still running, its end sends the request again.
+			 */
+			if (err->error == -EBUSY && dump_refused(hdr->nlmsg_seq))
+				return;
+			/* acks and errors also complete a request */
+			if (find_request(hdr->nlmsg_seq))
+				process_response(hdr->nlmsg_seq);
 			return;
 		case RTM_NEWLINK:
 			rtnl_newlink(hdr);
@@ -1432,38 +1506,70 @@ static void rtnl_message(void *buf, size_t len)
 
 static gboolean netlink_event(GIOChannel *chan, GIOCondition cond, gpointer data)
 {
-	unsigned char buf[4096];
 	struct sockaddr_nl nladdr;
-	socklen_t addr_len = sizeof(nladdr);
+	socklen_t addr_len;
 	ssize_t status;
+	bool overrun = false;
 	int fd;
 
 	if (cond & (G_IO_NVAL | G_IO_HUP | G_IO_ERR))
 		return FALSE;
 
-	memset(buf, 0, sizeof(buf));
-	memset(&nladdr, 0, sizeof(nladdr));
-
 	fd = g_io_channel_unix_get_fd(chan);
 
-	status = recvfrom(fd, buf, sizeof(buf), 0,
-                       (struct sockaddr *) &nladdr, &addr_len);
-	if (status < 0) {
-		if (errno == EINTR || errno == EAGAIN)
-			return TRUE;
+	/* Read until the socket is empty, a burst is handled in one go */
+	while (1) {
+		/* Peek at the size of the next message to fit it completely */
+		status = recv(fd, NULL, 0, MSG_PEEK | MSG_TRUNC | MSG_DONTWAIT);
+		netlink_stats.receive_calls++;
 
-		return FALSE;
-	}
+		if (status > 0 && (size_t) status > netlink_buf_len) {
+			netlink_buf_len = status;
+			netlink_buf = g_realloc(netlink_buf, netlink_buf_len);
+		}
 
-	if (status == 0)
-		return FALSE;
+		if (status >= 0) {
+			memset(&nladdr, 0, sizeof(nladdr));
+			addr_len = sizeof(nladdr);
+
+			status = recvfrom(fd, netlink_buf, netlink_buf_len,
+					MSG_DONTWAIT, (struct sockaddr *) &nladdr,
+					&addr_len);
+			netlink_stats.receive_calls++;
+		}
+
+		if (status < 0) {
+			if (errno == EINTR)
+				continue;
+
+			/* Messages were dropped, the socket is usable again */
+			if (errno == ENOBUFS) {
+				netlink_stats.overruns++;
+				overrun = true;
+				continue;
+			}
+
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+
+			return FALSE;
+		}
+
+		if (status == 0)
+			return FALSE;
 
-	if (nladdr.nl_pid != 0) { /* not sent by kernel, ignore */
-		DBG("Received msg from %u, ignoring it", nladdr.nl_pid);
-		return TRUE;
+		if (nladdr.nl_pid != 0) { /* not sent by kernel, ignore */
+			DBG("Received msg from %u, ignoring it", nladdr.nl_pid);
+			continue;
+		}
+
+		netlink_stats.messages++;
+
+		rtnl_message(netlink_buf, status);
 	}
 
-	rtnl_message(buf, status);
+	if (overrun)
+		rtnl_resync();
 
 	return TRUE;
 }
@@ -1488,6 +1594,31 @@ static int send_getlink(void)
 	return queue_request(req);
 }
 
+/*
+ * Request a single link, the reply is processed like any other
+ * RTM_NEWLINK. The ack completes the request in the queue.
+ */
+static int send_getlink_index(int index)
+{
+	struct rtnl_request *req;
+
+	DBG("index %d", index);
+
+	req = g_try_malloc0(RTNL_LINK_REQUEST_SIZE);
+	if (!req)
+		return -ENOMEM;
+
+	req->hdr.nlmsg_len = RTNL_LINK_REQUEST_SIZE;
+	req->hdr.nlmsg_type = RTM_GETLINK;
+	req->hdr.nlmsg_flags = NLM_F_REQUEST | NLM_F_ACK;
+	req->hdr.nlmsg_pid = 0;
+	req->hdr.nlmsg_seq = request_seq++;
+	req->ifi.ifi_family = AF_UNSPEC;
+	req->ifi.ifi_index = index;
+
+	return queue_request(req);
+}
+
 static int send_getaddr(void)
 {
 	struct rtnl_request *req;
@@ -1528,76 +1659,226 @@ static int send_getroute(void)
 	return queue_request(req);
 }
 
-static gboolean update_timeout_cb(gpointer user_data)
+static void update_schedule(struct update_data *update)
 {
-	__connman_rtnl_request_update();
+	update->slot = (update_slot + update->interval) % UPDATE_WHEEL_SIZE;
+	update->rounds = (update->interval - 1) / UPDATE_WHEEL_SIZE;
 
-	return TRUE;
+	update_wheel[update->slot] = g_slist_prepend(update_wheel[update->slot],
+								update);
 }
 
-static void update_interval_callback(guint min)
+static bool dump_refused(guint32 seq)
 {
-	if (update_timeout > 0)
-		g_source_remove(update_timeout);
+	struct rtnl_request *req = g_slist_nth_data(request_list, 0);
 
-	if (min < G_MAXUINT) {
-		update_interval = min;
-		update_timeout = g_timeout_add_seconds(update_interval,
-						update_timeout_cb, NULL);
-	} else {
-		update_timeout = 0;
-		update_interval = G_MAXUINT;
+	return req && req->hdr.nlmsg_seq == seq &&
+				req->hdr.nlmsg_flags & NLM_F_DUMP;
+}
+
+static bool dump_queued(uint16_t type)
+{
+	GSList *list;
+
+	for (list = request_list; list; list = list->next) {
+		struct rtnl_request *req = list->data;
+
+		if (req->hdr.nlmsg_type == type &&
+				req->hdr.nlmsg_flags & NLM_F_DUMP)
+			return true;
 	}
+
+	return false;
 }
 
-static gint compare_interval(gconstpointer a, gconstpointer b)
+/*
+ * The kernel dropped messages because the socket buffer was full, so
+ * links, addresses and routes may be out of date. Dump all of them
+ * again, unless such dumps are waiting in the queue anyway.
+ *
+ * The answer to the request in flight may be lost too, and the queue
+ * would wait for it forever. A dump in flight is dropped since it is
+ * requested again, any other request is sent again with a new
+ * sequence number so that what is left of the old answer is ignored.
+ */
+static void rtnl_resync(void)
 {
-	guint val_a = GPOINTER_TO_UINT(a);
-	guint val_b = GPOINTER_TO_UINT(b);
+	struct rtnl_request *req;
+	bool resend;
+
+	connman_warn("Netlink messages lost, resynchronizing");
+
+	netlink_stats.resyncs++;
+
+	req = g_slist_nth_data(request_list, 0);
+	if (req && req->hdr.nlmsg_flags & NLM_F_DUMP) {
+		request_list = g_slist_remove(request_list, req);
+		g_free(req);
+	} else if (req)
+		req->hdr.nlmsg_seq = request_seq++;
+
+	/* otherwise the first new dump is sent when it is queued */
+	resend = request_list != NULL;
+
+	if (!dump_queued(RTM_GETLINK))
+		send_getlink();
+
+	if (!dump_queued(RTM_GETADDR))
+		send_getaddr();
+
+	if (!dump_queued(RTM_GETROUTE))
+		send_getroute();
 
-	return val_a - val_b;
+	if (resend)
+		send_request(request_list->data);
 }
 
-unsigned int __connman_rtnl_update_interval_add(unsigned int interval)
+void __connman_rtnl_append_statistics(DBusMessageIter *dict)
 {
-	guint min;
+	dbus_uint64_t messages = netlink_stats.messages;
+	dbus_uint64_t receive_calls = netlink_stats.receive_calls;
+	dbus_uint64_t overruns = netlink_stats.overruns;
+	dbus_uint64_t resyncs = netlink_stats.resyncs;
+
+	connman_dbus_dict_append_basic(dict, "Messages",
+					DBUS_TYPE_UINT64, &messages);
+	connman_dbus_dict_append_basic(dict, "ReceiveCalls",
+					DBUS_TYPE_UINT64, &receive_calls);
+	connman_dbus_dict_append_basic(dict, "Overruns",
+					DBUS_TYPE_UINT64, &overruns);
+	connman_dbus_dict_append_basic(dict, "Resyncs",
+					DBUS_TYPE_UINT64, &resyncs);
+}
 
-	if (interval == 0)
-		return 0;
+static gboolean update_timeout_cb(gpointer user_data)
+{
+	GSList *list, *slot;
+	bool expired = false;
 
-	update_list = g_slist_insert_sorted(update_list,
-			GUINT_TO_POINTER(interval), compare_interval);
+	update_slot = (update_slot + 1) % UPDATE_WHEEL_SIZE;
 
-	min = GPOINTER_TO_UINT(g_slist_nth_data(update_list, 0));
-	if (min < update_interval) {
-		update_interval_callback(min);
-		__connman_rtnl_request_update();
+	slot = update_wheel[update_slot];
+	update_wheel[update_slot] = NULL;
+
+	for (list = slot; list; list = list->next) {
+		struct update_data *update = list->data;
+
+		if (update->rounds > 0) {
+			update->rounds--;
+			update_wheel[update_slot] = g_slist_prepend(
+					update_wheel[update_slot], update);
+			continue;
+		}
+
+		update_schedule(update);
+		expired = true;
+
+		if (update->callback)
+			update->callback(update->user_data);
 	}
 
-	return update_interval;
+	g_slist_free(slot);
+
+	if (expired)
+		__connman_rtnl_request_update();
+
+	return TRUE;
 }
 
-unsigned int __connman_rtnl_update_interval_remove(unsigned int interval)
+unsigned int __connman_rtnl_update_interval_add(unsigned int interval,
+					connman_rtnl_update_cb_t callback,
+					void *user_data)
 {
-	guint min = G_MAXUINT;
+	struct update_data *update;
 
 	if (interval == 0)
 		return 0;
 
-	update_list = g_slist_remove(update_list, GINT_TO_POINTER(interval));
+	update = g_try_new0(struct update_data, 1);
+	if (!update)
+		return 0;
+
+	update->id = ++update_id;
+	update->interval = interval;
+	update->callback = callback;
+	update->user_data = user_data;
 
-	if (update_list)
-		min = GPOINTER_TO_UINT(g_slist_nth_data(update_list, 0));
+	g_hash_table_insert(update_table, GUINT_TO_POINTER(update->id),
+								update);
+	update_schedule(update);
 
-	if (min > update_interval)
-		update_interval_callback(min);
+	if (update_timeout == 0)
+		update_timeout = g_timeout_add_seconds(1, update_timeout_cb,
+									NULL);
 
-	return min;
+	__connman_rtnl_request_update();
+
+	return update->id;
+}
+
+void __connman_rtnl_update_interval_remove(unsigned int id)
+{
+	struct update_data *update;
+
+	update = g_hash_table_lookup(update_table, GUINT_TO_POINTER(id));
+	if (!update)
+		return;
+
+	update_wheel[update->slot] = g_slist_remove(update_wheel[update->slot],
+								update);
+	g_hash_table_remove(update_table, GUINT_TO_POINTER(id));
+
+	if (g_hash_table_size(update_table) == 0 && update_timeout > 0) {
+		g_source_remove(update_timeout);
+		update_timeout = 0;
+	}
+}
+
+void __connman_rtnl_update_index_add(int index)
+{
+	unsigned int count;
+
+	if (index < 0)
+		return;
+
+	count = GPOINTER_TO_UINT(g_hash_table_lookup(update_index_table,
+						GINT_TO_POINTER(index)));
+	g_hash_table_replace(update_index_table, GINT_TO_POINTER(index),
+						GUINT_TO_POINTER(count + 1));
+}
+
+void __connman_rtnl_update_index_remove(int index)
+{
+	unsigned int count;
+
+	if (index < 0)
+		return;
+
+	count = GPOINTER_TO_UINT(g_hash_table_lookup(update_index_table,
+						GINT_TO_POINTER(index)));
+	if (count > 1)
+		g_hash_table_replace(update_index_table,
+						GINT_TO_POINTER(index),
+						GUINT_TO_POINTER(count - 1));
+	else
+		g_hash_table_remove(update_index_table,
+						GINT_TO_POINTER(index));
 }
 
 int __connman_rtnl_request_update(void)
 {
-	return send_getlink();
+	GHashTableIter iter;
+	gpointer key;
+	int err = 0;
+
+	g_hash_table_iter_init(&iter, update_index_table);
+	while (g_hash_table_iter_next(&iter, &key, NULL)) {
+		err = send_getlink_index(GPOINTER_TO_INT(key));
+		if (err < 0)
+			break;
+	}
+
+	return err < 0 ? err : 0;
 }
 
 int __connman_rtnl_init(void)
@@ -1610,6 +1891,10 @@ int __connman_rtnl_init(void)
 	interface_list = g_hash_table_new_full(g_direct_hash, g_direct_equal,
 							NULL, free_interface);
 
+	update_table = g_hash_table_new_full(g_direct_hash, g_direct_equal,
+							NULL, g_free);
+	update_index_table = g_hash_table_new(g_direct_hash, g_direct_equal);
+
 	sk = socket(PF_NETLINK, SOCK_DGRAM | SOCK_CLOEXEC, NETLINK_ROUTE);
 	if (sk < 0)
 		return -1;
@@ -1650,6 +1935,7 @@ void __connman_rtnl_start(void)
 void __connman_rtnl_cleanup(void)
 {
 	GSList *list;
+	int i;
 
 	DBG("");
 
@@ -1665,8 +1951,21 @@ void __connman_rtnl_cleanup(void)
 	g_slist_free(watch_list);
 	watch_list = NULL;
 
-	g_slist_free(update_list);
-	update_list = NULL;
+	if (update_timeout > 0) {
+		g_source_remove(update_timeout);
+		update_timeout = 0;
+	}
+
+	for (i = 0; i < UPDATE_WHEEL_SIZE; i++) {
+		g_slist_free(update_wheel[i]);
+		update_wheel[i] = NULL;
+	}
+
+	g_hash_table_destroy(update_table);
+	update_table = NULL;
+
+	g_hash_table_destroy(update_index_table);
+	update_index_table = NULL;
 
 	for (list = request_list; list; list = list->next) {
 		struct rtnl_request *req = list->data;
@@ -1693,5 +1992,9 @@ void __connman_rtnl_cleanup(void)
 
 	channel = NULL;
 
+	g_free(netlink_buf);
+	netlink_buf = NULL;
+	netlink_buf_len = 0;
+
 	g_hash_table_destroy(interface_list);
 }
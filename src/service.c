@@ -24,6 +24,7 @@
 #endif
 
 #include <errno.h>
+#include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
 #include <netdb.h>
@@ -41,17 +42,43 @@
 
 static DBusConnection *connection = NULL;
 
+/*
+ * The services are kept sorted in service_sequence, so that a service
+ * whose state, strength or favorite setting changed can be moved to
+ * its new place in O(log n). service_list has the same order and is
+ * made of the list links embedded in the services.
+ */
+static GSequence *service_sequence = NULL;
 static GList *service_list = NULL;
+static bool service_list_moved = false;
 static GHashTable *service_hash = NULL;
 static GSList *counter_list = NULL;
 static unsigned int autoconnect_id = 0;
 static unsigned int vpn_autoconnect_id = 0;
 static struct connman_service *current_default = NULL;
 static bool services_dirty = false;
+static unsigned int services_changed_interval;
+static unsigned int strength_hysteresis;
+
+/*
+ * Services whose settings have changed but are not written yet. They
+ * are written together once save_delay has passed since the first
+ * change, so a burst of property changes costs a single write.
+ */
+static GHashTable *pending_saves = NULL;
+static unsigned int save_delay;
+static guint save_timeout = 0;
+
+static struct {
+	uint64_t requests;
+	uint64_t writes;
+	uint64_t avoided;
+} save_stats;
 
 struct connman_stats {
 	bool valid;
 	bool enabled;
+	int index;
 	struct connman_stats_data data_last;
 	struct connman_stats_data data;
 	GTimer *timer;
@@ -59,6 +86,7 @@ struct connman_stats {
 
 struct connman_stats_counter {
 	bool append_all;
+	bool due;	/* the interval expired, send Usage with the reply */
 	struct connman_stats stats;
 	struct connman_stats stats_roaming;
 };
@@ -135,8 +163,18 @@ struct connman_service {
 	bool hidden_service;
 	char *config_file;
 	char *config_entry;
+	uint64_t sort_key;
+	char *sort_name;	/* the name as of the last sort, for ties */
+	uint8_t strength_reported; /* last one clients have seen */
+	GSequenceIter *sort_iter;
+	GList sort_link;
 };
 
+static void service_list_unlink(struct connman_service *service);
+static void service_list_link(struct connman_service *service,
+				struct connman_service *next);
+static void service_list_reposition(struct connman_service *service);
+
 static bool allow_property_changed(struct connman_service *service);
 
 static struct connman_ipconfig *create_ip4config(struct connman_service *service,
@@ -371,6 +409,8 @@ static void set_split_routing(struct connman_service *service, bool value)
 		service->order = 0;
 	else
 		service->order = 10;
+
+	service_list_reposition(service);
 }
 
 int __connman_service_load_modifiable(struct connman_service *service)
@@ -611,7 +651,7 @@ done:
 	return err;
 }
 
-static int service_save(struct connman_service *service)
+static int service_write(struct connman_service *service)
 {
 	GKeyFile *keyfile;
 	gchar *str;
@@ -619,15 +659,14 @@ static int service_save(struct connman_service *service)
 	const char *cst_str = NULL;
 	int err = 0;
 
-	DBG("service %p new %d", service, service->new_service);
-
-	if (service->new_service)
-		return -ESRCH;
+	DBG("service %p", service);
 
 	keyfile = __connman_storage_open_service(service->identifier);
 	if (!keyfile)
 		return -EIO;
 
+	save_stats.writes++;
+
 	if (service->name)
 		g_key_file_set_string(keyfile, service->identifier,
 						"Name", service->name);
@@ -810,6 +849,105 @@ done:
 	return err;
 }
 
+static gboolean save_timeout_cb(gpointer user_data)
+{
+	save_timeout = 0;
+
+	__connman_service_flush_saves();
+
+	return FALSE;
+}
+
+static int service_save(struct connman_service *service)
+{
+	DBG("service %p new %d", service, service->new_service);
+
+	if (service->new_service)
+		return -ESRCH;
+
+	save_stats.requests++;
+
+	if (save_delay == 0)
+		return service_write(service);
+
+	if (g_hash_table_contains(pending_saves, service)) {
+		save_stats.avoided++;
+		return 0;
+	}
+
+	g_hash_table_add(pending_saves, service);
+
+	if (!save_timeout)
+		save_timeout = g_timeout_add(save_delay, save_timeout_cb,
+									NULL);
+
+	return 0;
+}
+
+static bool service_take_save(struct connman_service *service)
+{
+	if (!pending_saves || !g_hash_table_remove(pending_saves, service))
+		return false;
+
+	if (save_timeout && g_hash_table_size(pending_saves) == 0) {
+		g_source_remove(save_timeout);
+		save_timeout = 0;
+	}
+
+	return true;
+}
+
+static void service_flush_save(struct connman_service *service)
+{
+	if (service_take_save(service))
+		service_write(service);
+}
+
+/*
+ * Drop a delayed save without writing it, for when the settings of
+ * the service are about to be removed from the storage.
+ */
+void __connman_service_cancel_save(struct connman_service *service)
+{
+	if (service_take_save(service))
+		DBG("service %p save cancelled", service);
+}
+
+void __connman_service_flush_saves(void)
+{
+	GList *services, *list;
+
+	if (save_timeout) {
+		g_source_remove(save_timeout);
+		save_timeout = 0;
+	}
+
+	if (!pending_saves || g_hash_table_size(pending_saves) == 0)
+		return;
+
+	services = g_hash_table_get_keys(pending_saves);
+	g_hash_table_remove_all(pending_saves);
+
+	for (list = services; list; list = list->next)
+		service_write(list->data);
+
+	g_list_free(services);
+}
+
+void __connman_service_append_statistics(DBusMessageIter *dict)
+{
+	dbus_uint64_t requests = save_stats.requests;
+	dbus_uint64_t writes = save_stats.writes;
+	dbus_uint64_t avoided = save_stats.avoided;
+
+	connman_dbus_dict_append_basic(dict, "SaveRequests",
+					DBUS_TYPE_UINT64, &requests);
+	connman_dbus_dict_append_basic(dict, "Writes",
+					DBUS_TYPE_UINT64, &writes);
+	connman_dbus_dict_append_basic(dict, "WritesAvoided",
+					DBUS_TYPE_UINT64, &avoided);
+}
+
 void __connman_service_save(struct connman_service *service)
 {
 	if (!service)
@@ -1424,6 +1562,11 @@ static void stats_start(struct connman_service *service)
 	if (!stats->timer)
 		return;
 
+	if (!stats->enabled) {
+		stats->index = __connman_service_get_index(service);
+		__connman_rtnl_update_index_add(stats->index);
+	}
+
 	stats->enabled = true;
 	stats->data_last.time = stats->data.time;
 
@@ -1448,6 +1591,8 @@ static void stats_stop(struct connman_service *service)
 	seconds = g_timer_elapsed(stats->timer, NULL);
 	stats->data.time = stats->data_last.time + seconds;
 
+	__connman_rtnl_update_index_remove(stats->index);
+
 	stats->enabled = false;
 }
 
@@ -1572,6 +1717,8 @@ static void strength_changed(struct connman_service *service)
 	connman_dbus_property_changed_basic(service->path,
 				CONNMAN_SERVICE_INTERFACE, "Strength",
 					DBUS_TYPE_BYTE, &service->strength);
+
+	service->strength_reported = service->strength;
 }
 
 static void favorite_changed(struct connman_service *service)
@@ -2182,49 +2329,49 @@ static void stats_append_counters(DBusMessageIter *dict,
 	if (counters->rx_packets != stats->rx_packets || append_all) {
 		counters->rx_packets = stats->rx_packets;
 		connman_dbus_dict_append_basic(dict, "RX.Packets",
-					DBUS_TYPE_UINT32, &stats->rx_packets);
+					DBUS_TYPE_UINT64, &stats->rx_packets);
 	}
 
 	if (counters->tx_packets != stats->tx_packets || append_all) {
 		counters->tx_packets = stats->tx_packets;
 		connman_dbus_dict_append_basic(dict, "TX.Packets",
-					DBUS_TYPE_UINT32, &stats->tx_packets);
+					DBUS_TYPE_UINT64, &stats->tx_packets);
 	}
 
 	if (counters->rx_bytes != stats->rx_bytes || append_all) {
 		counters->rx_bytes = stats->rx_bytes;
 		connman_dbus_dict_append_basic(dict, "RX.Bytes",
-					DBUS_TYPE_UINT32, &stats->rx_bytes);
+					DBUS_TYPE_UINT64, &stats->rx_bytes);
 	}
 
 	if (counters->tx_bytes != stats->tx_bytes || append_all) {
 		counters->tx_bytes = stats->tx_bytes;
 		connman_dbus_dict_append_basic(dict, "TX.Bytes",
-					DBUS_TYPE_UINT32, &stats->tx_bytes);
+					DBUS_TYPE_UINT64, &stats->tx_bytes);
 	}
 
 	if (counters->rx_errors != stats->rx_errors || append_all) {
 		counters->rx_errors = stats->rx_errors;
 		connman_dbus_dict_append_basic(dict, "RX.Errors",
-					DBUS_TYPE_UINT32, &stats->rx_errors);
+					DBUS_TYPE_UINT64, &stats->rx_errors);
 	}
 
 	if (counters->tx_errors != stats->tx_errors || append_all) {
 		counters->tx_errors = stats->tx_errors;
 		connman_dbus_dict_append_basic(dict, "TX.Errors",
-					DBUS_TYPE_UINT32, &stats->tx_errors);
+					DBUS_TYPE_UINT64, &stats->tx_errors);
 	}
 
 	if (counters->rx_dropped != stats->rx_dropped || append_all) {
 		counters->rx_dropped = stats->rx_dropped;
 		connman_dbus_dict_append_basic(dict, "RX.Dropped",
-					DBUS_TYPE_UINT32, &stats->rx_dropped);
+					DBUS_TYPE_UINT64, &stats->rx_dropped);
 	}
 
 	if (counters->tx_dropped != stats->tx_dropped || append_all) {
 		counters->tx_dropped = stats->tx_dropped;
 		connman_dbus_dict_append_basic(dict, "TX.Dropped",
-					DBUS_TYPE_UINT32, &stats->tx_dropped);
+					DBUS_TYPE_UINT64, &stats->tx_dropped);
 	}
 
 	if (counters->time != stats->time || append_all) {
@@ -2273,10 +2420,10 @@ static void stats_append(struct connman_service *service,
 }
 
 static void stats_update(struct connman_service *service,
-				unsigned int rx_packets, unsigned int tx_packets,
-				unsigned int rx_bytes, unsigned int tx_bytes,
-				unsigned int rx_errors, unsigned int tx_errors,
-				unsigned int rx_dropped, unsigned int tx_dropped)
+				uint64_t rx_packets, uint64_t tx_packets,
+				uint64_t rx_bytes, uint64_t tx_bytes,
+				uint64_t rx_errors, uint64_t tx_errors,
+				uint64_t rx_dropped, uint64_t tx_dropped)
 {
 	struct connman_stats *stats = stats_get(service);
 	struct connman_stats_data *data_last = &stats->data_last;
@@ -2317,13 +2464,16 @@ static void stats_update(struct connman_service *service,
 
 	seconds = g_timer_elapsed(stats->timer, NULL);
 	stats->data.time = stats->data_last.time + seconds;
+
+	__connman_stats_shm_update(service->identifier, service->roaming,
+								data);
 }
 
 void __connman_service_notify(struct connman_service *service,
-			unsigned int rx_packets, unsigned int tx_packets,
-			unsigned int rx_bytes, unsigned int tx_bytes,
-			unsigned int rx_errors, unsigned int tx_errors,
-			unsigned int rx_dropped, unsigned int tx_dropped)
+			uint64_t rx_packets, uint64_t tx_packets,
+			uint64_t rx_bytes, uint64_t tx_bytes,
+			uint64_t rx_errors, uint64_t tx_errors,
+			uint64_t rx_dropped, uint64_t tx_dropped)
 {
 	GHashTableIter iter;
 	gpointer key, value;
@@ -2355,8 +2505,12 @@ void __connman_service_notify(struct connman_service *service,
 		counter = key;
 		counters = value;
 
+		if (!counters->append_all && !counters->due)
+			continue;
+
 		stats_append(service, counter, counters, counters->append_all);
 		counters->append_all = false;
+		counters->due = false;
 	}
 }
 
@@ -2402,6 +2556,29 @@ void __connman_service_counter_unregister(const char *counter)
 	counter_list = g_slist_remove(counter_list, counter);
 }
 
+/*
+ * The statistics of the connected services are requested now, mark
+ * them so that the replies are sent to this counter.
+ */
+void __connman_service_counter_due(const char *counter)
+{
+	struct connman_stats_counter *counters;
+	struct connman_service *service;
+	GList *list;
+
+	for (list = service_list; list; list = list->next) {
+		service = list->data;
+
+		if (!is_connected(service->state))
+			continue;
+
+		counters = g_hash_table_lookup(service->counter_table,
+								counter);
+		if (counters)
+			counters->due = true;
+	}
+}
+
 int connman_service_iterate_services(connman_service_iterate_cb cb,
 							void *user_data)
 {
@@ -4483,6 +4660,7 @@ static void apply_relevant_default_downgrade(struct connman_service *service)
 	if (def_service == service &&
 			def_service->state == CONNMAN_SERVICE_STATE_ONLINE) {
 		def_service->state = CONNMAN_SERVICE_STATE_READY;
+		service_list_reposition(def_service);
 		__connman_notifier_leave_online(def_service->type);
 		state_changed(def_service);
 	}
@@ -4491,20 +4669,23 @@ static void apply_relevant_default_downgrade(struct connman_service *service)
 static void switch_default_service(struct connman_service *default_service,
 		struct connman_service *downgrade_service)
 {
-	struct connman_service *service;
 	GList *src, *dst;
 
 	apply_relevant_default_downgrade(default_service);
-	src = g_list_find(service_list, downgrade_service);
-	dst = g_list_find(service_list, default_service);
+	src = &downgrade_service->sort_link;
+	dst = &default_service->sort_link;
 
 	/* Nothing to do */
 	if (src == dst || src->next == dst)
 		return;
 
-	service = src->data;
-	service_list = g_list_delete_link(service_list, src);
-	service_list = g_list_insert_before(service_list, dst, service);
+	/*
+	 * This order only lasts until the next service moves, then
+	 * service_list follows service_sequence again.
+	 */
+	service_list_unlink(downgrade_service);
+	service_list_link(downgrade_service, default_service);
+	service_list_moved = true;
 
 	downgrade_state(downgrade_service);
 }
@@ -4513,6 +4694,7 @@ static struct _services_notify {
 	int id;
 	GHashTable *add;
 	GHashTable *remove;
+	GPtrArray *sent; /* order of the services in the last signal */
 } *services_notify;
 
 
@@ -4529,6 +4711,8 @@ static void service_append_added_foreach(gpointer data, gpointer user_data)
 	if (g_hash_table_lookup(services_notify->add, service->path)) {
 		DBG("new %s", service->path);
 
+		/* clients see the strength of a new service from here on */
+		service->strength_reported = service->strength;
 		append_struct(service, iter);
 		g_hash_table_remove(services_notify->add, service->path);
 	} else {
@@ -4557,14 +4741,61 @@ static void service_append_removed(DBusMessageIter *iter, void *user_data)
 	g_hash_table_foreach(services_notify->remove, append_removed, iter);
 }
 
+/* Compare service_list with the order last sent and remember it */
+static bool service_order_changed(void)
+{
+	GPtrArray *sent = services_notify->sent;
+	bool changed = false;
+	unsigned int i = 0;
+	GList *list;
+
+	for (list = service_list; list; list = list->next) {
+		struct connman_service *service = list->data;
+
+		if (!service->path)
+			continue;
+
+		if (i == sent->len) {
+			g_ptr_array_add(sent, service);
+			changed = true;
+		} else if (g_ptr_array_index(sent, i) != service) {
+			sent->pdata[i] = service;
+			changed = true;
+		}
+
+		i++;
+	}
+
+	if (i != sent->len) {
+		g_ptr_array_set_size(sent, i);
+		changed = true;
+	}
+
+	return changed;
+}
+
 static gboolean service_send_changed(gpointer data)
 {
 	DBusMessage *signal;
-
-	DBG("");
+	bool order_changed;
 
 	services_notify->id = 0;
 
+	/*
+	 * Changes within the interval may have cancelled each other out,
+	 * e.g. a service moved up and back down again.
+	 */
+	order_changed = service_order_changed();
+
+	DBG("order %s added %u removed %u",
+		order_changed ? "changed" : "unchanged",
+		g_hash_table_size(services_notify->add),
+		g_hash_table_size(services_notify->remove));
+
+	if (!order_changed && g_hash_table_size(services_notify->add) == 0 &&
+			g_hash_table_size(services_notify->remove) == 0)
+		return FALSE;
+
 	signal = dbus_message_new_signal(CONNMAN_MANAGER_PATH,
 			CONNMAN_MANAGER_INTERFACE, "ServicesChanged");
 	if (!signal)
@@ -4589,7 +4820,8 @@ static void service_schedule_changed(void)
 	if (services_notify->id != 0)
 		return;
 
-	services_notify->id = g_timeout_add(100, service_send_changed, NULL);
+	services_notify->id = g_timeout_add(services_changed_interval,
+						service_send_changed, NULL);
 }
 
 static DBusMessage *move_service(DBusConnection *conn,
@@ -4798,6 +5030,8 @@ static void service_free(gpointer user_data)
 
 	DBG("service %p", service);
 
+	service_flush_save(service);
+
 	reply_pending(service, ENOENT);
 
 	if (service->nameservers_timeout) {
@@ -4810,6 +5044,7 @@ static void service_free(gpointer user_data)
 
 	__connman_wispr_stop(service);
 	stats_stop(service);
+	__connman_stats_shm_remove(service->identifier);
 
 	service->path = NULL;
 
@@ -4859,6 +5094,7 @@ static void service_free(gpointer user_data)
 	g_free(service->domainname);
 	g_free(service->pac);
 	g_free(service->name);
+	g_free(service->sort_name);
 	g_free(service->passphrase);
 	g_free(service->identifier);
 	g_free(service->eap);
@@ -4926,6 +5162,8 @@ static void service_initialize(struct connman_service *service)
 
 	service->order = 0;
 
+	service->sort_link.data = service;
+
 	stats_init(service);
 
 	service->provider = NULL;
@@ -5013,127 +5251,286 @@ void connman_service_unref_debug(struct connman_service *service,
 	if (__sync_fetch_and_sub(&service->refcount, 1) != 1)
 		return;
 
-	service_list = g_list_remove(service_list, service);
+	if (service->sort_iter) {
+		g_sequence_remove(service->sort_iter);
+		service->sort_iter = NULL;
+		service_list_unlink(service);
+	}
 
 	__connman_service_disconnect(service);
 
 	g_hash_table_remove(service_hash, service->identifier);
 }
 
-static gint service_compare(gconstpointer a, gconstpointer b)
-{
-	struct connman_service *service_a = (void *) a;
-	struct connman_service *service_b = (void *) b;
-	enum connman_service_state state_a, state_b;
-	bool a_connected, b_connected;
-	gint strength;
-
-	state_a = service_a->state;
-	state_b = service_b->state;
-	a_connected = is_connected(state_a);
-	b_connected = is_connected(state_b);
-
-	if (a_connected && b_connected) {
-		if (service_a->order > service_b->order)
-			return -1;
+/*
+ * Everything service_compare() looks at except the names is packed into
+ * one integer, lower values sort first:
+ *
+ *   bit  40      not connected
+ *   bits 32..39  255 - order, connected services only
+ *   bits 24..31  online, ready, connecting, other states
+ *   bits 16..23  not favorite
+ *   bits  8..15  rank of the type, PreferredTechnologies first
+ *   bits  0.. 7  255 - strength
+ */
+static unsigned int service_type_rank(enum connman_service_type type)
+{
+	static const enum connman_service_type type_order[] = {
+		CONNMAN_SERVICE_TYPE_ETHERNET,
+		CONNMAN_SERVICE_TYPE_WIFI,
+		CONNMAN_SERVICE_TYPE_CELLULAR,
+		CONNMAN_SERVICE_TYPE_BLUETOOTH,
+		CONNMAN_SERVICE_TYPE_VPN,
+		CONNMAN_SERVICE_TYPE_GADGET,
+	};
+	unsigned int *tech_array;
+	unsigned int i;
 
-		if (service_a->order < service_b->order)
-			return 1;
+	tech_array = connman_setting_get_uint_list("PreferredTechnologies");
+	if (tech_array) {
+		for (i = 0; i < 64 && tech_array[i]; i++) {
+			if (tech_array[i] == type)
+				return i;
+		}
 	}
 
-	if (state_a != state_b) {
-		if (a_connected && b_connected) {
-			/* We prefer online over ready state */
-			if (state_a == CONNMAN_SERVICE_STATE_ONLINE)
-				return -1;
+	for (i = 0; i < G_N_ELEMENTS(type_order); i++) {
+		if (type_order[i] == type)
+			return 64 + i;
+	}
 
-			if (state_b == CONNMAN_SERVICE_STATE_ONLINE)
-				return 1;
-		}
+	return 64 + G_N_ELEMENTS(type_order);
+}
 
-		if (a_connected)
-			return -1;
-		if (b_connected)
-			return 1;
+static uint64_t service_sort_key(const struct connman_service *service)
+{
+	uint64_t key = 0;
+	unsigned int state;
 
-		if (is_connecting(state_a))
-			return -1;
-		if (is_connecting(state_b))
-			return 1;
+	switch (service->state) {
+	case CONNMAN_SERVICE_STATE_ONLINE:
+		state = 0;
+		break;
+	case CONNMAN_SERVICE_STATE_READY:
+		state = 1;
+		break;
+	case CONNMAN_SERVICE_STATE_ASSOCIATION:
+	case CONNMAN_SERVICE_STATE_CONFIGURATION:
+		state = 2;
+		break;
+	default:
+		state = 3;
+		break;
 	}
 
-	if (service_a->favorite && !service_b->favorite)
+	if (is_connected(service->state))
+		key |= (uint64_t) (255 - MIN(service->order, 255)) << 32;
+	else
+		key |= (uint64_t) 1 << 40;
+
+	key |= (uint64_t) state << 24;
+	key |= (uint64_t) !service->favorite << 16;
+	key |= (uint64_t) service_type_rank(service->type) << 8;
+	key |= (uint64_t) (255 - service->strength);
+
+	return key;
+}
+
+static gint service_compare_key(uint64_t key_a, const char *name_a,
+				uint64_t key_b, const char *name_b)
+{
+	if (key_a < key_b)
 		return -1;
 
-	if (!service_a->favorite && service_b->favorite)
+	if (key_a > key_b)
 		return 1;
 
-	if (service_a->type != service_b->type) {
-		unsigned int *tech_array;
-		int i;
+	return g_strcmp0(name_a, name_b);
+}
 
-		tech_array = connman_setting_get_uint_list(
-						"PreferredTechnologies");
-		if (tech_array) {
-			for (i = 0; tech_array[i]; i++) {
-				if (tech_array[i] == service_a->type)
-					return -1;
+/*
+ * The sequence must only see values that change when the service is
+ * repositioned, so the name is copied along with the key.
+ */
+static void service_sort_update(struct connman_service *service)
+{
+	service->sort_key = service_sort_key(service);
 
-				if (tech_array[i] == service_b->type)
-					return 1;
-			}
+	if (g_strcmp0(service->sort_name, service->name) != 0) {
+		g_free(service->sort_name);
+		service->sort_name = g_strdup(service->name);
+	}
+}
+
+static gint service_compare(gconstpointer a, gconstpointer b,
+							gpointer user_data)
+{
+	const struct connman_service *service_a = a;
+	const struct connman_service *service_b = b;
+	gint result;
+
+	result = service_compare_key(service_a->sort_key,
+					service_a->sort_name,
+					service_b->sort_key,
+					service_b->sort_name);
+	if (result)
+		return result;
+
+	/* keep the order of equal services stable */
+	return g_strcmp0(service_a->identifier, service_b->identifier);
+}
+
+static void service_list_unlink(struct connman_service *service)
+{
+	GList *link = &service->sort_link;
+
+	if (link->prev)
+		link->prev->next = link->next;
+	else if (service_list == link)
+		service_list = link->next;
+
+	if (link->next)
+		link->next->prev = link->prev;
+
+	link->prev = link->next = NULL;
+}
+
+/* Link service into service_list in front of next, or at the end */
+static void service_list_link(struct connman_service *service,
+				struct connman_service *next)
+{
+	GList *link = &service->sort_link, *prev;
+
+	if (next) {
+		prev = next->sort_link.prev;
+		next->sort_link.prev = link;
+		link->next = &next->sort_link;
+	} else {
+		GSequenceIter *iter;
+
+		iter = g_sequence_iter_prev(service->sort_iter);
+		prev = NULL;
+		if (iter != service->sort_iter) {
+			struct connman_service *last = g_sequence_get(iter);
+
+			prev = &last->sort_link;
 		}
 
-		if (service_a->type == CONNMAN_SERVICE_TYPE_ETHERNET)
-			return -1;
-		if (service_b->type == CONNMAN_SERVICE_TYPE_ETHERNET)
-			return 1;
+		link->next = NULL;
+	}
 
-		if (service_a->type == CONNMAN_SERVICE_TYPE_WIFI)
-			return -1;
-		if (service_b->type == CONNMAN_SERVICE_TYPE_WIFI)
-			return 1;
+	link->prev = prev;
+	if (prev)
+		prev->next = link;
+	else
+		service_list = link;
+}
 
-		if (service_a->type == CONNMAN_SERVICE_TYPE_CELLULAR)
-			return -1;
-		if (service_b->type == CONNMAN_SERVICE_TYPE_CELLULAR)
-			return 1;
+static struct connman_service *service_list_next(
+					struct connman_service *service)
+{
+	GSequenceIter *iter = g_sequence_iter_next(service->sort_iter);
 
-		if (service_a->type == CONNMAN_SERVICE_TYPE_BLUETOOTH)
-			return -1;
-		if (service_b->type == CONNMAN_SERVICE_TYPE_BLUETOOTH)
-			return 1;
+	if (g_sequence_iter_is_end(iter))
+		return NULL;
+
+	return g_sequence_get(iter);
+}
+
+static void service_list_rebuild(void)
+{
+	GSequenceIter *iter;
+	GList *prev = NULL;
+
+	service_list = NULL;
 
-		if (service_a->type == CONNMAN_SERVICE_TYPE_VPN)
-			return -1;
-		if (service_b->type == CONNMAN_SERVICE_TYPE_VPN)
-			return 1;
+	iter = g_sequence_get_begin_iter(service_sequence);
+	while (!g_sequence_iter_is_end(iter)) {
+		struct connman_service *service = g_sequence_get(iter);
+		GList *link = &service->sort_link;
 
-		if (service_a->type == CONNMAN_SERVICE_TYPE_GADGET)
-			return -1;
-		if (service_b->type == CONNMAN_SERVICE_TYPE_GADGET)
-			return 1;
+		link->prev = prev;
+		link->next = NULL;
+		if (prev)
+			prev->next = link;
+		else
+			service_list = link;
+
+		prev = link;
+		iter = g_sequence_iter_next(iter);
 	}
 
-	strength = (gint) service_b->strength - (gint) service_a->strength;
-	if (strength)
-		return strength;
+	service_list_moved = false;
+}
 
-	return g_strcmp0(service_a->name, service_b->name);
+static void service_list_insert(struct connman_service *service)
+{
+	service_sort_update(service);
+	service->sort_iter = g_sequence_insert_sorted(service_sequence,
+						service, service_compare, NULL);
+
+	service_list_link(service, service_list_next(service));
 }
 
-static void service_list_sort(void)
+/*
+ * Move one service whose sort key may have changed to its new place
+ * in the sequence and in service_list.
+ */
+static void service_list_reposition(struct connman_service *service)
 {
-	if (service_list && service_list->next) {
-		service_list = g_list_sort(service_list, service_compare);
+	GList *prev, *next;
+
+	if (!service->sort_iter)
+		return;
+
+	service_sort_update(service);
+
+	g_sequence_sort_changed(service->sort_iter, service_compare, NULL);
+
+	if (service_list_moved) {
+		service_list_rebuild();
+		service_schedule_changed();
+		return;
+	}
+
+	prev = service->sort_link.prev;
+	next = service->sort_link.next;
+
+	service_list_unlink(service);
+	service_list_link(service, service_list_next(service));
+
+	/* ServicesChanged is only needed if the order changed */
+	if (service->sort_link.prev != prev || service->sort_link.next != next)
 		service_schedule_changed();
+}
+
+/* Sort all services again, only needed when many may have changed */
+static void service_list_sort(void)
+{
+	GSequenceIter *iter;
+
+	if (!service_list || !service_list->next)
+		return;
+
+	iter = g_sequence_get_begin_iter(service_sequence);
+	while (!g_sequence_iter_is_end(iter)) {
+		struct connman_service *service = g_sequence_get(iter);
+
+		service_sort_update(service);
+		iter = g_sequence_iter_next(iter);
 	}
+
+	g_sequence_sort(service_sequence, service_compare, NULL);
+	service_list_rebuild();
+
+	service_schedule_changed();
 }
 
 int __connman_service_compare(const struct connman_service *a,
 					const struct connman_service *b)
 {
-	return service_compare(a, b);
+	return service_compare_key(service_sort_key(a), a->name,
+					service_sort_key(b), b->name);
 }
 
 /**
@@ -5287,7 +5684,7 @@ int __connman_service_set_favorite_delayed(struct connman_service *service,
 
 	if (!delay_ordering) {
 
-		service_list_sort();
+		service_list_reposition(service);
 
 		__connman_connection_update_gateway();
 	}
@@ -5541,6 +5938,7 @@ static void request_input_cb(struct connman_service *service,
 		/* It is not relevant to stay on Failure state
 		 * when failing is due to wrong user input */
 		service->state = CONNMAN_SERVICE_STATE_IDLE;
+		service_list_reposition(service);
 
 		if (!service->hidden) {
 			/*
@@ -5821,7 +6219,7 @@ static int service_indicate_state(struct connman_service *service)
 		break;
 	}
 
-	service_list_sort();
+	service_list_reposition(service);
 
 	__connman_connection_update_gateway();
 
@@ -6664,8 +7062,7 @@ static struct connman_service *service_get(const char *identifier)
 
 	service->identifier = g_strdup(identifier);
 
-	service_list = g_list_insert_sorted(service_list, service,
-						service_compare);
+	service_list_insert(service);
 
 	g_hash_table_insert(service_hash, service->identifier, service);
 
@@ -6692,7 +7089,7 @@ static int service_register(struct connman_service *service)
 					service_methods, service_signals,
 							NULL, service, NULL);
 
-	service_list_sort();
+	service_list_reposition(service);
 
 	__connman_connection_update_gateway();
 
@@ -7093,7 +7490,7 @@ static void update_from_network(struct connman_service *service,
 	if (!service->network)
 		service->network = connman_network_ref(network);
 
-	service_list_sort();
+	service_list_reposition(service);
 }
 
 /**
@@ -7235,6 +7632,7 @@ void __connman_service_update_from_network(struct connman_network *network)
 	if (g_strcmp0(service->name, name) != 0) {
 		g_free(service->name);
 		service->name = g_strdup(name);
+		need_sort = true;
 
 		if (allow_property_changed(service))
 			connman_dbus_property_changed_basic(service->path,
@@ -7252,7 +7650,10 @@ void __connman_service_update_from_network(struct connman_network *network)
 	service->strength = strength;
 	need_sort = true;
 
-	strength_changed(service);
+	/* smaller changes are scan noise, not worth waking up clients */
+	if (abs((int) strength - (int) service->strength_reported) >=
+						(int) strength_hysteresis)
+		strength_changed(service);
 
 roaming:
 	roaming = connman_network_get_bool(service->network, "Roaming");
@@ -7273,7 +7674,7 @@ roaming:
 
 sorting:
 	if (need_sort) {
-		service_list_sort();
+		service_list_reposition(service);
 	}
 }
 
@@ -7345,6 +7746,8 @@ __connman_service_create_from_provider(struct connman_provider *provider)
 
 	service->strength = 0;
 
+	service_list_reposition(service);
+
 	if (!service->ipconfig_ipv4)
 		service->ipconfig_ipv4 = create_ip4config(service, index,
 				CONNMAN_IPCONFIG_METHOD_MANUAL);
@@ -7473,17 +7876,34 @@ int __connman_service_init(void)
 
 	service_hash = g_hash_table_new_full(g_str_hash, g_str_equal,
 							NULL, service_free);
+	service_sequence = g_sequence_new(NULL);
 
 	services_notify = g_new0(struct _services_notify, 1);
 	services_notify->remove = g_hash_table_new_full(g_str_hash,
 			g_str_equal, g_free, NULL);
 	services_notify->add = g_hash_table_new(g_str_hash, g_str_equal);
+	services_notify->sent = g_ptr_array_new();
+
+	services_changed_interval =
+		connman_setting_get_uint("ServicesChangedInterval");
+	strength_hysteresis =
+		connman_setting_get_uint("ServiceStrengthHysteresis");
+
+	pending_saves = g_hash_table_new(g_direct_hash, g_direct_equal);
+	save_delay = connman_setting_get_uint("ServiceSaveDelay");
 
 	remove_unprovisioned_services();
 
 	return 0;
 }
 
+static void service_forget_sort_iter(gpointer data, gpointer user_data)
+{
+	struct connman_service *service = data;
+
+	service->sort_iter = NULL;
+}
+
 void __connman_service_cleanup(void)
 {
 	DBG("");
@@ -7500,7 +7920,12 @@ void __connman_service_cleanup(void)
 
 	connman_agent_driver_unregister(&agent_driver);
 
-	g_list_free(service_list);
+	__connman_service_flush_saves();
+
+	/* the services are freed with the hash, after the sequence */
+	g_sequence_foreach(service_sequence, service_forget_sort_iter, NULL);
+	g_sequence_free(service_sequence);
+	service_sequence = NULL;
 	service_list = NULL;
 
 	g_hash_table_destroy(service_hash);
@@ -7516,7 +7941,11 @@ void __connman_service_cleanup(void)
 
 	g_hash_table_destroy(services_notify->remove);
 	g_hash_table_destroy(services_notify->add);
+	g_ptr_array_free(services_notify->sent, TRUE);
 	g_free(services_notify);
 
+	g_hash_table_destroy(pending_saves);
+	pending_saves = NULL;
+
 	dbus_connection_unref(connection);
 }
@@ -479,8 +479,12 @@ static void cleanup_routing_table(struct connman_session *session)
 
 static void update_firewall(struct connman_session *session)
 {
+	__connman_firewall_begin();
+
 	cleanup_firewall_session(session);
 	init_firewall_session(session);
+
+	__connman_firewall_commit();
 }
 
 static void update_routing_table(struct connman_session *session)
@@ -1051,7 +1055,7 @@ int connman_session_config_update(struct connman_session *session)
 	struct session_info *info = session->info;
 	GSList *allowed_bearers;
 	char *allowed_interface;
-	int err;
+	int err, e;
 
 	DBG("session %p", session);
 
@@ -1061,8 +1065,12 @@ int connman_session_config_update(struct connman_session *session)
 	 */
 
 	if (session->id_type != session->policy_config->id_type) {
+		__connman_firewall_begin();
 		cleanup_firewall_session(session);
 		err = init_firewall_session(session);
+		e = __connman_firewall_commit();
+		if (err == 0)
+			err = e;
 		if (err < 0) {
 			connman_session_destroy(session);
 			return err;
@@ -1884,6 +1892,9 @@ static void handle_service_state_online(struct connman_service *service,
 	GHashTableIter iter;
 	gpointer key, value;
 
+	/* the firewall rules of all sessions are committed together */
+	__connman_firewall_begin();
+
 	g_hash_table_iter_init(&iter, session_hash);
 	while (g_hash_table_iter_next(&iter, &key, &value)) {
 		struct connman_session *session = value;
@@ -1908,6 +1919,8 @@ static void handle_service_state_online(struct connman_service *service,
 			update_session_state(session);
 		}
 	}
+
+	__connman_firewall_commit();
 }
 
 static void handle_service_state_offline(struct connman_service *service,
@@ -1915,6 +1928,8 @@ static void handle_service_state_offline(struct connman_service *service,
 {
 	GSList *list;
 
+	__connman_firewall_begin();
+
 	for (list = info->sessions; list; list = list->next) {
 		struct connman_session *session = list->data;
 
@@ -1930,6 +1945,8 @@ static void handle_service_state_offline(struct connman_service *service,
 		update_session_state(session);
 		session_activate(session);
 	}
+
+	__connman_firewall_commit();
 }
 
 static void service_state_changed(struct connman_service *service,
@@ -1981,6 +1998,8 @@ static void ipconfig_changed(struct connman_service *service,
 
 	type = __connman_ipconfig_get_config_type(ipconfig);
 
+	__connman_firewall_begin();
+
 	g_hash_table_iter_init(&iter, session_hash);
 
 	while (g_hash_table_iter_next(&iter, &key, &value)) {
@@ -1999,6 +2018,8 @@ static void ipconfig_changed(struct connman_service *service,
 				ipconfig_ipv6_changed(session);
 		}
 	}
+
+	__connman_firewall_commit();
 }
 
 static const struct connman_notifier session_notifier = {
@@ -2041,8 +2062,12 @@ void __connman_session_cleanup(void)
 	connman_notifier_unregister(&session_notifier);
 
 	g_hash_table_foreach(session_hash, release_session, NULL);
+
+	__connman_firewall_begin();
 	g_hash_table_destroy(session_hash);
 	session_hash = NULL;
+	__connman_firewall_commit();
+
 	g_hash_table_destroy(service_hash);
 	service_hash = NULL;
 
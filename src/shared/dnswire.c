@@ -0,0 +1,409 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2026  Connection Manager contributors.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <string.h>
+#include <arpa/nameser.h>
+
+#include "src/shared/dnswire.h"
+
+/* Guards against compression pointer loops */
+#define MAX_POINTERS 64
+
+void dns_reader_init(struct dns_reader *reader, const void *msg, size_t len)
+{
+	reader->msg = msg;
+	reader->len = len;
+	reader->pos = 0;
+}
+
+int dns_skip(struct dns_reader *reader, size_t len)
+{
+	if (len > reader->len - reader->pos)
+		return -EINVAL;
+
+	reader->pos += len;
+
+	return 0;
+}
+
+int dns_read_u16(struct dns_reader *reader, uint16_t *val)
+{
+	if (reader->len - reader->pos < 2)
+		return -EINVAL;
+
+	*val = dns_get_u16(reader->msg + reader->pos);
+	reader->pos += 2;
+
+	return 0;
+}
+
+int dns_read_u32(struct dns_reader *reader, uint32_t *val)
+{
+	if (reader->len - reader->pos < 4)
+		return -EINVAL;
+
+	*val = dns_get_u32(reader->msg + reader->pos);
+	reader->pos += 4;
+
+	return 0;
+}
+
+/*
+ * Read a possibly compressed name and store it uncompressed into name,
+ * which may be NULL if the name is only skipped. Returns the length of
+ * the uncompressed name including the root label.
+ */
+int dns_read_name(struct dns_reader *reader, uint8_t *name, size_t size)
+{
+	const uint8_t *msg = reader->msg;
+	size_t pos = reader->pos, end = 0, len = 0;
+	int pointers = 0;
+
+	while (1) {
+		uint8_t label_len;
+
+		if (pos >= reader->len)
+			return -EINVAL;
+
+		label_len = msg[pos];
+
+		if ((label_len & NS_CMPRSFLGS) == NS_CMPRSFLGS) {
+			if (pos + 1 >= reader->len)
+				return -EINVAL;
+
+			if (++pointers > MAX_POINTERS)
+				return -EINVAL;
+
+			if (!end)
+				end = pos + 2;
+
+			pos = (label_len & ~NS_CMPRSFLGS) << 8 | msg[pos + 1];
+			continue;
+		}
+
+		/* the extended label types are not in use */
+		if (label_len & NS_CMPRSFLGS)
+			return -EINVAL;
+
+		if (pos + 1 + label_len > reader->len)
+			return -EINVAL;
+
+		if (len + 1 + label_len > DNS_MAX_NAME)
+			return -EINVAL;
+
+		if (name) {
+			if (len + 1 + label_len > size)
+				return -ENOBUFS;
+
+			memcpy(name + len, msg + pos, 1 + label_len);
+		}
+
+		len += 1 + label_len;
+		pos += 1 + label_len;
+
+		if (label_len == 0)
+			break;
+	}
+
+	reader->pos = end ? end : pos;
+
+	return len;
+}
+
+int dns_read_question(struct dns_reader *reader, uint8_t *name, size_t size,
+			uint16_t *type, uint16_t *class)
+{
+	int err;
+
+	err = dns_read_name(reader, name, size);
+	if (err < 0)
+		return err;
+
+	if (dns_read_u16(reader, type) < 0 || dns_read_u16(reader, class) < 0)
+		return -EINVAL;
+
+	return err;
+}
+
+/*
+ * Read the resource record at the current position, the reader is
+ * left at the start of the next one. The record data is only checked
+ * to be within the message.
+ */
+int dns_read_rr(struct dns_reader *reader, uint8_t *name, size_t size,
+			struct dns_rr *rr)
+{
+	int err;
+
+	err = dns_read_name(reader, name, size);
+	if (err < 0)
+		return err;
+
+	rr->offset = reader->pos;
+
+	if (dns_read_u16(reader, &rr->type) < 0 ||
+			dns_read_u16(reader, &rr->class) < 0 ||
+			dns_read_u32(reader, &rr->ttl) < 0 ||
+			dns_read_u16(reader, &rr->rdlen) < 0)
+		return -EINVAL;
+
+	rr->rdata = reader->pos;
+
+	return dns_skip(reader, rr->rdlen);
+}
+
+void dns_writer_init(struct dns_writer *writer, void *buf, size_t size)
+{
+	writer->buf = buf;
+	writer->size = size;
+	writer->pos = 0;
+}
+
+int dns_write_data(struct dns_writer *writer, const void *data, size_t len)
+{
+	if (len > writer->size - writer->pos)
+		return -ENOBUFS;
+
+	memcpy(writer->buf + writer->pos, data, len);
+	writer->pos += len;
+
+	return 0;
+}
+
+int dns_write_u16(struct dns_writer *writer, uint16_t val)
+{
+	if (writer->size - writer->pos < 2)
+		return -ENOBUFS;
+
+	dns_put_u16(writer->buf + writer->pos, val);
+	writer->pos += 2;
+
+	return 0;
+}
+
+/* Length of an uncompressed name including the root label */
+int dns_name_length(const uint8_t *name, size_t len)
+{
+	size_t pos = 0;
+
+	while (pos < len && pos < DNS_MAX_NAME) {
+		if (name[pos] & NS_CMPRSFLGS)
+			return -EINVAL;
+
+		if (name[pos] == 0)
+			return pos + 1;
+
+		pos += name[pos] + 1;
+	}
+
+	return -EINVAL;
+}
+
+static uint8_t ascii_lower(uint8_t c)
+{
+	if (c >= 'A' && c <= 'Z')
+		return c - 'A' + 'a';
+
+	return c;
+}
+
+/* Compare two uncompressed names, ignoring case */
+int dns_name_equal(const uint8_t *a, const uint8_t *b)
+{
+	size_t pos = 0;
+
+	while (pos < DNS_MAX_NAME) {
+		uint8_t label_len = a[pos], i;
+
+		if (label_len != b[pos])
+			return 0;
+
+		if (label_len == 0)
+			return 1;
+
+		for (i = 1; i <= label_len; i++)
+			if (ascii_lower(a[pos + i]) != ascii_lower(b[pos + i]))
+				return 0;
+
+		pos += label_len + 1;
+	}
+
+	return 0;
+}
+
+static int expand_name(struct dns_reader *reader, struct dns_writer *writer,
+			const uint8_t *from, const uint8_t *to)
+{
+	uint8_t name[DNS_MAX_NAME];
+	int len;
+
+	len = dns_read_name(reader, name, sizeof(name));
+	if (len < 0)
+		return len;
+
+	if (from && dns_name_equal(name, from))
+		return dns_write_data(writer, to, dns_name_length(to,
+								DNS_MAX_NAME));
+
+	return dns_write_data(writer, name, len);
+}
+
+/*
+ * Names inside the record data of these types may be compressed, so
+ * they have to be expanded as well. The fixed fields in front of the
+ * (first) name and behind the (last) name are copied as is.
+ */
+static int expand_rdata(struct dns_reader *reader, struct dns_writer *writer,
+			const struct dns_rr *rr)
+{
+	size_t end = rr->rdata + rr->rdlen;
+	int names = 1, prefix = 0, suffix = 0;
+
+	switch (rr->type) {
+	case ns_t_cname:
+	case ns_t_ns:
+	case ns_t_ptr:
+	case ns_t_mb:
+	case ns_t_mg:
+	case ns_t_mr:
+		break;
+	case ns_t_mx:
+	case ns_t_afsdb:
+	case ns_t_rt:
+		prefix = 2;
+		break;
+	case ns_t_srv:
+		prefix = 6;
+		break;
+	case ns_t_soa:
+		names = 2;
+		suffix = 5 * NS_INT32SZ;
+		break;
+	default:
+		return dns_write_data(writer, reader->msg + rr->rdata,
+								rr->rdlen);
+	}
+
+	reader->pos = rr->rdata;
+
+	if (dns_skip(reader, prefix) < 0 ||
+			dns_write_data(writer, reader->msg + rr->rdata,
+								prefix) < 0)
+		return -EINVAL;
+
+	while (names-- > 0) {
+		if (expand_name(reader, writer, NULL, NULL) < 0)
+			return -EINVAL;
+	}
+
+	if (reader->pos + suffix != end)
+		return -EINVAL;
+
+	if (dns_write_data(writer, reader->msg + reader->pos, suffix) < 0)
+		return -ENOBUFS;
+
+	reader->pos = end;
+
+	return 0;
+}
+
+/*
+ * Copy the message into buf with all names uncompressed. The question
+ * and owner names equal to from are replaced by to, so after that no
+ * compression pointer would be valid anymore. Returns the length of
+ * the new message.
+ */
+int dns_expand_message(const uint8_t *msg, size_t len,
+			const uint8_t *from, const uint8_t *to,
+			uint8_t *buf, size_t size)
+{
+	struct dns_reader reader;
+	struct dns_writer writer;
+	unsigned int qdcount, count;
+
+	if (len < DNS_HEADER_SIZE)
+		return -EINVAL;
+
+	qdcount = dns_get_u16(msg + 4);
+	count = dns_get_u16(msg + 6) + dns_get_u16(msg + 8) +
+						dns_get_u16(msg + 10);
+
+	dns_reader_init(&reader, msg, len);
+	dns_writer_init(&writer, buf, size);
+
+	if (dns_skip(&reader, DNS_HEADER_SIZE) < 0 ||
+			dns_write_data(&writer, msg, DNS_HEADER_SIZE) < 0)
+		return -ENOBUFS;
+
+	while (qdcount-- > 0) {
+		if (expand_name(&reader, &writer, from, to) < 0)
+			return -EINVAL;
+
+		if (dns_skip(&reader, NS_QFIXEDSZ) < 0 ||
+				dns_write_data(&writer,
+					msg + reader.pos - NS_QFIXEDSZ,
+					NS_QFIXEDSZ) < 0)
+			return -EINVAL;
+	}
+
+	while (count-- > 0) {
+		struct dns_rr rr;
+		size_t rdlen_pos;
+		int err;
+
+		if (expand_name(&reader, &writer, from, to) < 0)
+			return -EINVAL;
+
+		rr.offset = reader.pos;
+
+		if (dns_read_u16(&reader, &rr.type) < 0 ||
+				dns_read_u16(&reader, &rr.class) < 0 ||
+				dns_read_u32(&reader, &rr.ttl) < 0 ||
+				dns_read_u16(&reader, &rr.rdlen) < 0)
+			return -EINVAL;
+
+		rr.rdata = reader.pos;
+
+		if (dns_skip(&reader, rr.rdlen) < 0)
+			return -EINVAL;
+
+		/* type, class, ttl and a placeholder for the new rdlen */
+		if (dns_write_data(&writer, msg + rr.offset,
+						NS_RRFIXEDSZ) < 0)
+			return -ENOBUFS;
+
+		rdlen_pos = writer.pos - NS_INT16SZ;
+
+		err = expand_rdata(&reader, &writer, &rr);
+		if (err < 0)
+			return err;
+
+		dns_put_u16(writer.buf + rdlen_pos, writer.pos - rdlen_pos -
+								NS_INT16SZ);
+	}
+
+	return writer.pos;
+}
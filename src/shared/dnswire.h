@@ -0,0 +1,104 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2026  Connection Manager contributors.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef SHARED_DNSWIRE_H
+#define SHARED_DNSWIRE_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Bounds checked reader and writer for DNS messages in wire format.
+ * They work on buffers owned by the caller and never allocate memory.
+ * All functions return a negative errno on malformed input or when
+ * the output does not fit.
+ */
+
+#define DNS_HEADER_SIZE 12
+#define DNS_MAX_NAME 255
+
+struct dns_reader {
+	const uint8_t *msg;
+	size_t len;
+	size_t pos;
+};
+
+struct dns_writer {
+	uint8_t *buf;
+	size_t size;
+	size_t pos;
+};
+
+struct dns_rr {
+	uint16_t type;
+	uint16_t class;
+	uint32_t ttl;
+	uint16_t rdlen;
+	size_t offset;	/* of the type field, right after the owner name */
+	size_t rdata;	/* of the record data */
+};
+
+static inline uint16_t dns_get_u16(const uint8_t *ptr)
+{
+	return ptr[0] << 8 | ptr[1];
+}
+
+static inline uint32_t dns_get_u32(const uint8_t *ptr)
+{
+	return (uint32_t) ptr[0] << 24 | ptr[1] << 16 | ptr[2] << 8 | ptr[3];
+}
+
+static inline void dns_put_u16(uint8_t *ptr, uint16_t val)
+{
+	ptr[0] = val >> 8;
+	ptr[1] = val & 0xff;
+}
+
+static inline void dns_put_u32(uint8_t *ptr, uint32_t val)
+{
+	ptr[0] = val >> 24;
+	ptr[1] = val >> 16 & 0xff;
+	ptr[2] = val >> 8 & 0xff;
+	ptr[3] = val & 0xff;
+}
+
+void dns_reader_init(struct dns_reader *reader, const void *msg, size_t len);
+int dns_read_u16(struct dns_reader *reader, uint16_t *val);
+int dns_read_u32(struct dns_reader *reader, uint32_t *val);
+int dns_skip(struct dns_reader *reader, size_t len);
+int dns_read_name(struct dns_reader *reader, uint8_t *name, size_t size);
+int dns_read_question(struct dns_reader *reader, uint8_t *name, size_t size,
+			uint16_t *type, uint16_t *class);
+int dns_read_rr(struct dns_reader *reader, uint8_t *name, size_t size,
+			struct dns_rr *rr);
+
+void dns_writer_init(struct dns_writer *writer, void *buf, size_t size);
+int dns_write_u16(struct dns_writer *writer, uint16_t val);
+int dns_write_data(struct dns_writer *writer, const void *data, size_t len);
+
+int dns_name_length(const uint8_t *name, size_t len);
+int dns_name_equal(const uint8_t *a, const uint8_t *b);
+
+int dns_expand_message(const uint8_t *msg, size_t len,
+			const uint8_t *from, const uint8_t *to,
+			uint8_t *buf, size_t size);
+
+#endif
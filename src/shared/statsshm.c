@@ -0,0 +1,134 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2026  Connection Manager contributors.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "src/shared/statsshm.h"
+
+#define MAX_READ_RETRIES 100
+
+void stats_shm_write_begin(struct stats_shm_entry *entry)
+{
+	__atomic_store_n(&entry->seq, entry->seq + 1, __ATOMIC_RELAXED);
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void stats_shm_write_end(struct stats_shm_entry *entry)
+{
+	__atomic_store_n(&entry->seq, entry->seq + 1, __ATOMIC_RELEASE);
+}
+
+int stats_shm_open(const struct stats_shm **shm)
+{
+	struct stats_shm *map;
+	struct stat st;
+	int fd, err;
+
+	fd = shm_open(STATS_SHM_NAME, O_RDONLY | O_CLOEXEC, 0);
+	if (fd < 0)
+		return -errno;
+
+	if (fstat(fd, &st) < 0) {
+		err = -errno;
+		close(fd);
+		return err;
+	}
+
+	if (st.st_size < (off_t) sizeof(struct stats_shm)) {
+		close(fd);
+		return -EINVAL;
+	}
+
+	map = mmap(NULL, sizeof(struct stats_shm), PROT_READ, MAP_SHARED,
+								fd, 0);
+	err = -errno;
+	close(fd);
+
+	if (map == MAP_FAILED)
+		return err;
+
+	if (!stats_shm_valid(map) ||
+			map->header.version != STATS_SHM_VERSION ||
+			map->header.entry_size !=
+				sizeof(struct stats_shm_entry) ||
+			map->header.entries != STATS_SHM_ENTRIES) {
+		munmap(map, sizeof(struct stats_shm));
+		return -EINVAL;
+	}
+
+	*shm = map;
+
+	return 0;
+}
+
+void stats_shm_close(const struct stats_shm *shm)
+{
+	munmap((void *) shm, sizeof(struct stats_shm));
+}
+
+int stats_shm_valid(const struct stats_shm *shm)
+{
+	return __atomic_load_n(&shm->header.magic, __ATOMIC_ACQUIRE) ==
+							STATS_SHM_MAGIC;
+}
+
+int stats_shm_read(const struct stats_shm *shm, unsigned int index,
+			struct stats_shm_entry *entry)
+{
+	const struct stats_shm_entry *shared;
+	uint32_t seq;
+	int i;
+
+	if (index >= STATS_SHM_ENTRIES)
+		return -EINVAL;
+
+	shared = &shm->entry[index];
+
+	for (i = 0; i < MAX_READ_RETRIES; i++) {
+		seq = __atomic_load_n(&shared->seq, __ATOMIC_ACQUIRE);
+		if (seq & 1)
+			continue;
+
+		memcpy(entry, shared, sizeof(*entry));
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&shared->seq, __ATOMIC_RELAXED) != seq)
+			continue;
+
+		if (!(entry->flags & STATS_SHM_ENTRY_USED))
+			return -ENOENT;
+
+		entry->ident[STATS_SHM_IDENT_LEN - 1] = '\0';
+
+		return 0;
+	}
+
+	return -EAGAIN;
+}
@@ -0,0 +1,102 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2026  Connection Manager contributors.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifndef SHARED_STATSSHM_H
+#define SHARED_STATSSHM_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/*
+ * Layout of the shared memory segment with the traffic counters of
+ * the services. connmand is the only writer, everybody else maps it
+ * read-only. Every entry is protected by its own sequence counter,
+ * which is odd while the entry is written, so readers never block the
+ * daemon and retry instead when they raced with an update.
+ */
+
+#define STATS_SHM_NAME		"/connman-stats"
+#define STATS_SHM_MAGIC		0x53534d43	/* "CMSS" */
+#define STATS_SHM_VERSION	1
+
+#define STATS_SHM_ENTRIES	256
+#define STATS_SHM_IDENT_LEN	128
+
+#define STATS_SHM_ENTRY_USED	(1 << 0)
+#define STATS_SHM_ENTRY_ROAMING	(1 << 1)
+
+struct stats_shm_counters {
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_errors;
+	uint64_t tx_errors;
+	uint64_t rx_dropped;
+	uint64_t tx_dropped;
+	uint64_t time;		/* seconds connected */
+	uint64_t updated;	/* CLOCK_MONOTONIC, in milliseconds */
+};
+
+struct stats_shm_entry {
+	uint32_t seq;
+	uint32_t flags;
+	char ident[STATS_SHM_IDENT_LEN];
+	struct stats_shm_counters counters;
+};
+
+/* magic is set last, and cleared when connmand goes away */
+struct stats_shm_header {
+	uint32_t magic;
+	uint32_t version;
+	uint32_t entry_size;
+	uint32_t entries;
+	uint32_t interval;	/* seconds between the updates */
+	uint32_t reserved;
+};
+
+struct stats_shm {
+	struct stats_shm_header header;
+	struct stats_shm_entry entry[STATS_SHM_ENTRIES];
+};
+
+/* writer side, used by connmand */
+void stats_shm_write_begin(struct stats_shm_entry *entry);
+void stats_shm_write_end(struct stats_shm_entry *entry);
+
+/*
+ * Client side. stats_shm_open() maps the segment read-only and fails
+ * with -ENOENT if connmand does not publish it. Once stats_shm_valid()
+ * returns false, connmand has restarted or stopped and the segment has
+ * to be opened again.
+ */
+int stats_shm_open(const struct stats_shm **shm);
+void stats_shm_close(const struct stats_shm *shm);
+int stats_shm_valid(const struct stats_shm *shm);
+
+/*
+ * Copy an entry consistently. Returns -ENOENT for an unused entry and
+ * -EAGAIN if it kept changing while being read.
+ */
+int stats_shm_read(const struct stats_shm *shm, unsigned int index,
+			struct stats_shm_entry *entry);
+
+#endif
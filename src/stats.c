@@ -45,7 +45,11 @@
 #define TFR
 #endif
 
-#define MAGIC 0xFA00B916
+#define MAGIC 0xFA00B917
+#define STATS_FILE_VERSION 2
+
+/* Files with 32 bit counters, their header has no version */
+#define MAGIC_V1 0xFA00B916
 
 /*
  * Statistics counters are stored into a ring buffer which is stored
@@ -58,6 +62,8 @@
  *   The grows by _SC_PAGESIZE step size
  *   For each service a file is created
  *   Each file has a header where the indexes are stored
+ *   The header also holds the format version and the record size,
+ *   files from before the version was added are converted on open
  *
  * Entries properties:
  *   Each entry has a timestamp
@@ -87,6 +93,9 @@
 
 struct stats_file_header {
 	unsigned int magic;
+	unsigned int version;
+	unsigned int record_size;
+	unsigned int reserved;
 	unsigned int begin;
 	unsigned int end;
 	unsigned int home;
@@ -99,6 +108,30 @@ struct stats_record {
 	struct connman_stats_data data;
 };
 
+struct stats_file_header_v1 {
+	unsigned int magic;
+	unsigned int begin;
+	unsigned int end;
+	unsigned int home;
+	unsigned int roaming;
+};
+
+struct stats_record_v1 {
+	time_t ts;
+	unsigned int roaming;
+	struct {
+		unsigned int rx_packets;
+		unsigned int tx_packets;
+		unsigned int rx_bytes;
+		unsigned int tx_bytes;
+		unsigned int rx_errors;
+		unsigned int tx_errors;
+		unsigned int rx_dropped;
+		unsigned int tx_dropped;
+		unsigned int time;
+	} data;
+};
+
 struct stats_file {
 	int fd;
 	char *name;
@@ -358,6 +391,124 @@ static int stats_open_temp(struct stats_file *file)
 	return 0;
 }
 
+static bool valid_offset_v1(struct stats_file *file, unsigned int off)
+{
+	size_t hdr_len = sizeof(struct stats_file_header_v1);
+
+	return off >= hdr_len &&
+		(off - hdr_len) % sizeof(struct stats_record_v1) == 0 &&
+		off + sizeof(struct stats_record_v1) <= file->len;
+}
+
+static void convert_record_v1(struct stats_record *rec,
+				const struct stats_record_v1 *old)
+{
+	rec->ts = old->ts;
+	rec->roaming = old->roaming;
+	rec->data.rx_packets = old->data.rx_packets;
+	rec->data.tx_packets = old->data.tx_packets;
+	rec->data.rx_bytes = old->data.rx_bytes;
+	rec->data.tx_bytes = old->data.tx_bytes;
+	rec->data.rx_errors = old->data.rx_errors;
+	rec->data.tx_errors = old->data.tx_errors;
+	rec->data.rx_dropped = old->data.rx_dropped;
+	rec->data.tx_dropped = old->data.tx_dropped;
+	rec->data.time = old->data.time;
+}
+
+/*
+ * Rewrite a file with 32 bit counters in place. The records are
+ * converted oldest first, if they do not fit into max_len anymore
+ * the oldest ones are dropped.
+ */
+static int stats_file_migrate_v1(struct stats_file *file)
+{
+	struct stats_file_header_v1 old;
+	struct stats_record_v1 *first, *last, *cur, *end;
+	struct stats_record *records, *rec;
+	struct stats_file_header *hdr;
+	unsigned int nr = 0, max_nr, skip, i;
+	unsigned int home = UINT_MAX, roaming = UINT_MAX;
+	size_t size;
+	int err;
+
+	memcpy(&old, file->addr, sizeof(old));
+
+	if (!valid_offset_v1(file, old.begin) ||
+			!valid_offset_v1(file, old.end))
+		return -EINVAL;
+
+	first = (struct stats_record_v1 *)(file->addr + sizeof(old));
+	last = first + (file->len - sizeof(old)) / sizeof(*first) - 1;
+	cur = (struct stats_record_v1 *)(file->addr + old.begin);
+	end = (struct stats_record_v1 *)(file->addr + old.end);
+
+	records = g_try_new(struct stats_record, last - first + 1);
+	if (!records)
+		return -ENOMEM;
+
+	while (cur != end) {
+		cur = cur == last ? first : cur + 1;
+
+		convert_record_v1(&records[nr], cur);
+
+		if ((char *)cur - file->addr == old.home)
+			home = nr;
+		if ((char *)cur - file->addr == old.roaming)
+			roaming = nr;
+
+		nr++;
+	}
+
+	/* one record is taken by 'begin' */
+	max_nr = (file->max_len - sizeof(*hdr)) / sizeof(*rec) - 1;
+	skip = nr > max_nr ? nr - max_nr : 0;
+
+	size = sizeof(*hdr) + (nr - skip + 1) * sizeof(*rec);
+	if (size > file->len) {
+		err = stats_file_remap(file, size);
+		if (err < 0) {
+			g_free(records);
+			return err;
+		}
+	}
+
+	hdr = get_hdr(file);
+	hdr->magic = MAGIC;
+	hdr->version = STATS_FILE_VERSION;
+	hdr->record_size = sizeof(struct stats_record);
+	hdr->reserved = 0;
+	hdr->begin = sizeof(struct stats_file_header);
+	hdr->home = UINT_MAX;
+	hdr->roaming = UINT_MAX;
+
+	update_first(file);
+	update_last(file);
+
+	rec = file->first;
+
+	for (i = skip; i < nr; i++) {
+		rec++;
+		memcpy(rec, &records[i], sizeof(*rec));
+
+		if (i == home)
+			set_home(file, rec);
+		if (i == roaming)
+			set_roaming(file, rec);
+	}
+
+	set_end(file, rec);
+
+	stats_file_update_cache(file);
+
+	g_free(records);
+
+	connman_info("Converted %u statistics records in %s", nr - skip,
+								file->name);
+
+	return 0;
+}
+
 static int stats_file_setup(struct stats_file *file)
 {
 	struct stats_file_header *hdr;
@@ -398,7 +549,17 @@ static int stats_file_setup(struct stats_file *file)
 
 	hdr = get_hdr(file);
 
-	if (hdr->magic != MAGIC ||
+	if (hdr->magic == MAGIC_V1) {
+		err = stats_file_migrate_v1(file);
+		if (err < 0)
+			connman_warn("Cannot convert %s, statistics are reset",
+								file->name);
+
+		hdr = get_hdr(file);
+	}
+
+	if (hdr->magic != MAGIC || hdr->version != STATS_FILE_VERSION ||
+			hdr->record_size != sizeof(struct stats_record) ||
 			hdr->begin < sizeof(struct stats_file_header) ||
 			hdr->end < sizeof(struct stats_file_header) ||
 			hdr->home < sizeof(struct stats_file_header) ||
@@ -406,6 +567,9 @@ static int stats_file_setup(struct stats_file *file)
 			hdr->begin > file->len ||
 			hdr->end > file->len) {
 		hdr->magic = MAGIC;
+		hdr->version = STATS_FILE_VERSION;
+		hdr->record_size = sizeof(struct stats_record);
+		hdr->reserved = 0;
 		hdr->begin = sizeof(struct stats_file_header);
 		hdr->end = sizeof(struct stats_file_header);
 		hdr->home = UINT_MAX;
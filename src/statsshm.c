@@ -0,0 +1,228 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2026  Connection Manager contributors.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#include "connman.h"
+
+#include "src/shared/statsshm.h"
+
+/*
+ * With SharedStatisticsInterval set, the counters of the connected
+ * services are published in a shared memory segment every interval,
+ * see src/shared/statsshm.h for the layout and the client functions.
+ * An entry is taken for a service on its first update and given back
+ * when the service goes away.
+ */
+
+static struct stats_shm *shm;
+static GHashTable *entry_table;
+static unsigned int update_id;
+
+static uint64_t now_ms(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+static int get_entry(const char *ident)
+{
+	gpointer value;
+	int i;
+
+	if (g_hash_table_lookup_extended(entry_table, ident, NULL, &value))
+		return GPOINTER_TO_INT(value);
+
+	if (strlen(ident) >= STATS_SHM_IDENT_LEN)
+		return -ENAMETOOLONG;
+
+	for (i = 0; i < STATS_SHM_ENTRIES; i++) {
+		if (!(shm->entry[i].flags & STATS_SHM_ENTRY_USED))
+			break;
+	}
+
+	if (i == STATS_SHM_ENTRIES)
+		return -ENOSPC;
+
+	g_hash_table_insert(entry_table, g_strdup(ident),
+						GINT_TO_POINTER(i));
+
+	return i;
+}
+
+void __connman_stats_shm_update(const char *ident, bool roaming,
+				const struct connman_stats_data *data)
+{
+	struct stats_shm_entry *entry;
+	int index;
+
+	if (!shm)
+		return;
+
+	index = get_entry(ident);
+	if (index < 0) {
+		DBG("no entry for %s: %s", ident, strerror(-index));
+		return;
+	}
+
+	entry = &shm->entry[index];
+
+	stats_shm_write_begin(entry);
+
+	if (!(entry->flags & STATS_SHM_ENTRY_USED))
+		g_strlcpy(entry->ident, ident, STATS_SHM_IDENT_LEN);
+
+	entry->flags = STATS_SHM_ENTRY_USED;
+	if (roaming)
+		entry->flags |= STATS_SHM_ENTRY_ROAMING;
+
+	entry->counters.rx_packets = data->rx_packets;
+	entry->counters.tx_packets = data->tx_packets;
+	entry->counters.rx_bytes = data->rx_bytes;
+	entry->counters.tx_bytes = data->tx_bytes;
+	entry->counters.rx_errors = data->rx_errors;
+	entry->counters.tx_errors = data->tx_errors;
+	entry->counters.rx_dropped = data->rx_dropped;
+	entry->counters.tx_dropped = data->tx_dropped;
+	entry->counters.time = data->time;
+	entry->counters.updated = now_ms();
+
+	stats_shm_write_end(entry);
+}
+
+void __connman_stats_shm_remove(const char *ident)
+{
+	struct stats_shm_entry *entry;
+	gpointer value;
+
+	if (!shm)
+		return;
+
+	if (!g_hash_table_lookup_extended(entry_table, ident, NULL, &value))
+		return;
+
+	entry = &shm->entry[GPOINTER_TO_INT(value)];
+
+	stats_shm_write_begin(entry);
+	entry->flags = 0;
+	memset(entry->ident, 0, sizeof(entry->ident));
+	memset(&entry->counters, 0, sizeof(entry->counters));
+	stats_shm_write_end(entry);
+
+	g_hash_table_remove(entry_table, ident);
+}
+
+int __connman_stats_shm_init(void)
+{
+	unsigned int interval;
+	int fd, err;
+
+	interval = connman_setting_get_uint("SharedStatisticsInterval");
+
+	DBG("interval %u", interval);
+
+	if (interval == 0)
+		return 0;
+
+	/* clients of a previous instance keep their own copy */
+	shm_unlink(STATS_SHM_NAME);
+
+	fd = shm_open(STATS_SHM_NAME, O_RDWR | O_CREAT | O_EXCL | O_CLOEXEC,
+								0640);
+	if (fd < 0) {
+		err = -errno;
+		connman_error("Failed to create %s: %s", STATS_SHM_NAME,
+							strerror(-err));
+		return err;
+	}
+
+	/* readable for the group of connmand, regardless of the umask */
+	if (fchmod(fd, 0640) < 0 ||
+			ftruncate(fd, sizeof(struct stats_shm)) < 0) {
+		err = -errno;
+		goto error;
+	}
+
+	shm = mmap(NULL, sizeof(struct stats_shm), PROT_READ | PROT_WRITE,
+							MAP_SHARED, fd, 0);
+	if (shm == MAP_FAILED) {
+		shm = NULL;
+		err = -errno;
+		goto error;
+	}
+
+	close(fd);
+
+	shm->header.version = STATS_SHM_VERSION;
+	shm->header.entry_size = sizeof(struct stats_shm_entry);
+	shm->header.entries = STATS_SHM_ENTRIES;
+	shm->header.interval = interval;
+	__atomic_store_n(&shm->header.magic, STATS_SHM_MAGIC,
+							__ATOMIC_RELEASE);
+
+	entry_table = g_hash_table_new_full(g_str_hash, g_str_equal,
+								g_free, NULL);
+
+	update_id = __connman_rtnl_update_interval_add(interval, NULL, NULL);
+
+	return 0;
+
+error:
+	connman_error("Failed to set up %s: %s", STATS_SHM_NAME,
+							strerror(-err));
+	close(fd);
+	shm_unlink(STATS_SHM_NAME);
+
+	return err;
+}
+
+void __connman_stats_shm_cleanup(void)
+{
+	DBG("");
+
+	if (!shm)
+		return;
+
+	__connman_rtnl_update_interval_remove(update_id);
+
+	__atomic_store_n(&shm->header.magic, 0, __ATOMIC_RELEASE);
+
+	munmap(shm, sizeof(struct stats_shm));
+	shm = NULL;
+
+	shm_unlink(STATS_SHM_NAME);
+
+	g_hash_table_destroy(entry_table);
+	entry_table = NULL;
+}
@@ -24,7 +24,11 @@
 #endif
 
 #include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
 #include <unistd.h>
+#include <sys/mman.h>
 #include <sys/stat.h>
 #include <dirent.h>
 
@@ -38,6 +42,65 @@
 #define MODE		(S_IRUSR | S_IWUSR | S_IXUSR | S_IRGRP | \
 			S_IXGRP | S_IROTH | S_IXOTH)
 
+/*
+ * With CompactServiceStorage the settings of the services are kept in
+ * one append-only log instead of a settings file per service. Every
+ * record holds the identifier and the keyfile data of a service, a
+ * later record replaces an earlier one and a record without data
+ * removes the service. At startup only the identifiers are read to
+ * build the index, the settings are read when a service is loaded.
+ * Once more than half of the log is taken by replaced records, it is
+ * rewritten in the background. The directory of a service is still
+ * used for its statistics and the DNS cache snapshot.
+ */
+#define SERVICES_LOG		"services.log"
+#define SERVICES_LOG_MAGIC	0x4c4d4e43	/* "CNML" */
+#define SERVICES_LOG_VERSION	1
+
+#define LOG_MAX_ID_LEN		256
+#define LOG_COMPACT_MIN		(64 * 1024)
+#define LOG_COMPACT_DELAY	10		/* seconds */
+#define LOG_COMPACT_BATCH	64		/* records per idle call */
+
+#define TFR TEMP_FAILURE_RETRY
+
+struct log_file_header {
+	uint32_t magic;
+	uint32_t version;
+};
+
+/* followed by the identifier and the data, in host byte order */
+struct log_record_header {
+	uint32_t checksum;
+	uint32_t id_len;
+	uint32_t data_len;
+};
+
+struct log_entry {
+	off_t offset;
+	uint32_t id_len;
+	uint32_t data_len;
+};
+
+struct services_log {
+	int fd;
+	GHashTable *index;
+	off_t size;
+	off_t live;
+};
+
+struct log_compaction {
+	struct services_log *log;
+	char *pathname;
+	char **ids;
+	unsigned int pos;
+	guint idle;
+};
+
+static struct services_log *services_log;
+static struct log_compaction *compaction;
+static guint compact_timeout;
+
 static GKeyFile *storage_load(const char *pathname)
 {
 	GKeyFile *keyfile = NULL;
@@ -84,6 +147,538 @@ static void storage_delete(const char *pathname)
 		connman_error("Failed to remove %s", pathname);
 }
 
+static off_t log_record_size(uint32_t id_len, uint32_t data_len)
+{
+	return sizeof(struct log_record_header) + id_len + data_len;
+}
+
+/* FNV-1a over the identifier and the data */
+static uint32_t log_checksum(const char *id, uint32_t id_len,
+				const char *data, uint32_t data_len)
+{
+	uint32_t hash = 2166136261u;
+	uint32_t i;
+
+	for (i = 0; i < id_len; i++)
+		hash = (hash ^ (unsigned char) id[i]) * 16777619u;
+
+	for (i = 0; i < data_len; i++)
+		hash = (hash ^ (unsigned char) data[i]) * 16777619u;
+
+	return hash;
+}
+
+static struct services_log *services_log_new(int fd)
+{
+	struct services_log *log;
+
+	log = g_new0(struct services_log, 1);
+	log->fd = fd;
+	log->index = g_hash_table_new_full(g_str_hash, g_str_equal,
+							g_free, g_free);
+	log->size = sizeof(struct log_file_header);
+
+	return log;
+}
+
+static void services_log_free(struct services_log *log)
+{
+	if (!log)
+		return;
+
+	close(log->fd);
+	g_hash_table_destroy(log->index);
+	g_free(log);
+}
+
+static void log_index_update(struct services_log *log, const char *id,
+				off_t offset, uint32_t id_len,
+				uint32_t data_len)
+{
+	struct log_entry *entry;
+
+	entry = g_hash_table_lookup(log->index, id);
+	if (entry) {
+		log->live -= log_record_size(entry->id_len, entry->data_len);
+		g_hash_table_remove(log->index, id);
+	}
+
+	if (data_len == 0)
+		return;
+
+	entry = g_new(struct log_entry, 1);
+	entry->offset = offset;
+	entry->id_len = id_len;
+	entry->data_len = data_len;
+	g_hash_table_insert(log->index, g_strdup(id), entry);
+
+	log->live += log_record_size(id_len, data_len);
+}
+
+static int log_append(struct services_log *log, const char *id,
+			const char *data, uint32_t data_len, bool sync)
+{
+	struct log_record_header header;
+	uint32_t id_len = strlen(id);
+	size_t len = log_record_size(id_len, data_len);
+	char *buf;
+	ssize_t ret;
+
+	if (id_len == 0 || id_len > LOG_MAX_ID_LEN)
+		return -EINVAL;
+
+	header.checksum = log_checksum(id, id_len, data, data_len);
+	header.id_len = id_len;
+	header.data_len = data_len;
+
+	buf = g_malloc(len);
+	memcpy(buf, &header, sizeof(header));
+	memcpy(buf + sizeof(header), id, id_len);
+	if (data_len > 0)
+		memcpy(buf + sizeof(header) + id_len, data, data_len);
+
+	ret = TFR(pwrite(log->fd, buf, len, log->size));
+	g_free(buf);
+
+	if (ret != (ssize_t) len || (sync && fdatasync(log->fd) < 0)) {
+		connman_error("Failed to write service log: %s",
+					ret < 0 ? strerror(errno) : "short");
+		if (ftruncate(log->fd, log->size) < 0)
+			DBG("truncate failed: %s", strerror(errno));
+		return -EIO;
+	}
+
+	log_index_update(log, id, log->size, id_len, data_len);
+	log->size += len;
+
+	return 0;
+}
+
+static char *log_read(struct services_log *log, const char *id,
+							uint32_t *data_len)
+{
+	struct log_record_header header;
+	struct log_entry *entry;
+	size_t len;
+	char *buf, *data;
+
+	entry = g_hash_table_lookup(log->index, id);
+	if (!entry)
+		return NULL;
+
+	len = log_record_size(entry->id_len, entry->data_len);
+	buf = g_malloc(len + 1);
+
+	if (TFR(pread(log->fd, buf, len, entry->offset)) != (ssize_t) len) {
+		connman_error("Failed to read %s from service log", id);
+		g_free(buf);
+		return NULL;
+	}
+
+	memcpy(&header, buf, sizeof(header));
+	if (header.checksum != log_checksum(buf + sizeof(header),
+						entry->id_len,
+						buf + len - entry->data_len,
+						entry->data_len)) {
+		connman_error("Corrupted record of %s in service log", id);
+		g_free(buf);
+		return NULL;
+	}
+
+	/* move the data to the front, NUL terminated */
+	data = memmove(buf, buf + len - entry->data_len, entry->data_len);
+	data[entry->data_len] = '\0';
+	*data_len = entry->data_len;
+
+	return data;
+}
+
+/* the rename of a new log is only durable once its directory is synced */
+static void sync_dir(const char *pathname)
+{
+	int fd;
+
+	fd = TFR(open(pathname, O_RDONLY | O_DIRECTORY | O_CLOEXEC));
+	if (fd < 0)
+		return;
+
+	if (fsync(fd) < 0)
+		DBG("fsync %s failed: %s", pathname, strerror(errno));
+
+	close(fd);
+}
+
+static bool log_scan_record(struct services_log *log, off_t offset,
+				off_t size, struct log_record_header *header,
+				char *id)
+{
+	if (TFR(pread(log->fd, header, sizeof(*header), offset)) !=
+							sizeof(*header))
+		return false;
+
+	if (header->id_len == 0 || header->id_len > LOG_MAX_ID_LEN)
+		return false;
+
+	if (offset + log_record_size(header->id_len, header->data_len) > size)
+		return false;
+
+	if (TFR(pread(log->fd, id, header->id_len,
+			offset + sizeof(*header))) != header->id_len)
+		return false;
+
+	id[header->id_len] = '\0';
+
+	return strlen(id) == header->id_len;
+}
+
+/*
+ * Find the first record behind offset which passes its checksum, or
+ * return -1 if there is none.
+ */
+static off_t log_resync(struct services_log *log, off_t offset, off_t size)
+{
+	struct log_record_header header;
+	const char *map;
+	off_t end;
+
+	map = mmap(NULL, size, PROT_READ, MAP_PRIVATE, log->fd, 0);
+	if (map == MAP_FAILED)
+		return -1;
+
+	for (offset++; offset + (off_t) sizeof(header) <= size; offset++) {
+		memcpy(&header, map + offset, sizeof(header));
+
+		if (header.id_len == 0 || header.id_len > LOG_MAX_ID_LEN)
+			continue;
+
+		end = offset + log_record_size(header.id_len,
+							header.data_len);
+		if (end > size)
+			continue;
+
+		if (log_checksum(map + offset + sizeof(header), header.id_len,
+				map + end - header.data_len,
+				header.data_len) == header.checksum)
+			break;
+	}
+
+	munmap((void *) map, size);
+
+	if (offset + (off_t) sizeof(header) > size)
+		return -1;
+
+	return offset;
+}
+
+/*
+ * Only the header and the identifier of the records are read. Every
+ * record is written with fdatasync(), so only the last one can be torn
+ * by a crash and only its data is checked. A broken record in the
+ * middle is skipped up to the next one that passes its checksum, the
+ * log is only truncated when no good record follows.
+ */
+static int log_scan(struct services_log *log)
+{
+	struct log_file_header file_header;
+	struct log_record_header header;
+	char id[LOG_MAX_ID_LEN + 1];
+	struct stat st;
+	off_t offset, next;
+
+	if (fstat(log->fd, &st) < 0)
+		return -errno;
+
+	if (st.st_size == 0) {
+		file_header.magic = SERVICES_LOG_MAGIC;
+		file_header.version = SERVICES_LOG_VERSION;
+
+		if (TFR(pwrite(log->fd, &file_header, sizeof(file_header),
+					0)) != sizeof(file_header))
+			return -EIO;
+
+		return 0;
+	}
+
+	if (TFR(pread(log->fd, &file_header, sizeof(file_header), 0)) !=
+						sizeof(file_header) ||
+			file_header.magic != SERVICES_LOG_MAGIC ||
+			file_header.version != SERVICES_LOG_VERSION) {
+		connman_error("Unknown service log format");
+		return -EINVAL;
+	}
+
+	offset = sizeof(file_header);
+
+	while (offset < st.st_size) {
+		bool good = log_scan_record(log, offset, st.st_size,
+							&header, id);
+
+		if (good)
+			next = offset + log_record_size(header.id_len,
+							header.data_len);
+
+		if (good && next == st.st_size) {
+			char *data = g_malloc(header.data_len);
+			uint32_t checksum = 0;
+
+			if (TFR(pread(log->fd, data, header.data_len,
+					next - header.data_len)) ==
+					header.data_len)
+				checksum = log_checksum(id, header.id_len,
+							data, header.data_len);
+			g_free(data);
+
+			good = checksum == header.checksum;
+		}
+
+		if (!good) {
+			next = log_resync(log, offset, st.st_size);
+			if (next < 0)
+				break;
+
+			/* the skipped bytes are dead and go with compaction */
+			connman_warn("Skipping broken service log record "
+					"at %lld", (long long) offset);
+			offset = next;
+			continue;
+		}
+
+		log_index_update(log, id, offset, header.id_len,
+							header.data_len);
+		offset = next;
+	}
+
+	log->size = offset;
+
+	if (offset < st.st_size) {
+		connman_warn("Dropping broken end of service log at %lld",
+							(long long) offset);
+		if (ftruncate(log->fd, offset) < 0)
+			return -errno;
+	}
+
+	return 0;
+}
+
+static struct services_log *log_open(const char *pathname, int flags)
+{
+	struct services_log *log;
+	int fd;
+
+	fd = TFR(open(pathname, O_RDWR | O_CREAT | O_CLOEXEC | flags,
+								0600));
+	if (fd < 0) {
+		connman_error("Failed to open %s: %s", pathname,
+							strerror(errno));
+		return NULL;
+	}
+
+	log = services_log_new(fd);
+
+	if (log_scan(log) < 0) {
+		services_log_free(log);
+		return NULL;
+	}
+
+	return log;
+}
+
+static void compaction_free(struct log_compaction *comp)
+{
+	if (comp->idle)
+		g_source_remove(comp->idle);
+
+	services_log_free(comp->log);
+	g_strfreev(comp->ids);
+	g_free(comp->pathname);
+	g_free(comp);
+}
+
+static void compaction_abort(void)
+{
+	if (!compaction)
+		return;
+
+	unlink(compaction->pathname);
+	compaction_free(compaction);
+	compaction = NULL;
+}
+
+static bool compaction_finish(void)
+{
+	gchar *pathname;
+	int err = 0;
+
+	if (fdatasync(compaction->log->fd) < 0)
+		return false;
+
+	pathname = g_strdup_printf("%s/%s", STORAGEDIR, SERVICES_LOG);
+	if (rename(compaction->pathname, pathname) < 0)
+		err = -errno;
+	g_free(pathname);
+
+	if (err < 0)
+		return false;
+
+	sync_dir(STORAGEDIR);
+
+	DBG("service log %lld bytes, was %lld",
+			(long long) compaction->log->size,
+			(long long) services_log->size);
+
+	services_log_free(services_log);
+	services_log = compaction->log;
+	compaction->log = NULL;
+
+	compaction->idle = 0;
+	compaction_free(compaction);
+	compaction = NULL;
+
+	return true;
+}
+
+/*
+ * The current records are copied over in batches. Services saved in
+ * the meantime are written to both logs and are not copied again.
+ */
+static gboolean compaction_step(gpointer user_data)
+{
+	const char *id;
+	uint32_t data_len;
+	char *data;
+	int i, err;
+
+	for (i = 0; i < LOG_COMPACT_BATCH && compaction->ids[compaction->pos];
+									i++) {
+		id = compaction->ids[compaction->pos++];
+
+		if (g_hash_table_contains(compaction->log->index, id))
+			continue;
+
+		data = log_read(services_log, id, &data_len);
+		if (!data)
+			continue;
+
+		err = log_append(compaction->log, id, data, data_len, false);
+		g_free(data);
+
+		if (err < 0)
+			goto error;
+	}
+
+	if (compaction->ids[compaction->pos])
+		return TRUE;
+
+	if (compaction_finish())
+		return FALSE;
+
+error:
+	connman_error("Failed to compact service log");
+
+	compaction->idle = 0;
+	compaction_abort();
+
+	return FALSE;
+}
+
+static gboolean compaction_start(gpointer user_data)
+{
+	struct services_log *log;
+	GHashTableIter iter;
+	gpointer key;
+	gchar *pathname;
+	int i = 0;
+
+	compact_timeout = 0;
+
+	pathname = g_strdup_printf("%s/%s.tmp", STORAGEDIR, SERVICES_LOG);
+
+	log = log_open(pathname, O_TRUNC);
+	if (!log) {
+		g_free(pathname);
+		return FALSE;
+	}
+
+	compaction = g_new0(struct log_compaction, 1);
+	compaction->log = log;
+	compaction->pathname = pathname;
+	compaction->ids = g_new0(char *,
+			g_hash_table_size(services_log->index) + 1);
+
+	g_hash_table_iter_init(&iter, services_log->index);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+		compaction->ids[i++] = g_strdup(key);
+
+	compaction->idle = g_idle_add_full(G_PRIORITY_LOW, compaction_step,
+								NULL, NULL);
+
+	return FALSE;
+}
+
+static void check_compaction(void)
+{
+	off_t dead;
+
+	if (compaction || compact_timeout)
+		return;
+
+	dead = services_log->size - sizeof(struct log_file_header) -
+							services_log->live;
+
+	if (dead < LOG_COMPACT_MIN || dead <= services_log->live)
+		return;
+
+	compact_timeout = g_timeout_add_seconds(LOG_COMPACT_DELAY,
+						compaction_start, NULL);
+}
+
+static int log_save_service(const char *id, const char *data,
+							uint32_t data_len)
+{
+	int err;
+
+	err = log_append(services_log, id, data, data_len, true);
+	if (err < 0)
+		return err;
+
+	if (compaction && (data_len > 0 ||
+			g_hash_table_contains(compaction->log->index, id))) {
+		if (log_append(compaction->log, id, data, data_len,
+								false) < 0)
+			compaction_abort();
+	}
+
+	check_compaction();
+
+	return 0;
+}
+
+static GKeyFile *log_load_service(const char *id)
+{
+	GKeyFile *keyfile;
+	GError *error = NULL;
+	uint32_t data_len;
+	char *data;
+
+	data = log_read(services_log, id, &data_len);
+	if (!data)
+		return NULL;
+
+	keyfile = g_key_file_new();
+
+	if (!g_key_file_load_from_data(keyfile, data, data_len, 0, &error)) {
+		DBG("Unable to load %s: %s", id, error->message);
+		g_clear_error(&error);
+
+		g_key_file_free(keyfile);
+		keyfile = NULL;
+	}
+
+	g_free(data);
+
+	return keyfile;
+}
+
 GKeyFile *__connman_storage_load_global(void)
 {
 	gchar *pathname;
@@ -166,6 +761,14 @@ GKeyFile *__connman_storage_open_service(const char *service_id)
 	gchar *pathname;
 	GKeyFile *keyfile = NULL;
 
+	if (services_log) {
+		keyfile = log_load_service(service_id);
+		if (keyfile)
+			return keyfile;
+
+		return g_key_file_new();
+	}
+
 	pathname = g_strdup_printf("%s/%s/%s", STORAGEDIR, service_id, SETTINGS);
 	if (!pathname)
 		return NULL;
@@ -183,6 +786,175 @@ GKeyFile *__connman_storage_open_service(const char *service_id)
 	return keyfile;
 }
 
+/*
+ * Index of the remembered WiFi networks, holding the settings which
+ * are needed to build scan parameters. It is loaded on first use and
+ * then kept up to date when service settings are saved or removed, so
+ * that a scan does not have to read all settings from disk. The hidden
+ * and autoconnect tables hold the networks the scans ask for.
+ */
+#define KNOWN_NETWORK_PREFIX	"wifi_"
+
+static GHashTable *known_networks;
+static GHashTable *hidden_networks;
+static GHashTable *autoconnect_networks;
+
+static void known_network_free(gpointer data)
+{
+	struct connman_storage_network *network = data;
+
+	g_free((char *) network->ident);
+	g_free((char *) network->name);
+	g_free((char *) network->ssid);
+	g_free(network);
+}
+
+static void known_network_update(const char *service_id, GKeyFile *keyfile)
+{
+	struct connman_storage_network *network;
+	GTimeVal modified;
+	gchar *str;
+
+	if (!known_networks || !g_str_has_prefix(service_id,
+						KNOWN_NETWORK_PREFIX))
+		return;
+
+	g_hash_table_remove(hidden_networks, service_id);
+	g_hash_table_remove(autoconnect_networks, service_id);
+	g_hash_table_remove(known_networks, service_id);
+
+	if (!keyfile || !g_key_file_has_group(keyfile, service_id))
+		return;
+
+	network = g_new0(struct connman_storage_network, 1);
+	network->ident = g_strdup(service_id);
+	network->name = g_key_file_get_string(keyfile, service_id,
+							"Name", NULL);
+	network->ssid = g_key_file_get_string(keyfile, service_id,
+							"SSID", NULL);
+	network->hidden = g_key_file_get_boolean(keyfile, service_id,
+							"Hidden", NULL);
+	network->favorite = g_key_file_get_boolean(keyfile, service_id,
+							"Favorite", NULL);
+	network->autoconnect = g_key_file_get_boolean(keyfile, service_id,
+							"AutoConnect", NULL);
+	network->frequency = g_key_file_get_integer(keyfile, service_id,
+							"Frequency", NULL);
+
+	str = g_key_file_get_string(keyfile, service_id, "Modified", NULL);
+	if (str && g_time_val_from_iso8601(str, &modified))
+		network->modified = modified.tv_sec;
+	g_free(str);
+
+	g_hash_table_replace(known_networks, (char *) network->ident,
+								network);
+
+	if (!network->favorite)
+		return;
+
+	if (network->hidden)
+		g_hash_table_replace(hidden_networks,
+					(char *) network->ident, network);
+
+	if (network->autoconnect && network->modified &&
+						network->frequency)
+		g_hash_table_replace(autoconnect_networks,
+					(char *) network->ident, network);
+}
+
+static void known_networks_load(void)
+{
+	GKeyFile *keyfile;
+	gchar **services;
+	int i;
+
+	if (known_networks)
+		return;
+
+	known_networks = g_hash_table_new_full(g_str_hash, g_str_equal,
+						NULL, known_network_free);
+	hidden_networks = g_hash_table_new(g_str_hash, g_str_equal);
+	autoconnect_networks = g_hash_table_new(g_str_hash, g_str_equal);
+
+	services = connman_storage_get_services();
+	for (i = 0; services && services[i]; i++) {
+		if (!g_str_has_prefix(services[i], KNOWN_NETWORK_PREFIX))
+			continue;
+
+		keyfile = connman_storage_load_service(services[i]);
+		if (!keyfile)
+			continue;
+
+		known_network_update(services[i], keyfile);
+		g_key_file_free(keyfile);
+	}
+
+	g_strfreev(services);
+
+	DBG("%u known networks", g_hash_table_size(known_networks));
+}
+
+static void known_networks_free(void)
+{
+	if (!known_networks)
+		return;
+
+	g_hash_table_destroy(hidden_networks);
+	g_hash_table_destroy(autoconnect_networks);
+	g_hash_table_destroy(known_networks);
+
+	hidden_networks = autoconnect_networks = known_networks = NULL;
+}
+
+static void known_networks_foreach(GHashTable *table,
+				connman_storage_network_cb_t func,
+				void *user_data)
+{
+	GHashTableIter iter;
+	gpointer value;
+
+	g_hash_table_iter_init(&iter, table);
+	while (g_hash_table_iter_next(&iter, NULL, &value))
+		func(value, user_data);
+}
+
+/* Favorite networks which are hidden */
+void connman_storage_foreach_hidden_network(connman_storage_network_cb_t func,
+						void *user_data)
+{
+	known_networks_load();
+
+	known_networks_foreach(hidden_networks, func, user_data);
+}
+
+/* Favorite networks with AutoConnect and a known frequency */
+void connman_storage_foreach_autoconnect_network(
+			connman_storage_network_cb_t func, void *user_data)
+{
+	known_networks_load();
+
+	known_networks_foreach(autoconnect_networks, func, user_data);
+}
+
+static gchar **log_get_services(void)
+{
+	GHashTableIter iter;
+	gchar **services;
+	gpointer key;
+	int i = 0;
+
+	if (g_hash_table_size(services_log->index) == 0)
+		return NULL;
+
+	services = g_new0(gchar *, g_hash_table_size(services_log->index) + 1);
+
+	g_hash_table_iter_init(&iter, services_log->index);
+	while (g_hash_table_iter_next(&iter, &key, NULL))
+		services[i++] = g_strdup(key);
+
+	return services;
+}
+
 gchar **connman_storage_get_services(void)
 {
 	struct dirent *d;
@@ -193,6 +965,9 @@ gchar **connman_storage_get_services(void)
 	struct stat buf;
 	int ret;
 
+	if (services_log)
+		return log_get_services();
+
 	dir = opendir(STORAGEDIR);
 	if (!dir)
 		return NULL;
@@ -245,6 +1020,9 @@ GKeyFile *connman_storage_load_service(const char *service_id)
 	gchar *pathname;
 	GKeyFile *keyfile = NULL;
 
+	if (services_log)
+		return log_load_service(service_id);
+
 	pathname = g_strdup_printf("%s/%s/%s", STORAGEDIR, service_id, SETTINGS);
 	if (!pathname)
 		return NULL;
@@ -274,13 +1052,27 @@ int __connman_storage_save_service(GKeyFile *keyfile, const char *service_id)
 		}
 	}
 
-	pathname = g_strdup_printf("%s/%s", dirname, SETTINGS);
+	if (services_log) {
+		gchar *data;
+		gsize length = 0;
 
-	g_free(dirname);
+		g_free(dirname);
 
-	ret = storage_save(keyfile, pathname);
+		data = g_key_file_to_data(keyfile, &length, NULL);
+		ret = log_save_service(service_id, data, length);
+		g_free(data);
+	} else {
+		pathname = g_strdup_printf("%s/%s", dirname, SETTINGS);
 
-	g_free(pathname);
+		g_free(dirname);
+
+		ret = storage_save(keyfile, pathname);
+
+		g_free(pathname);
+	}
+
+	if (ret == 0)
+		known_network_update(service_id, keyfile);
 
 	return ret;
 }
@@ -329,16 +1121,29 @@ bool __connman_storage_remove_service(const char *service_id)
 {
 	bool removed;
 
+	if (services_log && g_hash_table_contains(services_log->index,
+							service_id)) {
+		if (log_save_service(service_id, NULL, 0) < 0)
+			return false;
+	}
+
 	/* Remove service configuration file */
 	removed = remove_file(service_id, SETTINGS);
 	if (!removed)
 		return false;
 
+	known_network_update(service_id, NULL);
+
 	/* Remove the statistics file also */
 	removed = remove_file(service_id, "data");
 	if (!removed)
 		return false;
 
+	/* and the DNS cache snapshot */
+	removed = remove_file(service_id, "dns-cache");
+	if (!removed)
+		return false;
+
 	removed = remove_dir(service_id);
 	if (!removed)
 		return false;
@@ -474,3 +1279,170 @@ gchar **__connman_storage_get_providers(void)
 
 	return providers;
 }
+
+/*
+ * Copy the settings files of all services into a new log, they are
+ * removed once the log is complete.
+ */
+static struct services_log *log_import(const char *pathname)
+{
+	struct services_log *log;
+	gchar **services, *tmpname, *filename, *data;
+	gsize length;
+	int i, err = 0;
+
+	services = connman_storage_get_services();
+
+	tmpname = g_strdup_printf("%s.tmp", pathname);
+
+	log = log_open(tmpname, O_TRUNC);
+	if (!log)
+		goto out;
+
+	for (i = 0; services && services[i]; i++) {
+		filename = g_strdup_printf("%s/%s/%s", STORAGEDIR,
+						services[i], SETTINGS);
+
+		if (g_file_get_contents(filename, &data, &length, NULL)) {
+			if (length > 0)
+				err = log_append(log, services[i], data,
+							length, false);
+			g_free(data);
+		}
+
+		g_free(filename);
+
+		if (err < 0)
+			break;
+	}
+
+	if (err == 0 && fdatasync(log->fd) < 0)
+		err = -errno;
+
+	if (err == 0 && rename(tmpname, pathname) < 0)
+		err = -errno;
+
+	if (err < 0) {
+		connman_error("Failed to import services: %s",
+							strerror(-err));
+		unlink(tmpname);
+		services_log_free(log);
+		log = NULL;
+		goto out;
+	}
+
+	sync_dir(STORAGEDIR);
+
+	for (i = 0; services && services[i]; i++)
+		remove_file(services[i], SETTINGS);
+
+	DBG("imported %d services", i);
+
+out:
+	g_strfreev(services);
+	g_free(tmpname);
+
+	return log;
+}
+
+/* Write the services of the log back to settings files */
+static void log_export(const char *pathname)
+{
+	struct services_log *log;
+	GHashTableIter iter;
+	gpointer key;
+	gchar *dirname, *filename;
+	uint32_t length;
+	char *data;
+	int err = 0;
+
+	log = log_open(pathname, 0);
+	if (!log)
+		return;
+
+	g_hash_table_iter_init(&iter, log->index);
+	while (err == 0 && g_hash_table_iter_next(&iter, &key, NULL)) {
+		data = log_read(log, key, &length);
+		if (!data) {
+			err = -EIO;
+			break;
+		}
+
+		dirname = g_strdup_printf("%s/%s", STORAGEDIR,
+							(char *) key);
+		filename = g_strdup_printf("%s/%s", dirname, SETTINGS);
+
+		if (mkdir(dirname, MODE) < 0 && errno != EEXIST)
+			err = -errno;
+		else if (!g_file_set_contents(filename, data, length, NULL))
+			err = -EIO;
+
+		g_free(filename);
+		g_free(dirname);
+		g_free(data);
+	}
+
+	services_log_free(log);
+
+	if (err < 0) {
+		connman_error("Failed to export services: %s",
+							strerror(-err));
+		return;
+	}
+
+	unlink(pathname);
+
+	DBG("exported services");
+}
+
+int __connman_storage_init(bool compact)
+{
+	gchar *pathname;
+
+	DBG("compact %d", compact);
+
+	pathname = g_strdup_printf("%s/%s", STORAGEDIR, SERVICES_LOG);
+
+	if (!compact) {
+		if (g_file_test(pathname, G_FILE_TEST_EXISTS))
+			log_export(pathname);
+
+		g_free(pathname);
+		return 0;
+	}
+
+	if (g_file_test(pathname, G_FILE_TEST_EXISTS))
+		services_log = log_open(pathname, 0);
+	else
+		services_log = log_import(pathname);
+
+	g_free(pathname);
+
+	if (!services_log) {
+		connman_warn("Using a settings file per service");
+		return -EIO;
+	}
+
+	DBG("%u services in log", g_hash_table_size(services_log->index));
+
+	check_compaction();
+
+	return 0;
+}
+
+void __connman_storage_cleanup(void)
+{
+	DBG("");
+
+	if (compact_timeout) {
+		g_source_remove(compact_timeout);
+		compact_timeout = 0;
+	}
+
+	compaction_abort();
+
+	services_log_free(services_log);
+	services_log = NULL;
+
+	known_networks_free();
+}
@@ -1587,6 +1587,10 @@ int __connman_technology_set_offlinemode(bool offlinemode)
 
 	global_offlinemode = offlinemode;
 
+	/* the power may be gone soon after going offline */
+	if (offlinemode)
+		__connman_service_flush_saves();
+
 	/* Traverse technology list, enable/disable each technology. */
 	for (list = technology_list; list; list = list->next) {
 		struct connman_technology *technology = list->data;
@@ -0,0 +1,170 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2026  Connection Manager contributors.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Benchmark for the lease handling of the DHCP server: simulated
+ * clients go through DISCOVER and REQUEST one after the other, the
+ * time per packet is printed for every batch of clients so that it
+ * can be seen whether it grows with the number of leases.
+ *
+ * The binary is linked with --wrap for the socket functions of gdhcp,
+ * the server listens on an eventfd which is always readable and gets
+ * its packets from here. It runs on the loopback interface and needs
+ * no privileges.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <net/if.h>
+#include <net/ethernet.h>
+#include <arpa/inet.h>
+#include <sys/eventfd.h>
+
+#include <glib.h>
+
+#include "gdhcp/gdhcp.h"
+#include "gdhcp/common.h"
+
+#define DEFAULT_CLIENTS 10000
+#define BATCH_SIZE 1000
+
+static struct dhcp_packet client_packet;
+static uint32_t reply_yiaddr;
+static uint8_t reply_type;
+
+int __wrap_dhcp_l3_socket(int port, const char *interface, int family)
+{
+	return eventfd(1, EFD_CLOEXEC);
+}
+
+int __wrap_dhcp_recv_l3_packet(struct dhcp_packet *packet, int fd)
+{
+	memcpy(packet, &client_packet, sizeof(*packet));
+
+	return sizeof(*packet);
+}
+
+int __wrap_dhcp_send_raw_packet(struct dhcp_packet *dhcp_pkt,
+			uint32_t source_ip, int source_port,
+			uint32_t dest_ip, int dest_port,
+			const uint8_t *dest_arp, int ifindex, bool bcast)
+{
+	uint8_t *type = dhcp_get_option(dhcp_pkt, DHCP_MESSAGE_TYPE);
+
+	reply_type = type ? *type : 0;
+	reply_yiaddr = dhcp_pkt->yiaddr;
+
+	return 0;
+}
+
+static uint8_t client_send(uint8_t type, unsigned int client,
+							uint32_t requested)
+{
+	dhcp_init_header(&client_packet, type);
+
+	client_packet.xid = htonl(client);
+	client_packet.chaddr[0] = 0x02;
+	client_packet.chaddr[2] = client >> 24;
+	client_packet.chaddr[3] = client >> 16;
+	client_packet.chaddr[4] = client >> 8;
+	client_packet.chaddr[5] = client;
+
+	if (requested)
+		dhcp_add_option_uint32(&client_packet, DHCP_REQUESTED_IP,
+							ntohl(requested));
+
+	reply_type = 0;
+
+	/* the listener is the only source, it handles one packet */
+	g_main_context_iteration(NULL, FALSE);
+
+	return reply_type;
+}
+
+static double elapsed_ns(const struct timespec *start,
+				const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e9 +
+				(end->tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char *argv[])
+{
+	GDHCPServerError error;
+	GDHCPServer *dhcp_server;
+	struct timespec start, end;
+	unsigned int clients = DEFAULT_CLIENTS, client, acked = 0;
+	int index;
+
+	if (argc > 1)
+		clients = strtoul(argv[1], NULL, 10);
+
+	if (clients == 0 || clients > 60000) {
+		fprintf(stderr, "Usage: %s [clients, at most 60000]\n",
+								argv[0]);
+		return 1;
+	}
+
+	index = if_nametoindex("lo");
+
+	dhcp_server = g_dhcp_server_new(G_DHCP_IPV4, index, &error);
+	if (!dhcp_server) {
+		fprintf(stderr, "Cannot create DHCP server (%d)\n", error);
+		return 1;
+	}
+
+	g_dhcp_server_set_ip_range(dhcp_server, "127.1.0.1",
+							"127.1.255.254");
+	g_dhcp_server_start(dhcp_server);
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (client = 1; client <= clients; client++) {
+		if (client_send(DHCPDISCOVER, client, 0) != DHCPOFFER)
+			break;
+
+		if (client_send(DHCPREQUEST, client, reply_yiaddr) == DHCPACK)
+			acked++;
+
+		if (client % BATCH_SIZE == 0 || client == clients) {
+			unsigned int batch = (client - 1) % BATCH_SIZE + 1;
+
+			clock_gettime(CLOCK_MONOTONIC, &end);
+
+			printf("%u leases, %.1f ns per packet\n", client,
+				elapsed_ns(&start, &end) / (2 * batch));
+
+			start = end;
+		}
+	}
+
+	printf("%u of %u clients got a lease\n", acked, clients);
+
+	g_dhcp_server_unref(dhcp_server);
+
+	return acked != clients;
+}
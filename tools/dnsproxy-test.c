@@ -36,6 +36,8 @@
 #include <resolv.h>
 #include <glib.h>
 #include <fcntl.h>
+#include <poll.h>
+#include <dbus/dbus.h>
 
 #if 0
 #define DEBUG
@@ -413,6 +415,172 @@ static void test_multiple_ipv6_tcp_msg(void)
 		g_assert_cmpint(received, >=, sizeof(msg2));
 }
 
+#define BURST_SIZE 16
+#define BURST_COUNT 2000
+
+/*
+ * Read the UDP counters of the DNS proxy, this only works if the proxy
+ * runs inside connmand on the system bus.
+ */
+static gboolean get_udp_counters(dbus_uint64_t *queries, dbus_uint64_t *calls)
+{
+	DBusConnection *conn;
+	DBusMessage *msg, *reply;
+	DBusMessageIter iter, dict;
+	gboolean found = FALSE;
+
+	*queries = *calls = 0;
+
+	conn = dbus_bus_get(DBUS_BUS_SYSTEM, NULL);
+	if (!conn)
+		return FALSE;
+
+	msg = dbus_message_new_method_call("net.connman", "/",
+				"net.connman.Manager", "GetDNSProxyStatistics");
+	reply = dbus_connection_send_with_reply_and_block(conn, msg,
+								1000, NULL);
+	dbus_message_unref(msg);
+	if (!reply)
+		goto out;
+
+	dbus_message_iter_init(reply, &iter);
+	if (dbus_message_iter_get_arg_type(&iter) != DBUS_TYPE_ARRAY)
+		goto unref;
+
+	dbus_message_iter_recurse(&iter, &dict);
+
+	while (dbus_message_iter_get_arg_type(&dict) ==
+						DBUS_TYPE_DICT_ENTRY) {
+		DBusMessageIter entry, value;
+		const char *key;
+		dbus_uint64_t val;
+
+		dbus_message_iter_recurse(&dict, &entry);
+		dbus_message_iter_get_basic(&entry, &key);
+		dbus_message_iter_next(&entry);
+		dbus_message_iter_recurse(&entry, &value);
+
+		if (dbus_message_iter_get_arg_type(&value) ==
+							DBUS_TYPE_UINT64) {
+			dbus_message_iter_get_basic(&value, &val);
+
+			if (g_str_equal(key, "UDPQueries")) {
+				*queries = val;
+				found = TRUE;
+			} else if (g_str_equal(key, "UDPReceiveCalls") ||
+					g_str_equal(key, "UDPSendCalls"))
+				*calls += val;
+		}
+
+		dbus_message_iter_next(&dict);
+	}
+
+unref:
+	dbus_message_unref(reply);
+out:
+	dbus_connection_unref(conn);
+
+	return found;
+}
+
+/*
+ * Send bursts of queries for a cached name, the way many tethered
+ * clients would, and measure how fast the proxy answers them.
+ */
+static void test_udp_burst(void)
+{
+	unsigned char query[BURST_SIZE][sizeof(msg) - 2];
+	unsigned char answer[BURST_SIZE][512];
+	struct mmsghdr msgs[BURST_SIZE];
+	struct iovec iov[BURST_SIZE];
+	struct sockaddr_in sa;
+	socklen_t len = sizeof(sa);
+	dbus_uint64_t queries_before, calls_before, queries, calls;
+	gboolean have_counters;
+	unsigned int burst, i, answered = 0;
+	GTimer *timer;
+	double elapsed;
+	int sk;
+
+	sk = connect_udp_socket("127.0.0.1", (struct sockaddr *)&sa, &len);
+	g_assert_cmpint(sk, >=, 0);
+
+	/* the first query puts the name into the cache */
+	change_msg(msg, 2, 20, 'b');
+	sendto_msg(sk, (struct sockaddr *)&sa, len, msg + 2, sizeof(msg) - 2);
+	receive_from_message(sk, (struct sockaddr *)&sa, len, 10, 12);
+
+	have_counters = get_udp_counters(&queries_before, &calls_before);
+
+	for (i = 0; i < BURST_SIZE; i++)
+		memcpy(query[i], msg + 2, sizeof(query[i]));
+
+	timer = g_timer_new();
+
+	for (burst = 0; burst < BURST_COUNT; burst++) {
+		unsigned int received = 0;
+
+		memset(msgs, 0, sizeof(msgs));
+
+		for (i = 0; i < BURST_SIZE; i++) {
+			change_msg(query[i], 0, 18, 'b');
+
+			iov[i].iov_base = query[i];
+			iov[i].iov_len = sizeof(query[i]);
+			msgs[i].msg_hdr.msg_name = &sa;
+			msgs[i].msg_hdr.msg_namelen = len;
+			msgs[i].msg_hdr.msg_iov = &iov[i];
+			msgs[i].msg_hdr.msg_iovlen = 1;
+		}
+
+		g_assert_cmpint(sendmmsg(sk, msgs, BURST_SIZE, 0), ==,
+								BURST_SIZE);
+
+		while (received < BURST_SIZE) {
+			struct pollfd pfd = { .fd = sk, .events = POLLIN };
+			int count;
+
+			if (poll(&pfd, 1, 1000) <= 0)
+				break;
+
+			memset(msgs, 0, sizeof(msgs));
+
+			for (i = 0; i < BURST_SIZE; i++) {
+				iov[i].iov_base = answer[i];
+				iov[i].iov_len = sizeof(answer[i]);
+				msgs[i].msg_hdr.msg_iov = &iov[i];
+				msgs[i].msg_hdr.msg_iovlen = 1;
+			}
+
+			count = recvmmsg(sk, msgs, BURST_SIZE - received,
+							MSG_DONTWAIT, NULL);
+			if (count > 0)
+				received += count;
+		}
+
+		answered += received;
+	}
+
+	elapsed = g_timer_elapsed(timer, NULL);
+	g_timer_destroy(timer);
+	close(sk);
+
+	g_assert_cmpuint(answered, >, 0);
+
+	g_test_maximized_result(answered / elapsed,
+				"%.0f queries/s (%u of %u answered)",
+				answered / elapsed, answered,
+				BURST_SIZE * BURST_COUNT);
+
+	if (have_counters && get_udp_counters(&queries, &calls) &&
+						queries > queries_before)
+		g_test_minimized_result((double) (calls - calls_before) /
+						(queries - queries_before),
+					"%.2f syscalls/query in the proxy",
+					(double) (calls - calls_before) /
+						(queries - queries_before));
+}
+
 static void test_failure_tcp_msg(void)
 {
 	int sk, received = 0;
@@ -463,5 +631,8 @@ int main(int argc, char *argv[])
 	g_test_add_func("/dnsproxy/multiple ipv6 tcp msg from cache",
 			test_multiple_ipv6_tcp_msg);
 
+	if (g_test_perf())
+		g_test_add_func("/dnsproxy/udp burst", test_udp_burst);
+
 	return g_test_run();
 }
@@ -0,0 +1,178 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2026  Connection Manager contributors.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Micro benchmark for the DNS reply path of the DNS proxy: a reply is
+ * parsed for caching and then rewritten without the appended domain.
+ * The binary is linked with --wrap for malloc, calloc and realloc so
+ * that the allocations done per reply can be counted.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/nameser.h>
+
+#include "src/shared/dnswire.h"
+
+#define DEFAULT_ITERATIONS 1000000
+
+static unsigned long allocations;
+
+void *__real_malloc(size_t size);
+void *__real_calloc(size_t nmemb, size_t size);
+void *__real_realloc(void *ptr, size_t size);
+
+void *__wrap_malloc(size_t size)
+{
+	allocations++;
+	return __real_malloc(size);
+}
+
+void *__wrap_calloc(size_t nmemb, size_t size)
+{
+	allocations++;
+	return __real_calloc(nmemb, size);
+}
+
+void *__wrap_realloc(void *ptr, size_t size)
+{
+	allocations++;
+	return __real_realloc(ptr, size);
+}
+
+/* host.example.com, a CNAME to www.example.com and two addresses */
+static const uint8_t reply[] = {
+	0x31, 0x82, 0x81, 0x80, 0x00, 0x01, 0x00, 0x03,
+	0x00, 0x01, 0x00, 0x00,
+	/* question, offset 12 */
+	0x04, 'h', 'o', 's', 't',
+	0x07, 'e', 'x', 'a', 'm', 'p', 'l', 'e',
+	0x03, 'c', 'o', 'm', 0x00,
+	0x00, 0x01, 0x00, 0x01,
+	/* host.example.com CNAME www.example.com */
+	0xc0, 0x0c, 0x00, 0x05, 0x00, 0x01, 0x00, 0x00, 0x0e, 0x10,
+	0x00, 0x06, 0x03, 'w', 'w', 'w', 0xc0, 0x11,
+	/* www.example.com A 192.0.2.1, owner at offset 46 */
+	0xc0, 0x2e, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c,
+	0x00, 0x04, 0xc0, 0x00, 0x02, 0x01,
+	/* www.example.com A 192.0.2.2 */
+	0xc0, 0x2e, 0x00, 0x01, 0x00, 0x01, 0x00, 0x00, 0x01, 0x2c,
+	0x00, 0x04, 0xc0, 0x00, 0x02, 0x02,
+	/* example.com NS ns.example.com */
+	0xc0, 0x11, 0x00, 0x02, 0x00, 0x01, 0x00, 0x01, 0x51, 0x80,
+	0x00, 0x05, 0x02, 'n', 's', 0xc0, 0x11,
+};
+
+static const uint8_t qname[] = {
+	0x04, 'h', 'o', 's', 't',
+	0x07, 'e', 'x', 'a', 'm', 'p', 'l', 'e',
+	0x03, 'c', 'o', 'm', 0x00,
+};
+
+static const uint8_t host[] = { 0x04, 'h', 'o', 's', 't', 0x00 };
+
+static int parse_reply(const uint8_t *msg, size_t len, uint32_t *ttl)
+{
+	struct dns_reader reader;
+	uint16_t type, class, count;
+	uint8_t name[DNS_MAX_NAME];
+	int err;
+
+	count = dns_get_u16(msg + 6) + dns_get_u16(msg + 8);
+	*ttl = UINT32_MAX;
+
+	dns_reader_init(&reader, msg, len);
+	reader.pos = DNS_HEADER_SIZE;
+
+	err = dns_read_question(&reader, name, sizeof(name), &type, &class);
+	if (err < 0)
+		return err;
+
+	while (count-- > 0) {
+		struct dns_rr rr;
+
+		err = dns_read_rr(&reader, NULL, 0, &rr);
+		if (err < 0)
+			return err;
+
+		if (rr.ttl < *ttl)
+			*ttl = rr.ttl;
+	}
+
+	return reader.pos;
+}
+
+static double elapsed_ns(const struct timespec *start,
+				const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e9 +
+				(end->tv_nsec - start->tv_nsec);
+}
+
+int main(int argc, char *argv[])
+{
+	uint8_t buf[2 + 65535];
+	struct timespec start, end;
+	unsigned long i, iterations = DEFAULT_ITERATIONS, before;
+	uint32_t ttl = 0;
+	int len = 0;
+
+	if (argc > 1)
+		iterations = strtoul(argv[1], NULL, 10);
+
+	if (iterations == 0) {
+		fprintf(stderr, "Usage: %s [iterations]\n", argv[0]);
+		return 1;
+	}
+
+	len = dns_expand_message(reply, sizeof(reply), qname, host,
+							buf, sizeof(buf));
+	if (len < 0 || parse_reply(reply, sizeof(reply), &ttl) < 0) {
+		fprintf(stderr, "Cannot parse the reply\n");
+		return 1;
+	}
+
+	printf("reply %zu bytes, rewritten %d bytes, ttl %u\n",
+					sizeof(reply), len, ttl);
+
+	before = allocations;
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = 0; i < iterations; i++) {
+		parse_reply(reply, sizeof(reply), &ttl);
+		len = dns_expand_message(reply, sizeof(reply), qname, host,
+							buf, sizeof(buf));
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("%lu replies, %.1f ns per reply, %.2f allocations per reply\n",
+		iterations, elapsed_ns(&start, &end) / iterations,
+		(double) (allocations - before) / iterations);
+
+	return len < 0;
+}
@@ -35,33 +35,44 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <stdint.h>
+#include <inttypes.h>
 #include <errno.h>
 
 #include <glib.h>
 #include <glib/gstdio.h>
 
+#include "src/shared/statsshm.h"
+
 #ifdef TEMP_FAILURE_RETRY
 #define TFR TEMP_FAILURE_RETRY
 #else
 #define TFR
 #endif
 
-#define MAGIC 0xFA00B916
+#define MAGIC 0xFA00B917
+#define STATS_FILE_VERSION 2
+
+/* Files with 32 bit counters, connmand converts them on open */
+#define MAGIC_V1 0xFA00B916
 
 struct connman_stats_data {
-	unsigned int rx_packets;
-	unsigned int tx_packets;
-	unsigned int rx_bytes;
-	unsigned int tx_bytes;
-	unsigned int rx_errors;
-	unsigned int tx_errors;
-	unsigned int rx_dropped;
-	unsigned int tx_dropped;
+	uint64_t rx_packets;
+	uint64_t tx_packets;
+	uint64_t rx_bytes;
+	uint64_t tx_bytes;
+	uint64_t rx_errors;
+	uint64_t tx_errors;
+	uint64_t rx_dropped;
+	uint64_t tx_dropped;
 	unsigned int time;
 };
 
 struct stats_file_header {
 	unsigned int magic;
+	unsigned int version;
+	unsigned int record_size;
+	unsigned int reserved;
 	unsigned int begin;
 	unsigned int end;
 	unsigned int home;
@@ -104,6 +115,7 @@ static bool option_summary = false;
 static char *option_info_file_name = NULL;
 static time_t option_start_ts = -1;
 static char *option_last_file_name = NULL;
+static bool option_shm = false;
 
 static bool parse_start_ts(const char *key, const char *value,
 					gpointer user_data, GError **error)
@@ -122,7 +134,8 @@ static GOptionEntry options[] = {
 	{ "create", 'c', 0, G_OPTION_ARG_INT, &option_create,
 			"Create a .data file with NR faked entries", "NR" },
 	{ "interval", 'i', 0, G_OPTION_ARG_INT, &option_interval,
-			"Interval in seconds (used with create)", "INTERVAL" },
+			"Interval in seconds (used with create and shm)",
+			"INTERVAL" },
 	{ "dump", 'd', 0, G_OPTION_ARG_NONE, &option_dump,
 			"Dump contents of .data file" },
 	{ "summary", 's', 0, G_OPTION_ARG_NONE, &option_summary,
@@ -134,6 +147,8 @@ static GOptionEntry options[] = {
 			"(example 2010-11-05T23:00:12Z)", "TS"},
 	{ "last", 'l', 0, G_OPTION_ARG_FILENAME, &option_last_file_name,
 			  "Start values from last .data file" },
+	{ "shm", 'm', 0, G_OPTION_ARG_NONE, &option_shm,
+			"Print the counters published by connmand" },
 	{ NULL },
 };
 
@@ -219,7 +234,8 @@ static void stats_print_record(struct stats_record *rec)
 	char buffer[30];
 
 	strftime(buffer, 30, "%d-%m-%Y %T", localtime(&rec->ts));
-	printf("%p %lld %s %01d %d %d %d %d %d %d %d %d %d\n",
+	printf("%p %lld %s %01d %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64
+		" %" PRIu64 " %" PRIu64 " %" PRIu64 " %" PRIu64 " %d\n",
 		rec, (long long int)rec->ts, buffer,
 		rec->roaming,
 		rec->data.rx_packets,
@@ -272,6 +288,8 @@ static void stats_hdr_info(struct stats_file *file)
 
 	printf("Header\n");
 	printf("  magic           0x%08x\n", hdr->magic);
+	printf("  version         %u\n", hdr->version);
+	printf("  record size     %u\n", hdr->record_size);
 	printf("  begin           [%d] 0x%08x\n",
 		get_index(file, begin), hdr->begin);
 	printf("  end             [%d] 0x%08x\n",
@@ -309,21 +327,21 @@ static void stats_print_entries(struct stats_file *file)
 static void stats_print_rec_diff(struct stats_record *begin,
 					struct stats_record *end)
 {
-	printf("\trx_packets: %d\n",
+	printf("\trx_packets: %" PRIu64 "\n",
 		end->data.rx_packets - begin->data.rx_packets);
-	printf("\ttx_packets: %d\n",
+	printf("\ttx_packets: %" PRIu64 "\n",
 		end->data.tx_packets - begin->data.tx_packets);
-	printf("\trx_bytes:   %d\n",
+	printf("\trx_bytes:   %" PRIu64 "\n",
 		end->data.rx_bytes - begin->data.rx_bytes);
-	printf("\ttx_bytes:   %d\n",
+	printf("\ttx_bytes:   %" PRIu64 "\n",
 		end->data.tx_bytes - begin->data.tx_bytes);
-	printf("\trx_errors:  %d\n",
+	printf("\trx_errors:  %" PRIu64 "\n",
 		end->data.rx_errors - begin->data.rx_errors);
-	printf("\ttx_errors:  %d\n",
+	printf("\ttx_errors:  %" PRIu64 "\n",
 		end->data.tx_errors - begin->data.tx_errors);
-	printf("\trx_dropped: %d\n",
+	printf("\trx_dropped: %" PRIu64 "\n",
 		end->data.rx_dropped - begin->data.rx_dropped);
-	printf("\ttx_dropped: %d\n",
+	printf("\ttx_dropped: %" PRIu64 "\n",
 		end->data.tx_dropped - begin->data.tx_dropped);
 	printf("\ttime:       %d\n",
 		end->data.time - begin->data.time);
@@ -506,7 +524,14 @@ static int stats_open(struct stats_file *file, const char *name)
 
 	/* Initialize new file */
 	hdr = get_hdr(file);
-	if (hdr->magic != MAGIC ||
+	if (hdr->magic == MAGIC_V1) {
+		fprintf(stderr, "%s has 32 bit counters, open it with "
+				"connmand first to convert it\n", file->name);
+		return -EINVAL;
+	}
+
+	if (hdr->magic != MAGIC || hdr->version != STATS_FILE_VERSION ||
+			hdr->record_size != sizeof(struct stats_record) ||
 			hdr->begin < sizeof(struct stats_file_header) ||
 			hdr->end < sizeof(struct stats_file_header) ||
 			hdr->home < sizeof(struct stats_file_header) ||
@@ -514,6 +539,9 @@ static int stats_open(struct stats_file *file, const char *name)
 			hdr->begin > file->len ||
 			hdr->end > file->len) {
 		hdr->magic = MAGIC;
+		hdr->version = STATS_FILE_VERSION;
+		hdr->record_size = sizeof(struct stats_record);
+		hdr->reserved = 0;
 		hdr->begin = sizeof(struct stats_file_header);
 		hdr->end = sizeof(struct stats_file_header);
 		hdr->home = UINT_MAX;
@@ -547,6 +575,9 @@ static int stats_create(struct stats_file *file, unsigned int nr,
 	hdr = get_hdr(file);
 
 	hdr->magic = MAGIC;
+	hdr->version = STATS_FILE_VERSION;
+	hdr->record_size = sizeof(struct stats_record);
+	hdr->reserved = 0;
 	hdr->begin = sizeof(struct stats_file_header);
 	hdr->end = sizeof(struct stats_file_header);
 	hdr->home = UINT_MAX;
@@ -826,6 +857,78 @@ static void history_file_update(struct stats_file *data_file,
 	swap_and_close_files(history_file, &tempory_file);
 }
 
+static double shm_rate(uint64_t value, uint64_t last, uint64_t msec)
+{
+	if (msec == 0 || value < last)
+		return 0;
+
+	return (value - last) * 1000.0 / msec;
+}
+
+/*
+ * Print the counters of the shared memory segment and the rates since
+ * the previous round, which is mapped again when connmand restarted.
+ */
+static int shm_watch(void)
+{
+	static struct stats_shm_entry last[STATS_SHM_ENTRIES];
+	const struct stats_shm *shm = NULL;
+	struct stats_shm_entry entry;
+	struct stats_shm_counters *now, *prev;
+	unsigned int i;
+	uint64_t msec;
+	int err;
+
+	while (1) {
+		if (!shm || !stats_shm_valid(shm)) {
+			if (shm)
+				stats_shm_close(shm);
+
+			err = stats_shm_open(&shm);
+			if (err < 0) {
+				fprintf(stderr, "failed to open %s: %s\n",
+					STATS_SHM_NAME, strerror(-err));
+				return 1;
+			}
+
+			memset(last, 0, sizeof(last));
+		}
+
+		printf("%-40s %14s %14s %12s %12s\n", "Service",
+			"RX bytes", "TX bytes", "RX bytes/s", "TX bytes/s");
+
+		for (i = 0; i < STATS_SHM_ENTRIES; i++) {
+			if (stats_shm_read(shm, i, &entry) < 0)
+				continue;
+
+			now = &entry.counters;
+			prev = &last[i].counters;
+
+			if (strcmp(entry.ident, last[i].ident) != 0)
+				memset(prev, 0, sizeof(*prev));
+
+			msec = prev->updated ? now->updated - prev->updated : 0;
+
+			printf("%-40s %14" PRIu64 " %14" PRIu64
+				" %12.0f %12.0f%s\n", entry.ident,
+				now->rx_bytes, now->tx_bytes,
+				shm_rate(now->rx_bytes, prev->rx_bytes, msec),
+				shm_rate(now->tx_bytes, prev->tx_bytes, msec),
+				entry.flags & STATS_SHM_ENTRY_ROAMING ?
+							" (roaming)" : "");
+
+			last[i] = entry;
+		}
+
+		printf("\n");
+		fflush(stdout);
+
+		sleep(option_interval);
+	}
+
+	return 0;
+}
+
 int main(int argc, char *argv[])
 {
 	GOptionContext *context;
@@ -857,6 +960,14 @@ int main(int argc, char *argv[])
 
 	g_option_context_free(context);
 
+	if (option_interval == 0) {
+		printf("interval cannot be zero, using the default value\n");
+		option_interval = 3;
+	}
+
+	if (option_shm)
+		return shm_watch();
+
 	if (argc < 2) {
 		printf("Usage: %s [FILENAME]\n", argv[0]);
 		exit(0);
@@ -884,11 +995,6 @@ int main(int argc, char *argv[])
 	else
 		start_ts = option_start_ts;
 
-	if (option_interval == 0) {
-		printf("interval cannot be zero, using the default value\n");
-		option_interval = 3;
-	}
-
 	if (option_create > 0)
 		stats_create(data_file, option_create, option_interval,
 				start_ts, rec);
@@ -0,0 +1,359 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2026  Connection Manager contributors.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+/*
+ * Benchmark for the signal handling of gsupplicant: a stream of signals
+ * is replayed through the D-Bus filter of gsupplicant and the time per
+ * signal is printed. The stream is either read from a capture made with
+ *
+ *   dbus-monitor --system --binary > capture
+ *
+ * or generated: an interface with the given number of BSSs, followed
+ * by rounds of BSS PropertiesChanged signals mixed with signals of
+ * other services, like in a crowded scan.
+ *
+ * The binary is linked with --wrap for the D-Bus connection functions
+ * used by gsupplicant, so no bus and no wpa_supplicant are needed.
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <time.h>
+
+#include <glib.h>
+#include <dbus/dbus.h>
+
+#include "gsupplicant/dbus.h"
+#include "gsupplicant/gsupplicant.h"
+
+#define DEFAULT_BSS_COUNT 1000
+#define BSS_PER_NETWORK 4
+#define ROUNDS 10
+
+#define INTERFACE_PATH SUPPLICANT_PATH "/Interfaces/0"
+
+static char bus;
+static DBusHandleMessageFunction filter;
+static const GSupplicantCallbacks callbacks;
+
+DBusConnection *__wrap_dbus_bus_get(DBusBusType type, DBusError *error)
+{
+	return (DBusConnection *) &bus;
+}
+
+void __wrap_dbus_connection_unref(DBusConnection *connection)
+{
+}
+
+dbus_bool_t __wrap_dbus_connection_add_filter(DBusConnection *connection,
+					DBusHandleMessageFunction function,
+					void *user_data,
+					DBusFreeFunction free_data_function)
+{
+	filter = function;
+
+	return TRUE;
+}
+
+void __wrap_dbus_connection_remove_filter(DBusConnection *connection,
+					DBusHandleMessageFunction function,
+					void *user_data)
+{
+	filter = NULL;
+}
+
+void __wrap_dbus_bus_add_match(DBusConnection *connection, const char *rule,
+							DBusError *error)
+{
+}
+
+void __wrap_dbus_bus_remove_match(DBusConnection *connection,
+					const char *rule, DBusError *error)
+{
+}
+
+void __wrap_dbus_connection_flush(DBusConnection *connection)
+{
+}
+
+dbus_bool_t __wrap_dbus_bus_name_has_owner(DBusConnection *connection,
+					const char *name, DBusError *error)
+{
+	return FALSE;
+}
+
+dbus_bool_t __wrap_dbus_connection_send(DBusConnection *connection,
+					DBusMessage *message,
+					dbus_uint32_t *serial)
+{
+	return TRUE;
+}
+
+/* Method calls fail, gsupplicant only gets to know what is signalled */
+dbus_bool_t __wrap_dbus_connection_send_with_reply(DBusConnection *connection,
+					DBusMessage *message,
+					DBusPendingCall **pending_return,
+					int timeout_milliseconds)
+{
+	return FALSE;
+}
+
+static DBusMessage *interface_added(void)
+{
+	DBusMessage *message;
+	DBusMessageIter iter, dict;
+	const char *path = INTERFACE_PATH, *ifname = "wlan0";
+
+	message = dbus_message_new_signal(SUPPLICANT_PATH,
+					SUPPLICANT_INTERFACE, "InterfaceAdded");
+
+	dbus_message_iter_init_append(message, &iter);
+	dbus_message_iter_append_basic(&iter, DBUS_TYPE_OBJECT_PATH, &path);
+
+	supplicant_dbus_dict_open(&iter, &dict);
+	supplicant_dbus_dict_append_basic(&dict, "Ifname",
+						DBUS_TYPE_STRING, &ifname);
+	supplicant_dbus_dict_close(&iter, &dict);
+
+	return message;
+}
+
+static DBusMessage *bss_added(unsigned int index)
+{
+	DBusMessage *message;
+	DBusMessageIter iter, dict;
+	unsigned char bssid[6] = { 0x02, 0x00 }, *bssid_value = bssid;
+	char ssid[32], *ssid_value = ssid, *path, *mode = "infrastructure";
+	dbus_uint16_t frequency = 2412 + 5 * (index % 13);
+	dbus_int16_t signal = -40 - index % 50;
+	dbus_bool_t privacy = FALSE;
+
+	bssid[2] = index >> 24;
+	bssid[3] = index >> 16;
+	bssid[4] = index >> 8;
+	bssid[5] = index;
+
+	snprintf(ssid, sizeof(ssid), "network-%u", index / BSS_PER_NETWORK);
+	path = g_strdup_printf("%s/BSSs/%u", INTERFACE_PATH, index);
+
+	message = dbus_message_new_signal(INTERFACE_PATH,
+				SUPPLICANT_INTERFACE ".Interface", "BSSAdded");
+
+	dbus_message_iter_init_append(message, &iter);
+	dbus_message_iter_append_basic(&iter, DBUS_TYPE_OBJECT_PATH, &path);
+
+	supplicant_dbus_dict_open(&iter, &dict);
+	supplicant_dbus_dict_append_fixed_array(&dict, "BSSID",
+				DBUS_TYPE_BYTE, &bssid_value, sizeof(bssid));
+	supplicant_dbus_dict_append_fixed_array(&dict, "SSID",
+				DBUS_TYPE_BYTE, &ssid_value, strlen(ssid));
+	supplicant_dbus_dict_append_basic(&dict, "Mode",
+					DBUS_TYPE_STRING, &mode);
+	supplicant_dbus_dict_append_basic(&dict, "Frequency",
+					DBUS_TYPE_UINT16, &frequency);
+	supplicant_dbus_dict_append_basic(&dict, "Signal",
+					DBUS_TYPE_INT16, &signal);
+	supplicant_dbus_dict_append_basic(&dict, "Privacy",
+					DBUS_TYPE_BOOLEAN, &privacy);
+	supplicant_dbus_dict_close(&iter, &dict);
+
+	g_free(path);
+
+	return message;
+}
+
+static DBusMessage *bss_changed(unsigned int index, unsigned int round)
+{
+	DBusMessage *message;
+	DBusMessageIter iter, dict;
+	dbus_int16_t signal = -40 - (index + round) % 50;
+	char *path;
+
+	path = g_strdup_printf("%s/BSSs/%u", INTERFACE_PATH, index);
+
+	message = dbus_message_new_signal(path,
+			SUPPLICANT_INTERFACE ".BSS", "PropertiesChanged");
+
+	dbus_message_iter_init_append(message, &iter);
+
+	supplicant_dbus_dict_open(&iter, &dict);
+	supplicant_dbus_dict_append_basic(&dict, "Signal",
+					DBUS_TYPE_INT16, &signal);
+	supplicant_dbus_dict_close(&iter, &dict);
+
+	g_free(path);
+
+	return message;
+}
+
+/* A signal of another service, which gsupplicant has to ignore */
+static DBusMessage *other_changed(unsigned int index)
+{
+	DBusMessage *message;
+	const char *name = "Strength";
+	char *path;
+
+	path = g_strdup_printf("/net/connman/service/wifi_%u", index);
+
+	message = dbus_message_new_signal(path, "net.connman.Service",
+							"PropertyChanged");
+	dbus_message_append_args(message, DBUS_TYPE_STRING, &name,
+							DBUS_TYPE_INVALID);
+
+	g_free(path);
+
+	return message;
+}
+
+static GPtrArray *generate_stream(unsigned int count)
+{
+	GPtrArray *stream;
+	unsigned int index, round;
+
+	stream = g_ptr_array_new();
+
+	g_ptr_array_add(stream, interface_added());
+
+	for (index = 0; index < count; index++)
+		g_ptr_array_add(stream, bss_added(index));
+
+	for (round = 0; round < ROUNDS; round++) {
+		for (index = 0; index < count; index++) {
+			g_ptr_array_add(stream, bss_changed(index, round));
+
+			if (index % 4 == 0)
+				g_ptr_array_add(stream, other_changed(index));
+		}
+	}
+
+	return stream;
+}
+
+static GPtrArray *read_stream(const char *filename)
+{
+	GPtrArray *stream;
+	gchar *contents;
+	gsize length, offset = 0;
+
+	if (!g_file_get_contents(filename, &contents, &length, NULL))
+		return NULL;
+
+	stream = g_ptr_array_new();
+
+	while (offset < length) {
+		DBusMessage *message;
+		int size;
+
+		size = dbus_message_demarshal_bytes_needed(contents + offset,
+							length - offset);
+		if (size <= 0 || (gsize) size > length - offset)
+			break;
+
+		message = dbus_message_demarshal(contents + offset, size,
+									NULL);
+		if (!message)
+			break;
+
+		if (dbus_message_get_type(message) == DBUS_MESSAGE_TYPE_SIGNAL)
+			g_ptr_array_add(stream, message);
+		else
+			dbus_message_unref(message);
+
+		offset += size;
+	}
+
+	g_free(contents);
+
+	return stream;
+}
+
+static double elapsed_ns(const struct timespec *start,
+				const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1e9 +
+				(end->tv_nsec - start->tv_nsec);
+}
+
+static void replay(GPtrArray *stream, unsigned int from, unsigned int to,
+						const char *description)
+{
+	struct timespec start, end;
+	unsigned int i;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	for (i = from; i < to; i++)
+		filter((DBusConnection *) &bus,
+				g_ptr_array_index(stream, i), NULL);
+
+	clock_gettime(CLOCK_MONOTONIC, &end);
+
+	printf("%s: %u signals, %.1f ns per signal\n", description, to - from,
+			to > from ? elapsed_ns(&start, &end) / (to - from) : 0);
+}
+
+int main(int argc, char *argv[])
+{
+	unsigned int count = DEFAULT_BSS_COUNT;
+	GPtrArray *stream;
+	char *end;
+
+	if (argc > 1) {
+		count = strtoul(argv[1], &end, 10);
+		if (*end != '\0')
+			count = 0;
+	}
+
+	g_supplicant_register(&callbacks);
+
+	if (!filter) {
+		fprintf(stderr, "No D-Bus filter registered\n");
+		return 1;
+	}
+
+	if (argc > 1 && count == 0) {
+		stream = read_stream(argv[1]);
+		if (!stream) {
+			fprintf(stderr, "Cannot read %s\n", argv[1]);
+			return 1;
+		}
+
+		replay(stream, 0, stream->len, "capture");
+	} else {
+		stream = generate_stream(count);
+
+		replay(stream, 0, count + 1, "interface and BSSs added");
+		replay(stream, count + 1, stream->len, "BSSs changed");
+	}
+
+	g_ptr_array_foreach(stream, (GFunc) dbus_message_unref, NULL);
+	g_ptr_array_free(stream, TRUE);
+
+	g_supplicant_unregister(&callbacks);
+
+	return 0;
+}
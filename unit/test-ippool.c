@@ -23,6 +23,8 @@
 #include <config.h>
 #endif
 
+#include <stdio.h>
+
 #include <glib.h>
 
 #include "../src/connman.h"
@@ -46,11 +48,11 @@ static void test_case_1(void)
 
 	__connman_ippool_init();
 
-	pool = __connman_ippool_create(23, 1, 500, NULL, NULL);
+	pool = __connman_ippool_create(23, 24, 1, 500, NULL, NULL);
 	g_assert(!pool);
 
 	for (i = 0; i < 100000; i++) {
-		pool = __connman_ippool_create(23, 1, 20, NULL, NULL);
+		pool = __connman_ippool_create(23, 24, 1, 20, NULL, NULL);
 		g_assert(pool);
 
 		__connman_ippool_free(pool);
@@ -73,7 +75,7 @@ static void test_case_2(void)
 
 	/* Test the IP range */
 	for (i = 1; i < 254; i++) {
-		pool = __connman_ippool_create(23, 1, i, NULL, NULL);
+		pool = __connman_ippool_create(23, 24, 1, i, NULL, NULL);
 		g_assert(pool);
 
 		gateway = __connman_ippool_get_gateway(pool);
@@ -130,7 +132,7 @@ static void test_case_3(void)
 	__connman_ippool_newaddr(46, "172.16.0.1", 11);
 
 	while (TRUE) {
-		pool = __connman_ippool_create(23, 1, 100, NULL, NULL);
+		pool = __connman_ippool_create(23, 24, 1, 100, NULL, NULL);
 		if (!pool)
 			break;
 		i += 1;
@@ -192,7 +194,7 @@ static void test_case_4(void)
 	/* Test the IP range collision */
 
 	flag = 0;
-	pool = __connman_ippool_create(23, 1, 100, collision_cb, &flag);
+	pool = __connman_ippool_create(23, 24, 1, 100, collision_cb, &flag);
 	g_assert(pool);
 
 	gateway = __connman_ippool_get_gateway(pool);
@@ -223,7 +225,7 @@ static void test_case_4(void)
 
 	flag = 0;
 
-	pool = __connman_ippool_create(23, 1, 100, collision_cb, &flag);
+	pool = __connman_ippool_create(23, 24, 1, 100, collision_cb, &flag);
 	g_assert(pool);
 
 	gateway = __connman_ippool_get_gateway(pool);
@@ -271,7 +273,7 @@ static void test_case_5(void)
 	g_assert(flag == 0);
 
 	/* pool should return 192.168.0.1 now */
-	pool1 = __connman_ippool_create(26, 1, 100, collision_cb, &flag);
+	pool1 = __connman_ippool_create(26, 24, 1, 100, collision_cb, &flag);
 	g_assert(pool1);
 
 	gateway = __connman_ippool_get_gateway(pool1);
@@ -303,7 +305,7 @@ static void test_case_5(void)
 
 	/* pool should return 192.168.2.1 now */
 	flag = 0;
-	pool2 = __connman_ippool_create(23, 1, 100, collision_cb, &flag);
+	pool2 = __connman_ippool_create(23, 24, 1, 100, collision_cb, &flag);
 	g_assert(pool2);
 
 	gateway = __connman_ippool_get_gateway(pool2);
@@ -361,7 +363,7 @@ static void test_case_6(void)
 	g_assert(flag == 0);
 
 	/* pool should return 192.168.2.1 now */
-	pool1 = __connman_ippool_create(26, 1, 100, collision_cb, &flag);
+	pool1 = __connman_ippool_create(26, 24, 1, 100, collision_cb, &flag);
 	g_assert(pool1);
 
 	gateway = __connman_ippool_get_gateway(pool1);
@@ -393,7 +395,7 @@ static void test_case_6(void)
 
 	/* pool should return 192.168.3.1 now */
 	flag = 0;
-	pool2 = __connman_ippool_create(23, 1, 100, collision_cb, &flag);
+	pool2 = __connman_ippool_create(23, 24, 1, 100, collision_cb, &flag);
 	g_assert(pool2);
 
 	gateway = __connman_ippool_get_gateway(pool2);
@@ -431,6 +433,177 @@ static void test_case_6(void)
 	__connman_ippool_cleanup();
 }
 
+static void test_case_7(void)
+{
+	struct connman_ippool *pool1, *pool2, *pool3, *pool4;
+
+	__connman_ippool_init();
+
+	/* Test pool sizes other than /24 */
+
+	g_assert(!__connman_ippool_create(23, 16, 1, 100, NULL, NULL));
+	g_assert(!__connman_ippool_create(23, 31, 1, 0, NULL, NULL));
+	g_assert(!__connman_ippool_create(23, 28, 1, 14, NULL, NULL));
+
+	pool1 = __connman_ippool_create(23, 28, 1, 13, NULL, NULL);
+	g_assert(pool1);
+
+	g_assert_cmpstr(__connman_ippool_get_gateway(pool1), ==,
+							"192.168.0.1");
+	g_assert_cmpstr(__connman_ippool_get_broadcast(pool1), ==,
+							"192.168.0.15");
+	g_assert_cmpstr(__connman_ippool_get_subnet_mask(pool1), ==,
+							"255.255.255.240");
+	g_assert_cmpstr(__connman_ippool_get_start_ip(pool1), ==,
+							"192.168.0.1");
+	g_assert_cmpstr(__connman_ippool_get_end_ip(pool1), ==,
+							"192.168.0.14");
+
+	pool2 = __connman_ippool_create(24, 28, 2, 1, NULL, NULL);
+	g_assert(pool2);
+
+	g_assert_cmpstr(__connman_ippool_get_gateway(pool2), ==,
+							"192.168.0.17");
+	g_assert_cmpstr(__connman_ippool_get_broadcast(pool2), ==,
+							"192.168.0.31");
+
+	/* the /24 holding the small pools is not free anymore */
+	pool3 = __connman_ippool_create(25, 24, 1, 100, NULL, NULL);
+	g_assert(pool3);
+
+	g_assert_cmpstr(__connman_ippool_get_gateway(pool3), ==,
+							"192.168.1.1");
+	g_assert_cmpstr(__connman_ippool_get_broadcast(pool3), ==,
+							"192.168.1.255");
+
+	/* and a /22 has to start behind all of them */
+	pool4 = __connman_ippool_create(26, 22, 1, 1000, NULL, NULL);
+	g_assert(pool4);
+
+	g_assert_cmpstr(__connman_ippool_get_gateway(pool4), ==,
+							"192.168.4.1");
+	g_assert_cmpstr(__connman_ippool_get_broadcast(pool4), ==,
+							"192.168.7.255");
+	g_assert_cmpstr(__connman_ippool_get_subnet_mask(pool4), ==,
+							"255.255.252.0");
+
+	__connman_ippool_free(pool1);
+	__connman_ippool_free(pool2);
+	__connman_ippool_free(pool3);
+	__connman_ippool_free(pool4);
+
+	__connman_ippool_cleanup();
+}
+
+static void test_case_8(void)
+{
+	struct connman_ippool *pool;
+	int flag;
+
+	__connman_ippool_init();
+
+	/* A block in use anywhere in the /24 makes it collide */
+
+	__connman_ippool_newaddr(25, "192.168.0.130", 25);
+
+	flag = 0;
+	pool = __connman_ippool_create(26, 24, 1, 100, collision_cb, &flag);
+	g_assert(pool);
+
+	g_assert_cmpstr(__connman_ippool_get_gateway(pool), ==,
+							"192.168.1.1");
+
+	__connman_ippool_newaddr(27, "192.168.1.200", 32);
+	g_assert(flag == 1);
+
+	__connman_ippool_free(pool);
+
+	__connman_ippool_deladdr(25, "192.168.0.130", 25);
+	__connman_ippool_deladdr(27, "192.168.1.200", 32);
+
+	/* the search goes on from the last block, which is free again */
+	pool = __connman_ippool_create(26, 24, 1, 100, NULL, NULL);
+	g_assert(pool);
+
+	g_assert_cmpstr(__connman_ippool_get_gateway(pool), ==,
+							"192.168.1.1");
+
+	__connman_ippool_free(pool);
+
+	__connman_ippool_cleanup();
+}
+
+/* The /24 of the nth bridge, the private ranges are filled in order */
+static void bridge_address(int n, char *address, size_t len)
+{
+	if (n < 255)
+		snprintf(address, len, "192.168.%d.1", n);
+	else if (n < 255 + 16 * 255)
+		snprintf(address, len, "172.%d.%d.1", 16 + (n - 255) / 255,
+							(n - 255) % 255);
+	else
+		snprintf(address, len, "10.%d.%d.1",
+					(n - 255 - 16 * 255) / 255,
+					(n - 255 - 16 * 255) % 255);
+}
+
+/*
+ * Lots of container bridges and a pool created and freed again next to
+ * them, while another bridge comes and goes. The time per round should
+ * not grow with the number of bridges, run with -m perf for the larger
+ * numbers.
+ */
+static void test_case_scaling(void)
+{
+	struct connman_ippool *pool;
+	char address[32];
+	int bridges, i, total = 0;
+	double elapsed;
+
+	__connman_ippool_init();
+
+	for (bridges = 1000; bridges <= (g_test_perf() ? 64000 : 4000);
+							bridges *= 2) {
+		for (i = total; i < bridges; i++) {
+			bridge_address(i, address, sizeof(address));
+			__connman_ippool_newaddr(1000 + i, address, 24);
+		}
+
+		total = bridges;
+
+		bridge_address(bridges / 2, address, sizeof(address));
+
+		g_test_timer_start();
+
+		for (i = 0; i < 1000; i++) {
+			pool = __connman_ippool_create(23, 24, 1, 100,
+							NULL, NULL);
+			g_assert(pool);
+
+			__connman_ippool_newaddr(999, address, 24);
+			__connman_ippool_free(pool);
+			__connman_ippool_deladdr(999, address, 24);
+		}
+
+		elapsed = g_test_timer_elapsed();
+
+		g_test_minimized_result(elapsed * 1e6 / 1000,
+			"%d bridges, %.2f us per round", bridges,
+			elapsed * 1e6 / 1000);
+
+		/* the pool has to go behind all of the bridges */
+		bridge_address(bridges, address, sizeof(address));
+
+		pool = __connman_ippool_create(23, 24, 1, 100, NULL, NULL);
+		g_assert(pool);
+		g_assert_cmpstr(__connman_ippool_get_gateway(pool), ==,
+								address);
+		__connman_ippool_free(pool);
+	}
+
+	__connman_ippool_cleanup();
+}
+
 int main(int argc, char *argv[])
 {
 	g_test_init(&argc, &argv, NULL);
@@ -441,6 +614,9 @@ int main(int argc, char *argv[])
 	g_test_add_func("/ippool/Test case 4", test_case_4);
 	g_test_add_func("/ippool/Test case 5", test_case_5);
 	g_test_add_func("/ippool/Test case 6", test_case_6);
+	g_test_add_func("/ippool/Test case 7", test_case_7);
+	g_test_add_func("/ippool/Test case 8", test_case_8);
+	g_test_add_func("/ippool/Scaling", test_case_scaling);
 
 	return g_test_run();
 }
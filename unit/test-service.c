@@ -0,0 +1,872 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <glib.h>
+#include <gdbus.h>
+
+#include "../src/connman.h"
+
+/* The networks only carry what the service needs from them */
+struct connman_network {
+	char *ident;
+	char *name;
+	uint8_t strength;
+};
+
+static unsigned int strength_hysteresis = 10;
+
+/* Start of dummies */
+
+unsigned int connman_setting_get_uint(const char *key)
+{
+	if (g_str_equal(key, "ServiceStrengthHysteresis"))
+		return strength_hysteresis;
+
+	return 0;
+}
+
+const char *__connman_network_get_ident(struct connman_network *network)
+{
+	return network->ident;
+}
+
+const char *connman_network_get_group(struct connman_network *network)
+{
+	return "managed_psk";
+}
+
+const char *__connman_network_get_type(struct connman_network *network)
+{
+	return "wifi";
+}
+
+enum connman_network_type connman_network_get_type(
+					struct connman_network *network)
+{
+	return CONNMAN_NETWORK_TYPE_WIFI;
+}
+
+const char *connman_network_get_string(struct connman_network *network,
+							const char *key)
+{
+	if (g_str_equal(key, "Name"))
+		return network->name;
+
+	if (g_str_equal(key, "WiFi.Security"))
+		return "psk";
+
+	return NULL;
+}
+
+uint8_t connman_network_get_strength(struct connman_network *network)
+{
+	return network->strength;
+}
+
+struct connman_network *
+connman_network_ref_debug(struct connman_network *network,
+			const char *file, int line, const char *caller)
+{
+	return network;
+}
+
+void __connman_6to4_remove(struct connman_ipconfig *ipconfig)
+{
+}
+
+int __connman_agent_request_passphrase_input(struct connman_service *service,
+			authentication_cb_t callback, const char *dbus_sender,
+			void *user_data)
+{
+	return 0;
+}
+
+int __connman_config_provision_service(struct connman_service *service)
+{
+	return 0;
+}
+
+int __connman_config_provision_service_ident(struct connman_service *service,
+			const char *ident, const char *file, const char *entry)
+{
+	return 0;
+}
+
+void __connman_connection_gateway_remove(struct connman_service *service,
+			enum connman_ipconfig_type type)
+{
+}
+
+bool __connman_connection_update_gateway(void)
+{
+	return false;
+}
+
+void __connman_counter_send_usage(const char *path, DBusMessage *message)
+{
+}
+
+dbus_bool_t __connman_dbus_append_objpath_array(DBusMessage *msg,
+			connman_dbus_append_cb_t function, void *user_data)
+{
+	return FALSE;
+}
+
+dbus_bool_t __connman_dbus_append_objpath_dict_array(DBusMessage *msg,
+			connman_dbus_append_cb_t function, void *user_data)
+{
+	return FALSE;
+}
+
+int __connman_device_request_hidden_scan(struct connman_device *device,
+			const char *ssid, unsigned int ssid_len,
+			const char *identity, const char *passphrase,
+			const char *security, void *user_data)
+{
+	return 0;
+}
+
+DBusMessage *__connman_error_failed(DBusMessage *msg, int errnum)
+{
+	return NULL;
+}
+
+DBusMessage *__connman_error_in_progress(DBusMessage *msg)
+{
+	return NULL;
+}
+
+DBusMessage *__connman_error_invalid_arguments(DBusMessage *msg)
+{
+	return NULL;
+}
+
+DBusMessage *__connman_error_invalid_property(DBusMessage *msg)
+{
+	return NULL;
+}
+
+DBusMessage *__connman_error_invalid_service(DBusMessage *msg)
+{
+	return NULL;
+}
+
+DBusMessage *__connman_error_not_supported(DBusMessage *msg)
+{
+	return NULL;
+}
+
+DBusMessage *__connman_error_operation_timeout(DBusMessage *msg)
+{
+	return NULL;
+}
+
+int __connman_ipconfig_address_remove(struct connman_ipconfig *ipconfig)
+{
+	return 0;
+}
+
+void __connman_ipconfig_append_ethernet(struct connman_ipconfig *ipconfig,
+			DBusMessageIter *iter)
+{
+}
+
+void __connman_ipconfig_append_ipv4(struct connman_ipconfig *ipconfig,
+			DBusMessageIter *iter)
+{
+}
+
+void __connman_ipconfig_append_ipv4config(struct connman_ipconfig *ipconfig,
+			DBusMessageIter *iter)
+{
+}
+
+void __connman_ipconfig_append_ipv6(struct connman_ipconfig *ipconfig,
+			DBusMessageIter *iter,
+			struct connman_ipconfig *ip4config)
+{
+}
+
+void __connman_ipconfig_append_ipv6config(struct connman_ipconfig *ipconfig,
+			DBusMessageIter *iter)
+{
+}
+
+struct connman_ipconfig *__connman_ipconfig_create(int index,
+			enum connman_ipconfig_type type)
+{
+	return NULL;
+}
+
+int __connman_ipconfig_disable(struct connman_ipconfig *ipconfig)
+{
+	return 0;
+}
+
+void __connman_ipconfig_disable_ipv6(struct connman_ipconfig *ipconfig)
+{
+}
+
+int __connman_ipconfig_enable(struct connman_ipconfig *ipconfig)
+{
+	return 0;
+}
+
+enum connman_ipconfig_type __connman_ipconfig_get_config_type(
+			struct connman_ipconfig *ipconfig)
+{
+	return 0;
+}
+
+void *__connman_ipconfig_get_data(struct connman_ipconfig *ipconfig)
+{
+	return NULL;
+}
+
+const char *__connman_ipconfig_get_gateway_from_index(int index,
+			enum connman_ipconfig_type type)
+{
+	return NULL;
+}
+
+int __connman_ipconfig_get_index(struct connman_ipconfig *ipconfig)
+{
+	return 0;
+}
+
+enum connman_ipconfig_method __connman_ipconfig_get_method(
+			struct connman_ipconfig *ipconfig)
+{
+	return 0;
+}
+
+const char *__connman_ipconfig_get_proxy_autoconfig(
+			struct connman_ipconfig *ipconfig)
+{
+	return NULL;
+}
+
+int __connman_ipconfig_ipv6_reset_privacy(struct connman_ipconfig *ipconfig)
+{
+	return 0;
+}
+
+bool __connman_ipconfig_is_usable(struct connman_ipconfig *ipconfig)
+{
+	return false;
+}
+
+int __connman_ipconfig_load(struct connman_ipconfig *ipconfig,
+			GKeyFile *keyfile, const char *identifier,
+			const char *prefix)
+{
+	return 0;
+}
+
+int __connman_ipconfig_save(struct connman_ipconfig *ipconfig,
+			GKeyFile *keyfile, const char *identifier,
+			const char *prefix)
+{
+	return 0;
+}
+
+int __connman_ipconfig_set_config(struct connman_ipconfig *ipconfig,
+			DBusMessageIter *array)
+{
+	return 0;
+}
+
+void __connman_ipconfig_set_data(struct connman_ipconfig *ipconfig, void *data)
+{
+}
+
+int __connman_ipconfig_set_method(struct connman_ipconfig *ipconfig,
+			enum connman_ipconfig_method method)
+{
+	return 0;
+}
+
+void __connman_ipconfig_set_ops(struct connman_ipconfig *ipconfig,
+			const struct connman_ipconfig_ops *ops)
+{
+}
+
+int __connman_ipconfig_set_proxy_autoconfig(struct connman_ipconfig *ipconfig,
+			const char *url)
+{
+	return 0;
+}
+
+int __connman_ipconfig_set_rp_filter(void)
+{
+	return 0;
+}
+
+const char *__connman_ipconfig_type2string(enum connman_ipconfig_type type)
+{
+	return NULL;
+}
+
+void __connman_ipconfig_unref_debug(struct connman_ipconfig *ipconfig,
+			const char *file, int line, const char *caller)
+{
+}
+
+void __connman_ipconfig_unset_rp_filter(int old_value)
+{
+}
+
+int __connman_network_clear_ipconfig(struct connman_network *network,
+			struct connman_ipconfig *ipconfig)
+{
+	return 0;
+}
+
+int __connman_network_connect(struct connman_network *network)
+{
+	return 0;
+}
+
+int __connman_network_disconnect(struct connman_network *network)
+{
+	return 0;
+}
+
+int __connman_network_enable_ipconfig(struct connman_network *network,
+			struct connman_ipconfig *ipconfig)
+{
+	return 0;
+}
+
+bool __connman_network_get_weakness(struct connman_network *network)
+{
+	return false;
+}
+
+void __connman_notifier_connect(enum connman_service_type type)
+{
+}
+
+void __connman_notifier_default_changed(struct connman_service *service)
+{
+}
+
+void __connman_notifier_disconnect(enum connman_service_type type)
+{
+}
+
+void __connman_notifier_enter_online(enum connman_service_type type)
+{
+}
+
+void __connman_notifier_ipconfig_changed(struct connman_service *service,
+			struct connman_ipconfig *ipconfig)
+{
+}
+
+void __connman_notifier_leave_online(enum connman_service_type type)
+{
+}
+
+void __connman_notifier_proxy_changed(struct connman_service *service)
+{
+}
+
+void __connman_notifier_service_add(struct connman_service *service,
+			const char *name)
+{
+}
+
+void __connman_notifier_service_remove(struct connman_service *service)
+{
+}
+
+void __connman_notifier_service_state_changed(struct connman_service *service,
+			enum connman_service_state state)
+{
+}
+
+void __connman_provider_append_properties(struct connman_provider *provider,
+			DBusMessageIter *iter)
+{
+}
+
+bool __connman_provider_check_routes(struct connman_provider *provider)
+{
+	return false;
+}
+
+int __connman_provider_connect(struct connman_provider *provider,
+			const char *dbus_sender)
+{
+	return 0;
+}
+
+const char *__connman_provider_get_ident(struct connman_provider *provider)
+{
+	return NULL;
+}
+
+bool __connman_provider_is_immutable(struct connman_provider *provider)
+{
+	return false;
+}
+
+void __connman_resolver_append_fallback_nameservers(void)
+{
+}
+
+int __connman_resolver_set_mdns(int index, bool enabled)
+{
+	return 0;
+}
+
+void __connman_rtnl_update_index_add(int index)
+{
+}
+
+void __connman_rtnl_update_index_remove(int index)
+{
+}
+
+bool __connman_session_policy_autoconnect(
+			enum connman_service_connect_reason reason)
+{
+	return false;
+}
+
+int __connman_stats_get(struct connman_service *service, bool roaming,
+			struct connman_stats_data *data)
+{
+	return 0;
+}
+
+int __connman_stats_service_register(struct connman_service *service)
+{
+	return 0;
+}
+
+void __connman_stats_service_unregister(struct connman_service *service)
+{
+}
+
+void __connman_stats_shm_remove(const char *ident)
+{
+}
+
+void __connman_stats_shm_update(const char *ident, bool roaming,
+			const struct connman_stats_data *data)
+{
+}
+
+int __connman_stats_update(struct connman_service *service, bool roaming,
+			struct connman_stats_data *data)
+{
+	return 0;
+}
+
+GKeyFile *__connman_storage_load_config(const char *ident)
+{
+	return NULL;
+}
+
+GKeyFile *__connman_storage_open_service(const char *ident)
+{
+	return NULL;
+}
+
+bool __connman_storage_remove_service(const char *service_id)
+{
+	return false;
+}
+
+int __connman_storage_save_service(GKeyFile *keyfile, const char *ident)
+{
+	return 0;
+}
+
+GSList *__connman_timeserver_get_all(struct connman_service *service)
+{
+	return NULL;
+}
+
+int __connman_timeserver_sync(struct connman_service *service)
+{
+	return 0;
+}
+
+int __connman_utsname_set_domainname(const char *domainname)
+{
+	return 0;
+}
+
+int __connman_utsname_set_hostname(const char *hostname)
+{
+	return 0;
+}
+
+int __connman_wispr_start(struct connman_service *service,
+			enum connman_ipconfig_type type)
+{
+	return 0;
+}
+
+void __connman_wispr_stop(struct connman_service *service)
+{
+}
+
+int __connman_wpad_start(struct connman_service *service)
+{
+	return 0;
+}
+
+void __connman_wpad_stop(struct connman_service *service)
+{
+}
+
+void connman_agent_cancel(void *user_context)
+{
+}
+
+int connman_agent_driver_register(struct connman_agent_driver *driver)
+{
+	return 0;
+}
+
+void connman_agent_driver_unregister(struct connman_agent_driver *driver)
+{
+}
+
+int connman_agent_report_error(void *user_context, const char *path,
+			const char *error, report_error_cb_t callback,
+			const char *dbus_sender, void *user_data)
+{
+	return 0;
+}
+
+DBusConnection *connman_dbus_get_connection(void)
+{
+	return NULL;
+}
+
+void connman_dbus_property_append_array(DBusMessageIter *iter, const char *key,
+			int type, connman_dbus_append_cb_t function,
+			void *user_data)
+{
+}
+
+void connman_dbus_property_append_basic(DBusMessageIter *iter, const char *key,
+			int type, void *val)
+{
+}
+
+void connman_dbus_property_append_dict(DBusMessageIter *iter, const char *key,
+			connman_dbus_append_cb_t function, void *user_data)
+{
+}
+
+dbus_bool_t connman_dbus_property_changed_array(const char *path,
+			const char *interface, const char *key, int type,
+			connman_dbus_append_cb_t function, void *user_data)
+{
+	return FALSE;
+}
+
+dbus_bool_t connman_dbus_property_changed_basic(const char *path,
+			const char *interface, const char *key, int type,
+			void *val)
+{
+	return FALSE;
+}
+
+dbus_bool_t connman_dbus_property_changed_dict(const char *path,
+			const char *interface, const char *key,
+			connman_dbus_append_cb_t function, void *user_data)
+{
+	return FALSE;
+}
+
+void connman_dbus_reply_pending(DBusMessage *pending, int error,
+			const char *path)
+{
+}
+
+bool connman_device_get_scanning(struct connman_device *device,
+			enum connman_service_type type)
+{
+	return false;
+}
+
+int connman_inet_add_host_route(int index, const char *host,
+			const char *gateway)
+{
+	return 0;
+}
+
+int connman_inet_add_ipv6_host_route(int index, const char *host,
+			const char *gateway)
+{
+	return 0;
+}
+
+int connman_inet_check_ipaddress(const char *host)
+{
+	return 0;
+}
+
+bool connman_inet_compare_subnet(int index, const char *host)
+{
+	return false;
+}
+
+int connman_inet_del_host_route(int index, const char *host)
+{
+	return 0;
+}
+
+int connman_inet_del_ipv6_host_route(int index, const char *host)
+{
+	return 0;
+}
+
+char *connman_inet_ifname(int index)
+{
+	return NULL;
+}
+
+void connman_network_append_acddbus(DBusMessageIter *dict,
+			struct connman_network *network)
+{
+}
+
+const void *connman_network_get_blob(struct connman_network *network,
+			const char *key, unsigned int *size)
+{
+	return NULL;
+}
+
+bool connman_network_get_bool(struct connman_network *network, const char *key)
+{
+	return false;
+}
+
+struct connman_device *connman_network_get_device(
+			struct connman_network *network)
+{
+	return NULL;
+}
+
+uint16_t connman_network_get_frequency(struct connman_network *network)
+{
+	return 0;
+}
+
+int connman_network_get_index(struct connman_network *network)
+{
+	return 0;
+}
+
+int connman_network_set_blob(struct connman_network *network, const char *key,
+			const void *data, unsigned int size)
+{
+	return 0;
+}
+
+int connman_network_set_bool(struct connman_network *network, const char *key,
+			bool value)
+{
+	return 0;
+}
+
+int connman_network_set_name(struct connman_network *network, const char *name)
+{
+	return 0;
+}
+
+int connman_network_set_string(struct connman_network *network,
+			const char *key, const char *value)
+{
+	return 0;
+}
+
+void connman_network_unref_debug(struct connman_network *network,
+			const char *file, int line, const char *caller)
+{
+}
+
+int connman_provider_disconnect(struct connman_provider *provider)
+{
+	return 0;
+}
+
+int connman_provider_get_index(struct connman_provider *provider)
+{
+	return 0;
+}
+
+const char *connman_provider_get_string(struct connman_provider *provider,
+			const char *key)
+{
+	return NULL;
+}
+
+struct connman_provider *connman_provider_ref_debug(
+			struct connman_provider *provider, const char *file,
+			int line, const char *caller)
+{
+	return NULL;
+}
+
+void connman_provider_unref_debug(struct connman_provider *provider,
+			const char *file, int line, const char *caller)
+{
+}
+
+int connman_resolver_append(int index, const char *domain, const char *server)
+{
+	return 0;
+}
+
+int connman_resolver_remove(int index, const char *domain, const char *server)
+{
+	return 0;
+}
+
+bool connman_setting_get_bool(const char *key)
+{
+	return false;
+}
+
+char **connman_setting_get_string_list(const char *key)
+{
+	return NULL;
+}
+
+unsigned int *connman_setting_get_uint_list(const char *key)
+{
+	return NULL;
+}
+
+gchar **connman_storage_get_services(void)
+{
+	return NULL;
+}
+
+GKeyFile *connman_storage_load_service(const char *service_id)
+{
+	return NULL;
+}
+
+/* End of dummies */
+
+static struct connman_network *network_new(const char *name,
+							uint8_t strength)
+{
+	struct connman_network *network;
+
+	network = g_new0(struct connman_network, 1);
+	network->ident = g_strdup_printf("ident%s", name);
+	network->name = g_strdup(name);
+	network->strength = strength;
+
+	return network;
+}
+
+static int collect_name(struct connman_service *service, void *user_data)
+{
+	GString *order = user_data;
+	const char *name = __connman_service_get_name(service);
+
+	/* only the services of the running test case are looked at */
+	if (name && name[0] == order->str[0]) {
+		if (order->len > 1)
+			g_string_append_c(order, ' ');
+		g_string_append(order, name);
+	}
+
+	return 0;
+}
+
+static char *service_order(char prefix)
+{
+	GString *order = g_string_new(NULL);
+
+	g_string_append_c(order, prefix);
+	connman_service_iterate_services(collect_name, order);
+
+	/* drop the prefix again */
+	g_string_erase(order, 0, 1);
+
+	return g_string_free(order, FALSE);
+}
+
+static void test_new_strong_service(void)
+{
+	char *order;
+
+	__connman_service_create_from_network(network_new("a_weak", 30));
+	__connman_service_create_from_network(network_new("a_mid", 50));
+	__connman_service_create_from_network(network_new("a_strong", 80));
+
+	order = service_order('a');
+	g_assert_cmpstr(order, ==, "a_strong a_mid a_weak");
+	g_free(order);
+}
+
+static void test_change_below_hysteresis(void)
+{
+	struct connman_network *weak, *mid;
+	char *order;
+
+	weak = network_new("b_weak", 45);
+	mid = network_new("b_mid", 50);
+
+	__connman_service_create_from_network(weak);
+	__connman_service_create_from_network(mid);
+
+	order = service_order('b');
+	g_assert_cmpstr(order, ==, "b_mid b_weak");
+	g_free(order);
+
+	/* too small to be signalled, but the order follows it */
+	weak->strength = 52;
+	__connman_service_update_from_network(weak);
+
+	order = service_order('b');
+	g_assert_cmpstr(order, ==, "b_weak b_mid");
+	g_free(order);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	__connman_service_init();
+
+	g_test_add_func("/service/New strong service",
+						test_new_strong_service);
+	g_test_add_func("/service/Change below hysteresis",
+						test_change_below_hysteresis);
+
+	return g_test_run();
+}
@@ -0,0 +1,172 @@
+/*
+ *
+ *  Connection Manager
+ *
+ *  Copyright (C) 2026  Connection Manager contributors.
+ *
+ *  This program is free software; you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License version 2 as
+ *  published by the Free Software Foundation.
+ *
+ *  This program is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with this program; if not, write to the Free Software
+ *  Foundation, Inc., 51 Franklin St, Fifth Floor, Boston, MA  02110-1301  USA
+ *
+ */
+
+#ifdef HAVE_CONFIG_H
+#include <config.h>
+#endif
+
+#include <errno.h>
+#include <stdio.h>
+
+#include <glib.h>
+
+#include "../src/shared/statsshm.h"
+
+#define WRITES 200000
+
+static int stop;
+
+static void write_entry(struct stats_shm_entry *entry, uint64_t value)
+{
+	stats_shm_write_begin(entry);
+
+	entry->flags = STATS_SHM_ENTRY_USED;
+	snprintf(entry->ident, STATS_SHM_IDENT_LEN, "service_%llu",
+						(unsigned long long) value);
+
+	entry->counters.rx_packets = value;
+	entry->counters.tx_packets = value;
+	entry->counters.rx_bytes = value;
+	entry->counters.tx_bytes = value;
+	entry->counters.rx_errors = value;
+	entry->counters.tx_errors = value;
+	entry->counters.rx_dropped = value;
+	entry->counters.tx_dropped = value;
+	entry->counters.time = value;
+	entry->counters.updated = value;
+
+	stats_shm_write_end(entry);
+}
+
+static gpointer writer(gpointer data)
+{
+	struct stats_shm_entry *entry = data;
+	uint64_t i;
+
+	for (i = 1; i <= WRITES; i++)
+		write_entry(entry, i);
+
+	__atomic_store_n(&stop, 1, __ATOMIC_RELEASE);
+
+	return NULL;
+}
+
+/* every field of a consistent copy was written in the same round */
+static void check_entry(const struct stats_shm_entry *entry)
+{
+	uint64_t value = entry->counters.rx_packets;
+	char ident[STATS_SHM_IDENT_LEN];
+
+	g_assert(entry->flags == STATS_SHM_ENTRY_USED);
+
+	snprintf(ident, sizeof(ident), "service_%llu",
+					(unsigned long long) value);
+	g_assert_cmpstr(entry->ident, ==, ident);
+
+	g_assert(entry->counters.tx_packets == value);
+	g_assert(entry->counters.rx_bytes == value);
+	g_assert(entry->counters.tx_bytes == value);
+	g_assert(entry->counters.rx_errors == value);
+	g_assert(entry->counters.tx_errors == value);
+	g_assert(entry->counters.rx_dropped == value);
+	g_assert(entry->counters.tx_dropped == value);
+	g_assert(entry->counters.time == value);
+	g_assert(entry->counters.updated == value);
+}
+
+static void test_statsshm_read(void)
+{
+	struct stats_shm *shm;
+	struct stats_shm_entry entry;
+
+	shm = g_new0(struct stats_shm, 1);
+
+	g_assert(stats_shm_read(shm, 0, &entry) == -ENOENT);
+	g_assert(stats_shm_read(shm, STATS_SHM_ENTRIES, &entry) == -EINVAL);
+
+	write_entry(&shm->entry[1], 42);
+
+	g_assert(stats_shm_read(shm, 1, &entry) == 0);
+	check_entry(&entry);
+	g_assert(entry.counters.rx_bytes == 42);
+
+	/* a write in progress is never handed out */
+	stats_shm_write_begin(&shm->entry[1]);
+	g_assert(stats_shm_read(shm, 1, &entry) == -EAGAIN);
+	stats_shm_write_end(&shm->entry[1]);
+	g_assert(stats_shm_read(shm, 1, &entry) == 0);
+
+	g_free(shm);
+}
+
+static void test_statsshm_concurrent_writer(void)
+{
+	struct stats_shm *shm;
+	struct stats_shm_entry entry;
+	GThread *thread;
+	uint64_t last = 0;
+	unsigned int reads = 0;
+	int err;
+
+	shm = g_new0(struct stats_shm, 1);
+
+	write_entry(&shm->entry[0], 0);
+
+	thread = g_thread_new("writer", writer, &shm->entry[0]);
+
+	while (!__atomic_load_n(&stop, __ATOMIC_ACQUIRE)) {
+		err = stats_shm_read(shm, 0, &entry);
+
+		/* giving up under heavy writing is fine, a torn copy is not */
+		if (err == -EAGAIN)
+			continue;
+
+		g_assert(err == 0);
+		check_entry(&entry);
+
+		/* and the writer never goes back in time */
+		g_assert(entry.counters.rx_packets >= last);
+		last = entry.counters.rx_packets;
+
+		reads++;
+	}
+
+	g_thread_join(thread);
+
+	g_assert(stats_shm_read(shm, 0, &entry) == 0);
+	check_entry(&entry);
+	g_assert(entry.counters.rx_packets == WRITES);
+
+	g_test_message("%u consistent reads", reads);
+
+	g_free(shm);
+}
+
+int main(int argc, char *argv[])
+{
+	g_test_init(&argc, &argv, NULL);
+
+	g_test_add_func("/statsshm/read", test_statsshm_read);
+	g_test_add_func("/statsshm/concurrent writer",
+					test_statsshm_concurrent_writer);
+
+	return g_test_run();
+}